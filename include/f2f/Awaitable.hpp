@@ -0,0 +1,129 @@
+#ifndef _F2F_API_AWAITABLE_H
+#define _F2F_API_AWAITABLE_H
+
+// Coroutine wrappers of asynchronous operations, available when compiled as C++20:
+//   f2f::FileDescriptor file = co_await f2f::coro::open(fs, "dir/file", f2f::OpenMode::ReadOnly);
+//   size_t readSize = co_await f2f::coro::read(file, position, size, buffer);
+// Coroutine is resumed on thread pool of file system. Storage that supports asynchronous
+// transfers (OpenUringFileStorage) doesn't occupy pool threads while data is read or written.
+// Errors are rethrown from co_await
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <utility>
+#include "f2f/FileDescriptor.hpp"
+#include "f2f/FileSystem.hpp"
+
+namespace f2f { namespace coro
+{
+
+// Starts operation on suspension. Its completion callback resumes the coroutine, which may
+// destroy the awaiter before start functor returns, so the functor is moved out of it and
+// awaiter isn't touched after the operation is started
+template<class T>
+class Awaitable
+{
+public:
+  typedef std::function<void(T, std::exception_ptr)> OnComplete;
+  typedef std::function<void(OnComplete const &)> Start;
+
+  explicit Awaitable(Start && start)
+    : m_start(std::move(start))
+    , m_result()
+  {}
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> coroutine)
+  {
+    Start const start = std::move(m_start);
+    start([this, coroutine](T result, std::exception_ptr error) {
+      m_result = std::move(result);
+      m_error = error;
+      coroutine.resume();
+    });
+  }
+
+  T await_resume()
+  {
+    if (m_error)
+      std::rethrow_exception(m_error);
+    return std::move(m_result);
+  }
+
+private:
+  Start m_start;
+  T m_result;
+  std::exception_ptr m_error;
+};
+
+template<>
+class Awaitable<void>
+{
+public:
+  typedef std::function<void(std::exception_ptr)> OnComplete;
+  typedef std::function<void(OnComplete const &)> Start;
+
+  explicit Awaitable(Start && start)
+    : m_start(std::move(start))
+  {}
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> coroutine)
+  {
+    Start const start = std::move(m_start);
+    start([this, coroutine](std::exception_ptr error) {
+      m_error = error;
+      coroutine.resume();
+    });
+  }
+
+  void await_resume()
+  {
+    if (m_error)
+      std::rethrow_exception(m_error);
+  }
+
+private:
+  Start m_start;
+  std::exception_ptr m_error;
+};
+
+// File system and descriptor must stay alive until awaited
+inline Awaitable<FileDescriptor> open(FileSystem & fs, PathRef path, OpenMode openMode, bool createIfRW = true)
+{
+  return Awaitable<FileDescriptor>([&fs, path, openMode, createIfRW](auto const & onComplete) {
+    fs.openAsync(path, openMode, createIfRW, onComplete);
+  });
+}
+
+inline Awaitable<void> remove(FileSystem & fs, PathRef path)
+{
+  return Awaitable<void>([&fs, path](auto const & onComplete) {
+    fs.removeAsync(path, onComplete);
+  });
+}
+
+inline Awaitable<size_t> read(FileDescriptor & file, uint64_t position, size_t size, void * buffer)
+{
+  return Awaitable<size_t>([&file, position, size, buffer](auto const & onComplete) {
+    file.readAsync(position, size, buffer, onComplete);
+  });
+}
+
+inline Awaitable<void> write(FileDescriptor & file, uint64_t position, size_t size, void const * buffer)
+{
+  return Awaitable<void>([&file, position, size, buffer](auto const & onComplete) {
+    file.writeAsync(position, size, buffer, onComplete);
+  });
+}
+
+}}
+
+#endif
+
+#endif
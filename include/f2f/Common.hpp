@@ -17,7 +17,11 @@ enum class FileType
 enum class OpenMode
 {
   ReadOnly,
-  ReadWrite
+  ReadWrite,
+  // File only: read-write descriptor that may coexist with other SharedReadWrite descriptors
+  // of the same file. Each read and write locks its byte range, so non-overlapping writes
+  // run in parallel
+  SharedReadWrite
 };
 
 const size_t MaxFileName = 950; // Max size of UTF-8 encoded file/directory name
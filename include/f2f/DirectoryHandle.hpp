@@ -0,0 +1,49 @@
+#ifndef _F2F_API_DIRECTORY_HANDLE_H
+#define _F2F_API_DIRECTORY_HANDLE_H
+
+#include "f2f/Common.hpp"
+#include "f2f/Defs.hpp"
+#include "f2f/PathRef.hpp"
+#include "f2f/FileDescriptor.hpp"
+
+namespace f2f
+{
+
+// Opened directory (see FileSystem::openDirectory). Relative paths passed to its methods
+// are resolved from this directory, absolute paths - from root directory.
+// If directory is removed, all operations on handle fail with ErrorCode::PathNotFound.
+class F2F_API_DECL DirectoryHandle
+{
+public:
+  DirectoryHandle();
+  DirectoryHandle(DirectoryHandle &&);
+  DirectoryHandle(DirectoryHandle const &);
+  ~DirectoryHandle();
+
+  DirectoryHandle & operator=(DirectoryHandle const &);
+  DirectoryHandle & operator=(DirectoryHandle &&);
+
+  bool isOpen() const;
+  void close();
+
+  FileDescriptor open(PathRef path, OpenMode openMode, bool createIfRW = true);
+  FileDescriptor open(PathRef path) const; // Open file in read-only mode
+
+  void createDirectory(PathRef path);
+  void remove(PathRef path);
+  void rename(PathRef from, PathRef to); // See FileSystem::rename
+
+  bool exists(PathRef path) const;
+  FileType fileType(PathRef path) const;
+
+  DirectoryHandle openDirectory(PathRef path) const;
+
+  class Impl;
+private:
+  friend class DirectoryHandleFactory;
+  Impl * m_impl;
+};
+
+}
+
+#endif
@@ -1,8 +1,11 @@
 #ifndef _F2F_API_DIRECTORY_ITERATOR_H
 #define _F2F_API_DIRECTORY_ITERATOR_H
 
+#include <cstdint>
+#include <string>
 #include "f2f/Common.hpp"
 #include "f2f/Defs.hpp"
+#include "f2f/PathRef.hpp"
 
 namespace f2f
 {
@@ -14,6 +17,19 @@ public:
   std::string name() const;
   std::string path() const;
 
+  // Allocation-free access for scanning large directories. Referenced name is valid
+  // until the iterator is incremented
+  PathRef nameRef() const;
+#ifdef F2F_HAS_STRING_VIEW
+  std::string_view nameView() const { PathRef name = nameRef(); return std::string_view(name.data(), name.size()); }
+#endif
+  void path(std::string & result) const; // Reuses capacity of result
+
+  // Inode metadata. Read together for several entries, so it is cheaper than opening
+  // each file. Zero for directories
+  uint64_t size() const;
+  uint64_t allocatedSize() const; // Size of data blocks on storage
+
   DirectoryEntry(DirectoryEntry const &) = delete;
   void operator=(DirectoryEntry const &) = delete;
 
@@ -25,7 +41,10 @@ protected:
 };
 
 // Directory can be deleted or modified while being iterated.
-// In this case next increment of the iterator will make it equal to end()
+// If directory is deleted, next increment of the iterator will make it equal to end().
+// After modification iteration continues from the same place: entries that weren't added or
+// removed meanwhile are visited exactly once, added and removed ones may be visited or not.
+// If directory format is upgraded during iteration, next increment makes iterator equal to end().
 //
 // Similar to C++ InputIterator concept. Only guarantee validity for single pass algorithms: once an 
 // iterator has been incremented, all copies of its previous value may be invalidated.
@@ -46,6 +65,10 @@ public:
   const DirectoryEntry & operator*() const;
   const DirectoryEntry * operator->() const;
 
+  // Opaque token to continue iteration from current entry with FileSystem::directoryIterator,
+  // also in another process. Same guarantees apply as for modification during iteration
+  std::string resumeToken() const;
+
   class Impl;
 private:
   friend class DirectoryIteratorFactory;
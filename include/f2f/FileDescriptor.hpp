@@ -1,7 +1,11 @@
 #ifndef _F2F_API_FILE_DESCRIPTOR_H
 #define _F2F_API_FILE_DESCRIPTOR_H
 
+#include <exception>
+#include <functional>
+#include <future>
 #include "f2f/Defs.hpp"
+#include "f2f/FileView.hpp"
 
 namespace f2f
 {
@@ -24,9 +28,30 @@ public:
   uint64_t position() const;
   void read(size_t & inOutSize, void * buffer);
   void write(size_t size, void const * buffer);
+  // Throws ErrorCode::FileLocked if file is mapped
   void truncate();
   uint64_t size() const;
 
+  // Read and write at position, current position isn't changed.
+  // Writes of different SharedReadWrite descriptors to non-overlapping ranges run in parallel
+  // unless they extend the file
+  void readAt(uint64_t position, size_t & inOutSize, void * buffer);
+  void writeAt(uint64_t position, size_t size, void const * buffer);
+
+  // Asynchronous readAt/writeAt run on thread pool of file system. Completion callback is called
+  // from pool thread with error (FileSystemError) or null. Buffer must stay valid until completion.
+  // Operations of one descriptor are serialized, use several descriptors to run them in parallel
+  typedef std::function<void(size_t /*readSize*/, std::exception_ptr)> OnReadComplete;
+  typedef std::function<void(std::exception_ptr)> OnComplete;
+  void readAsync(uint64_t position, size_t size, void * buffer, OnReadComplete const &);
+  void writeAsync(uint64_t position, size_t size, void const * buffer, OnComplete const &);
+  std::future<size_t> readAsync(uint64_t position, size_t size, void * buffer);
+  std::future<void> writeAsync(uint64_t position, size_t size, void const * buffer);
+
+  // Zero-copy read of [offset, offset + length) range clipped by file size.
+  // Requires storage supporting IStorage::map.
+  FileView map(uint64_t offset, size_t length) const;
+
 private:
   friend class FileDescriptorFactory;
   class Impl;
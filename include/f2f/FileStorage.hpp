@@ -9,9 +9,24 @@
 namespace f2f
 {
 
+// On POSIX systems storage opened read-only uses positional reads, so threads reading it don't wait for each other
 F2F_API_DECL std::unique_ptr<IStorage> OpenFileStorage(const char * fileName, OpenMode = OpenMode::ReadWrite);
 F2F_API_DECL std::unique_ptr<IStorage> OpenFileStorage(const wchar_t * fileName, OpenMode = OpenMode::ReadWrite);
 
+// Storage file accessed through Linux io_uring: batched reads are submitted together. Falls back
+// to OpenFileStorage if library is built without io_uring or kernel doesn't allow it
+F2F_API_DECL std::unique_ptr<IStorage> OpenUringFileStorage(const char * fileName, OpenMode = OpenMode::ReadWrite);
+F2F_API_DECL std::unique_ptr<IStorage> OpenUringFileStorage(const wchar_t * fileName, OpenMode = OpenMode::ReadWrite);
+
+// Storage file opened for direct I/O (O_DIRECT), bypassing kernel page cache. Falls back to
+// OpenFileStorage where direct I/O isn't supported
+F2F_API_DECL std::unique_ptr<IStorage> OpenDirectFileStorage(const char * fileName, OpenMode = OpenMode::ReadWrite);
+F2F_API_DECL std::unique_ptr<IStorage> OpenDirectFileStorage(const wchar_t * fileName, OpenMode = OpenMode::ReadWrite);
+
+// Read-only storage mapped to memory. Supports zero-copy reads with FileDescriptor::map
+F2F_API_DECL std::unique_ptr<IStorage> OpenMappedFileStorage(const char * fileName);
+F2F_API_DECL std::unique_ptr<IStorage> OpenMappedFileStorage(const wchar_t * fileName);
+
 }
 
 #endif
\ No newline at end of file
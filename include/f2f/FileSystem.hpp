@@ -2,9 +2,17 @@
 #define _F2F_API_FILE_SYSTEM_H
 
 #include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <limits>
 #include <memory>
+#include <string>
+#include <vector>
 #include "f2f/Common.hpp"
 #include "f2f/Defs.hpp"
+#include "f2f/PathRef.hpp"
+#include "f2f/DirectoryHandle.hpp"
 #include "f2f/DirectoryIterator.hpp"
 #include "f2f/FileDescriptor.hpp"
 
@@ -13,10 +21,24 @@ namespace f2f
 
 class IStorage;
 
+// Parameters of storage chosen when it's formatted
+struct FormatOptions
+{
+  // Size of storage block: power of two from 1 KB to 64 KB. Larger blocks keep file data in fewer
+  // ranges and make block trees and directories shallower, so that they are read with fewer and
+  // larger requests, but each file and directory node occupies at least one block
+  uint32_t blockSize = 1024;
+  // Pads storage header to 4 KB, so that all blocks are aligned to 4 KB in storage and whole-block
+  // requests of OpenDirectFileStorage don't need bounce buffers. Requires block size of 4 KB or more
+  bool alignedLayout = false;
+};
+
 class F2F_API_DECL FileSystem
 {
 public:
   FileSystem(std::unique_ptr<IStorage> && storage, bool format, OpenMode openMode = OpenMode::ReadWrite);
+  // Formats storage (ErrorCode::InvalidArgument if options are invalid)
+  FileSystem(std::unique_ptr<IStorage> && storage, FormatOptions const & formatOptions);
   ~FileSystem();
 
   FileSystem(FileSystem const &) = delete;
@@ -24,16 +46,54 @@ public:
 
   OpenMode openMode() const;
 
-  FileDescriptor open(const char * path, OpenMode openMode, bool createIfRW = true);
-  FileDescriptor open(const char * path) const; // Open file in read-only mode
+  // File opened in ReadWrite mode can't be opened by other descriptors (ErrorCode::FileLocked).
+  // SharedReadWrite descriptors may be opened together, but not with descriptors of other modes
+  FileDescriptor open(PathRef path, OpenMode openMode, bool createIfRW = true);
+  FileDescriptor open(PathRef path) const; // Open file in read-only mode
+
+  // Asynchronous open() and remove() run on internal thread pool. Completion callback is called
+  // from pool thread with error (FileSystemError) or null. Path is copied
+  typedef std::function<void(FileDescriptor, std::exception_ptr)> OnOpenComplete;
+  typedef std::function<void(std::exception_ptr)> OnComplete;
+  void openAsync(PathRef path, OpenMode openMode, bool createIfRW, OnOpenComplete const &);
+  void removeAsync(PathRef path, OnComplete const &);
+  std::future<FileDescriptor> openAsync(PathRef path, OpenMode openMode, bool createIfRW = true);
+  std::future<void> removeAsync(PathRef path);
+
+  void createDirectory(PathRef path);
+  // Creates empty regular files in existing directory. Either all files are created or,
+  // if some name is already taken, none of them (ErrorCode::FileExists is thrown)
+  void createFiles(PathRef directoryPath, std::vector<std::string> const & names);
+  // Directories and large files are unlinked immediately, their storage is released later by reclaim()
+  void remove(PathRef path);
+  // Releases storage of removed directories and large files, about blocksBudget blocks at most
+  // (entries of removed directory are released in chunks). Progress is kept in storage, so reclamation
+  // continues after reopening. Returns true if nothing is left to reclaim. Requires read-write mode.
+  bool reclaim(uint64_t blocksBudget = std::numeric_limits<uint64_t>::max());
+  // Runs reclaim(stepBlocksBudget) on internal thread pool until nothing is left to reclaim, and again
+  // after each removal. Other operations proceed between steps. Zero budget stops background
+  // reclamation. Requires read-write mode.
+  void reclaimInBackground(uint64_t stepBlocksBudget = 4096);
+  // Moves file or directory to another name, possibly in another directory, without copying data.
+  // Existing regular file with the new name is replaced (it is removed as by remove()).
+  // Throws ErrorCode::FileExists if the new name belongs to directory or a directory is renamed
+  // to name of existing file, ErrorCode::CantMoveDirectoryIntoItself if directory is moved into its subtree
+  void rename(PathRef from, PathRef to);
+
+  bool exists(PathRef path) const;
+  FileType fileType(PathRef path) const;
 
-  void createDirectory(const char * path);
-  void remove(const char * path);
+  DirectoryIterator directoryIterator(PathRef path) const;
+  // Continues iteration from entry where DirectoryIterator::resumeToken() was taken.
+  // Throws ErrorCode::IncorrectIteratorAccess if token doesn't belong to this directory
+  DirectoryIterator directoryIterator(PathRef path, std::string const & resumeToken) const;
 
-  bool exists(const char * path) const;
-  FileType fileType(const char * path) const;
+  // Throws ErrorCode::PathNotFound if path doesn't point to directory
+  DirectoryHandle openDirectory(PathRef path) const;
 
-  DirectoryIterator directoryIterator(const char * path) const;
+  // Rewrites directories created by older versions in current directory format.
+  // Requires read-write mode.
+  void upgradeDirectories();
 
   void check();
 
@@ -18,7 +18,10 @@ enum class ErrorCode
   OperationRequiresOpenedFile,
   StorageLimitReached,
   InvalidStorageFormat,
-  InternalExpectationFail
+  InternalExpectationFail,
+  OperationNotSupportedByStorage,
+  CantMoveDirectoryIntoItself,
+  InvalidArgument
 };
 
 class F2F_API_DECL FileSystemError
@@ -0,0 +1,44 @@
+#ifndef _F2F_API_FILE_VIEW_H
+#define _F2F_API_FILE_VIEW_H
+
+#include <cstdint>
+#include "f2f/Defs.hpp"
+
+namespace f2f
+{
+
+struct ConstBuffer
+{
+  void const * data;
+  size_t size;
+};
+
+// Read-only view of file contents placed directly in storage memory (see FileDescriptor::map).
+// While view exists, file can't be truncated and its removal is postponed.
+class F2F_API_DECL FileView
+{
+public:
+  FileView();
+  FileView(FileView &&);
+  FileView(FileView const &);
+  ~FileView();
+
+  FileView & operator=(FileView const &);
+  FileView & operator=(FileView &&);
+
+  uint64_t size() const;
+  size_t buffersCount() const;
+  ConstBuffer const & buffer(size_t index) const;
+
+  ConstBuffer const * begin() const;
+  ConstBuffer const * end() const;
+
+  class Impl;
+private:
+  friend class FileViewFactory;
+  Impl * m_impl;
+};
+
+}
+
+#endif
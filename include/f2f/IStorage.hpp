@@ -2,11 +2,16 @@
 #define _F2F_API_ISTORAGE_H
 
 #include <cstdint>
+#include <exception>
+#include <functional>
 #include "f2f/Common.hpp"
 
 namespace f2f
 {
-  
+
+// Storage is accessed from all threads that use file system, so implementations must be
+// thread-safe: read, write, size, map and prefetch may be called concurrently with each other
+// and with resize. Ranges that are read and written concurrently never overlap.
 class IStorage
 {
 public:
@@ -15,9 +20,75 @@ public:
   virtual void write(uint64_t position, size_t size, void const *) = 0;
   virtual void resize(uint64_t size) = 0; // fill with zeros on increase
 
+  // Direct read-only access to storage contents (e.g. memory-mapped file).
+  // Returned memory must stay valid until storage object is destroyed.
+  // Storages that can't provide such access return nullptr.
+  virtual void const * map(uint64_t /*position*/, size_t /*size*/) const { return nullptr; }
+
+  // Hint that range is going to be read soon. Storage may start loading it in background.
+  virtual void prefetch(uint64_t /*position*/, size_t /*size*/) const {}
+
+  struct ReadRequest
+  {
+    uint64_t position;
+    size_t size;
+    void * data;
+  };
+
+  // Reads several non-overlapping ranges, e.g. all block ranges of one file read. Storage may
+  // keep them in flight at once to fill deep queue of the device. Default reads them one by one.
+  virtual void readBatch(ReadRequest const * requests, size_t count) const
+  {
+    for(size_t i = 0; i < count; ++i)
+      read(requests[i].position, requests[i].size, requests[i].data);
+  }
+
+  struct WriteRequest
+  {
+    uint64_t position;
+    size_t size;
+    void const * data;
+  };
+
+  typedef std::function<void(std::exception_ptr)> OnBatchComplete;
+
+  // Asynchronous batches. Requests array isn't used after the call returns, buffers must stay
+  // valid until onComplete is called. It's called once when all ranges are transferred or some
+  // of them failed, unless the call itself throws. Storage may call it on own thread, so it must
+  // be short and must not destroy the storage. Default transfers data synchronously and calls
+  // onComplete before return.
+  virtual void readBatchAsync(ReadRequest const * requests, size_t count, OnBatchComplete const & onComplete) const
+  {
+    std::exception_ptr error;
+    try
+    {
+      readBatch(requests, count);
+    }
+    catch (...)
+    {
+      error = std::current_exception();
+    }
+    onComplete(error);
+  }
+
+  virtual void writeBatchAsync(WriteRequest const * requests, size_t count, OnBatchComplete const & onComplete)
+  {
+    std::exception_ptr error;
+    try
+    {
+      for(size_t i = 0; i < count; ++i)
+        write(requests[i].position, requests[i].size, requests[i].data);
+    }
+    catch (...)
+    {
+      error = std::current_exception();
+    }
+    onComplete(error);
+  }
+
   virtual ~IStorage() {}
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
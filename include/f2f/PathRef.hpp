@@ -0,0 +1,51 @@
+#ifndef _F2F_API_PATH_REF_H
+#define _F2F_API_PATH_REF_H
+
+#include <cstring>
+#include <string>
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#  include <string_view>
+#  define F2F_HAS_STRING_VIEW 1
+#endif
+
+namespace f2f
+{
+
+// Non-owning reference to UTF-8 encoded path passed to FileSystem and DirectoryHandle methods. 
+// Path doesn't have to be null-terminated. Referenced string must stay valid during the call.
+class PathRef
+{
+public:
+  PathRef(const char * path)
+    : m_data(path)
+    , m_size(std::strlen(path))
+  {}
+
+  PathRef(const char * path, size_t size)
+    : m_data(path)
+    , m_size(size)
+  {}
+
+  PathRef(std::string const & path)
+    : m_data(path.data())
+    , m_size(path.size())
+  {}
+
+#ifdef F2F_HAS_STRING_VIEW
+  PathRef(std::string_view path)
+    : m_data(path.data())
+    , m_size(path.size())
+  {}
+#endif
+
+  const char * data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+private:
+  const char * m_data;
+  size_t m_size;
+};
+
+}
+
+#endif
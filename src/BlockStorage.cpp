@@ -1,8 +1,11 @@
 #include "BlockStorage.hpp"
+#include <algorithm>
 #include <limits>
 #include "util/Assert.hpp"
 #include "util/BitRange.hpp"
+#include "util/FloorDiv.hpp"
 #include "util/StorageT.hpp"
+#include "util/BlockBuffer.hpp"
 #include "format/Common.hpp"
 
 namespace f2f
@@ -17,28 +20,10 @@ TODO: Check topmost level handling and actual size limit
 
 */
 
-struct OccupancyGroupLevelsInit
-{
-  static const unsigned LevelsCount = 4;
-  OccupancyGroupLevelsInit()
-  {
-    levelAbsoluteSize[0] =
-      format::OccupancyBlockSize + format::OccupancyBlock::BitmapItemsCount * format::AddressableBlockSize;
-    blocksInLevel[0] = format::OccupancyBlock::BitmapItemsCount;
-    for (int level = 1; level < LevelsCount; ++level)
-    {
-      levelAbsoluteSize[level] =
-        levelAbsoluteSize[level - 1] * format::OccupancyBlock::BitmapItemsCount
-        + format::OccupancyBlockSize;
-      blocksInLevel[level] = blocksInLevel[level - 1] * format::OccupancyBlock::BitmapItemsCount;
-    }
-  }
-
-  uint64_t levelAbsoluteSize[LevelsCount];
-  uint64_t blocksInLevel[LevelsCount];
-};
+// Block indices are kept in 48 bits (see format::BlockRange)
+const uint64_t MaxBlocksCount = uint64_t(1) << 48;
 
-const OccupancyGroupLevelsInit OccupancyGroupLevels;
+typedef util::BlockBuffer<format::OccupancyBlock> OccupancyBlock;
 
 template<class T>
 inline void readT(IStorage const & storage, uint64_t position, T & obj)
@@ -54,69 +39,105 @@ inline void writeT(IStorage & storage, uint64_t position, T const & obj)
   storage.write(position, sizeof(T), &obj);
 }
 
+inline void readT(IStorage const & storage, uint64_t position, OccupancyBlock & block)
+{
+  storage.read(position, block.size(), block.data());
+}
+
+inline void writeT(IStorage & storage, uint64_t position, OccupancyBlock const & block)
+{
+  storage.write(position, block.size(), block.data());
+}
+
 }
 
-uint64_t BlockAddress::absoluteAddress() const
+void BlockStorage::initGeometry()
 {
-  uint64_t occupancyBlocks = m_blockIndex / format::OccupancyBlock::BitmapItemsCount + 1;
-  for(int level = 1; level < OccupancyGroupLevels.LevelsCount; ++level)
+  unsigned const blockSizeLog2 = m_storageHeader.blockSizeLog2();
+  F2F_FORMAT_ASSERT(blockSizeLog2 <= format::MaxBlockSizeLog2);
+  m_blockSize = format::AddressableBlockSize << blockSizeLog2;
+  m_headerSize = m_storageHeader.alignedLayout()
+    ? format::StorageHeader::AlignedHeaderSize : sizeof(format::StorageHeader);
+  uint64_t const bitmapItemsCount = format::OccupancyBlock::bitmapItemsCount(m_blockSize);
+  m_levelAbsoluteSize[0] = m_blockSize + bitmapItemsCount * m_blockSize;
+  m_blocksInLevel[0] = bitmapItemsCount;
+  for (m_levelsCount = 1; m_blocksInLevel[m_levelsCount - 1] < MaxBlocksCount; ++m_levelsCount)
+  {
+    F2F_ASSERT(m_levelsCount < MaxLevelsCount);
+    uint64_t const previousSize = m_levelAbsoluteSize[m_levelsCount - 1];
+    m_levelAbsoluteSize[m_levelsCount] =
+      previousSize <= (std::numeric_limits<uint64_t>::max() - m_blockSize) / bitmapItemsCount
+        ? previousSize * bitmapItemsCount + m_blockSize
+        : std::numeric_limits<uint64_t>::max();
+    m_blocksInLevel[m_levelsCount] = m_blocksInLevel[m_levelsCount - 1] * bitmapItemsCount;
+  }
+}
+
+uint64_t BlockStorage::absoluteAddress(BlockAddress blockAddress) const
+{
+  uint64_t const blockIndex = blockAddress.index();
+  uint64_t occupancyBlocks = blockIndex / m_blocksInLevel[0] + 1;
+  for(unsigned level = 1; level < m_levelsCount; ++level)
   {
     occupancyBlocks += 
-      (m_blockIndex + (OccupancyGroupLevels.blocksInLevel[level] - OccupancyGroupLevels.blocksInLevel[level - 1])) 
-      / OccupancyGroupLevels.blocksInLevel[level];
+      (blockIndex + (m_blocksInLevel[level] - m_blocksInLevel[level - 1])) / m_blocksInLevel[level];
   }
-  return sizeof(format::StorageHeader)
-    + occupancyBlocks * format::OccupancyBlockSize
-    + m_blockIndex * format::AddressableBlockSize;
+  return m_headerSize + (occupancyBlocks + blockIndex) * m_blockSize;
 }
 
-uint64_t BlockStorage::getOccupancyBlockPosition(uint64_t groupIndex)
+uint64_t BlockStorage::getOccupancyBlockPosition(uint64_t groupIndex) const
 {
-  return BlockAddress::fromBlockIndex(groupIndex * format::OccupancyBlock::BitmapItemsCount).absoluteAddress() 
-    - format::OccupancyBlockSize;
+  return absoluteAddress(BlockAddress::fromBlockIndex(groupIndex * m_blocksInLevel[0])) - m_blockSize;
 }
 
-uint64_t BlockStorage::getBlockGroupIndex(uint64_t blockIndex)
+// Position of occupancy block of given level. The block follows first subgroup of the group
+uint64_t BlockStorage::getOccupancyBlockPosition(unsigned level, uint64_t groupIndexInLevel) const
 {
-  return blockIndex / format::OccupancyBlock::BitmapItemsCount;
+  if (level == 0)
+    return getOccupancyBlockPosition(groupIndexInLevel);
+  return getOccupancyBlockPosition(groupIndexInLevel * (m_blocksInLevel[level] / m_blocksInLevel[0]))
+    + m_levelAbsoluteSize[level - 1];
 }
 
-unsigned BlockStorage::getBlockIndexInGroup(uint64_t blockIndex)
+uint64_t BlockStorage::getBlockGroupIndex(uint64_t blockIndex) const
 {
-  return blockIndex % format::OccupancyBlock::BitmapItemsCount;
+  return blockIndex / m_blocksInLevel[0];
 }
 
-uint64_t BlockStorage::getSizeForNBlocks(uint64_t numBlocks)
+unsigned BlockStorage::getBlockIndexInGroup(uint64_t blockIndex) const
+{
+  return blockIndex % m_blocksInLevel[0];
+}
+
+uint64_t BlockStorage::getSizeForNBlocks(uint64_t numBlocks) const
 {
   if (numBlocks == 0)
-    return sizeof(format::StorageHeader);
-  return BlockAddress::fromBlockIndex(numBlocks - 1).absoluteAddress() + format::AddressableBlockSize;
+    return m_headerSize;
+  return absoluteAddress(BlockAddress::fromBlockIndex(numBlocks - 1)) + m_blockSize;
 }
 
-uint64_t BlockStorage::getBlocksCountByStorageSize(uint64_t size)
+uint64_t BlockStorage::getBlocksCountByStorageSize(uint64_t size) const
 {
   uint64_t blocksCount = 0;
-  for(int level = OccupancyGroupLevels.LevelsCount - 1; level >= 0; --level)
+  for(int level = m_levelsCount - 1; level >= 0; --level)
   {
-    uint64_t groupsCount = size / OccupancyGroupLevels.levelAbsoluteSize[level];
-    size %= OccupancyGroupLevels.levelAbsoluteSize[level];
-    blocksCount += groupsCount * OccupancyGroupLevels.blocksInLevel[level];
+    uint64_t groupsCount = size / m_levelAbsoluteSize[level];
+    size %= m_levelAbsoluteSize[level];
+    blocksCount += groupsCount * m_blocksInLevel[level];
     if (level == 0)
     {
-      F2F_FORMAT_ASSERT(!(size > 0
-        && (size < format::OccupancyBlockSize
-          || (size - format::OccupancyBlockSize) % format::AddressableBlockSize != 0)));
+      F2F_FORMAT_ASSERT(!(size > 0 && (size < m_blockSize || size % m_blockSize != 0)));
       if (size > 0)
-        blocksCount += (size - format::OccupancyBlockSize) / format::AddressableBlockSize;
+        blocksCount += (size - m_blockSize) / m_blockSize;
     }
     else
-      if (size > OccupancyGroupLevels.levelAbsoluteSize[level - 1])
-        size -= format::OccupancyBlockSize;
+      if (size > m_levelAbsoluteSize[level - 1])
+        size -= m_blockSize;
   }
   return blocksCount;
 }
 
-BlockStorage::BlockStorage(IStorage & storage, bool format)
+BlockStorage::BlockStorage(IStorage & storage, bool format, unsigned blockSizeLog2, bool alignedLayout)
   : m_storage(storage)
 {
   if (format)
@@ -124,7 +145,11 @@ BlockStorage::BlockStorage(IStorage & storage, bool format)
     m_blocksCount = 0;
     memset(&m_storageHeader, 0, sizeof(m_storageHeader));
     m_storageHeader.magic = format::StorageHeader::MagicValue;
-    storage.resize(sizeof(format::StorageHeader));
+    m_storageHeader.version = format::StorageHeader::CurrentVersion;
+    m_storageHeader.blockSizeAndFlags = uint8_t(blockSizeLog2)
+      | (alignedLayout ? format::StorageHeader::AlignedLayoutFlag : 0);
+    initGeometry();
+    storage.resize(m_headerSize);
     writeT(m_storage, 0, m_storageHeader);
   }
   else
@@ -132,10 +157,21 @@ BlockStorage::BlockStorage(IStorage & storage, bool format)
     F2F_FORMAT_ASSERT(storage.size() >= sizeof(format::StorageHeader));
     readT(m_storage, 0, m_storageHeader);
     F2F_FORMAT_ASSERT(m_storageHeader.magic == format::StorageHeader::MagicValue);
-    m_blocksCount = getBlocksCountByStorageSize(storage.size() - sizeof(format::StorageHeader));
+    F2F_FORMAT_ASSERT(m_storageHeader.version <= format::StorageHeader::CurrentVersion);
+    F2F_FORMAT_ASSERT(m_storageHeader.version > 0 || m_storageHeader.blockSizeAndFlags == 0);
+    F2F_FORMAT_ASSERT((m_storageHeader.blockSizeAndFlags & ~(format::StorageHeader::BlockSizeLog2Mask
+      | format::StorageHeader::AlignedLayoutFlag)) == 0);
+    initGeometry();
+    F2F_FORMAT_ASSERT(storage.size() >= m_headerSize);
+    m_blocksCount = getBlocksCountByStorageSize(storage.size() - m_headerSize);
   }
 }
 
+uint64_t BlockStorage::fileBlocksCount(uint64_t fileSize) const
+{
+  return util::FloorDiv(fileSize, uint64_t(m_blockSize));
+}
+
 BlockAddress BlockStorage::allocateBlock()
 {
   BlockAddress newBlock;
@@ -145,20 +181,22 @@ BlockAddress BlockStorage::allocateBlock()
 
 void BlockStorage::allocateBlocks(uint64_t numBlocks, std::function<void(BlockAddress const &)> const & visitor)
 {
-  if (m_storageHeader.occupiedBlocksCount + numBlocks > m_blocksCount)
+  std::lock_guard<std::mutex> lock(m_mutex);
+  uint64_t const occupiedBlocksCount = m_storageHeader.occupiedBlocksCount() + numBlocks;
+  if (occupiedBlocksCount > m_blocksCount)
   {
     // Have to extend storage
-    if (m_storageHeader.occupiedBlocksCount + numBlocks >= OccupancyGroupLevels.blocksInLevel[OccupancyGroupLevels.LevelsCount - 1])
+    if (occupiedBlocksCount >= std::min(m_blocksInLevel[m_levelsCount - 1], MaxBlocksCount))
       // It's not the format limitation, but the current implementation. 
       // When top-level handling will be improved this limitation can be removed.
       throw FileSystemError(ErrorCode::StorageLimitReached, "BlockStorage size limit exceeded");
 
-    m_storage.resize(getSizeForNBlocks(m_storageHeader.occupiedBlocksCount + numBlocks));
-    m_blocksCount = m_storageHeader.occupiedBlocksCount + numBlocks;
+    m_storage.resize(getSizeForNBlocks(occupiedBlocksCount));
+    m_blocksCount = occupiedBlocksCount;
   }
-  m_storageHeader.occupiedBlocksCount += numBlocks;
+  m_storageHeader.setOccupiedBlocksCount(occupiedBlocksCount);
 
-  allocateBlocks(numBlocks, visitor, OccupancyGroupLevels.LevelsCount - 1, sizeof(format::StorageHeader), 0);
+  allocateBlocks(numBlocks, visitor, m_levelsCount - 1, m_headerSize, 0);
 
   writeT(m_storage, 0, m_storageHeader);
 }
@@ -174,8 +212,8 @@ bool BlockStorage::allocateBlocks(uint64_t & numBlocks,
   }
   else
   {
-    uint64_t position = absoluteOffset + OccupancyGroupLevels.levelAbsoluteSize[level - 1];
-    if (position >= m_storage.size() - sizeof(format::StorageHeader))
+    uint64_t position = absoluteOffset + m_levelAbsoluteSize[level - 1];
+    if (position >= m_storage.size())
     {
       // Occupancy block of this level isn't created yet
       allocateBlocks(numBlocks, visitor, level - 1, absoluteOffset, blocksOffset);
@@ -184,23 +222,23 @@ bool BlockStorage::allocateBlocks(uint64_t & numBlocks,
     else
     {
       bool blockIsDirty = false;
-      format::OccupancyBlock block;
+      OccupancyBlock block(m_blockSize);
       readT(m_storage, position, block);
       int nextBitmapWord = 0;
       for (; numBlocks > 0 && nextBitmapWord != -1;)
       {
         int freeGroup = util::FindFirstZeroBit(
-          block.bitmap, nextBitmapWord, format::OccupancyBlock::BitmapWordsCount, nextBitmapWord);
+          block->bitmap, nextBitmapWord, format::OccupancyBlock::bitmapWordsCount(m_blockSize), nextBitmapWord);
         if (freeGroup == -1)
           break;
         if (!allocateBlocks(numBlocks, visitor, level - 1, 
           freeGroup == 0 
             ? absoluteOffset 
-            : (absoluteOffset + format::OccupancyBlockSize + freeGroup * OccupancyGroupLevels.levelAbsoluteSize[level - 1]),
-          blocksOffset + freeGroup * OccupancyGroupLevels.blocksInLevel[level - 1]))
+            : (absoluteOffset + m_blockSize + freeGroup * m_levelAbsoluteSize[level - 1]),
+          blocksOffset + freeGroup * m_blocksInLevel[level - 1]))
         {
           blockIsDirty = true;
-          util::SetBit(block.bitmap, freeGroup);
+          util::SetBit(block->bitmap, freeGroup);
         }
       }
       if (blockIsDirty)
@@ -216,14 +254,10 @@ bool BlockStorage::allocateBlocksLevel0(uint64_t & numBlocks,
   uint64_t absoluteOffset, uint64_t blocksOffset)
 {
   bool blockIsDirty = false;
-  format::OccupancyBlock block;
-  if (absoluteOffset >= m_storage.size() - sizeof(format::StorageHeader))
-  {
-    // Occupancy block of this level isn't created yet, but it may be created
-    // during processing the loop
-    memset(&block, 0, sizeof(block));
-  }
-  else
+  // Zero-filled if occupancy block of this level isn't created yet, it may be created
+  // during processing the loop
+  OccupancyBlock block(m_blockSize);
+  if (absoluteOffset < m_storage.size())
     readT(m_storage, absoluteOffset, block);
 
   int nextBitmapWord = 0;
@@ -231,7 +265,7 @@ bool BlockStorage::allocateBlocksLevel0(uint64_t & numBlocks,
   {
     int occupiedBlockInGroup =
       util::FindAndSetFirstZeroBit(
-        block.bitmap, nextBitmapWord, format::OccupancyBlock::BitmapWordsCount, nextBitmapWord);
+        block->bitmap, nextBitmapWord, format::OccupancyBlock::bitmapWordsCount(m_blockSize), nextBitmapWord);
     if (occupiedBlockInGroup == -1)
       break;
 
@@ -257,13 +291,13 @@ bool BlockStorage::markBlocksAsFree(uint64_t beginBlockInGroup, uint64_t endBloc
   if (level == 0)
   {
     F2F_ASSERT(beginBlockInGroup <= endBlockInGroup);
-    F2F_ASSERT(endBlockInGroup < format::OccupancyBlock::BitmapItemsCount);
-    if (absoluteOffset < m_storage.size() - sizeof(format::StorageHeader))
+    F2F_ASSERT(endBlockInGroup < m_blocksInLevel[0]);
+    if (absoluteOffset < m_storage.size())
     {
-      format::OccupancyBlock block;
+      OccupancyBlock block(m_blockSize);
       readT(m_storage, absoluteOffset, block);
-      bool hadFreeBlocks = util::HasZeroBit(block.bitmap, format::OccupancyBlock::BitmapWordsCount);
-      util::ClearBitRange(block.bitmap, beginBlockInGroup, endBlockInGroup);
+      bool hadFreeBlocks = util::HasZeroBit(block->bitmap, format::OccupancyBlock::bitmapWordsCount(m_blockSize));
+      util::ClearBitRange(block->bitmap, beginBlockInGroup, endBlockInGroup);
       writeT(m_storage, absoluteOffset, block);
       return !hadFreeBlocks;
     }
@@ -273,34 +307,34 @@ bool BlockStorage::markBlocksAsFree(uint64_t beginBlockInGroup, uint64_t endBloc
   else
   {
     bool blockIsDirty = false;
-    uint64_t beginSubGroup = beginBlockInGroup / OccupancyGroupLevels.blocksInLevel[level - 1];
-    uint64_t endSubGroup = endBlockInGroup / OccupancyGroupLevels.blocksInLevel[level - 1];
+    uint64_t beginSubGroup = beginBlockInGroup / m_blocksInLevel[level - 1];
+    uint64_t endSubGroup = endBlockInGroup / m_blocksInLevel[level - 1];
     F2F_ASSERT(beginSubGroup <= endSubGroup);
-    F2F_ASSERT(endSubGroup < format::OccupancyBlock::BitmapItemsCount);
+    F2F_ASSERT(endSubGroup < m_blocksInLevel[0]);
     for(uint64_t subGroup = beginSubGroup; subGroup <= endSubGroup; ++subGroup)
     {
       uint64_t beginBlockInSubGroup = 0;
-      uint64_t endBlockInSubGroup = OccupancyGroupLevels.blocksInLevel[level - 1] - 1;
+      uint64_t endBlockInSubGroup = m_blocksInLevel[level - 1] - 1;
       if (subGroup == beginSubGroup)
-        beginBlockInSubGroup = beginBlockInGroup % OccupancyGroupLevels.blocksInLevel[level - 1];
+        beginBlockInSubGroup = beginBlockInGroup % m_blocksInLevel[level - 1];
       if (subGroup == endSubGroup)
-        endBlockInSubGroup = endBlockInGroup % OccupancyGroupLevels.blocksInLevel[level - 1];
+        endBlockInSubGroup = endBlockInGroup % m_blocksInLevel[level - 1];
       if (markBlocksAsFree(beginBlockInSubGroup, endBlockInSubGroup, level - 1,
           subGroup == 0
             ? absoluteOffset
-            : (absoluteOffset + format::OccupancyBlockSize + subGroup * OccupancyGroupLevels.levelAbsoluteSize[level - 1]),
-          blocksOffset + subGroup * OccupancyGroupLevels.blocksInLevel[level - 1]))
+            : (absoluteOffset + m_blockSize + subGroup * m_levelAbsoluteSize[level - 1]),
+          blocksOffset + subGroup * m_blocksInLevel[level - 1]))
         blockIsDirty = true;
     }
 
     bool hadFreeBlocks = true;
-    uint64_t position = absoluteOffset + OccupancyGroupLevels.levelAbsoluteSize[level - 1];
-    if (position < m_storage.size() - sizeof(format::StorageHeader))
+    uint64_t position = absoluteOffset + m_levelAbsoluteSize[level - 1];
+    if (position < m_storage.size())
     {
-      format::OccupancyBlock block;
+      OccupancyBlock block(m_blockSize);
       readT(m_storage, position, block);
-      bool hadFreeBlocks = util::HasZeroBit(block.bitmap, format::OccupancyBlock::BitmapWordsCount);
-      util::ClearBitRange(block.bitmap, beginSubGroup, endSubGroup);
+      bool hadFreeBlocks = util::HasZeroBit(block->bitmap, format::OccupancyBlock::bitmapWordsCount(m_blockSize));
+      util::ClearBitRange(block->bitmap, beginSubGroup, endSubGroup);
       writeT(m_storage, position, block);
     }
     return !hadFreeBlocks;
@@ -309,6 +343,7 @@ bool BlockStorage::markBlocksAsFree(uint64_t beginBlockInGroup, uint64_t endBloc
 
 void BlockStorage::releaseBlocks(BlockAddress blockAddress, unsigned numBlocks)
 {
+  std::lock_guard<std::mutex> lock(m_mutex);
   auto blockIndex = blockAddress.index();
 
   F2F_ASSERT(blockIndex + numBlocks <= m_blocksCount);
@@ -323,19 +358,94 @@ void BlockStorage::releaseBlocks(BlockAddress blockAddress, unsigned numBlocks)
   }
   else
     endBlockIndex = blockIndex + numBlocks - 1;
-  m_storageHeader.occupiedBlocksCount -= numBlocks;
+  m_storageHeader.setOccupiedBlocksCount(m_storageHeader.occupiedBlocksCount() - numBlocks);
 
-  markBlocksAsFree(blockIndex, endBlockIndex, OccupancyGroupLevels.LevelsCount - 1, sizeof(format::StorageHeader), 0);
+  markBlocksAsFree(blockIndex, endBlockIndex, m_levelsCount - 1, m_headerSize, 0);
   
   writeT(m_storage,0,m_storageHeader);
 }
 
-bool BlockStorage::isAdjacentBlocks(BlockAddress blockRangeStart, unsigned rangeSize, BlockAddress blockIndex2)
+void BlockStorage::releaseExtents(std::vector<Extent> & extents)
+{
+  if (extents.empty())
+    return;
+
+  std::sort(extents.begin(), extents.end());
+
+  uint64_t releasedCount = 0;
+  for(auto const & extent: extents)
+    releasedCount += extent.second;
+
+  std::lock_guard<std::mutex> lock(m_mutex);
+
+  // Each level is processed in single pass over sorted extents, so every occupancy block
+  // is read and written once
+  uint64_t const storageSize = m_storage.size();
+  for(unsigned level = 0; level < m_levelsCount; ++level)
+  {
+    uint64_t const blocksInGroup = m_blocksInLevel[level];
+    uint64_t const blocksInBit = level == 0 ? 1 : m_blocksInLevel[level - 1];
+
+    OccupancyBlock block(m_blockSize);
+    bool isBlockRead = false;
+    uint64_t blockPosition = 0;
+    uint64_t previousEnd = 0;
+    for(auto const & extent: extents)
+    {
+      uint64_t const begin = extent.first.index();
+      uint64_t const end = begin + extent.second;
+      F2F_ASSERT(previousEnd <= begin);
+      F2F_ASSERT(end <= m_blocksCount);
+      previousEnd = end;
+
+      for(uint64_t blockIndex = begin; blockIndex < end; )
+      {
+        uint64_t const groupIndex = blockIndex / blocksInGroup;
+        uint64_t const groupEnd = std::min(end, (groupIndex + 1) * blocksInGroup);
+        uint64_t const position = getOccupancyBlockPosition(level, groupIndex);
+        if (position < storageSize)
+        {
+          if (!isBlockRead || blockPosition != position)
+          {
+            if (isBlockRead)
+              writeT(m_storage, blockPosition, block);
+            readT(m_storage, position, block);
+            isBlockRead = true;
+            blockPosition = position;
+          }
+          util::ClearBitRange(block->bitmap,
+            static_cast<unsigned>(blockIndex % blocksInGroup / blocksInBit),
+            static_cast<unsigned>((groupEnd - 1) % blocksInGroup / blocksInBit));
+        }
+        blockIndex = groupEnd;
+      }
+    }
+    if (isBlockRead)
+      writeT(m_storage, blockPosition, block);
+  }
+
+  uint64_t const lastExtentEnd = extents.back().first.index() + extents.back().second;
+  if (lastExtentEnd == m_blocksCount)
+    // Truncate as much as possible including all free blocks at the end
+    truncateStorage(findStartOfFreeBlocksRange(extents.back().first.index()));
+
+  m_storageHeader.setOccupiedBlocksCount(m_storageHeader.occupiedBlocksCount() - releasedCount);
+  writeT(m_storage, 0, m_storageHeader);
+}
+
+void BlockStorage::setOrphanListBlock(uint64_t blockIndex)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_storageHeader.setOrphanListBlock(blockIndex);
+  writeT(m_storage, 0, m_storageHeader);
+}
+
+bool BlockStorage::isAdjacentBlocks(BlockAddress blockRangeStart, unsigned rangeSize, BlockAddress blockIndex2) const
 {
   auto lastBlockInRange = blockRangeStart.index() + rangeSize - 1;
   return lastBlockInRange + 1 == blockIndex2.index()
-    && BlockAddress::fromBlockIndex(lastBlockInRange).absoluteAddress() 
-      + format::AddressableBlockSize == blockIndex2.absoluteAddress();
+    && absoluteAddress(BlockAddress::fromBlockIndex(lastBlockInRange)) + m_blockSize
+      == absoluteAddress(blockIndex2);
 }
 
 int64_t BlockStorage::findStartOfFreeBlocksRange(uint64_t endBlockIndex) const
@@ -345,16 +455,16 @@ int64_t BlockStorage::findStartOfFreeBlocksRange(uint64_t endBlockIndex) const
   uint64_t endGroupIndex = getBlockGroupIndex(endBlockIndex - 1);
   for (uint64_t groupIndex = endGroupIndex;; --groupIndex)
   {
-    format::OccupancyBlock block;
+    OccupancyBlock block(m_blockSize);
     readT(m_storage, getOccupancyBlockPosition(groupIndex), block);
 
-    unsigned lastBit = format::OccupancyBlock::BitmapItemsCount;
+    unsigned lastBit = unsigned(m_blocksInLevel[0]);
     if (groupIndex == endGroupIndex)
       lastBit = getBlockIndexInGroup(endBlockIndex - 1) + 1;
 
-    int lastOccupiedBlockInGroup = util::FindLastSetBit(block.bitmap, lastBit);
+    int lastOccupiedBlockInGroup = util::FindLastSetBit(block->bitmap, lastBit);
     if (lastOccupiedBlockInGroup != -1)
-      return groupIndex * format::OccupancyBlock::BitmapItemsCount + lastOccupiedBlockInGroup + 1;
+      return groupIndex * m_blocksInLevel[0] + lastOccupiedBlockInGroup + 1;
 
     if (groupIndex == 0)
       break;
@@ -375,50 +485,51 @@ struct BlockStorage::CheckState
 
 void BlockStorage::check() const
 {
+  std::lock_guard<std::mutex> lock(m_mutex);
   CheckState checkState = {};
-  checkLevel(checkState, OccupancyGroupLevels.LevelsCount - 1, sizeof(format::StorageHeader), 0);
+  checkLevel(checkState, m_levelsCount - 1, m_headerSize, 0);
 
-  F2F_FORMAT_ASSERT(checkState.occupiedBlocksCount == m_storageHeader.occupiedBlocksCount);
+  F2F_FORMAT_ASSERT(checkState.occupiedBlocksCount == m_storageHeader.occupiedBlocksCount());
 }
 
 bool BlockStorage::checkLevel(CheckState & checkState, unsigned level, uint64_t absoluteOffset, uint64_t blocksOffset) const
 {
   if (level == 0)
   {
-    if (absoluteOffset >= m_storage.size() - sizeof(format::StorageHeader))
+    if (absoluteOffset >= m_storage.size())
       return true;
-    format::OccupancyBlock block;
+    OccupancyBlock block(m_blockSize);
     readT(m_storage, absoluteOffset, block);
-    for (int i = 0; i < format::OccupancyBlock::BitmapItemsCount; ++i)
+    for (unsigned i = 0; i < m_blocksInLevel[0]; ++i)
     {
-      if (util::GetBit(block.bitmap, i))
+      if (util::GetBit(block->bitmap, i))
         ++checkState.occupiedBlocksCount;
     }
-    return util::HasZeroBit(block.bitmap, format::OccupancyBlock::BitmapWordsCount);
+    return util::HasZeroBit(block->bitmap, format::OccupancyBlock::bitmapWordsCount(m_blockSize));
   }
   else
   {
-    uint64_t position = absoluteOffset + OccupancyGroupLevels.levelAbsoluteSize[level - 1];
-    format::OccupancyBlock block;
+    uint64_t position = absoluteOffset + m_levelAbsoluteSize[level - 1];
+    OccupancyBlock block(m_blockSize);
     bool hasFreeBlocks = true;
-    bool levelBlockExists = position < m_storage.size() - sizeof(format::StorageHeader);
+    bool levelBlockExists = position < m_storage.size();
     if (levelBlockExists)
     {
       readT(m_storage, position, block);
-      hasFreeBlocks = util::HasZeroBit(block.bitmap, format::OccupancyBlock::BitmapWordsCount);
+      hasFreeBlocks = util::HasZeroBit(block->bitmap, format::OccupancyBlock::bitmapWordsCount(m_blockSize));
     }
 
-    for(int subGroup = 0; subGroup < (levelBlockExists ? format::OccupancyBlock::BitmapItemsCount : 1); ++subGroup)
+    for(unsigned subGroup = 0; subGroup < (levelBlockExists ? m_blocksInLevel[0] : 1); ++subGroup)
     {
       bool subGroupHasFreeBlocks = checkLevel(
         checkState,
         level - 1,
         subGroup == 0
           ? absoluteOffset
-          : (absoluteOffset + format::OccupancyBlockSize + subGroup * OccupancyGroupLevels.levelAbsoluteSize[level - 1]),
-        blocksOffset + subGroup * OccupancyGroupLevels.blocksInLevel[level - 1]);
+          : (absoluteOffset + m_blockSize + subGroup * m_levelAbsoluteSize[level - 1]),
+        blocksOffset + subGroup * m_blocksInLevel[level - 1]);
       if (levelBlockExists)
-        F2F_FORMAT_ASSERT(subGroupHasFreeBlocks != util::GetBit(block.bitmap, subGroup));
+        F2F_FORMAT_ASSERT(subGroupHasFreeBlocks != util::GetBit(block->bitmap, subGroup));
     }
     return hasFreeBlocks;
   }
@@ -426,24 +537,26 @@ bool BlockStorage::checkLevel(CheckState & checkState, unsigned level, uint64_t
 
 void BlockStorage::checkAllocatedBlock(BlockAddress blockIndex) const
 {
+  std::lock_guard<std::mutex> lock(m_mutex);
   F2F_FORMAT_ASSERT(blockIndex.index() < m_blocksCount);
 
-  format::OccupancyBlock block;
+  OccupancyBlock block(m_blockSize);
   readT(m_storage, getOccupancyBlockPosition(getBlockGroupIndex(blockIndex.index())), block);
-  F2F_FORMAT_ASSERT(util::GetBitInRange(block.bitmap, getBlockIndexInGroup(blockIndex.index())));
+  F2F_FORMAT_ASSERT(util::GetBitInRange(block->bitmap, getBlockIndexInGroup(blockIndex.index())));
 }
 
 void BlockStorage::enumerateAllocatedBlocks(std::function<void(BlockAddress const &)> const & visitor) const
 {
+  std::lock_guard<std::mutex> lock(m_mutex);
   for (uint64_t groupIndex = 0, blockIndex = 0; blockIndex < m_blocksCount; ++groupIndex)
   {
-    format::OccupancyBlock block;
+    OccupancyBlock block(m_blockSize);
     readT(m_storage, getOccupancyBlockPosition(groupIndex), block);
     for(unsigned blockInGroupIndex = 0; 
       blockIndex < m_blocksCount
-        && blockInGroupIndex < format::OccupancyBlock::BitmapItemsCount; 
+        && blockInGroupIndex < m_blocksInLevel[0]; 
       ++blockIndex, ++blockInGroupIndex)
-      if (util::GetBitInRange(block.bitmap, blockInGroupIndex))
+      if (util::GetBitInRange(block->bitmap, blockInGroupIndex))
         visitor(BlockAddress::fromBlockIndex(blockIndex));
   }
 }
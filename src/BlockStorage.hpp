@@ -1,5 +1,7 @@
 #pragma once
 
+#include <mutex>
+#include <vector>
 #include <boost/optional.hpp>
 #include "f2f/IStorage.hpp"
 #include "format/BlockStorage.hpp"
@@ -13,7 +15,6 @@ class BlockAddress
 public:
   BlockAddress() = default;
 
-  uint64_t absoluteAddress() const;
   inline uint64_t index() const { return m_blockIndex; }
 
   static BlockAddress fromBlockIndex(uint64_t blockIndex)
@@ -37,17 +38,39 @@ private:
   uint64_t m_blockIndex;
 };
 
+// Block allocator. Allocation, release and diagnostics are serialized by internal mutex,
+// so that files and directories can be modified from different threads.
+// Visitors passed to its methods are called under the lock and must not call BlockStorage.
 class BlockStorage
 {
 public:
-  explicit BlockStorage(IStorage &, bool format = false);
+  // Block size is format::AddressableBlockSize << blockSizeLog2. Aligned layout pads storage
+  // header to format::StorageHeader::AlignedHeaderSize. Both are chosen when storage is formatted
+  // and kept in storage header, they are ignored when storage is opened
+  explicit BlockStorage(IStorage &, bool format = false, unsigned blockSizeLog2 = 0,
+    bool alignedLayout = false);
 
   IStorage & storage() const { return m_storage; }
+  unsigned blockSize() const { return m_blockSize; }
+  uint64_t absoluteAddress(BlockAddress) const;
 
   BlockAddress allocateBlock();
   void allocateBlocks(uint64_t numBlocks, std::function<void (BlockAddress const &)> const & visitor);
   void releaseBlocks(BlockAddress blockIndex, unsigned numBlocks);
-  static bool isAdjacentBlocks(BlockAddress blockRangeStart, unsigned rangeSize, BlockAddress blockIndex2);
+  // First block and blocks count
+  typedef std::pair<BlockAddress, unsigned> Extent;
+  // Releases non-overlapping extents updating each occupancy block and storage header once.
+  // Extents are sorted in place.
+  void releaseExtents(std::vector<Extent> & extents);
+  bool isAdjacentBlocks(BlockAddress blockRangeStart, unsigned rangeSize, BlockAddress blockIndex2) const;
+  // Number of blocks holding regular file of given size
+  uint64_t fileBlocksCount(uint64_t fileSize) const;
+  // Number of blocks whose occupancy is kept in one occupancy block
+  unsigned blocksInGroup() const { return unsigned(m_blocksInLevel[0]); }
+
+  // Block index of orphan list head kept in storage header, 0 if there is no list
+  uint64_t orphanListBlock() const { return m_storageHeader.orphanListBlock(); }
+  void setOrphanListBlock(uint64_t blockIndex);
 
   // Diagnostics
   void check() const;
@@ -57,8 +80,19 @@ public:
 
 private:
   IStorage & m_storage;
+  mutable std::mutex m_mutex;
   uint64_t m_blocksCount;
   format::StorageHeader m_storageHeader;
+  unsigned m_blockSize;
+  uint64_t m_headerSize; // Size of storage area preceding the first group of blocks
+
+  // Blocks are grouped by levels of occupancy blocks. Group of level 0 is its occupancy block
+  // followed by blocks it describes. Group of next level is sequence of groups of previous level,
+  // its occupancy block follows the first of them. Levels are added until they address 2^48 blocks
+  static const unsigned MaxLevelsCount = 4;
+  unsigned m_levelsCount;
+  uint64_t m_levelAbsoluteSize[MaxLevelsCount]; // Saturated on overflow in top level
+  uint64_t m_blocksInLevel[MaxLevelsCount];
 
   bool allocateBlocksLevel0(uint64_t & numBlocks,
     std::function<void(BlockAddress const &)> const & visitor,
@@ -76,11 +110,13 @@ private:
   struct CheckState;
   bool checkLevel(CheckState &, unsigned level, uint64_t absoluteOffset, uint64_t blocksOffset) const;
 
-  static uint64_t getOccupancyBlockPosition(uint64_t groupIndex);
-  static uint64_t getBlockGroupIndex(uint64_t blockIndex);
-  static unsigned getBlockIndexInGroup(uint64_t blockIndex);
-  static uint64_t getSizeForNBlocks(uint64_t numBlocks);
-  static uint64_t getBlocksCountByStorageSize(uint64_t size);
+  void initGeometry(); // From storage header
+  uint64_t getOccupancyBlockPosition(uint64_t groupIndex) const;
+  uint64_t getOccupancyBlockPosition(unsigned level, uint64_t groupIndexInLevel) const;
+  uint64_t getBlockGroupIndex(uint64_t blockIndex) const;
+  unsigned getBlockIndexInGroup(uint64_t blockIndex) const;
+  uint64_t getSizeForNBlocks(uint64_t numBlocks) const;
+  uint64_t getBlocksCountByStorageSize(uint64_t size) const;
 };
 
 }
\ No newline at end of file
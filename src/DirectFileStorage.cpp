@@ -0,0 +1,234 @@
+#include "f2f/FileStorage.hpp"
+#include <boost/filesystem.hpp>
+
+#ifndef _WIN32
+#  include <atomic>
+#  include <cerrno>
+#  include <cstdlib>
+#  include <cstring>
+#  include <fcntl.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#  include "f2f/FileSystemError.hpp"
+#  include "util/RangeLock.hpp"
+#endif
+
+namespace f2f
+{
+
+namespace fs = boost::filesystem;
+
+#if !defined(_WIN32) && defined(O_DIRECT)
+
+// Storage file opened with O_DIRECT, so its contents aren't cached by kernel. Direct I/O needs
+// offsets, sizes and memory aligned to device blocks, while file system accesses storage at
+// arbitrary offsets. Unaligned requests go through aligned bounce buffer, unaligned write
+// reads and rewrites its boundary blocks under exclusive lock of them.
+class DirectFileStorage: public IStorage
+{
+public:
+  // Returns nullptr if file system of the file doesn't support direct I/O
+  static std::unique_ptr<IStorage> open(fs::path const & fileName, OpenMode openMode)
+  {
+    int const fd = openMode == OpenMode::ReadOnly
+      ? ::open(fileName.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC)
+      : ::open(fileName.c_str(), O_RDWR | O_CREAT | O_DIRECT | O_CLOEXEC, 0666);
+    if (fd < 0 && errno == EINVAL)
+      return nullptr;
+    if (fd < 0)
+      throw fs::filesystem_error("Can't open storage file", fileName,
+        boost::system::error_code(errno, boost::system::system_category()));
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+    {
+      int const error = errno;
+      ::close(fd);
+      throw fs::filesystem_error("Can't get size of storage file", fileName,
+        boost::system::error_code(error, boost::system::system_category()));
+    }
+    return std::unique_ptr<IStorage>(new DirectFileStorage(fd, openMode, uint64_t(st.st_size)));
+  }
+
+  ~DirectFileStorage()
+  {
+    // Rewritten boundary blocks may extend file beyond its size
+    if (m_openMode != OpenMode::ReadOnly)
+    {
+      int const result = ::ftruncate(m_fd, off_t(m_size.load()));
+      (void)result;
+    }
+    ::close(m_fd);
+  }
+
+  uint64_t size() const override { return m_size; }
+
+  void read(uint64_t position, size_t size, void * data) const override
+  {
+    if (isAligned(position, size, data))
+    {
+      if (transfer(position, size, static_cast<char *>(data), false) < size)
+        throw FileSystemError(ErrorCode::InvalidStorageFormat, "Can't read from storage file");
+      return;
+    }
+    uint64_t const begin = alignDown(position);
+    size_t const alignedSize = size_t(alignUp(position + size) - begin);
+    AlignedBuffer buffer(alignedSize);
+    if (transfer(begin, alignedSize, buffer.get(), false) < position + size - begin)
+      throw FileSystemError(ErrorCode::InvalidStorageFormat, "Can't read from storage file");
+    memcpy(data, buffer.get() + (position - begin), size);
+  }
+
+  void write(uint64_t position, size_t size, void const * data) override
+  {
+    if (m_openMode == OpenMode::ReadOnly)
+      throw FileSystemError(ErrorCode::OperationRequiresWriteAccess, "Storage is opened in read-only mode");
+    if (isAligned(position, size, data))
+    {
+      writeAll(position, size, static_cast<char *>(const_cast<void *>(data)));
+      extendSize(position + size);
+      return;
+    }
+    uint64_t const begin = alignDown(position);
+    uint64_t const end = alignUp(position + size);
+    size_t const alignedSize = size_t(end - begin);
+    AlignedBuffer buffer(alignedSize);
+    // Boundary blocks may be shared with concurrent writes of adjacent ranges
+    util::RangeLock::Guard lock(m_boundaryLock, begin, end, true);
+    if (begin != position)
+      readBlock(begin, buffer.get());
+    if (end != position + size && (end - Alignment != begin || begin == position))
+      readBlock(end - Alignment, buffer.get() + alignedSize - Alignment);
+    memcpy(buffer.get() + (position - begin), data, size);
+    writeAll(begin, alignedSize, buffer.get());
+    extendSize(position + size);
+  }
+
+  void resize(uint64_t size) override
+  {
+    if (m_openMode == OpenMode::ReadOnly)
+      throw FileSystemError(ErrorCode::OperationRequiresWriteAccess, "Storage is opened in read-only mode");
+    if (::ftruncate(m_fd, off_t(size)) != 0)
+      throw FileSystemError(ErrorCode::InvalidStorageFormat, "Can't resize storage file");
+    m_size = size;
+  }
+
+private:
+  // Covers logical block size of common devices and memory page size
+  static const size_t Alignment = 4096;
+
+  class AlignedBuffer
+  {
+  public:
+    explicit AlignedBuffer(size_t size)
+    {
+      void * data = nullptr;
+      if (::posix_memalign(&data, Alignment, size) != 0)
+        throw std::bad_alloc();
+      m_data = static_cast<char *>(data);
+    }
+    ~AlignedBuffer() { ::free(m_data); }
+
+    AlignedBuffer(AlignedBuffer const &) = delete;
+    void operator=(AlignedBuffer const &) = delete;
+
+    char * get() const { return m_data; }
+
+  private:
+    char * m_data;
+  };
+
+  int const m_fd;
+  OpenMode const m_openMode;
+  std::atomic<uint64_t> m_size;
+  util::RangeLock m_boundaryLock;
+
+  DirectFileStorage(int fd, OpenMode openMode, uint64_t size)
+    : m_fd(fd)
+    , m_openMode(openMode)
+    , m_size(size)
+  {}
+
+  static uint64_t alignDown(uint64_t value) { return value - value % Alignment; }
+  static uint64_t alignUp(uint64_t value) { return alignDown(value + Alignment - 1); }
+
+  static bool isAligned(uint64_t position, size_t size, void const * data)
+  {
+    return position % Alignment == 0 && size % Alignment == 0
+      && reinterpret_cast<uintptr_t>(data) % Alignment == 0;
+  }
+
+  // Returns transferred size, which is less than requested only if read reaches end of file
+  size_t transfer(uint64_t position, size_t size, char * data, bool isWrite) const
+  {
+    size_t done = 0;
+    while (done < size)
+    {
+      ssize_t const result = isWrite
+        ? ::pwrite(m_fd, data + done, size - done, off_t(position + done))
+        : ::pread(m_fd, data + done, size - done, off_t(position + done));
+      if (result < 0 && errno == EINTR)
+        continue;
+      if (result < 0)
+        throw FileSystemError(ErrorCode::InvalidStorageFormat, isWrite
+          ? "Can't write to storage file" : "Can't read from storage file");
+      if (result == 0)
+        break;
+      done += size_t(result);
+    }
+    return done;
+  }
+
+  void writeAll(uint64_t position, size_t size, char * data)
+  {
+    if (transfer(position, size, data, true) < size)
+      throw FileSystemError(ErrorCode::InvalidStorageFormat, "Can't write to storage file");
+  }
+
+  // Write past the end extends storage as it does with regular file, file is trimmed to that size
+  // on close
+  void extendSize(uint64_t end)
+  {
+    uint64_t size = m_size;
+    while (size < end && !m_size.compare_exchange_weak(size, end))
+    {}
+  }
+
+  // Part of block beyond end of file is zeroed
+  void readBlock(uint64_t position, char * data) const
+  {
+    size_t const readSize = transfer(position, Alignment, data, false);
+    memset(data + readSize, 0, Alignment - readSize);
+  }
+};
+
+#endif
+
+namespace
+{
+  std::unique_ptr<IStorage> TryOpenDirectStorage(fs::path const & fileName, OpenMode openMode)
+  {
+#if !defined(_WIN32) && defined(O_DIRECT)
+    return DirectFileStorage::open(fileName, openMode);
+#else
+    (void)fileName;
+    (void)openMode;
+    return nullptr;
+#endif
+  }
+}
+
+std::unique_ptr<IStorage> OpenDirectFileStorage(const char * fileName, OpenMode openMode)
+{
+  if (auto storage = TryOpenDirectStorage(fileName, openMode))
+    return storage;
+  return OpenFileStorage(fileName, openMode);
+}
+
+std::unique_ptr<IStorage> OpenDirectFileStorage(const wchar_t * fileName, OpenMode openMode)
+{
+  if (auto storage = TryOpenDirectStorage(fileName, openMode))
+    return storage;
+  return OpenFileStorage(fileName, openMode);
+}
+
+}
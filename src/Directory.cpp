@@ -4,15 +4,84 @@
 #include "util/Assert.hpp"
 #include "util/StorageT.hpp"
 #include "util/FNVHash.hpp"
+#include "util/XXHash.hpp"
 #include "util/Algorithm.hpp"
+#include "util/BlockBuffer.hpp"
 #include <boost/iterator.hpp>
 
 namespace f2f
 {
 
+class Directory::Tree
+{
+public:
+  virtual ~Tree() {}
+
+  virtual uint16_t formatVersion() const = 0;
+  virtual BlockAddress parentInodeAddress() const = 0;
+  virtual void setParentInodeAddress(BlockAddress const & parentAddress) = 0;
+
+  // Inode value contains DirectoryTreeLeafItem::DirectoryFlag for directories
+  virtual void addFile(uint64_t inode, utf8string_ref_t fileName) = 0;
+  // Files are sorted by name hash and merged into tree in one pass
+  virtual void addFiles(std::vector<std::pair<uint64_t, utf8string_ref_t>> const & files) = 0;
+  virtual boost::optional<uint64_t> searchFile(utf8string_ref_t fileName) const = 0;
+  virtual boost::optional<uint64_t> removeFile(utf8string_ref_t fileName) = 0;
+  // Changes inode value of existing item without modifying tree structure. Returns previous value
+  virtual boost::optional<uint64_t> replaceFile(utf8string_ref_t fileName, uint64_t inode) = 0;
+
+  // Releases all tree nodes except inode
+  virtual void removeNodes(OnDeleteFileFunc_t const &, OnReleaseBlockFunc_t const &) = 0;
+  // Writes inode to another block
+  virtual void moveInode(BlockAddress const & newInodeAddress) = 0;
+
+  // Iteration starts from the first item with name hash not less than fromNameHash
+  virtual std::unique_ptr<Iterator::Impl> iterate(uint64_t fromNameHash) const = 0;
+  virtual void check() const = 0;
+};
+
+struct Directory::Iterator::Impl
+{
+  virtual ~Impl() {}
+
+  virtual void moveNext() = 0;
+  virtual bool eof() const = 0;
+  virtual uint64_t currentInode() const = 0;
+  virtual uint64_t currentNameHash() const = 0;
+  virtual utf8string_ref_t currentName() const = 0;
+  // Enumerates inodes from current position to the end of current leaf
+  virtual void enumerateLeafInodes(std::function<void(uint64_t)> const &) const = 0;
+};
+
+uint64_t EncodeInode(BlockAddress const & inodeAddress, FileType fileType)
+{
+  switch (fileType)
+  {
+  case f2f::FileType::Regular:
+    return inodeAddress.index();
+  case f2f::FileType::Directory:
+    return inodeAddress.index() | format::DirectoryTreeLeafItem::DirectoryFlag;
+  default:
+    F2F_ASSERT(false);
+    return 0;
+  }
+}
+
+std::pair<BlockAddress, FileType> DecodeInode(uint64_t inode)
+{
+  return std::make_pair(
+    BlockAddress::fromBlockIndex(inode & ~format::DirectoryTreeLeafItem::DirectoryFlag),
+    (inode & format::DirectoryTreeLeafItem::DirectoryFlag)
+      ? FileType::Directory
+      : FileType::Regular);
+}
+
 namespace
 {
 
+template<class T, class U>
+using CopyConst_t = typename std::conditional<std::is_const<T>::value, U const, U>::type;
+
 template<class T>
 class DirectoryTreeLeafItemIteratorT
 {
@@ -65,753 +134,1806 @@ private:
   }
 };
 
-typedef DirectoryTreeLeafItemIteratorT<format::DirectoryTreeLeafItem> DirectoryTreeLeafItemIterator;
-typedef DirectoryTreeLeafItemIteratorT<format::DirectoryTreeLeafItem const> DirectoryTreeLeafItemConstIterator;
-
-} // anonymous namespace
-
-const BlockAddress Directory::NoParentDirectory = BlockAddress::fromBlockIndex(std::numeric_limits<uint64_t>::max());
-
-Directory::Directory(BlockStorage & blockStorage, BlockAddress const & parentAddress, create_tag)
-  : m_blockStorage(blockStorage)
-  , m_storage(blockStorage.storage())
-{
-  m_inodeAddress = m_blockStorage.allocateBlock();
-  memset(&m_inode, 0, sizeof(m_inode));
-  m_inode.parentDirectoryInode = 
-    parentAddress == NoParentDirectory ? m_inodeAddress.index() : parentAddress.index();
-  m_inode.levelsCount = 0;
-  m_inode.directReferences.dataSize = 0;
-  util::writeT(m_storage, m_inodeAddress, m_inode);
-}
-
-Directory::Directory(BlockStorage & blockStorage, BlockAddress const & inodeAddress)
-  : m_blockStorage(blockStorage)
-  , m_storage(blockStorage.storage())
-  , m_inodeAddress(inodeAddress)
+// Items of leaf node (or of inode without child nodes) are stored one after another in sorted order.
+// LeafItem may be const-qualified for read-only access
+template<class LeafItem>
+class PackedLeafItems
 {
-  util::readT(m_storage, inodeAddress, m_inode);
+public:
+  typedef typename std::remove_const<LeafItem>::type Item_t;
+  typedef decltype(Item_t::nameHash) NameHash_t;
+  typedef CopyConst_t<LeafItem, uint16_t> DataSize_t;
 
-  F2F_FORMAT_ASSERT(m_inode.levelsCount < 100);
-  if (m_inode.levelsCount > 0)
-    F2F_FORMAT_ASSERT(m_inode.indirectReferences.itemsCount <= m_inode.indirectReferences.MaxCount);
-  else
-    F2F_FORMAT_ASSERT(m_inode.directReferences.dataSize <= m_inode.directReferences.MaxDataSize);
-}
+  class Cursor
+  {
+  public:
+    explicit Cursor(PackedLeafItems const & items)
+      : m_iterator(items.m_head, items.m_dataSize)
+    {}
+
+    bool atEnd() const { return m_iterator.atEnd(); }
+    void operator ++() { ++m_iterator; }
+
+    NameHash_t nameHash() const { return m_iterator->nameHash; }
+    uint64_t inode() const { return m_iterator->inode; }
+    utf8string_ref_t name() const { return utf8string_ref_t(m_iterator->name, m_iterator->nameSize); }
+
+  private:
+    DirectoryTreeLeafItemIteratorT<Item_t const> m_iterator;
+  };
+
+  PackedLeafItems(DataSize_t & dataSize, LeafItem & head, unsigned maxDataSize)
+    : m_dataSize(dataSize)
+    , m_head(head)
+    , m_maxDataSize(maxDataSize)
+  {}
 
-BlockAddress Directory::parentInodeAddress() const
-{
-  return BlockAddress::fromBlockIndex(m_inode.parentDirectoryInode);
-}
+  static unsigned entrySize(size_t nameSize)
+  {
+    return offsetof(Item_t, name) + nameSize;
+  }
 
-void Directory::read(BlockAddress blockIndex, format::DirectoryTreeInternalNode & internalNode) const
-{
-  util::readT(m_storage, blockIndex, internalNode);
-  F2F_FORMAT_ASSERT(internalNode.itemsCount <= internalNode.MaxCount);
-}
+  unsigned usedSize() const { return m_dataSize; }
+  unsigned maxSize() const { return m_maxDataSize; }
+  Cursor cursor() const { return Cursor(*this); }
 
-void Directory::read(BlockAddress blockIndex, format::DirectoryTreeLeaf & leaf) const
-{
-  util::readT(m_storage, blockIndex, leaf);
-  F2F_FORMAT_ASSERT(leaf.dataSize <= leaf.MaxDataSize);
-}
+  void checkHeader() const
+  {
+    F2F_FORMAT_ASSERT(m_dataSize <= m_maxDataSize);
+  }
 
-boost::optional<std::pair<BlockAddress, FileType>> Directory::searchFile(utf8string_t const & fileName) const
-{
-  static const std::string ParentDirectoryName("..");
-  if (fileName == ParentDirectoryName)
-    return std::make_pair(parentInodeAddress(), FileType::Directory);
+  void check() const
+  {}
 
-  NameHash_t nameHash = util::HashFNV1a_32(fileName.data(), fileName.data() + fileName.size());
-  boost::optional<uint64_t> result;
-  if (m_inode.levelsCount > 0)
+  boost::optional<uint64_t> search(NameHash_t nameHash, utf8string_ref_t fileName) const
   {
-    result = searchInNode(
-      nameHash, 
-      fileName, 
-      m_inode.levelsCount, 
-      m_inode.indirectReferences.children, 
-      m_inode.indirectReferences.itemsCount);
+    for(Cursor item(*this); !item.atEnd() && nameHash >= item.nameHash(); ++item)
+      if (nameHash == item.nameHash() && item.name() == fileName)
+        return item.inode();
+    return {};
   }
-  else
+
+  // Returns false if there is not enough space for new item
+  bool insert(uint64_t inode, NameHash_t nameHash, utf8string_ref_t fileName)
   {
-    result = searchInNode(
-      nameHash,
-      fileName,
-      m_inode.directReferences.head,
-      m_inode.directReferences.dataSize);
-  }
-  if (result)
-    return std::make_pair(
-      BlockAddress::fromBlockIndex(*result & ~format::DirectoryTreeLeafItem::DirectoryFlag), 
-      (*result & format::DirectoryTreeLeafItem::DirectoryFlag) 
-        ? FileType::Directory 
-        : FileType::Regular);
-  else
-    return {};
-}
+    DirectoryTreeLeafItemIteratorT<LeafItem> position(m_head, m_dataSize);
+    for(;!position.atEnd() && nameHash >= position->nameHash; ++position)
+    {
+      if (nameHash == position->nameHash
+        && utf8string_ref_t(position->name, position->nameSize) == fileName)
+        throw Directory::FileExistsError(DecodeInode(position->inode).second);
+    }
 
-boost::optional<uint64_t> Directory::searchInNode(NameHash_t nameHash, 
-  utf8string_t const & fileName, unsigned levelsRemain, 
-  format::DirectoryTreeChildNodeReference const * children, unsigned itemsCount) const
-{
-  auto position = std::lower_bound(
-    children + 1,
-    children + itemsCount,
-    nameHash,
-    [](format::DirectoryTreeChildNodeReference const & child, NameHash_t nameHash) -> bool 
-    {
-      return child.nameHash < nameHash;
-    }
-  );
-  // Key value "K" may be both in branch with "K" key and in previous branch too due to 
-  // way how duplicates are handled
-  --position;
-  // In case of hash collision and long file names more than one branch may contain same hash
-  for(; position != children + itemsCount && (position == children || nameHash >= position->nameHash); ++position)
-    if (boost::optional<uint64_t> result = searchInNode(
-        nameHash, fileName, levelsRemain - 1, 
-        BlockAddress::fromBlockIndex(position->childBlockIndex)))
-      return result;
-  return {};
-}
+    auto insertSize = entrySize(fileName.size());
+    if (m_dataSize + insertSize > m_maxDataSize)
+      return false;
+
+    char * data = reinterpret_cast<char *>(&m_head);
+    memmove(
+      data + position.offsetInBytes() + insertSize,
+      data + position.offsetInBytes(),
+      m_dataSize - position.offsetInBytes());
+    write(data + position.offsetInBytes(), inode, nameHash, fileName);
+    m_dataSize += insertSize;
+    return true;
+  }
 
-boost::optional<uint64_t> Directory::searchInNode(
-  NameHash_t nameHash, 
-  utf8string_t const & fileName, 
-  format::DirectoryTreeLeafItem const & head, 
-  unsigned dataSize) const
-{
-  for(DirectoryTreeLeafItemConstIterator item(head, dataSize); 
-    !item.atEnd() && nameHash >= item->nameHash; 
-    ++item)
+  // Adds item after all existing ones, ignoring sort order
+  void append(uint64_t inode, NameHash_t nameHash, utf8string_ref_t fileName)
   {
-    if (nameHash == item->nameHash 
-      && item->nameSize == fileName.size()
-      && std::equal(item->name, item->name + item->nameSize, fileName.begin()))
-      return item->inode;
+    auto appendSize = entrySize(fileName.size());
+    F2F_ASSERT(m_dataSize + appendSize <= m_maxDataSize);
+    write(reinterpret_cast<char *>(&m_head) + m_dataSize, inode, nameHash, fileName);
+    m_dataSize += appendSize;
   }
-  return {};
-}
 
-boost::optional<uint64_t> Directory::searchInNode(NameHash_t nameHash, 
-  utf8string_t const & fileName, unsigned levelsRemain, BlockAddress blockIndex) const
-{
-  if (levelsRemain > 0)
+  boost::optional<uint64_t> remove(NameHash_t nameHash, utf8string_ref_t fileName)
   {
-    format::DirectoryTreeInternalNode internalNode;
-    read(blockIndex, internalNode);
-    return searchInNode(nameHash, fileName, levelsRemain, internalNode.children, internalNode.itemsCount);
+    for (DirectoryTreeLeafItemIteratorT<LeafItem> item(m_head, m_dataSize);
+      !item.atEnd() && nameHash >= item->nameHash;
+      ++item)
+    {
+      if (nameHash == item->nameHash
+        && utf8string_ref_t(item->name, item->nameSize) == fileName)
+      {
+        auto inode = item->inode;
+
+        auto offset = item.offsetInBytes();
+        ++item;
+        if (item.atEnd())
+        {
+          // Removing last item - just change dataSize field
+          m_dataSize = offset;
+        }
+        else
+        {
+          auto removedSize = item.offsetInBytes() - offset;
+          memmove(
+            reinterpret_cast<char *>(&m_head) + offset,
+            reinterpret_cast<char *>(&m_head) + item.offsetInBytes(),
+            m_dataSize - item.offsetInBytes()
+            );
+          m_dataSize -= removedSize;
+        }
+
+        return inode;
+      }
+    }
+    return {};
   }
-  else
+
+  // Sets inode of existing item in place. Returns previous inode
+  boost::optional<uint64_t> replace(NameHash_t nameHash, utf8string_ref_t fileName, uint64_t inode)
   {
-    format::DirectoryTreeLeaf leaf;
-    read(blockIndex, leaf);
-    return searchInNode(nameHash, fileName, leaf.head, leaf.dataSize);
+    for (DirectoryTreeLeafItemIteratorT<LeafItem> item(m_head, m_dataSize);
+      !item.atEnd() && nameHash >= item->nameHash;
+      ++item)
+    {
+      if (nameHash == item->nameHash
+        && utf8string_ref_t(item->name, item->nameSize) == fileName)
+      {
+        uint64_t const replacedInode = item->inode;
+        item->inode = inode;
+        return replacedInode;
+      }
+    }
+    return {};
   }
-}
 
-std::vector<format::DirectoryTreeChildNodeReference> Directory::insertInNode(
-  uint64_t inode, NameHash_t nameHash, utf8string_t const & fileName,
-  unsigned levelsRemain, BlockAddress blockIndex)
-{
-  std::vector<format::DirectoryTreeChildNodeReference> newChildren;
-  if (levelsRemain == 0)
+  void clear()
   {
-    format::DirectoryTreeLeaf leaf;
-    read(blockIndex, leaf);
-    bool isDirty = false;
-    newChildren = insertInNode(inode, nameHash, fileName, 
-      leaf.head, leaf.nextLeafNode, leaf.dataSize, format::DirectoryTreeLeaf::MaxDataSize, isDirty);
-    if (isDirty)
-      util::writeT(m_storage, blockIndex, leaf);
+    m_dataSize = 0;
   }
-  else
+
+private:
+  DataSize_t & m_dataSize;
+  LeafItem & m_head;
+  unsigned const m_maxDataSize;
+
+  static void write(char * position, uint64_t inode, NameHash_t nameHash, utf8string_ref_t fileName)
   {
-    format::DirectoryTreeInternalNode internalNode;
-    read(blockIndex, internalNode);
-    bool isDirty = false;
-    auto newChild = insertInNode(inode, nameHash, fileName, levelsRemain, internalNode.children,
-      internalNode.itemsCount, internalNode.MaxCount, isDirty);
-    if (isDirty)
-      util::writeT(m_storage, blockIndex, internalNode);
-    if (newChild)
-      newChildren.push_back(*newChild);
-  }
-  return newChildren;
-}
+    Item_t & item = *reinterpret_cast<Item_t *>(position);
+    item.inode = inode;
+    item.nameHash = nameHash;
+    item.nameSize = fileName.size();
+    std::copy(fileName.begin(), fileName.end(), item.name);
+  }
+};
 
-boost::optional<format::DirectoryTreeChildNodeReference> Directory::insertInNode(
-  uint64_t inode, NameHash_t nameHash, utf8string_t const & fileName,
-  unsigned levelsRemain, format::DirectoryTreeChildNodeReference * children, 
-  uint16_t & itemsCount, unsigned maxItemsCount, bool & isDirty)
+// Items of leaf node (or of inode without child nodes) are referenced by array of slots sorted by hash,
+// so that lookup is a binary search and insertion moves only slots.
+// Items may be const-qualified for read-only access
+template<class Items>
+class SlottedLeafItems
 {
-  F2F_ASSERT(levelsRemain > 0);
+public:
+  typedef uint64_t NameHash_t;
+  typedef format::DirectorySlot Slot;
+  typedef format::DirectorySlottedRecord Record;
+  typedef typename std::remove_const<Items>::type Items_t;
 
-  auto position = std::lower_bound(
-    children + 1,
-    children + itemsCount,
-    nameHash,
-    [](format::DirectoryTreeChildNodeReference const & child, NameHash_t nameHash) -> bool
-    {
-      return child.nameHash < nameHash;
-    }
-  );
-  if (position == children + itemsCount || position->nameHash != nameHash)
-    --position;
+  class Cursor
+  {
+  public:
+    explicit Cursor(SlottedLeafItems const & items)
+      : m_items(items)
+      , m_index(0)
+    {}
+
+    bool atEnd() const { return m_index >= m_items.m_items.slotsCount; }
+    void operator ++() { ++m_index; }
+
+    NameHash_t nameHash() const { return m_items.slots()[m_index].nameHash; }
+    uint64_t inode() const { return m_items.record(m_index).inode; }
+    utf8string_ref_t name() const { return m_items.name(m_index); }
+
+  private:
+    SlottedLeafItems m_items;
+    unsigned m_index;
+  };
+
+  explicit SlottedLeafItems(Items & items)
+    : m_items(items)
+  {}
 
-  std::vector<format::DirectoryTreeChildNodeReference> newChildren =
-    insertInNode(inode, nameHash, fileName, levelsRemain - 1, BlockAddress::fromBlockIndex(position->childBlockIndex));
+  static unsigned entrySize(size_t nameSize)
+  {
+    return sizeof(Slot) + recordSize(nameSize);
+  }
 
-  if (!newChildren.empty())
+  unsigned usedSize() const
   {
-    isDirty = true;
-    if (itemsCount + newChildren.size() <= maxItemsCount)
-    {
-      std::copy_backward(
-        position + 1,
-        children + itemsCount,
-        children + itemsCount + newChildren.size());
-      std::copy(
-        newChildren.begin(),
-        newChildren.end(),
-        position + 1);
-      itemsCount += newChildren.size();
-    }
-    else
-    {
-      BlockAddress newBlock = m_blockStorage.allocateBlock();
-      format::DirectoryTreeInternalNode newNode;
-      newNode.itemsCount = (itemsCount + newChildren.size()) / 2;
-      unsigned itemsCountToLeave = itemsCount + newChildren.size() - newNode.itemsCount;
-      util::InsertAndCopyBackward(
-        children, children + itemsCount,
-        position + 1,
-        newChildren.begin(), newChildren.end(),
-        util::MakeSplitOutputIterator(
-          boost::make_reverse_iterator(newNode.children + newNode.itemsCount),
-          boost::make_reverse_iterator(newNode.children),
-          boost::make_reverse_iterator(children + itemsCountToLeave)));
-
-      util::writeT(m_storage, newBlock, newNode);
-      itemsCount = itemsCountToLeave;
-      format::DirectoryTreeChildNodeReference newNodeReference;
-      newNodeReference.childBlockIndex = newBlock.index();
-      newNodeReference.nameHash = newNode.children[0].nameHash;
-      return newNodeReference;
-    }
-  }
-  return {};
-}
+    return m_items.slotsCount * sizeof(Slot) + Items_t::MaxDataSize - m_items.recordsOffset;
+  }
 
-// At most two new leaf nodes may be needed (the "worst" case when large file name appears in the middle)
-std::vector<format::DirectoryTreeChildNodeReference> Directory::insertInNode(
-  uint64_t inode,
-  NameHash_t nameHash, utf8string_t const & fileName,
-  format::DirectoryTreeLeafItem & head, 
-  uint64_t & nextLeafNode,
-  uint16_t & dataSize, unsigned maxSize, bool & isDirty)
-{
-  DirectoryTreeLeafItemIterator position(head, dataSize);
-  for(;!position.atEnd() && nameHash >= position->nameHash; ++position)
+  unsigned maxSize() const { return Items_t::MaxDataSize; }
+  Cursor cursor() const { return Cursor(*this); }
+
+  void checkHeader() const
   {
-    if (nameHash == position->nameHash
-      && position->nameSize == fileName.size()
-      && std::equal(position->name, position->name + position->nameSize, fileName.begin()))
-      throw FileExistsError(position->inode & format::DirectoryTreeLeafItem::DirectoryFlag
-        ? FileType::Directory
-        : FileType::Regular);
+    F2F_FORMAT_ASSERT(m_items.recordsOffset <= Items_t::MaxDataSize);
+    F2F_FORMAT_ASSERT(m_items.slotsCount * sizeof(Slot) <= m_items.recordsOffset);
   }
 
-  auto insertSize = getSizeOfLeafRecord(fileName);
-  auto sumSize = insertSize + dataSize;
-  
-  char tempBlock[format::DirectoryTreeLeaf::MaxDataSize * 2];
-  char * sumData;
-  if (sumSize <= maxSize)
+  void check() const
   {
-    // Perform insert in place
-    sumData = reinterpret_cast<char *>(&head);
+    unsigned recordsSize = 0;
+    for(unsigned i = 0; i < m_items.slotsCount; ++i)
+      recordsSize += recordSize(record(i).nameSize);
+    F2F_FORMAT_ASSERT(recordsSize == Items_t::MaxDataSize - m_items.recordsOffset);
   }
-  else
+
+  boost::optional<uint64_t> search(NameHash_t nameHash, utf8string_ref_t fileName) const
   {
-    // Perform insert in temporary buffer
-    sumData = tempBlock;
-    memcpy(sumData, &head, position.offsetInBytes());
+    auto range = equalRange(nameHash);
+    for(unsigned i = range.first; i != range.second; ++i)
+      if (name(i) == fileName)
+        return record(i).inode;
+    return {};
   }
 
-  memmove(
-    sumData + position.offsetInBytes() + insertSize,
-    reinterpret_cast<const char *>(position.get()),
-    dataSize - position.offsetInBytes());
+  // Returns false if there is not enough space for new item
+  bool insert(uint64_t inode, NameHash_t nameHash, utf8string_ref_t fileName)
+  {
+    auto range = equalRange(nameHash);
+    for(unsigned i = range.first; i != range.second; ++i)
+      if (name(i) == fileName)
+        throw Directory::FileExistsError(DecodeInode(record(i).inode).second);
+
+    if (usedSize() + entrySize(fileName.size()) > Items_t::MaxDataSize)
+      return false;
+
+    Slot * slotsBegin = slots();
+    std::copy_backward(
+      slotsBegin + range.second,
+      slotsBegin + m_items.slotsCount,
+      slotsBegin + m_items.slotsCount + 1);
+    writeSlot(slotsBegin[range.second], inode, nameHash, fileName);
+    ++m_items.slotsCount;
+    return true;
+  }
 
-  format::DirectoryTreeLeafItem & destPosition = 
-    *reinterpret_cast<format::DirectoryTreeLeafItem *>(sumData + position.offsetInBytes());
-  destPosition.inode = inode;
-  destPosition.nameHash = nameHash;
-  destPosition.nameSize = fileName.size();
-  std::copy(fileName.begin(), fileName.end(), destPosition.name);
+  // Adds item after all existing ones, ignoring sort order
+  void append(uint64_t inode, NameHash_t nameHash, utf8string_ref_t fileName)
+  {
+    F2F_ASSERT(usedSize() + entrySize(fileName.size()) <= Items_t::MaxDataSize);
+    writeSlot(slots()[m_items.slotsCount], inode, nameHash, fileName);
+    ++m_items.slotsCount;
+  }
 
-  if (sumSize <= maxSize)
+  boost::optional<uint64_t> remove(NameHash_t nameHash, utf8string_ref_t fileName)
   {
-    dataSize = sumSize;
-    isDirty = true;
+    auto range = equalRange(nameHash);
+    for(unsigned i = range.first; i != range.second; ++i)
+      if (name(i) == fileName)
+      {
+        uint64_t inode = record(i).inode;
+
+        // Close the gap in records area by moving records that precede removed one
+        Slot * slotsBegin = slots();
+        unsigned const offset = slotsBegin[i].recordOffset;
+        unsigned const removedSize = recordSize(record(i).nameSize);
+        memmove(
+          m_items.data + m_items.recordsOffset + removedSize,
+          m_items.data + m_items.recordsOffset,
+          offset - m_items.recordsOffset);
+        for(Slot * slot = slotsBegin; slot != slotsBegin + m_items.slotsCount; ++slot)
+          if (slot->recordOffset < offset)
+            slot->recordOffset += removedSize;
+        m_items.recordsOffset += removedSize;
+
+        std::copy(slotsBegin + i + 1, slotsBegin + m_items.slotsCount, slotsBegin + i);
+        --m_items.slotsCount;
+        return inode;
+      }
     return {};
   }
-  else
+
+  // Sets inode of existing item in place. Returns previous inode
+  boost::optional<uint64_t> replace(NameHash_t nameHash, utf8string_ref_t fileName, uint64_t inode)
   {
-    // Have to split on 2 or 3
-    unsigned mid = sumSize / 2;
-    unsigned beforeMid = 0, afterMid = sumSize;
-    format::DirectoryTreeLeafItem const & destHead =
-      *reinterpret_cast<format::DirectoryTreeLeafItem *>(sumData);
-    for (DirectoryTreeLeafItemConstIterator item(destHead, sumSize); !item.atEnd(); ++item)
-    {
-      if (item.offsetInBytes() > mid)
+    auto range = equalRange(nameHash);
+    for(unsigned i = range.first; i != range.second; ++i)
+      if (name(i) == fileName)
       {
-        afterMid = item.offsetInBytes();
-        break;
+        Record & target = const_cast<Record &>(record(i));
+        uint64_t const replacedInode = target.inode;
+        target.inode = inode;
+        return replacedInode;
       }
-      else
-        beforeMid = item.offsetInBytes();
-    }
-
-    std::vector<format::DirectoryTreeChildNodeReference> newLeafsReferences;
-    if (std::min(afterMid, sumSize - beforeMid) <= format::DirectoryTreeLeafHeader::MaxDataSize)
-    {
-      // We can split on 2
-      auto splitBy = (afterMid < sumSize - beforeMid) ? afterMid : beforeMid;
-      BlockAddress newBlock = m_blockStorage.allocateBlock();
-      format::DirectoryTreeLeaf newLeaf;
-      newLeaf.nextLeafNode = nextLeafNode;
-      nextLeafNode = newBlock.index();
-      newLeaf.dataSize = sumSize - splitBy;
-      memcpy(&newLeaf.head, sumData + splitBy, newLeaf.dataSize);
-      util::writeT(m_storage, newBlock, newLeaf);
-      format::DirectoryTreeChildNodeReference reference;
-      reference.childBlockIndex = newBlock.index();
-      reference.nameHash = newLeaf.head.nameHash;
-      newLeafsReferences.push_back(reference);
+    return {};
+  }
 
-      dataSize = splitBy;
-      memcpy(&head, sumData, dataSize); 
-      isDirty = true;
-    }
-    else
-    {
-      // 3 leafs are required
-      BlockAddress newBlock1 = m_blockStorage.allocateBlock();
-      BlockAddress newBlock2 = m_blockStorage.allocateBlock();
+  void clear()
+  {
+    m_items.slotsCount = 0;
+    m_items.recordsOffset = Items_t::MaxDataSize;
+  }
 
-      // 1st new block
-      format::DirectoryTreeLeaf newLeaf;
-      newLeaf.nextLeafNode = newBlock2.index();
-      newLeaf.dataSize = afterMid - beforeMid;
-      memcpy(&newLeaf.head, sumData + beforeMid, newLeaf.dataSize);
-      util::writeT(m_storage, newBlock1, newLeaf);
+private:
+  Items & m_items;
 
-      format::DirectoryTreeChildNodeReference reference;
-      reference.childBlockIndex = newBlock1.index();
-      reference.nameHash = newLeaf.head.nameHash;
-      newLeafsReferences.push_back(reference);
+  static unsigned recordSize(size_t nameSize)
+  {
+    return offsetof(Record, name) + nameSize;
+  }
 
-      // 2nd new block
-      newLeaf.nextLeafNode = nextLeafNode;
-      newLeaf.dataSize = sumSize - afterMid;
-      memcpy(&newLeaf.head, sumData + afterMid, newLeaf.dataSize);
-      util::writeT(m_storage, newBlock2, newLeaf);
+  CopyConst_t<Items, Slot> * slots() const
+  {
+    return reinterpret_cast<CopyConst_t<Items, Slot> *>(m_items.data);
+  }
 
-      reference.childBlockIndex = newBlock2.index();
-      reference.nameHash = newLeaf.head.nameHash;
-      newLeafsReferences.push_back(reference);
+  Record const & record(unsigned index) const
+  {
+    unsigned offset = slots()[index].recordOffset;
+    F2F_FORMAT_ASSERT(offset >= m_items.recordsOffset);
+    F2F_FORMAT_ASSERT(offset + offsetof(Record, name) <= Items_t::MaxDataSize);
+    Record const & result = *reinterpret_cast<Record const *>(m_items.data + offset);
+    F2F_FORMAT_ASSERT(offset + recordSize(result.nameSize) <= Items_t::MaxDataSize);
+    return result;
+  }
 
-      nextLeafNode = newBlock1.index();
-      dataSize = beforeMid;
-      memcpy(&head, sumData, dataSize);
-      isDirty = true;
-    }
-    return newLeafsReferences;
+  utf8string_ref_t name(unsigned index) const
+  {
+    Record const & result = record(index);
+    return utf8string_ref_t(result.name, result.nameSize);
   }
-}
 
-unsigned Directory::getSizeOfLeafRecord(utf8string_t const & fileName)
+  std::pair<unsigned, unsigned> equalRange(NameHash_t nameHash) const
+  {
+    auto begin = slots();
+    auto end = begin + m_items.slotsCount;
+    auto lower = std::lower_bound(begin, end, nameHash,
+      [](Slot const & slot, NameHash_t nameHash) -> bool
+      {
+        return slot.nameHash < nameHash;
+      });
+    auto upper = std::upper_bound(lower, end, nameHash,
+      [](NameHash_t nameHash, Slot const & slot) -> bool
+      {
+        return nameHash < slot.nameHash;
+      });
+    return std::make_pair(unsigned(lower - begin), unsigned(upper - begin));
+  }
+
+  void writeSlot(Slot & slot, uint64_t inode, NameHash_t nameHash, utf8string_ref_t fileName)
+  {
+    m_items.recordsOffset -= recordSize(fileName.size());
+    Record & record = *reinterpret_cast<Record *>(m_items.data + m_items.recordsOffset);
+    record.inode = inode;
+    record.nameSize = fileName.size();
+    std::copy(fileName.begin(), fileName.end(), record.name);
+    slot.nameHash = nameHash;
+    slot.recordOffset = m_items.recordsOffset;
+  }
+};
+
+template<class SourceItems, class DestItems>
+void CopyLeafItems(SourceItems const & source, DestItems && dest)
 {
-  return offsetof(format::DirectoryTreeLeafItem, name) + fileName.size();
+  dest.clear();
+  for(auto item = source.cursor(); !item.atEnd(); ++item)
+    dest.append(item.inode(), item.nameHash(), item.name());
 }
 
-void Directory::addFile(BlockAddress inodeAddress, FileType fileType, utf8string_t const & fileName)
+template<uint16_t FormatVersion, class NameHash, NameHash (*HashFunc)(char const *, char const *)>
+struct PackedDirectoryFormat
 {
-  uint64_t inode;
-  switch (fileType)
+  static const uint16_t Version = FormatVersion;
+  static const unsigned MaxFileNameSize = format::DirectoryMaxFileNameSize<NameHash>::value;
+  typedef NameHash NameHash_t;
+  typedef format::DirectoryTreeLeafT<NameHash> Leaf;
+  typedef format::DirectoryTreeInternalNodeT<NameHash> InternalNode;
+  typedef format::DirectoryInodeT<NameHash> Inode;
+  typedef PackedLeafItems<format::DirectoryTreeLeafItemT<NameHash>> LeafItems;
+  typedef PackedLeafItems<format::DirectoryTreeLeafItemT<NameHash> const> ConstLeafItems;
+
+  static NameHash_t hash(char const * begin, char const * end)
   {
-  case f2f::FileType::Regular:
-    inode = inodeAddress.index();
-    break;
-  case f2f::FileType::Directory:
-    inode = inodeAddress.index() | format::DirectoryTreeLeafItem::DirectoryFlag;
-    break;
-  default:
-    F2F_ASSERT(false);
-    return;
+    return HashFunc(begin, end);
   }
 
-  bool inodeIsDirty = false;
-
-  NameHash_t nameHash = util::HashFNV1a_32(fileName.data(), fileName.data() + fileName.size());
-  if (m_inode.levelsCount == 0)
+  static LeafItems items(Leaf & leaf)
   {
-    auto newRecordSize = getSizeOfLeafRecord(fileName);
-    if (m_inode.directReferences.dataSize + newRecordSize > m_inode.directReferences.MaxDataSize)
-    {
-      // Not enough space in root. Need to move root contents and new item into child nodes
-      BlockAddress newBlock = m_blockStorage.allocateBlock();
-      format::DirectoryTreeLeaf newLeaf;
-      newLeaf.nextLeafNode = format::DirectoryTreeLeaf::NoNextLeaf;
-      newLeaf.dataSize = m_inode.directReferences.dataSize;
-      memcpy(&newLeaf.head, &m_inode.directReferences.head, m_inode.directReferences.dataSize);
-
-      bool isNewLeafDirty;
-      std::vector<format::DirectoryTreeChildNodeReference> newChildrenReferences = insertInNode(
-        inode, nameHash, fileName, 
-        newLeaf.head, newLeaf.nextLeafNode, newLeaf.dataSize, newLeaf.MaxDataSize, isNewLeafDirty);
-
-      util::writeT(m_storage, newBlock, newLeaf);
-      m_inode.levelsCount = 1;
-      m_inode.indirectReferences.itemsCount = 1;
-      m_inode.indirectReferences.children[0].nameHash = 0;
-      m_inode.indirectReferences.children[0].childBlockIndex = newBlock.index();
-
-      for(auto const & newChild: newChildrenReferences)
-      {
-        // Second child node was needed
-        m_inode.indirectReferences.children[m_inode.indirectReferences.itemsCount] = newChild;
-        ++m_inode.indirectReferences.itemsCount;
-      }
-      inodeIsDirty = true;
-    }
-    else
-    {
-      uint64_t nextLeafNode = 0; // shouldn't be used
-      std::vector<format::DirectoryTreeChildNodeReference> newChildrenReferences = insertInNode(
-        inode, nameHash, fileName, 
-        m_inode.directReferences.head, 
-        nextLeafNode,
-        m_inode.directReferences.dataSize,
-        m_inode.directReferences.MaxDataSize,
-        inodeIsDirty);
-      F2F_ASSERT(newChildrenReferences.empty());
-    }
+    return LeafItems(leaf.dataSize, leaf.head, Leaf::MaxDataSize);
   }
-  else
-  {
-    if (m_inode.indirectReferences.itemsCount + 2 > m_inode.indirectReferences.MaxCount)
-    {
-      // At most two items may be added. Splitting root in advance to simplify the code.
-      BlockAddress newBlock1 = m_blockStorage.allocateBlock();
-      BlockAddress newBlock2 = m_blockStorage.allocateBlock();
-      format::DirectoryTreeInternalNode newNode;
-
-      unsigned nodesInBlock1 = m_inode.indirectReferences.itemsCount / 2;
-      newNode.itemsCount = nodesInBlock1;
-      std::copy_n(
-        m_inode.indirectReferences.children,
-        newNode.itemsCount,
-        newNode.children);
-      util::writeT(m_storage, newBlock1, newNode);
 
-      newNode.itemsCount = m_inode.indirectReferences.itemsCount - nodesInBlock1;
-      std::copy_n(
-        m_inode.indirectReferences.children + nodesInBlock1,
-        newNode.itemsCount,
-        newNode.children);
-      util::writeT(m_storage, newBlock2, newNode);
-
-      ++m_inode.levelsCount;
-      m_inode.indirectReferences.itemsCount = 2;
-      m_inode.indirectReferences.children[0].childBlockIndex = newBlock1.index();
-      m_inode.indirectReferences.children[0].nameHash = 0;
-      m_inode.indirectReferences.children[1].childBlockIndex = newBlock2.index();
-      m_inode.indirectReferences.children[1].nameHash = newNode.children[0].nameHash;
-      inodeIsDirty = true;
-    }
-    boost::optional<format::DirectoryTreeChildNodeReference> newChild = insertInNode(
-      inode, nameHash, fileName, m_inode.levelsCount, 
-      m_inode.indirectReferences.children,
-      m_inode.indirectReferences.itemsCount, 
-      m_inode.indirectReferences.MaxCount,
-      inodeIsDirty);
-    F2F_ASSERT(!newChild);
+  static ConstLeafItems items(Leaf const & leaf)
+  {
+    return ConstLeafItems(leaf.dataSize, leaf.head, Leaf::MaxDataSize);
   }
-  if (inodeIsDirty)
-    util::writeT(m_storage, m_inodeAddress, m_inode);
-}
 
-boost::optional<uint64_t> Directory::removeFromNode(NameHash_t nameHash, utf8string_t const & fileName,
-  unsigned levelsRemain, BlockAddress blockIndex)
-{
-  boost::optional<uint64_t> removedInode;
-  if (levelsRemain == 0)
+  static LeafItems items(typename Inode::DirectReferences & references)
   {
-    format::DirectoryTreeLeaf leaf;
-    read(blockIndex, leaf);
-    bool isDirty = false;
-    removedInode = removeFromNode(nameHash, fileName,
-      leaf.head, leaf.dataSize, isDirty);
-    if (isDirty)
-      util::writeT(m_storage, blockIndex, leaf);
+    return LeafItems(references.dataSize, references.head, references.MaxDataSize);
   }
-  else
+
+  static ConstLeafItems items(typename Inode::DirectReferences const & references)
   {
-    format::DirectoryTreeInternalNode internalNode;
-    read(blockIndex, internalNode);
-    bool isDirty = false;
-    removedInode = removeFromNode(nameHash, fileName, levelsRemain, internalNode.children,
-      internalNode.itemsCount, isDirty);
-    if (isDirty)
-      util::writeT(m_storage, blockIndex, internalNode);
+    return ConstLeafItems(references.dataSize, references.head, references.MaxDataSize);
   }
-  return removedInode;
-}
+};
 
-boost::optional<uint64_t> Directory::removeFromNode(
-  NameHash_t nameHash, utf8string_t const & fileName,
-  unsigned levelsRemain, format::DirectoryTreeChildNodeReference * children,
-  uint16_t & itemsCount, bool & isDirty)
-{
-  auto position = std::lower_bound(
-    children + 1,
-    children + itemsCount,
-    nameHash,
-    [](format::DirectoryTreeChildNodeReference const & child, NameHash_t nameHash) -> bool 
-    {
-      return child.nameHash < nameHash;
-    }
-  );
-  // Key value "K" may be both in branch with "K" key and in previous branch too due to 
-  // way how duplicates are handled
-  --position;
-  // In case of hash collision and long file names more than one branch may contain same hash
-  for(; position != children + itemsCount && (position == children || nameHash >= position->nameHash); ++position)
-    if (boost::optional<uint64_t> result = removeFromNode(
-        nameHash, fileName, levelsRemain - 1, 
-        BlockAddress::fromBlockIndex(position->childBlockIndex)))
-      return result;
-  return {};
-}
+typedef PackedDirectoryFormat<format::DirectoryFormatFNV1a32, uint32_t, &util::HashFNV1a_32> DirectoryFormatFNV1a32;
 
-boost::optional<uint64_t> Directory::removeFromNode(
-  NameHash_t nameHash, utf8string_t const & fileName,
-  format::DirectoryTreeLeafItem & head, uint16_t & dataSize, bool & isDirty)
+// Leaves and internal nodes fill whole block. File name size limit doesn't depend on block size,
+// so that names fit in directory of any storage
+template<unsigned BlockSize>
+struct DirectoryFormatSlotted
 {
-  for (DirectoryTreeLeafItemConstIterator item(head, dataSize);
-    !item.atEnd() && nameHash >= item->nameHash;
-    ++item)
+  static const uint16_t Version = format::DirectoryFormatSlotted;
+  static const unsigned MaxFileNameSize = format::DirectorySlottedLeaf::Items::MaxDataSize
+    - sizeof(format::DirectorySlot) - offsetof(format::DirectorySlottedRecord, name);
+  typedef uint64_t NameHash_t;
+  typedef format::DirectorySlottedLeafT<BlockSize> Leaf;
+  typedef format::DirectoryTreeInternalNodeT<NameHash_t, BlockSize> InternalNode;
+  typedef format::DirectorySlottedInode Inode;
+  typedef SlottedLeafItems<typename Leaf::Items> LeafItems;
+  typedef SlottedLeafItems<typename Leaf::Items const> ConstLeafItems;
+
+  static NameHash_t hash(char const * begin, char const * end)
   {
-    if (nameHash == item->nameHash
-      && item->nameSize == fileName.size()
-      && std::equal(item->name, item->name + item->nameSize, fileName.begin()))
-    {
-      isDirty = true;
-
-      auto inode = item->inode;
-
-      auto offset = item.offsetInBytes();
-      ++item;
-      if (item.atEnd())
-      {
-        // Removing last item - just change dataSize field
-        dataSize = offset; 
-      }
-      else
-      {
-        auto removedSize = item.offsetInBytes() - offset;
-        memmove(
-          reinterpret_cast<char *>(&head) + offset, 
-          reinterpret_cast<char *>(&head) + item.offsetInBytes(),
-          dataSize - item.offsetInBytes()
-          );
-        dataSize -= removedSize;
-      }
+    return util::HashXXH64(begin, end);
+  }
 
-      return inode;
-    }
+  static LeafItems items(Leaf & leaf)
+  {
+    return LeafItems(leaf.items);
   }
-  return {};
-}
 
-boost::optional<std::pair<BlockAddress, FileType>> Directory::removeFile(utf8string_t const & fileName) 
-{
-  bool inodeIsDirty = false;
-  boost::optional<uint64_t> removedInode;
+  static ConstLeafItems items(Leaf const & leaf)
+  {
+    return ConstLeafItems(leaf.items);
+  }
 
-  NameHash_t nameHash = util::HashFNV1a_32(fileName.data(), fileName.data() + fileName.size());
-  if (m_inode.levelsCount == 0)
+  static SlottedLeafItems<Inode::DirectReferences> items(Inode::DirectReferences & references)
   {
-    removedInode = removeFromNode(
-      nameHash, fileName,
-      m_inode.directReferences.head,
-      m_inode.directReferences.dataSize,
-      inodeIsDirty);
+    return SlottedLeafItems<Inode::DirectReferences>(references);
   }
-  else
+
+  static SlottedLeafItems<Inode::DirectReferences const> items(Inode::DirectReferences const & references)
   {
-    removedInode = removeFromNode(
-      nameHash, fileName, m_inode.levelsCount,
-      m_inode.indirectReferences.children,
-      m_inode.indirectReferences.itemsCount,
-      inodeIsDirty);
-  }
-  if (inodeIsDirty)
-    util::writeT(m_storage, m_inodeAddress, m_inode);
-
-  if (removedInode)
-    return std::make_pair(
-      BlockAddress::fromBlockIndex(*removedInode & ~format::DirectoryTreeLeafItem::DirectoryFlag),
-      (*removedInode & format::DirectoryTreeLeafItem::DirectoryFlag)
-        ? FileType::Directory
-        : FileType::Regular);
-  else
-    return {};
-}
+    return SlottedLeafItems<Inode::DirectReferences const>(references);
+  }
+};
 
-void Directory::remove(OnDeleteFileFunc_t const & onDeleteFile)
+template<class Format>
+class DirectoryTree: public Directory::Tree
 {
-  if (m_inode.levelsCount == 0)
-    removeNode(onDeleteFile, m_inode.directReferences.head, m_inode.directReferences.dataSize);
-  else
-    removeNode(onDeleteFile, m_inode.indirectReferences.children, m_inode.indirectReferences.itemsCount, m_inode.levelsCount);
-
-  m_blockStorage.releaseBlocks(m_inodeAddress, 1);
-}
+public:
+  typedef typename Format::NameHash_t NameHash_t;
+  typedef typename Format::Leaf Leaf;
+  typedef typename Format::Inode Inode;
+  typedef format::DirectoryTreeChildNodeReferenceT<NameHash_t> ChildNodeReference;
+  typedef typename Format::InternalNode InternalNode;
+  // Nodes fill whole block, so they are kept in block buffers instead of stack
+  typedef util::BlockBuffer<Leaf> LeafBuffer;
+  typedef util::BlockBuffer<InternalNode> InternalNodeBuffer;
+
+  // Create directory
+  DirectoryTree(BlockStorage & blockStorage, BlockAddress const & inodeAddress, BlockAddress const & parentAddress)
+    : m_blockStorage(blockStorage)
+    , m_inodeAddress(inodeAddress)
+  {
+    memset(&m_inode, 0, sizeof(m_inode));
+    m_inode.flags = Format::Version;
+    m_inode.parentDirectoryInode = parentAddress.index();
+    m_inode.levelsCount = 0;
+    Format::items(m_inode.directReferences).clear();
+    util::writeT(m_blockStorage, m_inodeAddress, m_inode);
+  }
 
-void Directory::removeNode(OnDeleteFileFunc_t const & onDeleteFile, format::DirectoryTreeChildNodeReference const * children, unsigned itemsCount, unsigned levelsRemain)
-{
-  for(unsigned i = 0; i < itemsCount; ++i)
+  // Open directory
+  DirectoryTree(BlockStorage & blockStorage, BlockAddress const & inodeAddress)
+    : m_blockStorage(blockStorage)
+    , m_inodeAddress(inodeAddress)
   {
-    if (levelsRemain == 1)
-    {
-      format::DirectoryTreeLeaf leaf;
-      read(BlockAddress::fromBlockIndex(children[i].childBlockIndex), leaf);
-      removeNode(onDeleteFile, leaf.head, leaf.dataSize);
-    }
+    util::readT(m_blockStorage, inodeAddress, m_inode);
+
+    F2F_FORMAT_ASSERT((m_inode.flags & format::DirectoryFormatMask) == Format::Version);
+    F2F_FORMAT_ASSERT(m_inode.levelsCount < 100);
+    if (m_inode.levelsCount > 0)
+      F2F_FORMAT_ASSERT(m_inode.indirectReferences.itemsCount <= m_inode.indirectReferences.MaxCount);
     else
-    {
-      format::DirectoryTreeInternalNode internalNode;
-      read(BlockAddress::fromBlockIndex(children[i].childBlockIndex), internalNode);
-      removeNode(onDeleteFile, internalNode.children, internalNode.itemsCount, levelsRemain - 1);
-    }
-    m_blockStorage.releaseBlocks(BlockAddress::fromBlockIndex(children[i].childBlockIndex), 1);
+      Format::items(m_inode.directReferences).checkHeader();
   }
-}
 
-void Directory::removeNode(OnDeleteFileFunc_t const & onDeleteFile, format::DirectoryTreeLeafItem const & head, unsigned dataSize)
-{
-  for (DirectoryTreeLeafItemConstIterator item(head, dataSize); !item.atEnd(); ++item)
+  uint16_t formatVersion() const override
   {
-    onDeleteFile(
-      BlockAddress::fromBlockIndex(item->inode & ~format::DirectoryTreeLeafItem::DirectoryFlag), 
-      (item->inode & format::DirectoryTreeLeafItem::DirectoryFlag)
-        ? FileType::Directory
-        : FileType::Regular);
+    return Format::Version;
   }
-}
-
-struct Directory::CheckState
-{
-  NameHash_t lastHash;
-  boost::optional<uint64_t> nextLeadNode;
-};
-
-void Directory::check() const
-{
-  CheckState state;
-  state.lastHash = 0;
 
-  if (m_inode.levelsCount == 0)
-    checkNode(state, m_inode.directReferences.head, m_inode.directReferences.dataSize);
-  else
-    checkNode(state, m_inode.indirectReferences.children, m_inode.indirectReferences.itemsCount, m_inode.levelsCount);
+  BlockAddress parentInodeAddress() const override
+  {
+    return BlockAddress::fromBlockIndex(m_inode.parentDirectoryInode);
+  }
 
-  F2F_FORMAT_ASSERT(!state.nextLeadNode 
-    || *state.nextLeadNode == format::DirectoryTreeLeaf::NoNextLeaf);
-}
+  void setParentInodeAddress(BlockAddress const & parentAddress) override
+  {
+    m_inode.parentDirectoryInode = parentAddress.index();
+    util::writeT(m_blockStorage, m_inodeAddress, m_inode);
+  }
 
-void Directory::checkNode(CheckState & checkState, format::DirectoryTreeChildNodeReference const * children, unsigned itemsCount, unsigned levelsRemain) const
-{
-  F2F_FORMAT_ASSERT(itemsCount <= format::DirectoryTreeInternalNode::MaxCount);
-  for(unsigned i=0; i<itemsCount; ++i)
+  boost::optional<uint64_t> searchFile(utf8string_ref_t fileName) const override
   {
-    if (i > 0)
+    NameHash_t nameHash = Format::hash(fileName.data(), fileName.data() + fileName.size());
+    if (m_inode.levelsCount > 0)
     {
-      F2F_FORMAT_ASSERT(children[i].nameHash >= checkState.lastHash);
-      checkState.lastHash = children[i].nameHash;
+      return searchInNode(
+        nameHash,
+        fileName,
+        m_inode.levelsCount,
+        m_inode.indirectReferences.children,
+        m_inode.indirectReferences.itemsCount);
     }
-    m_blockStorage.checkAllocatedBlock(BlockAddress::fromBlockIndex(children[i].childBlockIndex));
-    if (levelsRemain == 1)
+    else
+      return Format::items(m_inode.directReferences).search(nameHash, fileName);
+  }
+
+  void addFile(uint64_t inode, utf8string_ref_t fileName) override
+  {
+    bool inodeIsDirty = false;
+
+    NameHash_t nameHash = Format::hash(fileName.data(), fileName.data() + fileName.size());
+    if (m_inode.levelsCount == 0)
     {
-      format::DirectoryTreeLeaf leaf;
-      read(BlockAddress::fromBlockIndex(children[i].childBlockIndex), leaf);
-      checkNode(checkState, leaf.head, leaf.dataSize);
-      if (checkState.nextLeadNode)
-        F2F_FORMAT_ASSERT(*checkState.nextLeadNode == children[i].childBlockIndex);
-      checkState.nextLeadNode = leaf.nextLeafNode;
+      if (!Format::items(m_inode.directReferences).insert(inode, nameHash, fileName))
+      {
+        // Not enough space in root. Need to move root contents and new item into child nodes
+        BlockAddress newBlock = m_blockStorage.allocateBlock();
+        LeafBuffer newLeafBuffer(sizeof(Leaf));
+        Leaf & newLeaf = *newLeafBuffer;
+        newLeaf.nextLeafNode = Leaf::NoNextLeaf;
+        CopyLeafItems(Format::items(m_inode.directReferences), Format::items(newLeaf));
+
+        std::vector<ChildNodeReference> newChildrenReferences = insertInLeaf(
+          inode, nameHash, fileName, newLeaf);
+
+        util::writeT(m_blockStorage, newBlock, newLeaf);
+        m_inode.levelsCount = 1;
+        m_inode.indirectReferences.itemsCount = 1;
+        m_inode.indirectReferences.children[0].nameHash = 0;
+        m_inode.indirectReferences.children[0].childBlockIndex = newBlock.index();
+
+        for(auto const & newChild: newChildrenReferences)
+        {
+          // Second child node was needed
+          m_inode.indirectReferences.children[m_inode.indirectReferences.itemsCount] = newChild;
+          ++m_inode.indirectReferences.itemsCount;
+        }
+      }
+      inodeIsDirty = true;
     }
     else
     {
-      format::DirectoryTreeInternalNode internalNode;
-      read(BlockAddress::fromBlockIndex(children[i].childBlockIndex), internalNode);
-      checkNode(checkState, internalNode.children, internalNode.itemsCount, levelsRemain - 1);
+      if (m_inode.indirectReferences.itemsCount + 2 > m_inode.indirectReferences.MaxCount)
+      {
+        // At most two items may be added. Splitting root in advance to simplify the code.
+        BlockAddress newBlock1 = m_blockStorage.allocateBlock();
+        BlockAddress newBlock2 = m_blockStorage.allocateBlock();
+        InternalNodeBuffer newNodeBuffer(sizeof(InternalNode));
+        InternalNode & newNode = *newNodeBuffer;
+
+        unsigned nodesInBlock1 = m_inode.indirectReferences.itemsCount / 2;
+        newNode.itemsCount = nodesInBlock1;
+        std::copy_n(
+          m_inode.indirectReferences.children,
+          newNode.itemsCount,
+          newNode.children);
+        util::writeT(m_blockStorage, newBlock1, newNode);
+
+        newNode.itemsCount = m_inode.indirectReferences.itemsCount - nodesInBlock1;
+        std::copy_n(
+          m_inode.indirectReferences.children + nodesInBlock1,
+          newNode.itemsCount,
+          newNode.children);
+        util::writeT(m_blockStorage, newBlock2, newNode);
+
+        ++m_inode.levelsCount;
+        m_inode.indirectReferences.itemsCount = 2;
+        m_inode.indirectReferences.children[0].childBlockIndex = newBlock1.index();
+        m_inode.indirectReferences.children[0].nameHash = 0;
+        m_inode.indirectReferences.children[1].childBlockIndex = newBlock2.index();
+        m_inode.indirectReferences.children[1].nameHash = newNode.children[0].nameHash;
+        inodeIsDirty = true;
+      }
+      boost::optional<ChildNodeReference> newChild = insertInNode(
+        inode, nameHash, fileName, m_inode.levelsCount,
+        m_inode.indirectReferences.children,
+        m_inode.indirectReferences.itemsCount,
+        m_inode.indirectReferences.MaxCount,
+        inodeIsDirty);
+      F2F_ASSERT(!newChild);
     }
+    if (inodeIsDirty)
+      util::writeT(m_blockStorage, m_inodeAddress, m_inode);
   }
-}
 
-void Directory::checkNode(CheckState & checkState, format::DirectoryTreeLeafItem const & head, unsigned dataSize) const
-{
-  F2F_FORMAT_ASSERT(dataSize <= format::DirectoryTreeLeaf::MaxDataSize);
-  for (DirectoryTreeLeafItemConstIterator item(head, dataSize); !item.atEnd(); ++item)
+  void addFiles(std::vector<std::pair<uint64_t, utf8string_ref_t>> const & files) override
   {
-    F2F_FORMAT_ASSERT(item->nameSize <= format::MaxFileNameSize);
-    NameHash_t nameHash = util::HashFNV1a_32(item->name, item->name + item->nameSize);
-    F2F_FORMAT_ASSERT(nameHash == item->nameHash);
-    F2F_FORMAT_ASSERT(item->nameHash >= checkState.lastHash);
-    checkState.lastHash = item->nameHash;
+    std::vector<LeafEntry> entries;
+    entries.reserve(files.size());
+    for(auto const & file: files)
+      entries.push_back(LeafEntry{
+        file.first,
+        Format::hash(file.second.data(), file.second.data() + file.second.size()),
+        file.second});
+    std::stable_sort(entries.begin(), entries.end(), LeafEntryLess());
+
+    // All names are checked before modification, so that directory stays unchanged on error
+    for(auto entry = entries.begin(); entry != entries.end(); ++entry)
+      for(auto same = entry + 1; same != entries.end() && same->nameHash == entry->nameHash; ++same)
+        if (same->name == entry->name)
+          throw Directory::FileExistsError(DecodeInode(entry->inode).second);
+
+    if (m_inode.levelsCount == 0)
+    {
+      auto directItems = Format::items(m_inode.directReferences);
+      checkNotExist(entries.begin(), entries.end(), directItems);
+
+      Inode const source = m_inode;
+      std::vector<LeafEntry> existing = leafEntries(Format::items(source.directReferences));
+      std::vector<LeafEntry> merged;
+      merged.reserve(existing.size() + entries.size());
+      std::merge(existing.begin(), existing.end(), entries.begin(), entries.end(),
+        std::back_inserter(merged), LeafEntryLess());
+
+      unsigned mergedSize = 0;
+      for(auto const & entry: merged)
+        mergedSize += Format::LeafItems::entrySize(entry.name.size());
+      if (mergedSize <= directItems.maxSize())
+      {
+        directItems.clear();
+        for(auto const & entry: merged)
+          directItems.append(entry.inode, entry.nameHash, entry.name);
+      }
+      else
+      {
+        // Building tree bottom-up
+        BlockAddress firstLeafAddress = m_blockStorage.allocateBlock();
+        LeafBuffer firstLeafBuffer(sizeof(Leaf));
+        Leaf & firstLeaf = *firstLeafBuffer;
+        firstLeaf.nextLeafNode = Leaf::NoNextLeaf;
+        std::vector<ChildNodeReference> children(1);
+        children[0].childBlockIndex = firstLeafAddress.index();
+        children[0].nameHash = 0;
+        std::vector<ChildNodeReference> newLeaves = fillLeaves(merged, firstLeaf);
+        util::writeT(m_blockStorage, firstLeafAddress, firstLeaf);
+        children.insert(children.end(), newLeaves.begin(), newLeaves.end());
+
+        m_inode.levelsCount = 1;
+        setRootChildren(children);
+      }
+    }
+    else
+    {
+      checkNotExist(entries.begin(), entries.end(),
+        m_inode.indirectReferences.children, m_inode.indirectReferences.itemsCount, m_inode.levelsCount);
+      setRootChildren(insertInChildren(entries.begin(), entries.end(),
+        m_inode.indirectReferences.children, m_inode.indirectReferences.itemsCount, m_inode.levelsCount));
+    }
+    util::writeT(m_blockStorage, m_inodeAddress, m_inode);
   }
-}
 
-struct Directory::Iterator::Iterator::Impl
-{
-  Impl(Directory const & directory)
-    : directory(directory)
-  {}
+  boost::optional<uint64_t> removeFile(utf8string_ref_t fileName) override
+  {
+    bool inodeIsDirty = false;
+    boost::optional<uint64_t> removedInode;
 
-  Directory const & directory;
-  format::DirectoryTreeLeaf currentLeaf;
-  std::unique_ptr<DirectoryTreeLeafItemConstIterator> iterator;
-};
+    NameHash_t nameHash = Format::hash(fileName.data(), fileName.data() + fileName.size());
+    if (m_inode.levelsCount == 0)
+    {
+      removedInode = Format::items(m_inode.directReferences).remove(nameHash, fileName);
+      inodeIsDirty = bool(removedInode);
+    }
+    else
+    {
+      removedInode = removeFromNode(
+        nameHash, fileName, m_inode.levelsCount,
+        m_inode.indirectReferences.children,
+        m_inode.indirectReferences.itemsCount,
+        inodeIsDirty);
+      if (removedInode && collapseRoot())
+        inodeIsDirty = true;
+    }
+    if (inodeIsDirty)
+      util::writeT(m_blockStorage, m_inodeAddress, m_inode);
+    return removedInode;
+  }
 
-Directory::Iterator::Iterator(Directory const & directory)
-  : m_impl(new Impl(directory))
-{
-  if (directory.m_inode.levelsCount == 0)
+  boost::optional<uint64_t> replaceFile(utf8string_ref_t fileName, uint64_t inode) override
+  {
+    NameHash_t nameHash = Format::hash(fileName.data(), fileName.data() + fileName.size());
+    if (m_inode.levelsCount > 0)
+    {
+      return replaceInNode(
+        nameHash,
+        fileName,
+        inode,
+        m_inode.levelsCount,
+        m_inode.indirectReferences.children,
+        m_inode.indirectReferences.itemsCount);
+    }
+
+    boost::optional<uint64_t> replacedInode = Format::items(m_inode.directReferences).replace(nameHash, fileName, inode);
+    if (replacedInode)
+      util::writeT(m_blockStorage, m_inodeAddress, m_inode);
+    return replacedInode;
+  }
+
+  void removeNodes(Directory::OnDeleteFileFunc_t const & onDeleteFile,
+    Directory::OnReleaseBlockFunc_t const & onReleaseBlock) override
   {
-    m_impl->currentLeaf.nextLeafNode = format::DirectoryTreeLeaf::NoNextLeaf;
-    m_impl->currentLeaf.dataSize = directory.m_inode.directReferences.dataSize;
-    memcpy(&m_impl->currentLeaf.head, &directory.m_inode.directReferences.head, 
-      directory.m_inode.directReferences.dataSize);
+    if (m_inode.levelsCount == 0)
+      removeItems(onDeleteFile, Format::items(m_inode.directReferences));
+    else
+      removeNode(onDeleteFile, onReleaseBlock,
+        m_inode.indirectReferences.children, m_inode.indirectReferences.itemsCount, m_inode.levelsCount);
   }
-  else
+
+  void moveInode(BlockAddress const & newInodeAddress) override
+  {
+    m_inodeAddress = newInodeAddress;
+    util::writeT(m_blockStorage, m_inodeAddress, m_inode);
+  }
+
+  std::unique_ptr<Directory::Iterator::Impl> iterate(uint64_t fromNameHash) const override
+  {
+    NameHash_t const nameHash = static_cast<NameHash_t>(fromNameHash);
+    F2F_ASSERT(nameHash == fromNameHash);
+    return std::unique_ptr<Directory::Iterator::Impl>(new IteratorImpl(*this, nameHash));
+  }
+
+  void check() const override
+  {
+    CheckState state;
+    state.lastHash = 0;
+
+    if (m_inode.levelsCount == 0)
+      checkItems(state, Format::items(m_inode.directReferences));
+    else
+      checkNode(state, m_inode.indirectReferences.children, m_inode.indirectReferences.itemsCount, m_inode.levelsCount);
+
+    F2F_FORMAT_ASSERT(!state.nextLeadNode
+      || *state.nextLeadNode == Leaf::NoNextLeaf);
+  }
+
+private:
+  BlockStorage & m_blockStorage;
+  BlockAddress m_inodeAddress;
+  Inode m_inode;
+
+  struct LeafEntry
+  {
+    uint64_t inode;
+    NameHash_t nameHash;
+    utf8string_ref_t name;
+  };
+
+  struct LeafEntryLess
+  {
+    bool operator()(LeafEntry const & lhs, LeafEntry const & rhs) const
+    {
+      return lhs.nameHash < rhs.nameHash;
+    }
+  };
+
+  void read(BlockAddress blockIndex, InternalNode & internalNode) const
+  {
+    util::readT(m_blockStorage, blockIndex, internalNode);
+    F2F_FORMAT_ASSERT(internalNode.itemsCount <= internalNode.MaxCount);
+  }
+
+  void read(BlockAddress blockIndex, Leaf & leaf) const
+  {
+    util::readT(m_blockStorage, blockIndex, leaf);
+    Format::items(leaf).checkHeader();
+  }
+
+  boost::optional<uint64_t> searchInNode(NameHash_t nameHash,
+    utf8string_ref_t fileName, unsigned levelsRemain,
+    ChildNodeReference const * children, unsigned itemsCount) const
+  {
+    auto position = std::lower_bound(
+      children + 1,
+      children + itemsCount,
+      nameHash,
+      [](ChildNodeReference const & child, NameHash_t nameHash) -> bool
+      {
+        return child.nameHash < nameHash;
+      }
+    );
+    // Key value "K" may be both in branch with "K" key and in previous branch too due to
+    // way how duplicates are handled
+    --position;
+    // In case of hash collision and long file names more than one branch may contain same hash
+    for(; position != children + itemsCount && (position == children || nameHash >= position->nameHash); ++position)
+      if (boost::optional<uint64_t> result = searchInNode(
+          nameHash, fileName, levelsRemain - 1,
+          BlockAddress::fromBlockIndex(position->childBlockIndex)))
+        return result;
+    return {};
+  }
+
+  boost::optional<uint64_t> searchInNode(NameHash_t nameHash,
+    utf8string_ref_t fileName, unsigned levelsRemain, BlockAddress blockIndex) const
+  {
+    if (levelsRemain > 0)
+    {
+      InternalNodeBuffer internalNodeBuffer(sizeof(InternalNode));
+      InternalNode & internalNode = *internalNodeBuffer;
+      read(blockIndex, internalNode);
+      return searchInNode(nameHash, fileName, levelsRemain, internalNode.children, internalNode.itemsCount);
+    }
+    else
+    {
+      LeafBuffer leafBuffer(sizeof(Leaf));
+      Leaf & leaf = *leafBuffer;
+      read(blockIndex, leaf);
+      return Format::items(leaf).search(nameHash, fileName);
+    }
+  }
+
+  // Traverses branches the same way as searchInNode
+  boost::optional<uint64_t> replaceInNode(NameHash_t nameHash, utf8string_ref_t fileName, uint64_t inode,
+    unsigned levelsRemain, ChildNodeReference const * children, unsigned itemsCount)
+  {
+    auto position = std::lower_bound(
+      children + 1,
+      children + itemsCount,
+      nameHash,
+      [](ChildNodeReference const & child, NameHash_t nameHash) -> bool
+      {
+        return child.nameHash < nameHash;
+      }
+    );
+    --position;
+    for(; position != children + itemsCount && (position == children || nameHash >= position->nameHash); ++position)
+      if (boost::optional<uint64_t> result = replaceInNode(
+          nameHash, fileName, inode, levelsRemain - 1,
+          BlockAddress::fromBlockIndex(position->childBlockIndex)))
+        return result;
+    return {};
+  }
+
+  boost::optional<uint64_t> replaceInNode(NameHash_t nameHash, utf8string_ref_t fileName, uint64_t inode,
+    unsigned levelsRemain, BlockAddress blockIndex)
   {
-    BlockAddress blockIndex = BlockAddress::fromBlockIndex(
-      directory.m_inode.indirectReferences.children[0].childBlockIndex);
-    for(int level = 1; level < directory.m_inode.levelsCount; ++level)
+    if (levelsRemain > 0)
+    {
+      InternalNodeBuffer internalNodeBuffer(sizeof(InternalNode));
+      InternalNode & internalNode = *internalNodeBuffer;
+      read(blockIndex, internalNode);
+      return replaceInNode(nameHash, fileName, inode, levelsRemain, internalNode.children, internalNode.itemsCount);
+    }
+    else
     {
-      format::DirectoryTreeInternalNode internalNode;
-      directory.read(blockIndex, internalNode);
-      blockIndex = BlockAddress::fromBlockIndex(internalNode.children[0].childBlockIndex);
+      LeafBuffer leafBuffer(sizeof(Leaf));
+      Leaf & leaf = *leafBuffer;
+      read(blockIndex, leaf);
+      boost::optional<uint64_t> replacedInode = Format::items(leaf).replace(nameHash, fileName, inode);
+      if (replacedInode)
+        util::writeT(m_blockStorage, blockIndex, leaf);
+      return replacedInode;
     }
-    directory.read(blockIndex, m_impl->currentLeaf);
   }
-  m_impl->iterator.reset(new DirectoryTreeLeafItemConstIterator(m_impl->currentLeaf.head, m_impl->currentLeaf.dataSize));
+
+  std::vector<ChildNodeReference> insertInNode(
+    uint64_t inode, NameHash_t nameHash, utf8string_ref_t fileName,
+    unsigned levelsRemain, BlockAddress blockIndex)
+  {
+    std::vector<ChildNodeReference> newChildren;
+    if (levelsRemain == 0)
+    {
+      LeafBuffer leafBuffer(sizeof(Leaf));
+      Leaf & leaf = *leafBuffer;
+      read(blockIndex, leaf);
+      newChildren = insertInLeaf(inode, nameHash, fileName, leaf);
+      util::writeT(m_blockStorage, blockIndex, leaf);
+    }
+    else
+    {
+      InternalNodeBuffer internalNodeBuffer(sizeof(InternalNode));
+      InternalNode & internalNode = *internalNodeBuffer;
+      read(blockIndex, internalNode);
+      bool isDirty = false;
+      auto newChild = insertInNode(inode, nameHash, fileName, levelsRemain, internalNode.children,
+        internalNode.itemsCount, internalNode.MaxCount, isDirty);
+      if (isDirty)
+        util::writeT(m_blockStorage, blockIndex, internalNode);
+      if (newChild)
+        newChildren.push_back(*newChild);
+    }
+    return newChildren;
+  }
+
+  boost::optional<ChildNodeReference> insertInNode(
+    uint64_t inode, NameHash_t nameHash, utf8string_ref_t fileName,
+    unsigned levelsRemain, ChildNodeReference * children,
+    uint16_t & itemsCount, unsigned maxItemsCount, bool & isDirty)
+  {
+    F2F_ASSERT(levelsRemain > 0);
+
+    auto position = std::lower_bound(
+      children + 1,
+      children + itemsCount,
+      nameHash,
+      [](ChildNodeReference const & child, NameHash_t nameHash) -> bool
+      {
+        return child.nameHash < nameHash;
+      }
+    );
+    if (position == children + itemsCount || position->nameHash != nameHash)
+      --position;
+
+    std::vector<ChildNodeReference> newChildren =
+      insertInNode(inode, nameHash, fileName, levelsRemain - 1, BlockAddress::fromBlockIndex(position->childBlockIndex));
+
+    if (!newChildren.empty())
+    {
+      isDirty = true;
+      if (itemsCount + newChildren.size() <= maxItemsCount)
+      {
+        std::copy_backward(
+          position + 1,
+          children + itemsCount,
+          children + itemsCount + newChildren.size());
+        std::copy(
+          newChildren.begin(),
+          newChildren.end(),
+          position + 1);
+        itemsCount += newChildren.size();
+      }
+      else
+      {
+        BlockAddress newBlock = m_blockStorage.allocateBlock();
+        InternalNodeBuffer newNodeBuffer(sizeof(InternalNode));
+        InternalNode & newNode = *newNodeBuffer;
+        newNode.itemsCount = (itemsCount + newChildren.size()) / 2;
+        unsigned itemsCountToLeave = itemsCount + newChildren.size() - newNode.itemsCount;
+        util::InsertAndCopyBackward(
+          children, children + itemsCount,
+          position + 1,
+          newChildren.begin(), newChildren.end(),
+          util::MakeSplitOutputIterator(
+            boost::make_reverse_iterator(newNode.children + newNode.itemsCount),
+            boost::make_reverse_iterator(newNode.children),
+            boost::make_reverse_iterator(children + itemsCountToLeave)));
+
+        util::writeT(m_blockStorage, newBlock, newNode);
+        itemsCount = itemsCountToLeave;
+        ChildNodeReference newNodeReference;
+        newNodeReference.childBlockIndex = newBlock.index();
+        newNodeReference.nameHash = newNode.children[0].nameHash;
+        return newNodeReference;
+      }
+    }
+    return {};
+  }
+
+  // At most two new leaf nodes may be needed (the "worst" case when large file name appears in the middle)
+  std::vector<ChildNodeReference> insertInLeaf(
+    uint64_t inode, NameHash_t nameHash, utf8string_ref_t fileName, Leaf & leaf)
+  {
+    if (Format::items(leaf).insert(inode, nameHash, fileName))
+      return {};
+
+    // Leaf is full. Distributing its items with the new one between 2 or 3 leaves
+    LeafBuffer sourceBuffer(sizeof(Leaf));
+    Leaf const & source = *sourceBuffer = leaf;
+    std::vector<LeafEntry> entries = leafEntries(Format::items(source));
+    entries.insert(
+      std::upper_bound(entries.begin(), entries.end(), LeafEntry{inode, nameHash, fileName}, LeafEntryLess()),
+      LeafEntry{inode, nameHash, fileName});
+
+    // offsets[i] - size of items before i-th
+    std::vector<unsigned> offsets(1, 0);
+    for(auto const & entry: entries)
+      offsets.push_back(offsets.back() + Format::LeafItems::entrySize(entry.name.size()));
+    unsigned const sumSize = offsets.back();
+    unsigned const maxSize = Format::items(leaf).maxSize();
+
+    // Indexes of first items of new leaves
+    std::vector<size_t> splitBy;
+    for(size_t i = 1; i < entries.size(); ++i)
+      if (offsets[i] <= maxSize && sumSize - offsets[i] <= maxSize
+        && (splitBy.empty()
+          || std::abs(2 * int(offsets[i]) - int(sumSize)) < std::abs(2 * int(offsets[splitBy[0]]) - int(sumSize))))
+        splitBy.assign(1, i);
+    if (splitBy.empty())
+    {
+      // 3 leafs are required: item in the middle doesn't fit together with any of its neighbours
+      size_t middle = std::upper_bound(offsets.begin(), offsets.end(), sumSize / 2) - offsets.begin() - 1;
+      F2F_ASSERT(middle > 0 && middle + 1 < entries.size());
+      splitBy.push_back(middle);
+      splitBy.push_back(middle + 1);
+    }
+    return writeLeaves(entries, splitBy, leaf);
+  }
+
+  // Puts entries to the leaf and to new leaves following it in the chain, filling each leaf
+  // up to its capacity. Returns references to new leaves
+  std::vector<ChildNodeReference> fillLeaves(std::vector<LeafEntry> const & entries, Leaf & leaf)
+  {
+    unsigned const maxSize = Format::items(leaf).maxSize();
+    std::vector<size_t> splitBy;
+    unsigned size = 0;
+    for(size_t i = 0; i < entries.size(); ++i)
+    {
+      unsigned entrySize = Format::LeafItems::entrySize(entries[i].name.size());
+      if (size + entrySize > maxSize)
+      {
+        splitBy.push_back(i);
+        size = 0;
+      }
+      size += entrySize;
+    }
+    return writeLeaves(entries, splitBy, leaf);
+  }
+
+  // Entries before splitBy[0] are put to the leaf, others - to new leaves starting at splitBy items.
+  // Leaf isn't written
+  std::vector<ChildNodeReference> writeLeaves(std::vector<LeafEntry> const & entries,
+    std::vector<size_t> splitBy, Leaf & leaf)
+  {
+    splitBy.push_back(entries.size());
+
+    auto fillLeaf = [&entries](Leaf & target, size_t begin, size_t end)
+    {
+      auto targetItems = Format::items(target);
+      targetItems.clear();
+      for(size_t i = begin; i != end; ++i)
+        targetItems.append(entries[i].inode, entries[i].nameHash, entries[i].name);
+    };
+
+    std::vector<BlockAddress> newBlocks;
+    for(size_t i = 1; i < splitBy.size(); ++i)
+      newBlocks.push_back(m_blockStorage.allocateBlock());
+
+    std::vector<ChildNodeReference> newLeafsReferences;
+    for(size_t i = 0; i < newBlocks.size(); ++i)
+    {
+      LeafBuffer newLeafBuffer(sizeof(Leaf));
+      Leaf & newLeaf = *newLeafBuffer;
+      newLeaf.nextLeafNode = i + 1 < newBlocks.size()
+        ? newBlocks[i + 1].index()
+        : leaf.nextLeafNode;
+      fillLeaf(newLeaf, splitBy[i], splitBy[i + 1]);
+      util::writeT(m_blockStorage, newBlocks[i], newLeaf);
+
+      ChildNodeReference reference;
+      reference.childBlockIndex = newBlocks[i].index();
+      reference.nameHash = entries[splitBy[i]].nameHash;
+      newLeafsReferences.push_back(reference);
+    }
+
+    if (!newBlocks.empty())
+      leaf.nextLeafNode = newBlocks[0].index();
+    fillLeaf(leaf, 0, splitBy[0]);
+    return newLeafsReferences;
+  }
+
+  typedef typename std::vector<LeafEntry>::const_iterator LeafEntryIterator;
+
+  // Index of child where item with the hash is inserted
+  static unsigned insertPosition(ChildNodeReference const * children, unsigned itemsCount, NameHash_t nameHash)
+  {
+    auto position = std::lower_bound(
+      children + 1,
+      children + itemsCount,
+      nameHash,
+      [](ChildNodeReference const & child, NameHash_t nameHash) -> bool
+      {
+        return child.nameHash < nameHash;
+      }
+    );
+    if (position == children + itemsCount || position->nameHash != nameHash)
+      --position;
+    return position - children;
+  }
+
+  // Sorted entries are merged into subtrees in one pass. Returns all children of the node
+  // including new ones
+  std::vector<ChildNodeReference> insertInChildren(LeafEntryIterator begin, LeafEntryIterator end,
+    ChildNodeReference const * children, unsigned itemsCount, unsigned levelsRemain)
+  {
+    std::vector<ChildNodeReference> result;
+    for(unsigned i = 0; i < itemsCount; ++i)
+    {
+      result.push_back(children[i]);
+      LeafEntryIterator rangeEnd = begin;
+      while (rangeEnd != end && insertPosition(children, itemsCount, rangeEnd->nameHash) == i)
+        ++rangeEnd;
+      if (begin != rangeEnd)
+      {
+        std::vector<ChildNodeReference> newChildren = insertInNode(begin, rangeEnd, levelsRemain - 1,
+          BlockAddress::fromBlockIndex(children[i].childBlockIndex));
+        result.insert(result.end(), newChildren.begin(), newChildren.end());
+      }
+      begin = rangeEnd;
+    }
+    F2F_ASSERT(begin == end);
+    return result;
+  }
+
+  // Returns references to new nodes of the same level
+  std::vector<ChildNodeReference> insertInNode(LeafEntryIterator begin, LeafEntryIterator end,
+    unsigned levelsRemain, BlockAddress blockIndex)
+  {
+    std::vector<ChildNodeReference> newNodes;
+    if (levelsRemain == 0)
+    {
+      LeafBuffer leafBuffer(sizeof(Leaf));
+      Leaf & leaf = *leafBuffer;
+      read(blockIndex, leaf);
+      LeafBuffer sourceBuffer(sizeof(Leaf));
+      Leaf const & source = *sourceBuffer = leaf;
+      std::vector<LeafEntry> entries = leafEntries(Format::items(source));
+      std::vector<LeafEntry> merged;
+      merged.reserve(entries.size() + (end - begin));
+      std::merge(entries.begin(), entries.end(), begin, end, std::back_inserter(merged), LeafEntryLess());
+      newNodes = fillLeaves(merged, leaf);
+      util::writeT(m_blockStorage, blockIndex, leaf);
+    }
+    else
+    {
+      InternalNodeBuffer internalNodeBuffer(sizeof(InternalNode));
+      InternalNode & internalNode = *internalNodeBuffer;
+      read(blockIndex, internalNode);
+      std::vector<ChildNodeReference> children = insertInChildren(begin, end,
+        internalNode.children, internalNode.itemsCount, levelsRemain);
+      if (children.size() == internalNode.itemsCount)
+        return newNodes; // Only subtrees were changed
+
+      std::vector<size_t> splitBy = splitToNodes(children.size(), InternalNode::MaxCount);
+      splitBy.push_back(children.size());
+      for(size_t i = 0; i + 1 < splitBy.size(); ++i)
+        newNodes.push_back(writeInternalNode(m_blockStorage.allocateBlock(),
+          children.begin() + splitBy[i], children.begin() + splitBy[i + 1]));
+      writeInternalNode(blockIndex, children.begin(), children.begin() + splitBy[0]);
+    }
+    return newNodes;
+  }
+
+  // Start indexes of all parts except the first one when splitting evenly into nodes of limited size
+  static std::vector<size_t> splitToNodes(size_t itemsCount, size_t maxItemsCount)
+  {
+    size_t const nodesCount = (itemsCount + maxItemsCount - 1) / maxItemsCount;
+    std::vector<size_t> splitBy;
+    for(size_t i = 1; i < nodesCount; ++i)
+      splitBy.push_back(itemsCount * i / nodesCount);
+    return splitBy;
+  }
+
+  template<class It>
+  ChildNodeReference writeInternalNode(BlockAddress const & blockIndex, It begin, It end)
+  {
+    InternalNodeBuffer internalNodeBuffer(sizeof(InternalNode));
+    InternalNode & internalNode = *internalNodeBuffer;
+    internalNode.itemsCount = end - begin;
+    std::copy(begin, end, internalNode.children);
+    util::writeT(m_blockStorage, blockIndex, internalNode);
+
+    ChildNodeReference reference;
+    reference.childBlockIndex = blockIndex.index();
+    reference.nameHash = begin->nameHash;
+    return reference;
+  }
+
+  // Adds tree levels until children fit in inode
+  void setRootChildren(std::vector<ChildNodeReference> children)
+  {
+    while (children.size() > m_inode.indirectReferences.MaxCount)
+    {
+      std::vector<size_t> splitBy = splitToNodes(children.size(), InternalNode::MaxCount);
+      splitBy.insert(splitBy.begin(), 0);
+      splitBy.push_back(children.size());
+      std::vector<ChildNodeReference> nodes;
+      for(size_t i = 0; i + 1 < splitBy.size(); ++i)
+        nodes.push_back(writeInternalNode(m_blockStorage.allocateBlock(),
+          children.begin() + splitBy[i], children.begin() + splitBy[i + 1]));
+      children.swap(nodes);
+      ++m_inode.levelsCount;
+    }
+    m_inode.indirectReferences.itemsCount = children.size();
+    std::copy(children.begin(), children.end(), m_inode.indirectReferences.children);
+    m_inode.indirectReferences.children[0].nameHash = 0;
+  }
+
+  // Throws FileExistsError if any of entries is present in subtree
+  void checkNotExist(LeafEntryIterator begin, LeafEntryIterator end,
+    ChildNodeReference const * children, unsigned itemsCount, unsigned levelsRemain) const
+  {
+    // Entries with the hash equal to child key may be in the previous child too
+    for(unsigned i = 0; i < itemsCount; ++i)
+    {
+      LeafEntryIterator rangeBegin = i == 0
+        ? begin
+        : std::lower_bound(begin, end, LeafEntry{0, children[i].nameHash, {}}, LeafEntryLess());
+      LeafEntryIterator rangeEnd = i + 1 == itemsCount
+        ? end
+        : std::upper_bound(begin, end, LeafEntry{0, children[i + 1].nameHash, {}}, LeafEntryLess());
+      if (rangeBegin >= rangeEnd)
+        continue;
+
+      BlockAddress const childAddress = BlockAddress::fromBlockIndex(children[i].childBlockIndex);
+      if (levelsRemain == 1)
+      {
+        LeafBuffer leafBuffer(sizeof(Leaf));
+        Leaf & leaf = *leafBuffer;
+        read(childAddress, leaf);
+        checkNotExist(rangeBegin, rangeEnd, Format::items(leaf));
+      }
+      else
+      {
+        InternalNodeBuffer internalNodeBuffer(sizeof(InternalNode));
+        InternalNode & internalNode = *internalNodeBuffer;
+        read(childAddress, internalNode);
+        checkNotExist(rangeBegin, rangeEnd, internalNode.children, internalNode.itemsCount, levelsRemain - 1);
+      }
+    }
+  }
+
+  template<class LeafItems>
+  static void checkNotExist(LeafEntryIterator begin, LeafEntryIterator end, LeafItems const & items)
+  {
+    for(; begin != end; ++begin)
+      if (boost::optional<uint64_t> existing = items.search(begin->nameHash, begin->name))
+        throw Directory::FileExistsError(DecodeInode(*existing).second);
+  }
+
+  template<class LeafItems>
+  static std::vector<LeafEntry> leafEntries(LeafItems const & items)
+  {
+    std::vector<LeafEntry> entries;
+    for(auto item = items.cursor(); !item.atEnd(); ++item)
+      entries.push_back(LeafEntry{item.inode(), item.nameHash(), item.name()});
+    return entries;
+  }
+
+  // Node is underfilled if it is less than quarter full. Underfilled node is merged with its sibling
+  // when they fit in one node
+  static bool isUnderfilled(unsigned usedSize, unsigned maxSize)
+  {
+    return usedSize * 4 < maxSize;
+  }
+
+  boost::optional<uint64_t> removeFromNode(NameHash_t nameHash, utf8string_ref_t fileName,
+    unsigned levelsRemain, BlockAddress blockIndex, bool & isUnderfilledNode)
+  {
+    boost::optional<uint64_t> removedInode;
+    if (levelsRemain == 0)
+    {
+      LeafBuffer leafBuffer(sizeof(Leaf));
+      Leaf & leaf = *leafBuffer;
+      read(blockIndex, leaf);
+      auto items = Format::items(leaf);
+      removedInode = items.remove(nameHash, fileName);
+      if (removedInode)
+      {
+        util::writeT(m_blockStorage, blockIndex, leaf);
+        isUnderfilledNode = isUnderfilled(items.usedSize(), items.maxSize());
+      }
+    }
+    else
+    {
+      InternalNodeBuffer internalNodeBuffer(sizeof(InternalNode));
+      InternalNode & internalNode = *internalNodeBuffer;
+      read(blockIndex, internalNode);
+      bool isDirty = false;
+      removedInode = removeFromNode(nameHash, fileName, levelsRemain, internalNode.children,
+        internalNode.itemsCount, isDirty);
+      if (isDirty)
+      {
+        util::writeT(m_blockStorage, blockIndex, internalNode);
+        isUnderfilledNode = isUnderfilled(internalNode.itemsCount, InternalNode::MaxCount);
+      }
+    }
+    return removedInode;
+  }
+
+  boost::optional<uint64_t> removeFromNode(
+    NameHash_t nameHash, utf8string_ref_t fileName,
+    unsigned levelsRemain, ChildNodeReference * children,
+    uint16_t & itemsCount, bool & isDirty)
+  {
+    auto position = std::lower_bound(
+      children + 1,
+      children + itemsCount,
+      nameHash,
+      [](ChildNodeReference const & child, NameHash_t nameHash) -> bool
+      {
+        return child.nameHash < nameHash;
+      }
+    );
+    // Key value "K" may be both in branch with "K" key and in previous branch too due to
+    // way how duplicates are handled
+    --position;
+    // In case of hash collision and long file names more than one branch may contain same hash
+    for(; position != children + itemsCount && (position == children || nameHash >= position->nameHash); ++position)
+    {
+      bool isUnderfilledChild = false;
+      if (boost::optional<uint64_t> result = removeFromNode(
+          nameHash, fileName, levelsRemain - 1,
+          BlockAddress::fromBlockIndex(position->childBlockIndex),
+          isUnderfilledChild))
+      {
+        if (isUnderfilledChild)
+          mergeChildren(children, itemsCount, position - children, levelsRemain - 1, isDirty);
+        return result;
+      }
+    }
+    return {};
+  }
+
+  // Merges child with its left or right sibling if their contents fit in one node
+  void mergeChildren(ChildNodeReference * children, uint16_t & itemsCount, unsigned childIndex,
+    unsigned childLevelsRemain, bool & isDirty)
+  {
+    if ((childIndex > 0 && mergeSiblings(children, itemsCount, childIndex - 1, childLevelsRemain))
+      || (childIndex + 1 < itemsCount && mergeSiblings(children, itemsCount, childIndex, childLevelsRemain)))
+      isDirty = true;
+  }
+
+  // Moves contents of the right node into the left one and releases the right node
+  bool mergeSiblings(ChildNodeReference * children, uint16_t & itemsCount, unsigned leftIndex,
+    unsigned childLevelsRemain)
+  {
+    unsigned const rightIndex = leftIndex + 1;
+    BlockAddress const leftAddress = BlockAddress::fromBlockIndex(children[leftIndex].childBlockIndex);
+    BlockAddress const rightAddress = BlockAddress::fromBlockIndex(children[rightIndex].childBlockIndex);
+
+    if (childLevelsRemain == 0)
+    {
+      LeafBuffer leftBuffer(sizeof(Leaf)), rightBuffer(sizeof(Leaf));
+      Leaf & left = *leftBuffer;
+      Leaf & right = *rightBuffer;
+      read(leftAddress, left);
+      read(rightAddress, right);
+      auto leftItems = Format::items(left);
+      auto rightItems = Format::items(right);
+      if (leftItems.usedSize() + rightItems.usedSize() > leftItems.maxSize())
+        return false;
+
+      for(auto item = rightItems.cursor(); !item.atEnd(); ++item)
+        leftItems.append(item.inode(), item.nameHash(), item.name());
+      left.nextLeafNode = right.nextLeafNode;
+      util::writeT(m_blockStorage, leftAddress, left);
+    }
+    else
+    {
+      InternalNodeBuffer leftBuffer(sizeof(InternalNode)), rightBuffer(sizeof(InternalNode));
+      InternalNode & left = *leftBuffer;
+      InternalNode & right = *rightBuffer;
+      read(leftAddress, left);
+      read(rightAddress, right);
+      if (left.itemsCount + right.itemsCount > InternalNode::MaxCount)
+        return false;
+
+      std::copy_n(right.children, right.itemsCount, left.children + left.itemsCount);
+      // Key of the first child of right node may be out of date
+      left.children[left.itemsCount].nameHash = children[rightIndex].nameHash;
+      left.itemsCount += right.itemsCount;
+      util::writeT(m_blockStorage, leftAddress, left);
+    }
+
+    m_blockStorage.releaseBlocks(rightAddress, 1);
+    std::copy(children + rightIndex + 1, children + itemsCount, children + rightIndex);
+    --itemsCount;
+    return true;
+  }
+
+  // Moves contents of the only child of root into inode while it fits (for leaf - while it is underfilled)
+  bool collapseRoot()
+  {
+    bool collapsed = false;
+    while (m_inode.levelsCount > 0 && m_inode.indirectReferences.itemsCount == 1)
+    {
+      BlockAddress const childAddress = BlockAddress::fromBlockIndex(
+        m_inode.indirectReferences.children[0].childBlockIndex);
+      if (m_inode.levelsCount == 1)
+      {
+        LeafBuffer leafBuffer(sizeof(Leaf));
+        Leaf & leaf = *leafBuffer;
+        read(childAddress, leaf);
+        auto leafItems = Format::items(leaf);
+        if (!isUnderfilled(leafItems.usedSize(), Format::items(m_inode.directReferences).maxSize()))
+          return collapsed;
+        CopyLeafItems(leafItems, Format::items(m_inode.directReferences));
+      }
+      else
+      {
+        InternalNodeBuffer internalNodeBuffer(sizeof(InternalNode));
+        InternalNode & internalNode = *internalNodeBuffer;
+        read(childAddress, internalNode);
+        if (internalNode.itemsCount > m_inode.indirectReferences.MaxCount)
+          return collapsed;
+        std::copy_n(internalNode.children, internalNode.itemsCount, m_inode.indirectReferences.children);
+        m_inode.indirectReferences.itemsCount = internalNode.itemsCount;
+        m_inode.indirectReferences.children[0].nameHash = 0;
+      }
+      --m_inode.levelsCount;
+      m_blockStorage.releaseBlocks(childAddress, 1);
+      collapsed = true;
+    }
+    return collapsed;
+  }
+
+  void removeNode(Directory::OnDeleteFileFunc_t const & onDeleteFile, Directory::OnReleaseBlockFunc_t const & onReleaseBlock,
+    ChildNodeReference const * children, unsigned itemsCount, unsigned levelsRemain)
+  {
+    for(unsigned i = 0; i < itemsCount; ++i)
+    {
+      if (levelsRemain == 1)
+      {
+        LeafBuffer leafBuffer(sizeof(Leaf));
+        Leaf & leaf = *leafBuffer;
+        read(BlockAddress::fromBlockIndex(children[i].childBlockIndex), leaf);
+        removeItems(onDeleteFile, Format::items(leaf));
+      }
+      else
+      {
+        InternalNodeBuffer internalNodeBuffer(sizeof(InternalNode));
+        InternalNode & internalNode = *internalNodeBuffer;
+        read(BlockAddress::fromBlockIndex(children[i].childBlockIndex), internalNode);
+        removeNode(onDeleteFile, onReleaseBlock, internalNode.children, internalNode.itemsCount, levelsRemain - 1);
+      }
+      onReleaseBlock(BlockAddress::fromBlockIndex(children[i].childBlockIndex));
+    }
+  }
+
+  template<class LeafItems>
+  static void removeItems(Directory::OnDeleteFileFunc_t const & onDeleteFile, LeafItems const & items)
+  {
+    for(auto item = items.cursor(); !item.atEnd(); ++item)
+    {
+      auto decoded = DecodeInode(item.inode());
+      onDeleteFile(decoded.first, decoded.second);
+    }
+  }
+
+  struct CheckState
+  {
+    NameHash_t lastHash;
+    boost::optional<uint64_t> nextLeadNode;
+  };
+
+  void checkNode(CheckState & checkState, ChildNodeReference const * children, unsigned itemsCount, unsigned levelsRemain) const
+  {
+    F2F_FORMAT_ASSERT(itemsCount <= InternalNode::MaxCount);
+    for(unsigned i=0; i<itemsCount; ++i)
+    {
+      if (i > 0)
+      {
+        F2F_FORMAT_ASSERT(children[i].nameHash >= checkState.lastHash);
+        checkState.lastHash = children[i].nameHash;
+      }
+      m_blockStorage.checkAllocatedBlock(BlockAddress::fromBlockIndex(children[i].childBlockIndex));
+      if (levelsRemain == 1)
+      {
+        LeafBuffer leafBuffer(sizeof(Leaf));
+        Leaf & leaf = *leafBuffer;
+        read(BlockAddress::fromBlockIndex(children[i].childBlockIndex), leaf);
+        checkItems(checkState, Format::items(leaf));
+        if (checkState.nextLeadNode)
+          F2F_FORMAT_ASSERT(*checkState.nextLeadNode == children[i].childBlockIndex);
+        checkState.nextLeadNode = leaf.nextLeafNode;
+      }
+      else
+      {
+        InternalNodeBuffer internalNodeBuffer(sizeof(InternalNode));
+        InternalNode & internalNode = *internalNodeBuffer;
+        read(BlockAddress::fromBlockIndex(children[i].childBlockIndex), internalNode);
+        checkNode(checkState, internalNode.children, internalNode.itemsCount, levelsRemain - 1);
+      }
+    }
+  }
+
+  template<class LeafItems>
+  static void checkItems(CheckState & checkState, LeafItems const & items)
+  {
+    items.check();
+    for(auto item = items.cursor(); !item.atEnd(); ++item)
+    {
+      utf8string_ref_t name = item.name();
+      F2F_FORMAT_ASSERT(name.size() <= Format::MaxFileNameSize);
+      F2F_FORMAT_ASSERT(Format::hash(name.data(), name.data() + name.size()) == item.nameHash());
+      F2F_FORMAT_ASSERT(item.nameHash() >= checkState.lastHash);
+      checkState.lastHash = item.nameHash();
+    }
+  }
+
+  class IteratorImpl: public Directory::Iterator::Impl
+  {
+  public:
+    IteratorImpl(DirectoryTree const & tree, NameHash_t fromNameHash)
+      : m_tree(tree)
+    {
+      if (tree.m_inode.levelsCount == 0)
+      {
+        m_currentLeaf.nextLeafNode = Leaf::NoNextLeaf;
+        CopyLeafItems(Format::items(tree.m_inode.directReferences), Format::items(m_currentLeaf));
+      }
+      else
+      {
+        BlockAddress blockIndex = BlockAddress::fromBlockIndex(firstBranch(
+          tree.m_inode.indirectReferences.children, tree.m_inode.indirectReferences.itemsCount, fromNameHash));
+        for(int level = 1; level < tree.m_inode.levelsCount; ++level)
+        {
+          InternalNodeBuffer internalNodeBuffer(sizeof(InternalNode));
+          InternalNode & internalNode = *internalNodeBuffer;
+          tree.read(blockIndex, internalNode);
+          blockIndex = BlockAddress::fromBlockIndex(firstBranch(
+            internalNode.children, internalNode.itemsCount, fromNameHash));
+        }
+        tree.read(blockIndex, m_currentLeaf);
+      }
+      m_iterator.emplace(Format::items(m_currentLeaf));
+      skipEmptyLeaves();
+      while (!eof() && m_iterator->nameHash() < fromNameHash)
+        moveNext();
+    }
+
+    void moveNext() override
+    {
+      ++*m_iterator;
+      skipEmptyLeaves();
+    }
+
+    bool eof() const override
+    {
+      return m_iterator->atEnd() && m_currentLeaf.nextLeafNode == Leaf::NoNextLeaf;
+    }
+
+    uint64_t currentInode() const override
+    {
+      return m_iterator->inode();
+    }
+
+    uint64_t currentNameHash() const override
+    {
+      return m_iterator->nameHash();
+    }
+
+    utf8string_ref_t currentName() const override
+    {
+      return m_iterator->name();
+    }
+
+    void enumerateLeafInodes(std::function<void(uint64_t)> const & func) const override
+    {
+      for(LeafCursor cursor = *m_iterator; !cursor.atEnd(); ++cursor)
+        func(cursor.inode());
+    }
+
+  private:
+    typedef typename Format::LeafItems::Cursor LeafCursor;
+
+    // Leftmost branch that may contain the hash. As in searchInNode, items with hash equal to
+    // the key of some branch may also be in the preceding one
+    static uint64_t firstBranch(ChildNodeReference const * children, unsigned itemsCount, NameHash_t nameHash)
+    {
+      auto position = std::lower_bound(
+        children + 1,
+        children + itemsCount,
+        nameHash,
+        [](ChildNodeReference const & child, NameHash_t nameHash) -> bool
+        {
+          return child.nameHash < nameHash;
+        }
+      );
+      return (position - 1)->childBlockIndex;
+    }
+
+    // Storages written by older versions may contain empty leaves
+    void skipEmptyLeaves()
+    {
+      while (m_iterator->atEnd() && m_currentLeaf.nextLeafNode != Leaf::NoNextLeaf)
+      {
+        m_tree.read(BlockAddress::fromBlockIndex(m_currentLeaf.nextLeafNode), m_currentLeaf);
+        m_iterator.emplace(Format::items(m_currentLeaf));
+      }
+    }
+
+    DirectoryTree const & m_tree;
+    Leaf m_currentLeaf;
+    boost::optional<LeafCursor> m_iterator; // Rebound in place to each next leaf
+  };
+};
+
+// Arguments are passed to constructor of DirectoryTree with slotted format for block size of storage
+template<class... Args>
+std::unique_ptr<Directory::Tree> CreateSlottedDirectoryTree(BlockStorage & blockStorage, Args const &... args)
+{
+  switch (blockStorage.blockSize())
+  {
+  case 1024:
+    return std::unique_ptr<Directory::Tree>(new DirectoryTree<DirectoryFormatSlotted<1024>>(blockStorage, args...));
+  case 2048:
+    return std::unique_ptr<Directory::Tree>(new DirectoryTree<DirectoryFormatSlotted<2048>>(blockStorage, args...));
+  case 4096:
+    return std::unique_ptr<Directory::Tree>(new DirectoryTree<DirectoryFormatSlotted<4096>>(blockStorage, args...));
+  case 8192:
+    return std::unique_ptr<Directory::Tree>(new DirectoryTree<DirectoryFormatSlotted<8192>>(blockStorage, args...));
+  case 16384:
+    return std::unique_ptr<Directory::Tree>(new DirectoryTree<DirectoryFormatSlotted<16384>>(blockStorage, args...));
+  case 32768:
+    return std::unique_ptr<Directory::Tree>(new DirectoryTree<DirectoryFormatSlotted<32768>>(blockStorage, args...));
+  case 65536:
+    return std::unique_ptr<Directory::Tree>(new DirectoryTree<DirectoryFormatSlotted<65536>>(blockStorage, args...));
+  default:
+    F2F_ASSERT(false);
+    return {};
+  }
+}
+
+std::unique_ptr<Directory::Tree> CreateDirectoryTree(uint16_t formatVersion,
+  BlockStorage & blockStorage, BlockAddress const & inodeAddress, BlockAddress const & parentAddress)
+{
+  switch (formatVersion)
+  {
+  case format::DirectoryFormatFNV1a32:
+    return std::unique_ptr<Directory::Tree>(
+      new DirectoryTree<DirectoryFormatFNV1a32>(blockStorage, inodeAddress, parentAddress));
+  case format::DirectoryFormatSlotted:
+    return CreateSlottedDirectoryTree(blockStorage, inodeAddress, parentAddress);
+  default:
+    F2F_ASSERT(false);
+    return {};
+  }
+}
+
+std::unique_ptr<Directory::Tree> OpenDirectoryTree(BlockStorage & blockStorage, BlockAddress const & inodeAddress)
+{
+  format::InodeHeader inodeHeader;
+  util::readT(blockStorage, inodeAddress, inodeHeader);
+  switch (inodeHeader.flags & format::DirectoryFormatMask)
+  {
+  case format::DirectoryFormatFNV1a32:
+    return std::unique_ptr<Directory::Tree>(
+      new DirectoryTree<DirectoryFormatFNV1a32>(blockStorage, inodeAddress));
+  case format::DirectoryFormatSlotted:
+    return CreateSlottedDirectoryTree(blockStorage, inodeAddress);
+  default:
+    ThrowFilesystemError(ErrorCode::InvalidStorageFormat, "Unknown directory format");
+  }
+}
+
+} // anonymous namespace
+
+const BlockAddress Directory::NoParentDirectory = BlockAddress::fromBlockIndex(std::numeric_limits<uint64_t>::max());
+
+Directory::Directory(BlockStorage & blockStorage, BlockAddress const & parentAddress, create_tag, uint16_t formatVersion)
+  : m_blockStorage(blockStorage)
+  , m_inodeAddress(blockStorage.allocateBlock())
+  , m_tree(CreateDirectoryTree(formatVersion, blockStorage, m_inodeAddress,
+      parentAddress == NoParentDirectory ? m_inodeAddress : parentAddress))
+{}
+
+Directory::Directory(BlockStorage & blockStorage, BlockAddress const & inodeAddress)
+  : m_blockStorage(blockStorage)
+  , m_inodeAddress(inodeAddress)
+  , m_tree(OpenDirectoryTree(blockStorage, inodeAddress))
+{}
+
+Directory::~Directory()
+{}
+
+BlockAddress Directory::parentInodeAddress() const
+{
+  return m_tree->parentInodeAddress();
+}
+
+void Directory::setParentInodeAddress(BlockAddress const & parentAddress)
+{
+  m_tree->setParentInodeAddress(parentAddress);
+}
+
+uint16_t Directory::formatVersion() const
+{
+  return m_tree->formatVersion();
+}
+
+boost::optional<std::pair<BlockAddress, FileType>> Directory::searchFile(utf8string_ref_t fileName) const
+{
+  static const std::string ParentDirectoryName("..");
+  if (fileName == ParentDirectoryName)
+    return std::make_pair(parentInodeAddress(), FileType::Directory);
+
+  if (boost::optional<uint64_t> result = m_tree->searchFile(fileName))
+    return DecodeInode(*result);
+  else
+    return {};
+}
+
+void Directory::addFile(BlockAddress inodeAddress, FileType fileType, utf8string_ref_t fileName)
+{
+  m_tree->addFile(EncodeInode(inodeAddress, fileType), fileName);
+}
+
+void Directory::addFiles(std::vector<NewFile> const & files)
+{
+  std::vector<std::pair<uint64_t, utf8string_ref_t>> encodedFiles;
+  encodedFiles.reserve(files.size());
+  for(auto const & file: files)
+    encodedFiles.push_back(std::make_pair(EncodeInode(file.inode, file.fileType), file.name));
+  m_tree->addFiles(encodedFiles);
+}
+
+boost::optional<std::pair<BlockAddress, FileType>> Directory::removeFile(utf8string_ref_t fileName)
+{
+  if (boost::optional<uint64_t> removedInode = m_tree->removeFile(fileName))
+    return DecodeInode(*removedInode);
+  else
+    return {};
+}
+
+boost::optional<std::pair<BlockAddress, FileType>> Directory::replaceFile(utf8string_ref_t fileName,
+  BlockAddress inode, FileType fileType)
+{
+  if (boost::optional<uint64_t> replacedInode = m_tree->replaceFile(fileName, EncodeInode(inode, fileType)))
+    return DecodeInode(*replacedInode);
+  else
+    return {};
+}
+
+void Directory::remove(OnDeleteFileFunc_t const & onDeleteFile)
+{
+  BlockStorage & blockStorage = m_blockStorage;
+  remove(onDeleteFile, [&blockStorage](BlockAddress block) { blockStorage.releaseBlocks(block, 1); });
+}
+
+void Directory::remove(OnDeleteFileFunc_t const & onDeleteFile, OnReleaseBlockFunc_t const & onReleaseBlock)
+{
+  m_tree->removeNodes(onDeleteFile, onReleaseBlock);
+  onReleaseBlock(m_inodeAddress);
+}
+
+void Directory::convert(uint16_t formatVersion)
+{
+  if (m_tree->formatVersion() == formatVersion)
+    return;
+
+  // Fill tree in new format using temporary inode block, then move it in place of old one
+  BlockAddress const temporaryInodeAddress = m_blockStorage.allocateBlock();
+  std::unique_ptr<Tree> tree = CreateDirectoryTree(
+    formatVersion, m_blockStorage, temporaryInodeAddress, m_tree->parentInodeAddress());
+  for(Iterator it(*this); !it.eof(); it.moveNext())
+    tree->addFile(EncodeInode(it.currentInode(), it.currentFileType()), it.currentName());
+
+  BlockStorage & blockStorage = m_blockStorage;
+  m_tree->removeNodes([](BlockAddress, FileType){},
+    [&blockStorage](BlockAddress block) { blockStorage.releaseBlocks(block, 1); });
+  tree->moveInode(m_inodeAddress);
+  m_blockStorage.releaseBlocks(temporaryInodeAddress, 1);
+  m_tree = std::move(tree);
+}
+
+void Directory::check() const
+{
+  m_tree->check();
+}
+
+Directory::Iterator::Iterator(Directory const & directory)
+  : m_impl(directory.m_tree->iterate(0))
+  , m_blockStorage(directory.m_blockStorage)
+  , m_formatVersion(directory.formatVersion())
+  , m_passedNamesHash(0)
+{
+  m_nameBuffer.reserve(format::MaxFileNameSize);
+  skipPassedNames();
+}
+
+Directory::Iterator::Iterator(Directory const & directory, Position const & position)
+  : m_impl(directory.m_tree->iterate(position.nameHash))
+  , m_blockStorage(directory.m_blockStorage)
+  , m_formatVersion(directory.formatVersion())
+  , m_passedNamesHash(position.nameHash)
+  , m_passedNames(position.passedNames)
+{
+  F2F_ASSERT(position.formatVersion == m_formatVersion);
+  m_nameBuffer.reserve(format::MaxFileNameSize);
+  skipPassedNames();
 }
 
 Directory::Iterator::~Iterator()
@@ -819,36 +1941,110 @@ Directory::Iterator::~Iterator()
 
 void Directory::Iterator::moveNext()
 {
-  ++*m_impl->iterator;
-  if (m_impl->iterator->atEnd())
-    if (m_impl->currentLeaf.nextLeafNode != format::DirectoryTreeLeaf::NoNextLeaf)
-    {
-      m_impl->directory.read(BlockAddress::fromBlockIndex(m_impl->currentLeaf.nextLeafNode), m_impl->currentLeaf);
-      m_impl->iterator.reset(new DirectoryTreeLeafItemConstIterator(m_impl->currentLeaf.head, m_impl->currentLeaf.dataSize));
-    }
+  uint64_t const nameHash = m_impl->currentNameHash();
+  // Name is only valid until the next leaf is read
+  utf8string_ref_t const name = m_impl->currentName();
+  m_nameBuffer.assign(name.data(), name.size());
+  m_impl->moveNext();
+  if (!m_impl->eof() && m_impl->currentNameHash() == nameHash)
+    m_passedNames.push_back(m_nameBuffer);
+  skipPassedNames();
+}
+
+void Directory::Iterator::skipPassedNames()
+{
+  while (!m_impl->eof() && m_impl->currentNameHash() == m_passedNamesHash
+    && std::find(m_passedNames.begin(), m_passedNames.end(), m_impl->currentName()) != m_passedNames.end())
+    m_impl->moveNext();
+
+  if (m_impl->eof() || m_impl->currentNameHash() != m_passedNamesHash)
+    m_passedNames.clear();
+  if (!m_impl->eof())
+    m_passedNamesHash = m_impl->currentNameHash();
+}
+
+Directory::Iterator::Position Directory::Iterator::position() const
+{
+  F2F_ASSERT(!m_impl->eof());
+  return Position{ m_formatVersion, m_impl->currentNameHash(), m_passedNames };
 }
 
 bool Directory::Iterator::eof() const
 {
-  return m_impl->iterator->atEnd() && m_impl->currentLeaf.nextLeafNode == format::DirectoryTreeLeaf::NoNextLeaf;
+  return m_impl->eof();
 }
 
 BlockAddress Directory::Iterator::currentInode() const
 {
-  return BlockAddress::fromBlockIndex(
-    (*m_impl->iterator)->inode & ~format::DirectoryTreeLeafItem::DirectoryFlag);
+  return DecodeInode(m_impl->currentInode()).first;
 }
 
 FileType Directory::Iterator::currentFileType() const
 {
-  return ((*m_impl->iterator)->inode & format::DirectoryTreeLeafItem::DirectoryFlag)
-    ? FileType::Directory
-    : FileType::Regular;
+  return DecodeInode(m_impl->currentInode()).second;
+}
+
+utf8string_ref_t Directory::Iterator::currentName() const
+{
+  return m_impl->currentName();
+}
+
+format::InodeHeader const & Directory::Iterator::currentInodeHeader() const
+{
+  uint64_t const blockIndex = currentInode().index();
+  auto less = [](std::pair<uint64_t, format::InodeHeader> const & item, uint64_t blockIndex) -> bool
+  {
+    return item.first < blockIndex;
+  };
+  auto header = std::lower_bound(m_inodeHeaders.begin(), m_inodeHeaders.end(), blockIndex, less);
+  if (header == m_inodeHeaders.end() || header->first != blockIndex)
+  {
+    readInodeHeaders();
+    header = std::lower_bound(m_inodeHeaders.begin(), m_inodeHeaders.end(), blockIndex, less);
+    F2F_ASSERT(header != m_inodeHeaders.end() && header->first == blockIndex);
+  }
+  return header->second;
+}
+
+uint64_t Directory::Iterator::currentAllocatedSize() const
+{
+  return currentInodeHeader().blocksCount * m_blockStorage.blockSize();
 }
 
-utf8string_t Directory::Iterator::currentName() const
+void Directory::Iterator::readInodeHeaders() const
 {
-  return utf8string_t((*m_impl->iterator)->name, (*m_impl->iterator)->name + (*m_impl->iterator)->nameSize);
+  static const unsigned MaxReadSize = 64 * 1024;
+
+  std::vector<uint64_t> blocks;
+  m_impl->enumerateLeafInodes([&blocks](uint64_t inode)
+  {
+    blocks.push_back(DecodeInode(inode).first.index());
+  });
+  std::sort(blocks.begin(), blocks.end());
+  blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+  // Inodes in adjacent blocks are read at once
+  m_inodeHeaders.clear();
+  unsigned const blockSize = m_blockStorage.blockSize();
+  std::vector<char> buffer;
+  for(size_t begin = 0; begin < blocks.size(); )
+  {
+    BlockAddress const first = BlockAddress::fromBlockIndex(blocks[begin]);
+    size_t end = begin + 1;
+    while (end < blocks.size() && (end - begin + 1) * blockSize <= MaxReadSize
+      && m_blockStorage.isAdjacentBlocks(first, end - begin, BlockAddress::fromBlockIndex(blocks[end])))
+      ++end;
+
+    buffer.resize((end - begin - 1) * blockSize + sizeof(format::InodeHeader));
+    m_blockStorage.storage().read(m_blockStorage.absoluteAddress(first), buffer.size(), buffer.data());
+    for(size_t i = begin; i != end; ++i)
+    {
+      format::InodeHeader header;
+      memcpy(&header, buffer.data() + (i - begin) * blockSize, sizeof(header));
+      m_inodeHeaders.push_back(std::make_pair(blocks[i], header));
+    }
+    begin = end;
+  }
 }
 
 Directory::FileExistsError::FileExistsError(FileType fileType)
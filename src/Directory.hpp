@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <memory>
+#include <boost/utility/string_ref.hpp>
 #include "BlockStorage.hpp"
 #include "format/Directory.hpp"
 
@@ -9,6 +10,11 @@ namespace f2f
 {
 
 typedef std::string utf8string_t;
+typedef boost::string_ref utf8string_ref_t;
+
+// Inode value stored in directory entries and orphan list, directory flag is kept in high bit
+uint64_t EncodeInode(BlockAddress const & inodeAddress, FileType);
+std::pair<BlockAddress, FileType> DecodeInode(uint64_t inode);
 
 class Directory
 {
@@ -16,23 +22,63 @@ public:
   static const BlockAddress NoParentDirectory;
   struct create_tag {};
 
-  Directory(BlockStorage &, BlockAddress const & parentAddress, create_tag); // Create directory
+  // Create directory
+  Directory(BlockStorage &, BlockAddress const & parentAddress, create_tag,
+    uint16_t formatVersion = format::DirectoryFormatCurrent);
   Directory(BlockStorage &, BlockAddress const & inodeAddress); // Open directory
+  ~Directory();
 
   BlockAddress inodeAddress() const { return m_inodeAddress; }
   BlockAddress parentInodeAddress() const;
+  // Used when directory is moved to another parent
+  void setParentInodeAddress(BlockAddress const & parentAddress);
+  uint16_t formatVersion() const;
 
   typedef std::function<void (BlockAddress, FileType)> OnDeleteFileFunc_t;
   void remove(OnDeleteFileFunc_t const &); // Delete this entire directory
-  void addFile(BlockAddress inode, FileType, utf8string_t const & fileName);
-  boost::optional<std::pair<BlockAddress, FileType>> searchFile(utf8string_t const & fileName) const;
-  boost::optional<std::pair<BlockAddress, FileType>> removeFile(utf8string_t const & fileName);
+  // Same as remove(), but blocks of directory are passed to onReleaseBlock instead of being released
+  typedef std::function<void (BlockAddress)> OnReleaseBlockFunc_t;
+  void remove(OnDeleteFileFunc_t const &, OnReleaseBlockFunc_t const & onReleaseBlock);
+  void addFile(BlockAddress inode, FileType, utf8string_ref_t fileName);
+  boost::optional<std::pair<BlockAddress, FileType>> searchFile(utf8string_ref_t fileName) const;
+  boost::optional<std::pair<BlockAddress, FileType>> removeFile(utf8string_ref_t fileName);
+  // Points existing entry to another file. Tree isn't restructured, so only I/O errors are possible.
+  // Returns previous file of the entry
+  boost::optional<std::pair<BlockAddress, FileType>> replaceFile(utf8string_ref_t fileName,
+    BlockAddress inode, FileType);
+
+  struct NewFile
+  {
+    BlockAddress inode;
+    FileType fileType;
+    utf8string_ref_t name;
+  };
+
+  // Adds files in one pass over directory tree. Throws FileExistsError and leaves directory unchanged
+  // if any of names is already present or is repeated in the list
+  void addFiles(std::vector<NewFile> const &);
+
+  // Rewrites directory contents in another format. Inode address stays the same.
+  void convert(uint16_t formatVersion);
 
   // Iterator doesn't return '..' record
   class Iterator
   {
   public:
+    // Place in iteration order that stays meaningful after directory is modified. Items are
+    // ordered by name hash, items with equal hashes are told apart by names already passed
+    struct Position
+    {
+      uint16_t formatVersion;
+      uint64_t nameHash;
+      std::vector<utf8string_t> passedNames; // Names with nameHash that precede the position
+    };
+
     Iterator(Directory const &);
+    // Continues iteration from position taken from another iterator of the same directory.
+    // Items present during the whole iteration are returned exactly once, added or removed
+    // ones may be skipped. Format version of directory must match the position
+    Iterator(Directory const &, Position const &);
     ~Iterator();
 
     void moveNext();
@@ -40,11 +86,28 @@ public:
 
     BlockAddress currentInode() const;
     FileType currentFileType() const;
-    utf8string_t currentName() const;
+    utf8string_ref_t currentName() const; // Valid until moveNext()
+
+    // Inodes of current and following files of the same tree leaf are read together on first
+    // access, so metadata of files modified after that may be out of date
+    format::InodeHeader const & currentInodeHeader() const;
+    uint64_t currentAllocatedSize() const; // Size of blocks owned by current file
+
+    // Iterator created with this position starts from current item
+    Position position() const;
 
-  private:
     struct Impl;
+  private:
     std::unique_ptr<Impl> m_impl;
+    BlockStorage const & m_blockStorage;
+    mutable std::vector<std::pair<uint64_t, format::InodeHeader>> m_inodeHeaders; // Sorted by inode block index
+    uint16_t const m_formatVersion;
+    uint64_t m_passedNamesHash;
+    std::vector<utf8string_t> m_passedNames; // Names with current hash preceding current item
+    utf8string_t m_nameBuffer;
+
+    void readInodeHeaders() const;
+    void skipPassedNames();
   };
 
   struct FileExistsError : public std::runtime_error
@@ -59,46 +122,13 @@ public:
   // Diagnostics
   void check() const;
 
+  // Implementation of specific directory format
+  class Tree;
+
 private:
   BlockStorage & m_blockStorage;
-  IStorage & m_storage;
   BlockAddress m_inodeAddress;
-  format::DirectoryInode m_inode;
-
-  void read(BlockAddress blockIndex, format::DirectoryTreeInternalNode & internalNode) const;
-  void read(BlockAddress blockIndex, format::DirectoryTreeLeaf & leaf) const;
-
-  typedef uint32_t NameHash_t;
-  boost::optional<uint64_t> searchInNode(NameHash_t nameHash, utf8string_t const & fileName, unsigned levelsRemain, format::DirectoryTreeChildNodeReference const * children, unsigned itemsCount) const;
-  boost::optional<uint64_t> searchInNode(NameHash_t nameHash, utf8string_t const & fileName, format::DirectoryTreeLeafItem const & head, unsigned dataSize) const;
-  boost::optional<uint64_t> searchInNode(NameHash_t nameHash, utf8string_t const & fileName, unsigned levelsRemain, BlockAddress blockIndex) const;
-
-  std::vector<format::DirectoryTreeChildNodeReference> insertInNode(uint64_t inode, NameHash_t nameHash, utf8string_t const & fileName, unsigned levelsRemain, BlockAddress blockIndex);
-  boost::optional<format::DirectoryTreeChildNodeReference> insertInNode(
-    uint64_t inode, NameHash_t nameHash, utf8string_t const & fileName, 
-    unsigned levelsRemain, format::DirectoryTreeChildNodeReference * children, 
-    uint16_t & itemsCount, unsigned maxItemsCount, bool & isDirty);
-  std::vector<format::DirectoryTreeChildNodeReference> insertInNode(
-    uint64_t inode, NameHash_t nameHash, utf8string_t const & fileName,
-    format::DirectoryTreeLeafItem & head, uint64_t & nextLeafNode, 
-    uint16_t & dataSize, unsigned maxSize, bool & isDirty);
-  static unsigned getSizeOfLeafRecord(utf8string_t const & fileName);
-
-  boost::optional<uint64_t> removeFromNode(NameHash_t nameHash, utf8string_t const & fileName, unsigned levelsRemain, BlockAddress blockIndex);
-  boost::optional<uint64_t> removeFromNode(
-    NameHash_t nameHash, utf8string_t const & fileName,
-    unsigned levelsRemain, format::DirectoryTreeChildNodeReference * children,
-    uint16_t & itemsCount, bool & isDirty);
-  boost::optional<uint64_t> removeFromNode(
-    NameHash_t nameHash, utf8string_t const & fileName,
-    format::DirectoryTreeLeafItem & head, uint16_t & dataSize, bool & isDirty);
-
-  void removeNode(OnDeleteFileFunc_t const &, format::DirectoryTreeChildNodeReference const * children, unsigned itemsCount, unsigned levelsRemain);
-  void removeNode(OnDeleteFileFunc_t const &, format::DirectoryTreeLeafItem const & head, unsigned dataSize);
-
-  struct CheckState;
-  void checkNode(CheckState &, format::DirectoryTreeChildNodeReference const * children, unsigned itemsCount, unsigned levelsRemain) const;
-  void checkNode(CheckState &, format::DirectoryTreeLeafItem const & head, unsigned dataSize) const;
+  std::unique_ptr<Tree> m_tree;
 };
 
-}
\ No newline at end of file
+}
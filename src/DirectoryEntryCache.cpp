@@ -0,0 +1,67 @@
+#include "DirectoryEntryCache.hpp"
+
+namespace f2f
+{
+
+DirectoryEntryCache::DirectoryEntryCache(size_t maxSize)
+  : m_maxSize(maxSize)
+{}
+
+boost::optional<DirectoryEntryCache::Entry> DirectoryEntryCache::find(BlockAddress directory, boost::string_ref name)
+{
+  auto it = m_items.find(KeyRef(directory.index(), name));
+  if (it == m_items.end())
+    return {};
+  m_lru.splice(m_lru.begin(), m_lru, it->second);
+  return it->second->entry;
+}
+
+void DirectoryEntryCache::insert(BlockAddress directory, boost::string_ref name, Entry const & entry)
+{
+  if (m_maxSize == 0)
+    return;
+
+  auto it = m_items.find(KeyRef(directory.index(), name));
+  if (it != m_items.end())
+  {
+    it->second->entry = entry;
+    m_lru.splice(m_lru.begin(), m_lru, it->second);
+    return;
+  }
+
+  if (m_items.size() >= m_maxSize)
+  {
+    m_items.erase(m_lru.back().key);
+    m_lru.pop_back();
+  }
+
+  m_lru.push_front(Item());
+  m_lru.front().entry = entry;
+  m_lru.front().key = m_items.insert(std::make_pair(Key(directory.index(), name.to_string()), m_lru.begin())).first;
+}
+
+void DirectoryEntryCache::invalidate(BlockAddress directory, boost::string_ref name)
+{
+  auto it = m_items.find(KeyRef(directory.index(), name));
+  if (it != m_items.end())
+  {
+    m_lru.erase(it->second);
+    m_items.erase(it);
+  }
+}
+
+void DirectoryEntryCache::invalidateDirectory(BlockAddress directory)
+{
+  auto range = m_items.equal_range(directory.index());
+  for(auto it = range.first; it != range.second; ++it)
+    m_lru.erase(it->second);
+  m_items.erase(range.first, range.second);
+}
+
+void DirectoryEntryCache::clear()
+{
+  m_items.clear();
+  m_lru.clear();
+}
+
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+#include <boost/optional.hpp>
+#include <boost/utility/string_ref.hpp>
+#include "f2f/Common.hpp"
+#include "BlockStorage.hpp"
+
+namespace f2f
+{
+
+// Bounded LRU cache of directory lookups: (directory inode, name) -> (inode, type).
+// Results of unsuccessful lookups are cached too (negative entries).
+class DirectoryEntryCache
+{
+public:
+  typedef boost::optional<std::pair<BlockAddress, FileType>> Entry; // Empty value - file not found
+
+  explicit DirectoryEntryCache(size_t maxSize);
+
+  // Returns empty optional if lookup result isn't cached
+  boost::optional<Entry> find(BlockAddress directory, boost::string_ref name);
+  void insert(BlockAddress directory, boost::string_ref name, Entry const &);
+
+  void invalidate(BlockAddress directory, boost::string_ref name);
+  void invalidateDirectory(BlockAddress directory); // Invalidate all entries of directory
+  void clear();
+
+  size_t size() const { return m_items.size(); }
+
+private:
+  typedef std::pair<uint64_t, std::string> Key;
+  typedef std::pair<uint64_t, boost::string_ref> KeyRef;
+
+  struct KeyLess
+  {
+    typedef void is_transparent;
+
+    template<class Key1, class Key2>
+    bool operator()(Key1 const & lhs, Key2 const & rhs) const
+    {
+      if (lhs.first != rhs.first)
+        return lhs.first < rhs.first;
+      return boost::string_ref(lhs.second) < boost::string_ref(rhs.second);
+    }
+
+    bool operator()(Key const & lhs, uint64_t rhs) const { return lhs.first < rhs; }
+    bool operator()(uint64_t lhs, Key const & rhs) const { return lhs < rhs.first; }
+  };
+
+  struct Item;
+  typedef std::map<Key, std::list<Item>::iterator, KeyLess> Items;
+
+  struct Item
+  {
+    Items::const_iterator key;
+    Entry entry;
+  };
+
+  size_t const m_maxSize;
+  Items m_items;
+  std::list<Item> m_lru; // Most recently used first
+};
+
+}
@@ -0,0 +1,120 @@
+#include "DirectoryHandleImpl.hpp"
+#include "f2f/FileSystemError.hpp"
+
+namespace f2f
+{
+
+DirectoryHandle::DirectoryHandle()
+  : m_impl(nullptr)
+{}
+
+DirectoryHandle::DirectoryHandle(DirectoryHandle && src)
+  : m_impl(src.m_impl)
+{
+  src.m_impl = nullptr;
+}
+
+DirectoryHandle::DirectoryHandle(DirectoryHandle const & src)
+  : m_impl(nullptr)
+{
+  if (src.m_impl)
+    m_impl = new Impl(*src.m_impl);
+}
+
+DirectoryHandle::~DirectoryHandle()
+{
+  delete m_impl;
+}
+
+DirectoryHandle & DirectoryHandle::operator=(DirectoryHandle const & src)
+{
+  if (this != &src)
+  {
+    delete m_impl;
+    if (src.m_impl)
+      m_impl = new Impl(*src.m_impl);
+    else
+      m_impl = nullptr;
+  }
+  return *this;
+}
+
+DirectoryHandle & DirectoryHandle::operator=(DirectoryHandle && src)
+{
+  delete m_impl;
+  m_impl = src.m_impl;
+  src.m_impl = nullptr;
+  return *this;
+}
+
+bool DirectoryHandle::isOpen() const
+{
+  return m_impl != nullptr;
+}
+
+void DirectoryHandle::close()
+{
+  delete m_impl;
+  m_impl = nullptr;
+}
+
+namespace
+{
+  // Removal of directory is checked by the file system under its lock
+  FileSystemImpl::OpenedDirectory const * OpenedDirectory(DirectoryHandle::Impl const * impl)
+  {
+    if (!impl)
+      throw FileSystemError(ErrorCode::OperationRequiresOpenedFile, "Directory isn't opened");
+    return impl->directory.get();
+  }
+}
+
+FileDescriptor DirectoryHandle::open(PathRef path, OpenMode openMode, bool createIfRW)
+{
+  auto const directory = OpenedDirectory(m_impl);
+  return m_impl->owner->open(directory, boost::string_ref(path.data(), path.size()), openMode, createIfRW);
+}
+
+FileDescriptor DirectoryHandle::open(PathRef path) const
+{
+  return const_cast<DirectoryHandle *>(this)->open(path, f2f::OpenMode::ReadOnly);
+}
+
+void DirectoryHandle::createDirectory(PathRef path)
+{
+  auto const directory = OpenedDirectory(m_impl);
+  m_impl->owner->createDirectory(directory, boost::string_ref(path.data(), path.size()));
+}
+
+void DirectoryHandle::remove(PathRef path)
+{
+  auto const directory = OpenedDirectory(m_impl);
+  m_impl->owner->remove(directory, boost::string_ref(path.data(), path.size()));
+}
+
+void DirectoryHandle::rename(PathRef from, PathRef to)
+{
+  auto const directory = OpenedDirectory(m_impl);
+  m_impl->owner->rename(directory, 
+    boost::string_ref(from.data(), from.size()), boost::string_ref(to.data(), to.size()));
+}
+
+bool DirectoryHandle::exists(PathRef path) const
+{
+  return fileType(path) != FileType::NotFound;
+}
+
+FileType DirectoryHandle::fileType(PathRef path) const
+{
+  auto const directory = OpenedDirectory(m_impl);
+  return m_impl->owner->fileType(directory, boost::string_ref(path.data(), path.size()));
+}
+
+DirectoryHandle DirectoryHandle::openDirectory(PathRef path) const
+{
+  auto const directory = OpenedDirectory(m_impl);
+  return DirectoryHandleFactory::create(
+    m_impl->owner->openDirectory(directory, boost::string_ref(path.data(), path.size())), m_impl->owner);
+}
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <memory>
+#include "f2f/DirectoryHandle.hpp"
+#include "FileSystemImpl.hpp"
+
+namespace f2f
+{
+
+class DirectoryHandle::Impl
+{
+public:
+  std::shared_ptr<FileSystemImpl> owner;
+  std::shared_ptr<FileSystemImpl::OpenedDirectory> directory;
+};
+
+class DirectoryHandleFactory
+{
+public:
+  static DirectoryHandle create(
+    std::shared_ptr<FileSystemImpl::OpenedDirectory> && directory,
+    std::shared_ptr<FileSystemImpl> const & owner)
+  {
+    DirectoryHandle handle;
+    handle.m_impl = new DirectoryHandle::Impl;
+    handle.m_impl->owner = owner;
+    handle.m_impl->directory = std::move(directory);
+    return handle;
+  }
+};
+
+}
@@ -1,3 +1,4 @@
+#include <cstring>
 #include "DirectoryIteratorImpl.hpp"
 #include "f2f/FileSystemError.hpp"
 
@@ -12,18 +13,44 @@ DirectoryEntry::~DirectoryEntry()
 
 FileType DirectoryEntry::type() const
 {
-  return m_impl->directory.m_iterator.currentFileType();
+  return m_impl->directory.m_iterator->currentFileType();
 }
 
 std::string DirectoryEntry::name() const
 {
   // TODO: encoding
-  return m_impl->directory.m_iterator.currentName();
+  return m_impl->directory.m_iterator->currentName().to_string();
 }
 
 std::string DirectoryEntry::path() const
 {
-  return m_impl->directory.m_directoryPath + "/" + name();
+  std::string result;
+  path(result);
+  return result;
+}
+
+PathRef DirectoryEntry::nameRef() const
+{
+  utf8string_ref_t name = m_impl->directory.m_iterator->currentName();
+  return PathRef(name.data(), name.size());
+}
+
+void DirectoryEntry::path(std::string & result) const
+{
+  utf8string_ref_t name = m_impl->directory.m_iterator->currentName();
+  std::string const & directoryPath = m_impl->directory.m_directoryPath;
+  result.reserve(directoryPath.size() + 1 + name.size());
+  result.assign(directoryPath).append(1, '/').append(name.data(), name.size());
+}
+
+uint64_t DirectoryEntry::size() const
+{
+  return m_impl->directory.m_iterator->currentInodeHeader().fileSize;
+}
+
+uint64_t DirectoryEntry::allocatedSize() const
+{
+  return m_impl->directory.m_iterator->currentAllocatedSize();
 }
 
 DirectoryIteratorImpl::DirectoryEntry::DirectoryEntry(DirectoryIteratorImpl & directory)
@@ -78,33 +105,38 @@ DirectoryIterator & DirectoryIterator::operator=(DirectoryIterator const & src)
 bool DirectoryIterator::operator!=(DirectoryIterator const & rhs) const
 {
   // Simple comparison only for end() check
-  return (!m_impl || m_impl->ptr->m_iterator.eof()) != (!rhs.m_impl || rhs.m_impl->ptr->m_iterator.eof());
+  return (!m_impl || m_impl->ptr->m_iterator->eof()) != (!rhs.m_impl || rhs.m_impl->ptr->m_iterator->eof());
 }
 
 DirectoryIterator & DirectoryIterator::operator++()
 {
-  if (!m_impl || m_impl->ptr->m_iterator.eof())
+  if (!m_impl || m_impl->ptr->m_iterator->eof())
     throw FileSystemError(ErrorCode::IncorrectIteratorAccess, "Incrementing end directory iterator");
-  if (!m_impl->ptr->m_isIteratorValid())
+  if (!m_impl->ptr->moveNext())
   {
     delete m_impl;
     m_impl = nullptr;
   }
-  else
-    m_impl->ptr->m_iterator.moveNext();
   return *this;
 }
 
+std::string DirectoryIterator::resumeToken() const
+{
+  if (!m_impl || m_impl->ptr->m_iterator->eof())
+    throw FileSystemError(ErrorCode::IncorrectIteratorAccess, "Taking resume token of end directory iterator");
+  return m_impl->ptr->resumeToken();
+}
+
 const DirectoryEntry & DirectoryIterator::operator*() const
 {
-  if (!m_impl || m_impl->ptr->m_iterator.eof())
+  if (!m_impl || m_impl->ptr->m_iterator->eof())
     throw FileSystemError(ErrorCode::IncorrectIteratorAccess, "Dereferencing end directory iterator");
   return m_impl->ptr->m_entry;
 }
 
 const DirectoryEntry * DirectoryIterator::operator->() const
 {
-  if (!m_impl || m_impl->ptr->m_iterator.eof())
+  if (!m_impl || m_impl->ptr->m_iterator->eof())
     throw FileSystemError(ErrorCode::IncorrectIteratorAccess, "Dereferencing end directory iterator");
   return &m_impl->ptr->m_entry;
 }
@@ -113,20 +145,125 @@ DirectoryIteratorImpl::DirectoryIteratorImpl(
   std::shared_ptr<FileSystemImpl> const & owner,
   std::string const & directoryPath,
   BlockAddress const & inodeAddress,
-  std::function<bool()> const & isIteratorValid,
-  std::function<void()> const & onFinishIteration)
+  FileSystemImpl::IteratedDirectory const & iteratedDirectory,
+  std::function<void()> const & onFinishIteration,
+  boost::optional<Directory::Iterator::Position> const & position)
   : m_owner(owner)
+  , m_inodeAddress(inodeAddress)
+  , m_iteratedDirectory(iteratedDirectory)
+  , m_generation(iteratedDirectory.generation)
+  , m_version(iteratedDirectory.version)
   , m_directoryPath(directoryPath)
-  , m_directory(owner->m_blockStorage, inodeAddress)
-  , m_iterator(m_directory)
-  , m_isIteratorValid(isIteratorValid)
   , m_onFinishIteration(onFinishIteration)
   , m_entry(*this)
-{}
+{
+  m_directory.emplace(owner->m_blockStorage, inodeAddress);
+  if (position)
+  {
+    if (position->formatVersion != m_directory->formatVersion())
+    {
+      m_onFinishIteration();
+      throw FileSystemError(ErrorCode::IncorrectIteratorAccess, "Resume token was taken before directory format upgrade");
+    }
+    m_iterator.emplace(*m_directory, *position);
+  }
+  else
+    m_iterator.emplace(*m_directory);
+}
 
 DirectoryIteratorImpl::~DirectoryIteratorImpl()
 {
   m_onFinishIteration();
 }
 
+bool DirectoryIteratorImpl::moveNext()
+{
+  FileSystemImpl::SharedLock namespaceLock = m_owner->sharedLock(m_owner->m_namespaceMutex);
+  FileSystemImpl::SharedLock directoryLock = m_owner->sharedLock(m_owner->directoryMutex(m_inodeAddress));
+  if (m_iteratedDirectory.version == m_version)
+  {
+    m_iterator->moveNext();
+    return true;
+  }
+
+  if (m_iteratedDirectory.generation != m_generation)
+    return false;
+
+  // Leaf read by iterator is still valid in memory, so position after current item is known
+  Directory::Iterator::Position position = m_iterator->position();
+  position.passedNames.push_back(m_iterator->currentName().to_string());
+  m_iterator = boost::none;
+  m_directory = boost::none;
+  m_directory.emplace(m_owner->m_blockStorage, m_inodeAddress);
+  m_version = m_iteratedDirectory.version;
+  if (m_directory->formatVersion() != position.formatVersion)
+    return false;
+  m_iterator.emplace(*m_directory, position);
+  return true;
+}
+
+namespace
+{
+  const uint8_t ResumeTokenVersion = 1;
+
+  template<class T>
+  void AppendT(std::string & token, T const & value)
+  {
+    token.append(reinterpret_cast<char const *>(&value), sizeof(value));
+  }
+
+  template<class T>
+  T ParseT(std::string const & token, size_t & offset)
+  {
+    T value;
+    if (token.size() - offset < sizeof(value))
+      throw FileSystemError(ErrorCode::IncorrectIteratorAccess, "Incorrect directory iterator resume token");
+    memcpy(&value, token.data() + offset, sizeof(value));
+    offset += sizeof(value);
+    return value;
+  }
+}
+
+std::string DirectoryIteratorImpl::resumeToken() const
+{
+  Directory::Iterator::Position const position = m_iterator->position();
+  std::string token;
+  AppendT(token, ResumeTokenVersion);
+  AppendT(token, m_inodeAddress.index());
+  AppendT(token, position.formatVersion);
+  AppendT(token, position.nameHash);
+  AppendT(token, static_cast<uint16_t>(position.passedNames.size()));
+  for(auto const & name: position.passedNames)
+  {
+    AppendT(token, static_cast<uint16_t>(name.size()));
+    token.append(name);
+  }
+  return token;
+}
+
+Directory::Iterator::Position DirectoryIteratorImpl::parseResumeToken(
+  std::string const & token, BlockAddress const & inodeAddress)
+{
+  size_t offset = 0;
+  if (ParseT<uint8_t>(token, offset) != ResumeTokenVersion)
+    throw FileSystemError(ErrorCode::IncorrectIteratorAccess, "Unsupported directory iterator resume token");
+  if (ParseT<uint64_t>(token, offset) != inodeAddress.index())
+    throw FileSystemError(ErrorCode::IncorrectIteratorAccess, "Resume token was taken from another directory");
+
+  Directory::Iterator::Position position;
+  position.formatVersion = ParseT<uint16_t>(token, offset);
+  position.nameHash = ParseT<uint64_t>(token, offset);
+  for(uint16_t count = ParseT<uint16_t>(token, offset); count > 0; --count)
+  {
+    uint16_t const size = ParseT<uint16_t>(token, offset);
+    if (token.size() - offset < size)
+      throw FileSystemError(ErrorCode::IncorrectIteratorAccess, "Incorrect directory iterator resume token");
+    position.passedNames.push_back(token.substr(offset, size));
+    offset += size;
+  }
+  if (offset != token.size())
+    throw FileSystemError(ErrorCode::IncorrectIteratorAccess, "Incorrect directory iterator resume token");
+  return position;
+}
+
 }
\ No newline at end of file
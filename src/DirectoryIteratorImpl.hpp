@@ -1,6 +1,7 @@
 #pragma once
 
 #include <functional>
+#include <boost/optional.hpp>
 #include "f2f/DirectoryIterator.hpp"
 #include "Directory.hpp"
 #include "FileSystemImpl.hpp"
@@ -11,22 +12,35 @@ namespace f2f
 class DirectoryIteratorImpl
 {
 public:
+  // Iteration starts from position if it's set
   DirectoryIteratorImpl(
     std::shared_ptr<FileSystemImpl> const & owner,
     std::string const & directoryPath,
     BlockAddress const & inodeAddress,
-    std::function<bool()> const & isIteratorValid,
-    std::function<void()> const & onFinishIteration);
+    FileSystemImpl::IteratedDirectory const & iteratedDirectory,
+    std::function<void()> const & onFinishIteration,
+    boost::optional<Directory::Iterator::Position> const & position = boost::none);
   ~DirectoryIteratorImpl();
 
+  // After directory modification continues from the same position in reopened directory.
+  // Returns false if directory was removed or converted to another format
+  bool moveNext();
+
+  // Token contains inode address of directory and iterator position
+  std::string resumeToken() const;
+  static Directory::Iterator::Position parseResumeToken(std::string const & token, BlockAddress const & inodeAddress);
+
 private:
   std::shared_ptr<FileSystemImpl> const m_owner;
-  Directory m_directory;
+  BlockAddress const m_inodeAddress;
+  FileSystemImpl::IteratedDirectory const & m_iteratedDirectory;
+  unsigned const m_generation;
+  unsigned m_version;
+  boost::optional<Directory> m_directory;
 
 public:
   std::string const m_directoryPath;
-  Directory::Iterator m_iterator;
-  std::function<bool()> m_isIteratorValid;
+  boost::optional<Directory::Iterator> m_iterator;
   std::function<void()> m_onFinishIteration;
 
   class DirectoryEntry: public f2f::DirectoryEntry
@@ -1,22 +1,77 @@
 #include "File.hpp"
+#include <atomic>
+#include <memory>
+#include <boost/container/small_vector.hpp>
 #include "util/Assert.hpp"
 #include "util/StorageT.hpp"
-#include "util/FloorDiv.hpp"
 
 namespace f2f
 {
 
-File::File(BlockStorage & blockStorage)
+namespace
+{
+  // Read-ahead starts after this number of reads, each continuing previous one
+  const unsigned SequentialReadsBeforeReadAhead = 2;
+  const unsigned ReadAheadRangesCount = 8;
+  const unsigned ReadAheadMaxSize = 1024 * 1024;
+  // Size limit of one write of empty inodes
+  const unsigned EmptyInodesWriteMaxSize = 1024 * 1024;
+
+  typedef boost::container::small_vector<std::pair<uint64_t, unsigned>, ReadAheadRangesCount> StorageRanges;
+  typedef boost::container::small_vector<IStorage::ReadRequest, ReadAheadRangesCount> ReadRequests;
+}
+
+File::File(BlockStorage & blockStorage, OpenMode openMode)
   : m_storage(blockStorage.storage())
   , m_blockStorage(blockStorage)
-  , m_openMode(OpenMode::ReadWrite)
+  , m_openMode(openMode)
   , m_inode()
   , m_fileBlocks(blockStorage, m_inode, m_inodeTreeRootIsDirty, true)
-  , m_position(0)
+  , m_pinCount(0)
 {
   m_inodeAddress = m_blockStorage.allocateBlock();
   memset(&m_inode, 0, sizeof(m_inode));
-  util::writeT(m_storage, m_inodeAddress, m_inode);
+  util::writeT(m_blockStorage, m_inodeAddress, m_inode);
+}
+
+std::vector<BlockAddress> File::createEmptyFiles(BlockStorage & blockStorage, size_t count)
+{
+  std::vector<BlockAddress> inodes;
+  inodes.reserve(count);
+  blockStorage.allocateBlocks(count, [&inodes](BlockAddress const & block) { inodes.push_back(block); });
+  try
+  {
+    // Inode of empty file is all zeros
+    unsigned const blockSize = blockStorage.blockSize();
+    size_t const maxRunSize = std::max<size_t>(EmptyInodesWriteMaxSize / blockSize, 1);
+    std::vector<char> zeros;
+    size_t runBegin = 0;
+    for(size_t i = 1; i <= inodes.size(); ++i)
+      if (i == inodes.size() || i - runBegin == maxRunSize
+        || !blockStorage.isAdjacentBlocks(inodes[runBegin], unsigned(i - runBegin), inodes[i]))
+      {
+        size_t const size = (i - runBegin) * blockSize;
+        if (zeros.size() < size)
+          zeros.resize(size);
+        blockStorage.storage().write(blockStorage.absoluteAddress(inodes[runBegin]), size, zeros.data());
+        runBegin = i;
+      }
+  }
+  catch (...)
+  {
+    removeEmptyFiles(blockStorage, inodes);
+    throw;
+  }
+  return inodes;
+}
+
+void File::removeEmptyFiles(BlockStorage & blockStorage, std::vector<BlockAddress> const & inodes)
+{
+  std::vector<BlockStorage::Extent> extents;
+  extents.reserve(inodes.size());
+  for(auto const & inode: inodes)
+    extents.push_back(BlockStorage::Extent(inode, 1));
+  blockStorage.releaseExtents(extents);
 }
 
 File::File(BlockStorage & blockStorage, BlockAddress const & inodeAddress, OpenMode openMode)
@@ -25,70 +80,177 @@ File::File(BlockStorage & blockStorage, BlockAddress const & inodeAddress, OpenM
   , m_openMode(openMode)
   , m_inodeAddress(inodeAddress)
   , m_fileBlocks(blockStorage, m_inode, m_inodeTreeRootIsDirty)
-  , m_position(0)
+  , m_pinCount(0)
 {
-  util::readT(m_storage, inodeAddress, m_inode);
+  util::readT(m_blockStorage, inodeAddress, m_inode);
 
-  uint64_t blocksSize = m_inode.blocksCount * format::AddressableBlockSize;
-  F2F_FORMAT_ASSERT(blocksSize >= m_inode.fileSize);
-  F2F_FORMAT_ASSERT(blocksSize - m_inode.fileSize < format::AddressableBlockSize);
+  F2F_FORMAT_ASSERT(m_inode.blocksCount == m_blockStorage.fileBlocksCount(m_inode.fileSize));
 }
 
 uint64_t File::size() const
 {
+  if (m_openMode == OpenMode::ReadOnly)
+    return m_inode.fileSize;
+  std::lock_guard<std::mutex> lock(m_mutex);
   return m_inode.fileSize;
 }
 
+std::shared_lock<File::SharedMutex> File::lockTreeShared() const
+{
+  if (m_openMode == OpenMode::ReadOnly)
+    return std::shared_lock<SharedMutex>();
+  return std::shared_lock<SharedMutex>(m_treeMutex);
+}
+
 void File::remove()
 {
+  std::lock_guard<SharedMutex> treeLock(m_treeMutex);
   m_fileBlocks.truncate(0);
   m_blockStorage.releaseBlocks(m_inodeAddress, 1);
 }
 
-void File::seek(uint64_t position)
+void File::enumerateAllBlocks(std::function<void(BlockAddress, unsigned)> const & visitor) const
 {
-  m_position = position;
+  auto treeLock = lockTreeShared();
+  m_fileBlocks.enumerateAllBlocks(visitor);
+  visitor(m_inodeAddress, 1);
 }
 
-void File::read(size_t & inOutSize, void * buffer)
+void File::read(Cursor & cursor, size_t & inOutSize, void * buffer)
 {
-  size_t const availableSize = size_t(std::min(uint64_t(inOutSize), m_inode.fileSize - m_position));
-  inOutSize = 0;
-  if (availableSize == 0)
-    return;
+  readData(cursor.position, inOutSize, buffer, &cursor);
+}
 
-  processData(availableSize,
-    [this, &buffer](uint64_t offset, unsigned size){
-      m_storage.read(offset, size, buffer);
-      reinterpret_cast<char *&>(buffer) += size;
-    });
+void File::readAt(uint64_t position, size_t & inOutSize, void * buffer)
+{
+  readData(position, inOutSize, buffer, nullptr);
+}
+
+void File::readData(uint64_t position, size_t & inOutSize, void * buffer, Cursor * readAheadCursor)
+{
+  // Storage ranges are found under shared lock of the tree and read after it's released, so that
+  // descriptors of the file read concurrently. Blocks can't be released meanwhile: file opened
+  // for writing has no other descriptors unless it's shared, then range lock holds off truncation.
+  // Read-only file isn't locked at all
+  uint64_t const rangeEnd = position + std::min(uint64_t(inOutSize), std::numeric_limits<uint64_t>::max() - position);
+  util::RangeLock::Guard rangeLock(m_rangeLock, position, rangeEnd, false, 
+    m_openMode == OpenMode::SharedReadWrite);
+  FileBlocks::Position localPosition;
+  FileBlocks::Position & blocksPosition = readAheadCursor ? readAheadCursor->blocksPosition : localPosition;
+  ReadRequests requests;
+  StorageRanges readAheadRanges;
+  size_t availableSize = 0;
+  {
+    auto treeLock = lockTreeShared();
+    if (position < m_inode.fileSize)
+      availableSize = size_t(std::min(uint64_t(inOutSize), m_inode.fileSize - position));
+    inOutSize = 0;
+    if (availableSize == 0)
+      return;
+
+    char * data = static_cast<char *>(buffer);
+    processData(blocksPosition, position, availableSize,
+      [&requests, &data](uint64_t offset, unsigned size){
+        requests.push_back(IStorage::ReadRequest{offset, size, data});
+        data += size;
+      });
+
+    if (readAheadCursor)
+    {
+      if (position == readAheadCursor->lastReadEnd)
+        ++readAheadCursor->sequentialReadsCount;
+      else
+        readAheadCursor->sequentialReadsCount = 0;
+      if (readAheadCursor->sequentialReadsCount >= SequentialReadsBeforeReadAhead)
+        readAhead(blocksPosition, [&readAheadRanges](uint64_t offset, unsigned size){
+          readAheadRanges.emplace_back(offset, size);
+        });
+    }
+  }
+
+  // Read-ahead is requested first to be in flight together with the batch
+  for(auto const & range: readAheadRanges)
+    m_storage.prefetch(range.first, range.second);
+  m_storage.readBatch(requests.data(), requests.size());
+  if (readAheadCursor)
+  {
+    readAheadCursor->position = position + availableSize;
+    readAheadCursor->lastReadEnd = readAheadCursor->position;
+  }
 
   inOutSize = size_t(availableSize);
 }
 
-void File::write(size_t size, void const * buffer)
+void File::write(Cursor & cursor, size_t size, void const * buffer)
+{
+  writeData(cursor.position, size, buffer, cursor.blocksPosition);
+  cursor.position += size;
+}
+
+void File::writeAt(uint64_t position, size_t size, void const * buffer)
+{
+  FileBlocks::Position blocksPosition;
+  writeData(position, size, buffer, blocksPosition);
+}
+
+void File::checkWrite(uint64_t position, size_t size) const
 {
   if (m_openMode == OpenMode::ReadOnly)
     throw FileSystemError(ErrorCode::OperationRequiresWriteAccess, "Can't write: file is opened as read-only");
-  if (size > std::numeric_limits<uint64_t>::max() - m_position)
+  if (size > std::numeric_limits<uint64_t>::max() - position)
     throw FileSystemError(ErrorCode::StorageLimitReached, "File size limit reached");
+}
+
+void File::writeData(uint64_t position, size_t size, void const * buffer, FileBlocks::Position & blocksPosition)
+{
+  checkWrite(position, size);
   if (size == 0)
     return;
-  if (m_position + size > m_inode.fileSize)
+
+  // Only extension of file is serialized, data is written after the lock is released
+  util::RangeLock::Guard rangeLock(m_rangeLock, position, position + size, true, 
+    m_openMode == OpenMode::SharedReadWrite);
+  StorageRanges ranges;
+  findWriteRanges(position, size, blocksPosition,
+    [&ranges](uint64_t offset, unsigned size){
+      ranges.emplace_back(offset, size);
+    });
+
+  for(auto const & range: ranges)
+  {
+    m_storage.write(range.first, range.second, buffer);
+    reinterpret_cast<const char *&>(buffer) += range.second;
+  }
+}
+
+void File::findWriteRanges(uint64_t position, size_t size, FileBlocks::Position & blocksPosition,
+  std::function<void(uint64_t, unsigned)> const & func)
+{
+  // File size can't decrease meanwhile: truncation waits for the range lock
+  std::shared_lock<SharedMutex> sharedTreeLock(m_treeMutex);
+  std::unique_lock<SharedMutex> treeLock(m_treeMutex, std::defer_lock);
+  if (position + size > m_inode.fileSize)
+  {
+    sharedTreeLock.unlock();
+    treeLock.lock();
+  }
+  if (position + size > m_inode.fileSize)
   {
     auto prevFileSize = m_inode.fileSize;
     auto prevBlocksCount = m_inode.blocksCount;
-    m_inode.blocksCount = (m_position + size + format::AddressableBlockSize - 1) / format::AddressableBlockSize;
-    if (m_inode.blocksCount > prevBlocksCount)
-      m_fileBlocks.append(m_inode.blocksCount - prevBlocksCount);
-    m_inode.fileSize = m_position + size;
-    util::writeT(m_storage, m_inodeAddress, m_inode);
-    if (prevFileSize < m_position)
+    uint64_t const blocksCount = m_blockStorage.fileBlocksCount(position + size);
+    if (blocksCount > prevBlocksCount)
+      m_fileBlocks.append(blocksCount - prevBlocksCount);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_inode.blocksCount = blocksCount;
+      m_inode.fileSize = position + size;
+    }
+    util::writeT(m_blockStorage, m_inodeAddress, m_inode);
+    if (prevFileSize < position)
     {
       // Zeroing unfilled parts of added space
-      auto savedPosition = m_position;
-      m_position = prevFileSize;
-      processData(savedPosition - prevFileSize, 
+      processData(blocksPosition, prevFileSize, position - prevFileSize, 
         [this](uint64_t offset, unsigned size){
           static const char ZeroBuffer[8096] = {};
           while (size > 0)
@@ -99,29 +261,118 @@ void File::write(size_t size, void const * buffer)
             offset += chunkSize;
           }
         });
-      F2F_ASSERT(m_position == savedPosition);
     }
   }
 
-  processData(size, 
-    [this, &buffer](uint64_t offset, unsigned size){
-      m_storage.write(offset, size, buffer);
-      reinterpret_cast<const char *&>(buffer) += size;
-    });
+  processData(blocksPosition, position, size, func);
 }
 
-void File::processData(size_t size, std::function<void (uint64_t, unsigned)> const & processFunc)
+void File::readAtAsync(uint64_t position, size_t size, void * buffer, OnReadComplete const & onComplete)
+{
+  uint64_t const rangeEnd = position + std::min(uint64_t(size), std::numeric_limits<uint64_t>::max() - position);
+  // Range is unlocked either on completion or on failure to start
+  auto isRangeLocked = std::make_shared<std::atomic<bool>>(m_openMode != OpenMode::ReadOnly);
+  if (*isRangeLocked)
+    m_rangeLock.lock(position, rangeEnd, false);
+  auto unlockRange = [this, position, rangeEnd, isRangeLocked]{
+    if (isRangeLocked->exchange(false))
+      m_rangeLock.unlock(position, rangeEnd, false);
+  };
+  ReadRequests requests;
+  size_t availableSize = 0;
+  try
+  {
+    auto treeLock = lockTreeShared();
+    if (position < m_inode.fileSize)
+      availableSize = size_t(std::min(uint64_t(size), m_inode.fileSize - position));
+    if (availableSize > 0)
+    {
+      FileBlocks::Position blocksPosition;
+      char * data = static_cast<char *>(buffer);
+      processData(blocksPosition, position, availableSize,
+        [&requests, &data](uint64_t offset, unsigned size){
+          requests.push_back(IStorage::ReadRequest{offset, size, data});
+          data += size;
+        });
+    }
+    if (treeLock.owns_lock())
+      treeLock.unlock();
+
+    m_storage.readBatchAsync(requests.data(), requests.size(),
+      [unlockRange, onComplete, availableSize](std::exception_ptr error){
+        unlockRange();
+        onComplete(error ? 0 : availableSize, error);
+      });
+  }
+  catch (...)
+  {
+    unlockRange();
+    throw;
+  }
+}
+
+void File::writeAtAsync(uint64_t position, size_t size, void const * buffer, OnComplete const & onComplete)
+{
+  checkWrite(position, size);
+  auto isRangeLocked = std::make_shared<std::atomic<bool>>(size > 0);
+  if (*isRangeLocked)
+    m_rangeLock.lock(position, position + size, true);
+  auto unlockRange = [this, position, size, isRangeLocked]{
+    if (isRangeLocked->exchange(false))
+      m_rangeLock.unlock(position, position + size, true);
+  };
+  try
+  {
+    boost::container::small_vector<IStorage::WriteRequest, ReadAheadRangesCount> requests;
+    if (size > 0)
+    {
+      FileBlocks::Position blocksPosition;
+      char const * data = static_cast<char const *>(buffer);
+      findWriteRanges(position, size, blocksPosition,
+        [&requests, &data](uint64_t offset, unsigned size){
+          requests.push_back(IStorage::WriteRequest{offset, size, data});
+          data += size;
+        });
+    }
+
+    m_storage.writeBatchAsync(requests.data(), requests.size(),
+      [unlockRange, onComplete](std::exception_ptr error){
+        unlockRange();
+        onComplete(error);
+      });
+  }
+  catch (...)
+  {
+    unlockRange();
+    throw;
+  }
+}
+
+void File::enumerateRanges(uint64_t position, size_t size, std::function<void(uint64_t, unsigned)> const & func)
+{
+  auto treeLock = lockTreeShared();
+  if (position >= m_inode.fileSize)
+    return;
+  size_t const availableSize = size_t(std::min(uint64_t(size), m_inode.fileSize - position));
+  FileBlocks::Position blocksPosition;
+  if (availableSize > 0)
+    processData(blocksPosition, position, availableSize, func);
+}
+
+void File::processData(FileBlocks::Position & blocksPosition, uint64_t position, size_t size,
+  std::function<void (uint64_t, unsigned)> const & processFunc) const
 {
   uint64_t remainingBytes = size;
-  uint64_t const blockIndex = m_position / format::AddressableBlockSize;
-  unsigned skipFromStart = unsigned(m_position - blockIndex * format::AddressableBlockSize);
-  for (m_fileBlocks.seek(blockIndex);;
-    m_fileBlocks.moveToNextRange())
+  unsigned const blockSize = m_blockStorage.blockSize();
+  uint64_t const blockIndex = position / blockSize;
+  unsigned skipFromStart = unsigned(position - blockIndex * blockSize);
+  for (m_fileBlocks.seek(blocksPosition, blockIndex);;
+    m_fileBlocks.moveToNextRange(blocksPosition))
   {
-    F2F_ASSERT(!m_fileBlocks.eof());
-    FileBlocks::OffsetAndSize offsetAndSize = m_fileBlocks.currentRange();
-    auto absoluteAddress = offsetAndSize.first.absoluteAddress(); // Convert blocks to bytes
-    unsigned bytesToReadFromRange = offsetAndSize.second * format::AddressableBlockSize;
+    F2F_ASSERT(!m_fileBlocks.eof(blocksPosition));
+    FileBlocks::OffsetAndSize offsetAndSize = m_fileBlocks.currentRange(blocksPosition);
+    auto absoluteAddress = m_blockStorage.absoluteAddress(offsetAndSize.first); // Convert blocks to bytes
+    unsigned bytesToReadFromRange = offsetAndSize.second * blockSize;
     if (skipFromStart > 0)
     {
       absoluteAddress += skipFromStart;
@@ -135,24 +386,63 @@ void File::processData(size_t size, std::function<void (uint64_t, unsigned)> con
     if (remainingBytes == 0)
       break;
   }
-  m_position += size;
 }
 
-void File::truncate()
+void File::readAhead(FileBlocks::Position const & blocksPosition, std::function<void(uint64_t, unsigned)> const & func) const
+{
+  // File blocks position is at the range containing last read byte
+  unsigned blocksRemain = ReadAheadMaxSize / m_blockStorage.blockSize();
+  m_fileBlocks.enumerateNextRanges(blocksPosition, ReadAheadRangesCount,
+    [this, &func, &blocksRemain](FileBlocks::OffsetAndSize const & range)
+    {
+      unsigned blocksCount = std::min(range.second, blocksRemain);
+      if (blocksCount > 0)
+      {
+        func(m_blockStorage.absoluteAddress(range.first), blocksCount * m_blockStorage.blockSize());
+        blocksRemain -= blocksCount;
+      }
+    });
+}
+
+void File::truncate(uint64_t size)
 {
-  if (m_inode.fileSize > m_position)
+  // Readers of read-only file don't lock the tree, so it must stay unchanged
+  if (m_openMode == OpenMode::ReadOnly)
+    throw FileSystemError(ErrorCode::OperationRequiresWriteAccess, "Can't truncate: file is opened as read-only");
+  // Waits for asynchronous operations in any mode
+  util::RangeLock::Guard rangeLock(m_rangeLock, size, std::numeric_limits<uint64_t>::max(), true);
+  std::lock_guard<SharedMutex> treeLock(m_treeMutex);
+  if (m_inode.fileSize > size)
   {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_pinCount > 0)
+        throw FileSystemError(ErrorCode::FileLocked, "Can't truncate file while it's mapped");
+      m_inode.fileSize = size;
+    }
     auto prevBlocksCount = m_inode.blocksCount;
-    m_inode.blocksCount = util::FloorDiv(m_position, format::AddressableBlockSize);
+    m_inode.blocksCount = m_blockStorage.fileBlocksCount(size);
     if (m_inode.blocksCount != prevBlocksCount)
       m_fileBlocks.truncate(m_inode.blocksCount);
-    m_inode.fileSize = m_position;
-    util::writeT(m_storage, m_inodeAddress, m_inode);
+    util::writeT(m_blockStorage, m_inodeAddress, m_inode);
   }
 }
 
+void File::pin()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  ++m_pinCount;
+}
+
+void File::unpin()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  --m_pinCount;
+}
+
 void File::check() const
 {
+  std::shared_lock<SharedMutex> treeLock(m_treeMutex);
   m_fileBlocks.check();
 }
 
@@ -1,29 +1,88 @@
 #pragma once
 
 #include <cstdint>
+#include <exception>
 #include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
 #include "BlockStorage.hpp"
 #include "FileBlocks.hpp"
+#include "util/RangeLock.hpp"
 
 namespace f2f
 {
 
+// Opened inode. One object is shared by all descriptors of the file, each of them reads and
+// writes at its own cursor. Block ranges tree is guarded by shared mutex: descriptors look up
+// ranges concurrently, each at position in the tree kept by its cursor, and extension or
+// truncation of file locks it exclusively. File data is read and written without holding it.
+// File opened in OpenMode::SharedReadWrite may have several writers, so each operation also
+// locks its byte range. Asynchronous operations lock it in any writable mode, as their data is
+// transferred after the call returns. Tree of file opened in OpenMode::ReadOnly can't change, so
+// it's read without any locks
 class File
 {
 public:
-  File(BlockStorage &); // Create file
+  explicit File(BlockStorage &, OpenMode openMode = OpenMode::ReadWrite); // Create file
   File(BlockStorage &, BlockAddress const & inodeAddress, OpenMode openMode); // Open file
+  // Allocates inodes of several empty files at once. Inodes in adjacent blocks are written by one
+  // storage write. Returns inode addresses, on error nothing stays allocated
+  static std::vector<BlockAddress> createEmptyFiles(BlockStorage &, size_t count);
+  // Releases inodes of files that are still empty, e.g. created by createEmptyFiles
+  static void removeEmptyFiles(BlockStorage &, std::vector<BlockAddress> const & inodes);
+
+  // Position of descriptor in file
+  struct Cursor
+  {
+    Cursor()
+      : position(0)
+      , lastReadEnd(0)
+      , sequentialReadsCount(0)
+    {}
+
+    uint64_t position;
+    uint64_t lastReadEnd;
+    unsigned sequentialReadsCount;
+    FileBlocks::Position blocksPosition;
+  };
 
   BlockAddress inodeAddress() const { return m_inodeAddress; }
+  IStorage & storage() const { return m_storage; }
 
   void remove();
-  void seek(uint64_t position);
-  uint64_t position() const { return m_position; }
-  void read(size_t & inOutSize, void * buffer);
-  void write(size_t size, void const * buffer);
-  void truncate();
+  // Enumerates all blocks owned by file including inode. Releasing them is same as remove()
+  void enumerateAllBlocks(std::function<void(BlockAddress, unsigned)> const & visitor) const;
+  void read(Cursor &, size_t & inOutSize, void * buffer);
+  void write(Cursor &, size_t size, void const * buffer);
+  // Positional operations, read-ahead isn't done
+  void readAt(uint64_t position, size_t & inOutSize, void * buffer);
+  void writeAt(uint64_t position, size_t size, void const * buffer);
+  // Asynchronous positional operations. Ranges are found on calling thread, then storage transfers
+  // data asynchronously and byte range stays locked until onComplete is called. Object must stay
+  // alive until then. If the call throws, onComplete isn't called
+  typedef std::function<void(size_t, std::exception_ptr)> OnReadComplete;
+  typedef std::function<void(std::exception_ptr)> OnComplete;
+  void readAtAsync(uint64_t position, size_t size, void * buffer, OnReadComplete const & onComplete);
+  void writeAtAsync(uint64_t position, size_t size, void const * buffer, OnComplete const & onComplete);
+  // Throws ErrorCode::FileLocked if file is mapped
+  void truncate(uint64_t size);
   uint64_t size() const;
 
+  // Mapped views keep file from truncation
+  void pin();
+  void unpin();
+
+  // Operations at own cursor of the object
+  void seek(uint64_t position) { m_cursor.position = position; }
+  uint64_t position() const { return m_cursor.position; }
+  void read(size_t & inOutSize, void * buffer) { read(m_cursor, inOutSize, buffer); }
+  void write(size_t size, void const * buffer) { write(m_cursor, size, buffer); }
+  void truncate() { truncate(m_cursor.position); }
+
+  // Enumerates storage ranges of [position, position + size) without changing current position
+  void enumerateRanges(uint64_t position, size_t size, std::function<void(uint64_t, unsigned int)> const & func);
+
   // Diagnostics
   void check() const;
 
@@ -32,12 +91,29 @@ private:
   IStorage & m_storage;
   OpenMode const m_openMode;
   BlockAddress m_inodeAddress;
+  util::RangeLock m_rangeLock; // Used in OpenMode::SharedReadWrite and by asynchronous operations
+  typedef std::shared_timed_mutex SharedMutex;
+  mutable SharedMutex m_treeMutex; // Also guards inode modification
+  mutable std::mutex m_mutex; // Guards file size for size() and pin count
   format::FileInode m_inode;
   bool m_inodeTreeRootIsDirty;
   FileBlocks m_fileBlocks;
-  uint64_t m_position;
+  unsigned m_pinCount;
+  Cursor m_cursor;
+
+  void readData(uint64_t position, size_t & inOutSize, void * buffer, Cursor * readAheadCursor);
+  void writeData(uint64_t position, size_t size, void const * buffer, FileBlocks::Position &);
+  void checkWrite(uint64_t position, size_t size) const;
+  // Doesn't lock tree of read-only file
+  std::shared_lock<SharedMutex> lockTreeShared() const;
+  // Extends file if needed and enumerates storage ranges of [position, position + size)
+  void findWriteRanges(uint64_t position, size_t size, FileBlocks::Position &,
+    std::function<void(uint64_t, unsigned int)> const & func);
 
-  void processData(size_t size, std::function<void(uint64_t, unsigned int)> const & func);
+  // Functions below require m_treeMutex to be locked
+  void processData(FileBlocks::Position &, uint64_t position, size_t size,
+    std::function<void(uint64_t, unsigned int)> const & func) const;
+  void readAhead(FileBlocks::Position const &, std::function<void(uint64_t, unsigned int)> const & func) const;
 };
 
 }
\ No newline at end of file
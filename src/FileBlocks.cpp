@@ -1,4 +1,7 @@
 #include "FileBlocks.hpp"
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
 #include "util/Assert.hpp"
 #include "util/StorageT.hpp"
 #include "util/FloorDiv.hpp"
@@ -6,6 +9,17 @@
 namespace f2f
 {
 
+struct FileBlocks::Position::NextLeaf
+{
+  uint64_t blockIndex;
+  uint64_t treeVersion;
+  util::BlockBuffer<format::BlockRangesLeafNode> block;
+  std::mutex mutex;
+  std::condition_variable loaded;
+  bool isLoaded;
+  bool failed;
+};
+
 FileBlocks::FileBlocks(
   BlockStorage & blockStorage, 
   format::FileInode & inode,
@@ -15,6 +29,9 @@ FileBlocks::FileBlocks(
   , m_storage(blockStorage.storage())
   , m_inode(inode)
   , m_treeRootBlockIsDirty(treeRootBlockIsDirty)
+  , m_leafMaxCount(format::BlockRangesLeafNode::maxCount(blockStorage.blockSize()))
+  , m_internalMaxCount(format::BlockRangesInternalNode::maxCount(blockStorage.blockSize()))
+  , m_treeVersion(0)
 {
   if (initializeInode)
   {
@@ -26,64 +43,140 @@ FileBlocks::FileBlocks(
     m_treeRootBlockIsDirty = false;
 }
 
-FileBlocks::OffsetAndSize const & FileBlocks::currentRange() const
+FileBlocks::OffsetAndSize const & FileBlocks::currentRange(Position const & position) const
 { 
-  F2F_ASSERT(m_position); // seek must have been called
-  return m_position->range;
+  F2F_ASSERT(position.m_isValid); // seek must have been called
+  return position.m_range;
 }
 
-void FileBlocks::moveToNextRange()
+void FileBlocks::moveToNextRange(Position & position) const
 {
-  F2F_ASSERT(m_position); // seek must have been called
+  F2F_ASSERT(position.m_isValid && position.m_treeVersion == m_treeVersion); // seek must have been called
 
-  if (m_position->indexInBlock < m_position->block.itemsCount)
-    ++m_position->indexInBlock;
+  if (position.m_indexInBlock < position.m_block->itemsCount)
+    ++position.m_indexInBlock;
 
-  if (m_position->indexInBlock == m_position->block.itemsCount
-    && m_position->block.nextLeafNode != format::BlockRangesLeafNode::NoNextLeaf)
+  if (position.m_indexInBlock == position.m_block->itemsCount
+    && position.m_block->nextLeafNode != format::BlockRangesLeafNode::NoNextLeaf)
     {
-      format::BlockRangesLeafNode leaf;
-      util::readT(m_storage, BlockAddress::fromBlockIndex(m_position->block.nextLeafNode), leaf);
-      m_position->block = leaf;
-      m_position->indexInBlock = 0;
+      uint64_t const nextLeafNode = position.m_block->nextLeafNode;
+      if (!takeNextLeaf(position, nextLeafNode))
+        util::readT(m_blockStorage, BlockAddress::fromBlockIndex(nextLeafNode), position.m_block);
+      position.m_indexInBlock = 0;
     }
 
-  if (!eof())
-    m_position->range = OffsetAndSize(
-      BlockAddress::fromBlockIndex(m_position->block.ranges[m_position->indexInBlock].blockIndex()),
-      m_position->block.ranges[m_position->indexInBlock].blocksCount);
+  if (!eof(position))
+    position.m_range = OffsetAndSize(
+      BlockAddress::fromBlockIndex(position.m_block->ranges[position.m_indexInBlock].blockIndex()),
+      position.m_block->ranges[position.m_indexInBlock].blocksCount);
 }
 
-bool FileBlocks::eof() const
+void FileBlocks::enumerateNextRanges(Position const & position, unsigned rangesCount,
+  std::function<void(OffsetAndSize const &)> const & visitor) const
 {
-  F2F_ASSERT(m_position); // seek must have been called
+  F2F_ASSERT(position.m_isValid && position.m_treeVersion == m_treeVersion); // seek must have been called
+
+  format::BlockRangesLeafNode const & block = *position.m_block;
+  unsigned index = position.m_indexInBlock + 1;
+  for(; rangesCount > 0 && index < block.itemsCount; --rangesCount, ++index)
+    visitor(OffsetAndSize(
+      BlockAddress::fromBlockIndex(block.ranges[index].blockIndex()),
+      block.ranges[index].blocksCount));
+  if (rangesCount > 0 && index >= block.itemsCount && block.nextLeafNode != format::BlockRangesLeafNode::NoNextLeaf)
+    loadNextLeaf(position, block.nextLeafNode);
+}
 
-  return m_position->indexInBlock == m_position->block.itemsCount;
+void FileBlocks::loadNextLeaf(Position const & position, uint64_t leafBlockIndex) const
+{
+  std::shared_ptr<Position::NextLeaf> const & current = position.m_nextLeaf;
+  if (current && current->blockIndex == leafBlockIndex && current->treeVersion == m_treeVersion)
+    return; // Already requested
+
+  std::shared_ptr<Position::NextLeaf> nextLeaf = std::make_shared<Position::NextLeaf>();
+  nextLeaf->blockIndex = leafBlockIndex;
+  nextLeaf->treeVersion = m_treeVersion;
+  nextLeaf->block.resize(m_blockStorage.blockSize());
+  nextLeaf->isLoaded = false;
+  nextLeaf->failed = false;
+  IStorage::ReadRequest const request = {
+    m_blockStorage.absoluteAddress(BlockAddress::fromBlockIndex(leafBlockIndex)),
+    nextLeaf->block.size(),
+    nextLeaf->block.data()};
+  try
+  {
+    m_storage.readBatchAsync(&request, 1, [nextLeaf](std::exception_ptr error)
+      {
+        std::lock_guard<std::mutex> lock(nextLeaf->mutex);
+        nextLeaf->isLoaded = true;
+        nextLeaf->failed = bool(error);
+        nextLeaf->loaded.notify_all();
+      });
+  }
+  catch (...)
+  {
+    // Leaf is read when position moves into it
+    return;
+  }
+  position.m_nextLeaf = std::move(nextLeaf);
 }
 
-void FileBlocks::seek(uint64_t blockIndex)
+bool FileBlocks::takeNextLeaf(Position & position, uint64_t leafBlockIndex) const
 {
-  if (m_position && m_position->block.ranges[0].fileOffset <= blockIndex 
-    && blockIndex < m_position->block.ranges[m_position->block.itemsCount - 1].fileOffset + m_position->block.ranges[m_position->block.itemsCount - 1].blocksCount)
+  std::shared_ptr<Position::NextLeaf> nextLeaf;
+  nextLeaf.swap(position.m_nextLeaf);
+  if (!nextLeaf || nextLeaf->blockIndex != leafBlockIndex || nextLeaf->treeVersion != m_treeVersion)
+    return false;
+
+  std::unique_lock<std::mutex> lock(nextLeaf->mutex);
+  nextLeaf->loaded.wait(lock, [&nextLeaf] { return nextLeaf->isLoaded; });
+  if (nextLeaf->failed)
+    return false; // Read again to report the error
+  // Copies of position may share the leaf, so it's copied rather than moved
+  memcpy(position.m_block.data(), nextLeaf->block.data(), nextLeaf->block.size());
+  return true;
+}
+
+bool FileBlocks::eof(Position const & position) const
+{
+  F2F_ASSERT(position.m_isValid); // seek must have been called
+
+  return position.m_indexInBlock == position.m_block->itemsCount;
+}
+
+void FileBlocks::seek(Position & position, uint64_t blockIndex) const
+{
+  format::BlockRangesLeafNode const & block = *position.m_block;
+  auto inBlock = [&block, blockIndex]()
   {
-    seekInNode(blockIndex, m_position->block.ranges, m_position->block.itemsCount);
+    return block.ranges[0].fileOffset <= blockIndex
+      && blockIndex < block.ranges[block.itemsCount - 1].fileOffset + block.ranges[block.itemsCount - 1].blocksCount;
+  };
+  bool const isValid = position.m_isValid && position.m_treeVersion == m_treeVersion;
+  // Sequential reads continue in the next leaf, which may be loaded in advance
+  if (isValid && !inBlock() && blockIndex > block.ranges[0].fileOffset
+    && block.nextLeafNode != format::BlockRangesLeafNode::NoNextLeaf)
+    takeNextLeaf(position, block.nextLeafNode);
+  if (isValid && inBlock())
+  {
+    seekInNode(position, blockIndex, block.ranges, block.itemsCount);
   }
   else
   {
+    position.m_isValid = false;
     if (m_inode.levelsCount > 0)
     {
-      seekInNode(m_inode.levelsCount, blockIndex, m_inode.indirectReferences.children, m_inode.indirectReferences.itemsCount);
+      seekInNode(position, m_inode.levelsCount, blockIndex, m_inode.indirectReferences.children, m_inode.indirectReferences.itemsCount);
     }
     else
     {
-      seekInNode(blockIndex, m_inode.directReferences.ranges, m_inode.directReferences.itemsCount);
+      seekInNode(position, blockIndex, m_inode.directReferences.ranges, m_inode.directReferences.itemsCount);
     }
   }
 }
 
-void FileBlocks::seekInNode(uint64_t keyBlockIndex, format::BlockRange const * ranges, unsigned itemsCount)
+void FileBlocks::seekInNode(Position & position, uint64_t keyBlockIndex, format::BlockRange const * ranges, unsigned itemsCount) const
 {
-  auto position = std::lower_bound(
+  auto range = std::lower_bound(
     ranges,
     ranges + itemsCount,
     keyBlockIndex,
@@ -91,31 +184,35 @@ void FileBlocks::seekInNode(uint64_t keyBlockIndex, format::BlockRange const * r
       return range.fileOffset < blockIndex;
     }
   );
-  if (position == ranges + itemsCount
-    || position->fileOffset > keyBlockIndex)
-    --position;
-  F2F_ASSERT(position->fileOffset <= keyBlockIndex && keyBlockIndex < position->fileOffset + position->blocksCount);
+  if (range == ranges + itemsCount
+    || range->fileOffset > keyBlockIndex)
+    --range;
+  F2F_ASSERT(range->fileOffset <= keyBlockIndex && keyBlockIndex < range->fileOffset + range->blocksCount);
 
-  if (!m_position || m_position->block.ranges != ranges)
+  if (!position.m_isValid)
   {
-    m_position = Position();
+    if (position.m_block.empty())
+      position.m_block.resize(m_blockStorage.blockSize());
     std::copy_n(
       ranges,
       itemsCount,
-      m_position->block.ranges
+      position.m_block->ranges
     );
-    m_position->block.itemsCount = itemsCount;
-    m_position->block.nextLeafNode = format::BlockRangesLeafNode::NoNextLeaf;
+    position.m_block->itemsCount = itemsCount;
+    position.m_block->nextLeafNode = format::BlockRangesLeafNode::NoNextLeaf;
+    position.m_treeVersion = m_treeVersion;
+    position.m_isValid = true;
   }
-  m_position->indexInBlock = position - ranges;
-  m_position->range = OffsetAndSize(
-    BlockAddress::fromBlockIndex(position->blockIndex() + (keyBlockIndex - position->fileOffset)),
-    position->blocksCount - (keyBlockIndex - position->fileOffset));
+  position.m_indexInBlock = unsigned(range - ranges);
+  position.m_range = OffsetAndSize(
+    BlockAddress::fromBlockIndex(range->blockIndex() + (keyBlockIndex - range->fileOffset)),
+    range->blocksCount - (keyBlockIndex - range->fileOffset));
 }
 
-void FileBlocks::seekInNode(unsigned levelsRemain, uint64_t keyBlockIndex, format::ChildNodeReference const * children, unsigned itemsCount)
+void FileBlocks::seekInNode(Position & position, unsigned levelsRemain, uint64_t keyBlockIndex,
+  format::ChildNodeReference const * children, unsigned itemsCount) const
 {
-  auto position = std::lower_bound(
+  auto child = std::lower_bound(
     children + 1,
     children + itemsCount,
     keyBlockIndex,
@@ -124,27 +221,27 @@ void FileBlocks::seekInNode(unsigned levelsRemain, uint64_t keyBlockIndex, forma
       return range.fileOffset < blockIndex;
     }
   );
-  if (position == children + itemsCount || position->fileOffset != keyBlockIndex)
-    --position;
-  seekTree(levelsRemain - 1, keyBlockIndex, BlockAddress::fromBlockIndex(position->childBlockIndex));
+  if (child == children + itemsCount || child->fileOffset != keyBlockIndex)
+    --child;
+  seekTree(position, levelsRemain - 1, keyBlockIndex, BlockAddress::fromBlockIndex(child->childBlockIndex));
 }
 
-void FileBlocks::seekTree(unsigned levelsRemain, uint64_t keyBlockIndex, BlockAddress nodeBlock) 
+void FileBlocks::seekTree(Position & position, unsigned levelsRemain, uint64_t keyBlockIndex, BlockAddress nodeBlock) const
 {
   if (levelsRemain == 0)
   {
-    format::BlockRangesLeafNode leaf;
-    util::readT(m_storage, nodeBlock, leaf);
+    LeafNode leaf(m_blockStorage.blockSize());
+    util::readT(m_blockStorage, nodeBlock, leaf);
 
-    seekInNode(keyBlockIndex, leaf.ranges, leaf.itemsCount);
-    m_position->block.nextLeafNode = leaf.nextLeafNode;
+    seekInNode(position, keyBlockIndex, leaf->ranges, leaf->itemsCount);
+    position.m_block->nextLeafNode = leaf->nextLeafNode;
   }
   else
   {
-    format::BlockRangesInternalNode internal;
-    util::readT(m_storage, nodeBlock, internal);
+    InternalNode internal(m_blockStorage.blockSize());
+    util::readT(m_blockStorage, nodeBlock, internal);
 
-    seekInNode(levelsRemain, keyBlockIndex, internal.children, internal.itemsCount);
+    seekInNode(position, levelsRemain, keyBlockIndex, internal->children, internal->itemsCount);
   }
 }
 
@@ -187,27 +284,28 @@ void FileBlocks::append(uint64_t numBlocks)
 
   if (m_inode.levelsCount > 0)
   {
-    format::BlockRangesInternalNode node;
+    InternalNode node(m_blockStorage.blockSize());
     appendRootT<RootReferencesTraitsIndirect>(numBlocks, node);
   }
   else
   {
-    format::BlockRangesLeafNode leaf;
-    leaf.nextLeafNode = leaf.NoNextLeaf;
+    LeafNode leaf(m_blockStorage.blockSize());
+    leaf->nextLeafNode = format::BlockRangesLeafNode::NoNextLeaf;
     appendRootT<RootReferencesTraitsDirect>(numBlocks, leaf);
   }
 
-  m_position.reset();
+  ++m_treeVersion;
 }
 
 template<class Traits>
-void FileBlocks::appendRootT(uint64_t numBlocks, typename Traits::NodeType & node_container)
+void FileBlocks::appendRootT(uint64_t numBlocks, util::BlockBuffer<typename Traits::NodeType> & node_buffer)
 {
   // Make in-memory BlockRangesNode pseudo-record for direct/indirect references "inlined" in inode, then
   // copy values back to inode if inode storage size is enough or create another "standalone" leaf node for them
   // otherwise
   
   auto & inode_container = Traits::getInodeContainer(m_inode);
+  auto & node_container = *node_buffer;
 
   node_container.itemsCount = inode_container.itemsCount;
   std::copy_n(
@@ -224,7 +322,7 @@ void FileBlocks::appendRootT(uint64_t numBlocks, typename Traits::NodeType & nod
     {
       // Move inode references to separate tree node
       BlockAddress newNode = m_blockStorage.allocateBlock();
-      util::writeT(m_storage, newNode, node_container);
+      util::writeT(m_blockStorage, newNode, node_buffer);
 
       format::ChildNodeReference newChildReference;
       newChildReference.childBlockIndex = newNode.index();
@@ -310,7 +408,7 @@ std::vector<format::ChildNodeReference> FileBlocks::appendToTreeNode(
 
   // Fill remaining free places in this block
   for (; newBlocksStart != newBlockRanges.end()
-    && node.itemsCount < node.MaxCount;
+    && node.itemsCount < m_leafMaxCount;
     ++newBlocksStart, ++node.itemsCount)
   {
     auto & item = node.ranges[node.itemsCount];
@@ -326,7 +424,7 @@ std::vector<format::ChildNodeReference> FileBlocks::appendToTreeNode(
   if (newBlocksStart != newBlockRanges.end())
   {
     unsigned blocksToAllocate =
-      util::FloorDiv(newBlockRanges.end() - newBlocksStart, format::BlockRangesLeafNode::MaxCount);
+      util::FloorDiv(newBlockRanges.end() - newBlocksStart, m_leafMaxCount);
     std::vector<BlockAddress> newLeafs;
     m_blockStorage.allocateBlocks(blocksToAllocate, [&newLeafs](BlockAddress block) {
       newLeafs.push_back(block);
@@ -341,16 +439,17 @@ std::vector<format::ChildNodeReference> FileBlocks::appendToTreeNode(
       newSiblingReferences.back().childBlockIndex = newLeafIndex.index();
       newSiblingReferences.back().fileOffset = positonInFile;
 
-      format::BlockRangesLeafNode newLeaf;
+      LeafNode newLeafBuffer(m_blockStorage.blockSize());
+      format::BlockRangesLeafNode & newLeaf = *newLeafBuffer;
 
       // Init leaf forward reference
       if (newLeafIndexIt + 1 != newLeafs.end())
         newLeaf.nextLeafNode = (newLeafIndexIt + 1)->index();
       else
-        newLeaf.nextLeafNode = newLeaf.NoNextLeaf;
+        newLeaf.nextLeafNode = format::BlockRangesLeafNode::NoNextLeaf;
 
       for (newLeaf.itemsCount = 0;
-        newLeaf.itemsCount < newLeaf.MaxCount
+        newLeaf.itemsCount < m_leafMaxCount
         && newBlocksStart != newBlockRanges.end();
         ++newLeaf.itemsCount, ++newBlocksStart)
       {
@@ -360,7 +459,7 @@ std::vector<format::ChildNodeReference> FileBlocks::appendToTreeNode(
         item.fileOffset = positonInFile;
         positonInFile += item.blocksCount;
       }
-      util::writeT(m_storage, newLeafIndex, newLeaf);
+      util::writeT(m_blockStorage, newLeafIndex, newLeafBuffer);
     }
   }
   return newSiblingReferences;
@@ -377,7 +476,7 @@ std::vector<format::ChildNodeReference> FileBlocks::appendToTreeNode(
 
   // Fill remaining free places in this block
   for (; newChildrenStart != newChildrenReferences.end()
-    && node.itemsCount < node.MaxCount;
+    && node.itemsCount < m_internalMaxCount;
     ++newChildrenStart, ++node.itemsCount)
   {
     node.children[node.itemsCount] = *newChildrenStart;
@@ -398,7 +497,7 @@ std::vector<format::ChildNodeReference> FileBlocks::createInternalNodes(
   std::vector<format::ChildNodeReference> newSiblingReferences;
   
   unsigned blocksToAllocate =
-    util::FloorDiv(newChildrenEnd - newChildrenStart, format::BlockRangesInternalNode::MaxCount);
+    util::FloorDiv(newChildrenEnd - newChildrenStart, m_internalMaxCount);
   std::vector<BlockAddress> newNodes;
   m_blockStorage.allocateBlocks(blocksToAllocate, [&newNodes](BlockAddress block) {
     newNodes.push_back(block);
@@ -410,15 +509,16 @@ std::vector<format::ChildNodeReference> FileBlocks::createInternalNodes(
     newSiblingReferences.back().childBlockIndex = newNodeIndex.index();
     newSiblingReferences.back().fileOffset = newChildrenStart->fileOffset;
 
-    format::BlockRangesInternalNode newInternal;
+    InternalNode newInternalBuffer(m_blockStorage.blockSize());
+    format::BlockRangesInternalNode & newInternal = *newInternalBuffer;
     for (newInternal.itemsCount = 0;
-      newInternal.itemsCount < newInternal.MaxCount
+      newInternal.itemsCount < m_internalMaxCount
       && newChildrenStart != newChildrenEnd;
       ++newInternal.itemsCount, ++newChildrenStart)
     {
       newInternal.children[newInternal.itemsCount] = *newChildrenStart;
     }
-    util::writeT(m_storage, newNodeIndex, newInternal);
+    util::writeT(m_blockStorage, newNodeIndex, newInternalBuffer);
   }
   return newSiblingReferences;
 }
@@ -429,25 +529,26 @@ std::vector<format::ChildNodeReference> FileBlocks::appendToTree(unsigned levels
   bool isDirty = false;
   if (levelsRemain == 0)
   {
-    format::BlockRangesLeafNode leaf;
-    util::readT(m_storage, nodeBlock, leaf);
-    result = appendToTreeNode(levelsRemain, numBlocks, leaf, isDirty);
+    LeafNode leaf(m_blockStorage.blockSize());
+    util::readT(m_blockStorage, nodeBlock, leaf);
+    result = appendToTreeNode(levelsRemain, numBlocks, *leaf, isDirty);
     if (isDirty)
-      util::writeT(m_storage, nodeBlock, leaf);
+      util::writeT(m_blockStorage, nodeBlock, leaf);
   }
   else
   {
-    format::BlockRangesInternalNode internal;
-    util::readT(m_storage, nodeBlock, internal);
-    result = appendToTreeNode(levelsRemain, numBlocks, internal, isDirty);
+    InternalNode internal(m_blockStorage.blockSize());
+    util::readT(m_blockStorage, nodeBlock, internal);
+    result = appendToTreeNode(levelsRemain, numBlocks, *internal, isDirty);
     if (isDirty)
-      util::writeT(m_storage, nodeBlock, internal);
+      util::writeT(m_blockStorage, nodeBlock, internal);
   }
   
   return result;
 }
 
-void FileBlocks::truncateTreeNode(uint64_t newSizeInBlocks, format::BlockRange * ranges, uint16_t & itemsCount, bool & isDirty)
+void FileBlocks::truncateTreeNode(uint64_t newSizeInBlocks, format::BlockRange * ranges, uint16_t & itemsCount, bool & isDirty,
+  ReleasedExtents & releasedExtents)
 {
   for(; itemsCount > 0; --itemsCount)
   {
@@ -455,7 +556,7 @@ void FileBlocks::truncateTreeNode(uint64_t newSizeInBlocks, format::BlockRange *
 
     if (range.fileOffset >= newSizeInBlocks)
     {
-      m_blockStorage.releaseBlocks(BlockAddress::fromBlockIndex(range.blockIndex()), range.blocksCount);
+      releasedExtents.emplace_back(BlockAddress::fromBlockIndex(range.blockIndex()), range.blocksCount);
       isDirty = true;
     }
     else
@@ -463,7 +564,7 @@ void FileBlocks::truncateTreeNode(uint64_t newSizeInBlocks, format::BlockRange *
       if (range.fileOffset + range.blocksCount > newSizeInBlocks)
       {
         uint16_t newBlocksCount = static_cast<uint16_t>(newSizeInBlocks - range.fileOffset);
-        m_blockStorage.releaseBlocks(BlockAddress::fromBlockIndex(range.blockIndex() + newBlocksCount), 
+        releasedExtents.emplace_back(BlockAddress::fromBlockIndex(range.blockIndex() + newBlocksCount), 
           range.blocksCount - newBlocksCount);
         range.blocksCount = newBlocksCount;
         isDirty = true;
@@ -479,7 +580,8 @@ void FileBlocks::truncateTreeNode(
   format::ChildNodeReference const * children, 
   uint16_t & itemsCount, 
   bool & isDirty, 
-  OnNewRootFunc const & onNewRoot)
+  OnNewRootFunc const & onNewRoot,
+  ReleasedExtents & releasedExtents)
 {
   for (; itemsCount > 0; --itemsCount)
   {
@@ -487,7 +589,8 @@ void FileBlocks::truncateTreeNode(
         levelsRemain - 1,
         newSizeInBlocks, 
         BlockAddress::fromBlockIndex(children[itemsCount - 1].childBlockIndex),
-        itemsCount == 1 ? onNewRoot : OnNewRootFunc())
+        itemsCount == 1 ? onNewRoot : OnNewRootFunc(),
+        releasedExtents)
       )
       break;
     isDirty = true;
@@ -495,17 +598,19 @@ void FileBlocks::truncateTreeNode(
 }
 
 // Return true if node was deleted or its reference moved to root
-bool FileBlocks::truncateTree(unsigned levelsRemain, uint64_t newSizeInBlocks, BlockAddress nodeBlock, OnNewRootFunc const & onNewRoot)
+bool FileBlocks::truncateTree(unsigned levelsRemain, uint64_t newSizeInBlocks, BlockAddress nodeBlock, OnNewRootFunc const & onNewRoot,
+  ReleasedExtents & releasedExtents)
 {
   bool isDirty = false;
   if (levelsRemain == 0)
   {
-    format::BlockRangesLeafNode leaf;
-    util::readT(m_storage, nodeBlock, leaf);
-    truncateTreeNode(newSizeInBlocks, leaf.ranges, leaf.itemsCount, isDirty);
+    LeafNode leafBuffer(m_blockStorage.blockSize());
+    format::BlockRangesLeafNode & leaf = *leafBuffer;
+    util::readT(m_blockStorage, nodeBlock, leafBuffer);
+    truncateTreeNode(newSizeInBlocks, leaf.ranges, leaf.itemsCount, isDirty, releasedExtents);
     if (leaf.itemsCount == 0)
     {
-      m_blockStorage.releaseBlocks(nodeBlock, 1);
+      releasedExtents.emplace_back(nodeBlock, 1);
       return true;
     }
     else if (leaf.nextLeafNode != format::BlockRangesLeafNode::NoNextLeaf)
@@ -518,7 +623,7 @@ bool FileBlocks::truncateTree(unsigned levelsRemain, uint64_t newSizeInBlocks, B
     {
       if (onNewRoot(nodeBlock, levelsRemain, &leaf, nullptr))
       {
-        m_blockStorage.releaseBlocks(nodeBlock, 1);
+        releasedExtents.emplace_back(nodeBlock, 1);
         return true;
       }
       else
@@ -526,17 +631,18 @@ bool FileBlocks::truncateTree(unsigned levelsRemain, uint64_t newSizeInBlocks, B
         returnValue = true;
     }
     if (isDirty)
-      util::writeT(m_storage, nodeBlock, leaf);
+      util::writeT(m_blockStorage, nodeBlock, leafBuffer);
     return returnValue;
   }
   else
   {
-    format::BlockRangesInternalNode internal;
-    util::readT(m_storage, nodeBlock, internal);
-    truncateTreeNode(levelsRemain, newSizeInBlocks, internal.children, internal.itemsCount, isDirty, onNewRoot);
+    InternalNode internalBuffer(m_blockStorage.blockSize());
+    format::BlockRangesInternalNode & internal = *internalBuffer;
+    util::readT(m_blockStorage, nodeBlock, internalBuffer);
+    truncateTreeNode(levelsRemain, newSizeInBlocks, internal.children, internal.itemsCount, isDirty, onNewRoot, releasedExtents);
     if (internal.itemsCount == 0)
     {
-      m_blockStorage.releaseBlocks(nodeBlock, 1);
+      releasedExtents.emplace_back(nodeBlock, 1);
       return true;
     }
     bool returnValue = false;
@@ -544,7 +650,7 @@ bool FileBlocks::truncateTree(unsigned levelsRemain, uint64_t newSizeInBlocks, B
     {
       if (onNewRoot(nodeBlock, levelsRemain, nullptr, &internal))
       {
-        m_blockStorage.releaseBlocks(nodeBlock, 1);
+        releasedExtents.emplace_back(nodeBlock, 1);
         return true;
       }
       else
@@ -552,17 +658,19 @@ bool FileBlocks::truncateTree(unsigned levelsRemain, uint64_t newSizeInBlocks, B
         returnValue = true;
     }
     if (isDirty)
-      util::writeT(m_storage, nodeBlock, internal);
+      util::writeT(m_blockStorage, nodeBlock, internalBuffer);
     return returnValue;
   }
 }
 
 void FileBlocks::truncate(uint64_t newSizeInBlocks)
 {
+  ReleasedExtents releasedExtents;
   if (m_inode.levelsCount > 0)
   {
-    boost::optional<format::BlockRangesLeafNode> newLeafContent;
-    boost::optional<format::BlockRangesInternalNode> newInternalContent;
+    // New root fitting in inode is copied to inode-sized container, as nodes have size of block
+    boost::optional<format::FileInode::DirectReferences> newLeafContent;
+    boost::optional<format::FileInode::IndirectReferences> newInternalContent;
     boost::optional<BlockAddress> newRootIndex;
     unsigned newLevel;
     truncateTreeNode(
@@ -578,12 +686,16 @@ void FileBlocks::truncate(uint64_t newSizeInBlocks)
       {
         if (leaf && leaf->itemsCount <= format::FileInode::DirectReferences::MaxCount)
         {
-          newLeafContent = *leaf;
+          newLeafContent.emplace();
+          newLeafContent->itemsCount = leaf->itemsCount;
+          std::copy_n(leaf->ranges, leaf->itemsCount, newLeafContent->ranges);
           return true; // release original node
         }
         else if (internal && internal->itemsCount <= format::FileInode::IndirectReferences::MaxCount)
         {
-          newInternalContent = *internal;
+          newInternalContent.emplace();
+          newInternalContent->itemsCount = internal->itemsCount;
+          std::copy_n(internal->children, internal->itemsCount, newInternalContent->children);
           newLevel = level;
           return true; // release original node
         }
@@ -593,7 +705,8 @@ void FileBlocks::truncate(uint64_t newSizeInBlocks)
           newLevel = level;
           return false;
         }
-      }
+      },
+      releasedExtents
     );
     if (newRootIndex)
     {
@@ -606,23 +719,13 @@ void FileBlocks::truncate(uint64_t newSizeInBlocks)
     else if (newLeafContent)
     {
       m_inode.levelsCount = 0;
-      m_inode.directReferences.itemsCount = newLeafContent->itemsCount;
-      std::copy_n(
-        newLeafContent->ranges,
-        newLeafContent->itemsCount,
-        m_inode.directReferences.ranges
-      );
+      m_inode.directReferences = *newLeafContent;
       m_treeRootBlockIsDirty = true;
     }
     else if (newInternalContent)
     {
       m_inode.levelsCount = newLevel;
-      m_inode.indirectReferences.itemsCount = newInternalContent->itemsCount;
-      std::copy_n(
-        newInternalContent->children,
-        newInternalContent->itemsCount,
-        m_inode.indirectReferences.children
-      );
+      m_inode.indirectReferences = *newInternalContent;
       m_treeRootBlockIsDirty = true;
     }
   }
@@ -632,10 +735,50 @@ void FileBlocks::truncate(uint64_t newSizeInBlocks)
       newSizeInBlocks,
       m_inode.directReferences.ranges,
       m_inode.directReferences.itemsCount,
-      m_treeRootBlockIsDirty);
+      m_treeRootBlockIsDirty,
+      releasedExtents);
   }
+  m_blockStorage.releaseExtents(releasedExtents);
 
-  m_position.reset();
+  ++m_treeVersion;
+}
+
+void FileBlocks::enumerateAllBlocks(std::function<void(BlockAddress, unsigned)> const & visitor) const
+{
+  if (m_inode.levelsCount > 0)
+  {
+    for (unsigned i = 0; i < m_inode.indirectReferences.itemsCount; ++i)
+      enumerateTreeBlocks(m_inode.levelsCount - 1,
+        BlockAddress::fromBlockIndex(m_inode.indirectReferences.children[i].childBlockIndex), visitor);
+  }
+  else
+  {
+    for (unsigned i = 0; i < m_inode.directReferences.itemsCount; ++i)
+      visitor(BlockAddress::fromBlockIndex(m_inode.directReferences.ranges[i].blockIndex()),
+        m_inode.directReferences.ranges[i].blocksCount);
+  }
+}
+
+void FileBlocks::enumerateTreeBlocks(unsigned levelsRemain, BlockAddress nodeBlock,
+  std::function<void(BlockAddress, unsigned)> const & visitor) const
+{
+  if (levelsRemain == 0)
+  {
+    LeafNode leaf(m_blockStorage.blockSize());
+    util::readT(m_blockStorage, nodeBlock, leaf);
+    F2F_FORMAT_ASSERT(leaf->itemsCount <= m_leafMaxCount);
+    for (unsigned i = 0; i < leaf->itemsCount; ++i)
+      visitor(BlockAddress::fromBlockIndex(leaf->ranges[i].blockIndex()), leaf->ranges[i].blocksCount);
+  }
+  else
+  {
+    InternalNode internal(m_blockStorage.blockSize());
+    util::readT(m_blockStorage, nodeBlock, internal);
+    F2F_FORMAT_ASSERT(internal->itemsCount <= m_internalMaxCount);
+    for (unsigned i = 0; i < internal->itemsCount; ++i)
+      enumerateTreeBlocks(levelsRemain - 1, BlockAddress::fromBlockIndex(internal->children[i].childBlockIndex), visitor);
+  }
+  visitor(nodeBlock, 1);
 }
 
 void FileBlocks::check() const
@@ -652,7 +795,7 @@ void FileBlocks::check() const
     || *state.lastNextLeafNodeReference == format::BlockRangesLeafNode::NoNextLeaf);
 
   F2F_FORMAT_ASSERT(m_inode.blocksCount == state.filePosition);
-  F2F_FORMAT_ASSERT(util::FloorDiv(m_inode.fileSize, format::AddressableBlockSize) == m_inode.blocksCount);
+  F2F_FORMAT_ASSERT(m_blockStorage.fileBlocksCount(m_inode.fileSize) == m_inode.blocksCount);
 }
 
 void FileBlocks::checkTree(unsigned levelsRemain, BlockAddress nodeBlock, CheckState & state) const
@@ -662,23 +805,23 @@ void FileBlocks::checkTree(unsigned levelsRemain, BlockAddress nodeBlock, CheckS
 
   if (levelsRemain == 0)
   {
-    format::BlockRangesLeafNode leaf;
-    util::readT(m_storage, nodeBlock, leaf);
+    LeafNode leaf(m_blockStorage.blockSize());
+    util::readT(m_blockStorage, nodeBlock, leaf);
 
     if (state.lastNextLeafNodeReference)
       F2F_FORMAT_ASSERT(nodeBlock.index() == *state.lastNextLeafNodeReference);
-    state.lastNextLeafNodeReference = leaf.nextLeafNode;
+    state.lastNextLeafNodeReference = leaf->nextLeafNode;
 
-    F2F_FORMAT_ASSERT(leaf.itemsCount > 0 && leaf.itemsCount <= leaf.MaxCount);
-    checkTreeNode(leaf.ranges, leaf.itemsCount, state);
+    F2F_FORMAT_ASSERT(leaf->itemsCount > 0 && leaf->itemsCount <= m_leafMaxCount);
+    checkTreeNode(leaf->ranges, leaf->itemsCount, state);
   }
   else
   {
-    format::BlockRangesInternalNode internal;
-    util::readT(m_storage, nodeBlock, internal);
+    InternalNode internal(m_blockStorage.blockSize());
+    util::readT(m_blockStorage, nodeBlock, internal);
 
-    F2F_FORMAT_ASSERT(internal.itemsCount > 0 && internal.itemsCount <= internal.MaxCount);
-    checkTreeNode(levelsRemain, internal.children, internal.itemsCount, state);
+    F2F_FORMAT_ASSERT(internal->itemsCount > 0 && internal->itemsCount <= m_internalMaxCount);
+    checkTreeNode(levelsRemain, internal->children, internal->itemsCount, state);
   }
 }
 
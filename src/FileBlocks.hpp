@@ -1,10 +1,12 @@
 #pragma once
 
 #include <cstdint>
+#include <memory>
 #include <vector>
 #include <set>
 #include "format/Inode.hpp"
 #include "BlockStorage.hpp"
+#include "util/BlockBuffer.hpp"
 
 namespace f2f
 {
@@ -19,12 +21,42 @@ public:
     bool & m_treeRootBlockIsDirty,
     bool initializeInode = false);
 
-  bool eof() const;
-  void seek(uint64_t blockIndex);
-  void moveToNextRange();
-  OffsetAndSize const & currentRange() const;
+  // Position in block ranges. Lookups don't modify the tree, so readers having own positions
+  // look up ranges concurrently. Position is invalidated by append() and truncate()
+  class Position
+  {
+  public:
+    Position()
+      : m_isValid(false)
+    {}
+
+  private:
+    friend class FileBlocks;
+
+    OffsetAndSize m_range;
+    util::BlockBuffer<format::BlockRangesLeafNode> m_block; // Allocated on first seek
+    unsigned m_indexInBlock;
+    uint64_t m_treeVersion;
+    bool m_isValid;
+    // Leaf following m_block, read asynchronously when enumeration reaches end of m_block. It's shared
+    // with storage callback, so that position may be destroyed while the read is in flight
+    struct NextLeaf;
+    mutable std::shared_ptr<NextLeaf> m_nextLeaf;
+  };
+
+  bool eof(Position const &) const;
+  void seek(Position &, uint64_t blockIndex) const;
+  void moveToNextRange(Position &) const;
+  OffsetAndSize const & currentRange(Position const &) const;
+  // Enumerates up to rangesCount ranges following current one without moving current position.
+  // Enumeration stops at the end of current leaf node, then next leaf node starts loading in
+  // background and moveToNextRange waits for it instead of reading it
+  void enumerateNextRanges(Position const &, unsigned rangesCount,
+    std::function<void(OffsetAndSize const &)> const & visitor) const;
   void append(uint64_t numBlocks);
   void truncate(uint64_t newSizeInBlocks);
+  // Enumerates data ranges and tree nodes without modifying the tree
+  void enumerateAllBlocks(std::function<void(BlockAddress, unsigned)> const & visitor) const;
 
   // Diagnostics
   void check() const;
@@ -34,29 +66,38 @@ private:
   IStorage & m_storage;
   bool & m_treeRootBlockIsDirty;
   format::FileInode & m_inode;
+  // Tree nodes fill whole block, so their capacity depends on block size
+  typedef util::BlockBuffer<format::BlockRangesLeafNode> LeafNode;
+  typedef util::BlockBuffer<format::BlockRangesInternalNode> InternalNode;
+  unsigned const m_leafMaxCount;
+  unsigned const m_internalMaxCount;
 
-  struct Position
-  {
-    OffsetAndSize range;
-    format::BlockRangesLeafNode block;
-    unsigned indexInBlock;
-  };
-  boost::optional<Position> m_position;
+  uint64_t m_treeVersion; // Incremented on each modification of the tree
 
-  void seekTree(unsigned levelsRemain, uint64_t blockIndex, BlockAddress nodeBlock);
-  void seekInNode(uint64_t keyBlockIndex, format::BlockRange const * ranges, unsigned itemsCount);
-  void seekInNode(unsigned levelsRemain, uint64_t keyBlockIndex, format::ChildNodeReference const * children, unsigned itemsCount);
+  void loadNextLeaf(Position const &, uint64_t leafBlockIndex) const;
+  bool takeNextLeaf(Position &, uint64_t leafBlockIndex) const; // False if leaf isn't loaded in advance
+  void seekTree(Position &, unsigned levelsRemain, uint64_t blockIndex, BlockAddress nodeBlock) const;
+  void seekInNode(Position &, uint64_t keyBlockIndex, format::BlockRange const * ranges, unsigned itemsCount) const;
+  void seekInNode(Position &, unsigned levelsRemain, uint64_t keyBlockIndex,
+    format::ChildNodeReference const * children, unsigned itemsCount) const;
   std::vector<format::ChildNodeReference> appendToTree(unsigned levelsRemain, uint64_t numBlocks, BlockAddress nodeBlock);
   std::vector<format::ChildNodeReference> appendToTreeNode(unsigned levelsRemain, uint64_t numBlocks, format::BlockRangesLeafNode &, bool & isDirty);
   std::vector<format::ChildNodeReference> appendToTreeNode(unsigned levelsRemain, uint64_t numBlocks, format::BlockRangesInternalNode &, bool & isDirty);
-  template<class Traits> void appendRootT(uint64_t numBlocks, typename Traits::NodeType &);
+  template<class Traits> void appendRootT(uint64_t numBlocks, util::BlockBuffer<typename Traits::NodeType> &);
   std::vector<format::ChildNodeReference> createInternalNodes(format::ChildNodeReference const * newChildrenStart, format::ChildNodeReference const * newChildrenEnd);
   typedef std::function<bool (BlockAddress, unsigned, format::BlockRangesLeafNode const *, format::BlockRangesInternalNode const *)> OnNewRootFunc;
-  bool truncateTree(unsigned levelsRemain, uint64_t newSizeInBlocks, BlockAddress nodeBlock, OnNewRootFunc const & onNewRoot);
-  void truncateTreeNode(uint64_t newSizeInBlocks, format::BlockRange * ranges, uint16_t & itemsCount, bool & isDirty);
+  // Released blocks are collected to releasedExtents and freed at once after truncation
+  typedef std::vector<BlockStorage::Extent> ReleasedExtents;
+  bool truncateTree(unsigned levelsRemain, uint64_t newSizeInBlocks, BlockAddress nodeBlock, OnNewRootFunc const & onNewRoot,
+    ReleasedExtents & releasedExtents);
+  void truncateTreeNode(uint64_t newSizeInBlocks, format::BlockRange * ranges, uint16_t & itemsCount, bool & isDirty,
+    ReleasedExtents & releasedExtents);
   void truncateTreeNode(unsigned levelsRemain, uint64_t newSizeInBlocks, format::ChildNodeReference const * children, 
     uint16_t & itemsCount, bool & isDirty, 
-    OnNewRootFunc const & onNewRoot);
+    OnNewRootFunc const & onNewRoot, ReleasedExtents & releasedExtents);
+
+  void enumerateTreeBlocks(unsigned levelsRemain, BlockAddress nodeBlock,
+    std::function<void(BlockAddress, unsigned)> const & visitor) const;
 
   struct CheckState
   {
@@ -1,4 +1,6 @@
 #include "FileDescriptorImpl.hpp"
+#include "FileSystemImpl.hpp"
+#include "FileViewImpl.hpp"
 #include "f2f/FileSystemError.hpp"
 
 namespace f2f
@@ -54,7 +56,10 @@ FileDescriptor & FileDescriptor::operator=(FileDescriptor && src)
 
 bool FileDescriptor::isOpen() const
 {
-  return m_impl != nullptr && m_impl->ptr->isOpen();
+  if (!m_impl)
+    return false;
+  std::lock_guard<std::mutex> lock(m_impl->ptr->mutex());
+  return m_impl->ptr->isOpen();
 }
 
 void FileDescriptor::close()
@@ -74,52 +79,221 @@ inline void ThrowNotOpened()
   throw FileSystemError(ErrorCode::OperationRequiresOpenedFile, "File isn't opened");
 }
 
-void FileDescriptor::seek(uint64_t position)
+// Descriptor is null if FileDescriptor object is empty
+inline std::unique_lock<std::mutex> LockOpenedFile(FileDescriptorImpl * descriptor)
 {
-  if (!isOpen())
+  if (!descriptor)
+    ThrowNotOpened();
+  std::unique_lock<std::mutex> lock(descriptor->mutex());
+  if (!descriptor->isOpen())
     ThrowNotOpened();
+  return lock;
+}
 
-  m_impl->ptr->file()->seek(position);
+void FileDescriptor::seek(uint64_t position)
+{
+  auto lock = LockOpenedFile(m_impl ? m_impl->ptr.get() : nullptr);
+
+  m_impl->ptr->cursor().position = position;
 }
 
 uint64_t FileDescriptor::position() const
 {
-  if (!isOpen())
-    ThrowNotOpened();
+  auto lock = LockOpenedFile(m_impl ? m_impl->ptr.get() : nullptr);
 
-  return m_impl->ptr->file()->position();
+  return m_impl->ptr->cursor().position;
 }
 
 void FileDescriptor::read(size_t & inOutSize, void * buffer)
 {
-  if (!isOpen())
-    ThrowNotOpened();
+  auto lock = LockOpenedFile(m_impl ? m_impl->ptr.get() : nullptr);
 
-  m_impl->ptr->file()->read(inOutSize, buffer);
+  m_impl->ptr->file()->read(m_impl->ptr->cursor(), inOutSize, buffer);
 }
 
 void FileDescriptor::write(size_t size, void const * buffer)
 {
-  if (!isOpen())
-    ThrowNotOpened();
+  auto lock = LockOpenedFile(m_impl ? m_impl->ptr.get() : nullptr);
 
-  m_impl->ptr->file()->write(size, buffer);
+  m_impl->ptr->file()->write(m_impl->ptr->cursor(), size, buffer);
 }
 
 void FileDescriptor::truncate()
 {
-  if(!isOpen())
-    ThrowNotOpened();
+  auto lock = LockOpenedFile(m_impl ? m_impl->ptr.get() : nullptr);
+
+  m_impl->ptr->file()->truncate(m_impl->ptr->cursor().position);
+}
+
+void FileDescriptor::readAt(uint64_t position, size_t & inOutSize, void * buffer)
+{
+  auto lock = LockOpenedFile(m_impl ? m_impl->ptr.get() : nullptr);
 
-  m_impl->ptr->file()->truncate();
+  m_impl->ptr->file()->readAt(position, inOutSize, buffer);
+}
+
+void FileDescriptor::writeAt(uint64_t position, size_t size, void const * buffer)
+{
+  auto lock = LockOpenedFile(m_impl ? m_impl->ptr.get() : nullptr);
+
+  m_impl->ptr->file()->writeAt(position, size, buffer);
+}
+
+namespace
+{
+  // References kept by asynchronous operation. Completion callback may be copied by the file and
+  // storage, so the copies share them and they are moved out on completion: no copy keeps
+  // descriptor opened after the caller is notified
+  struct PendingOperation
+  {
+    std::shared_ptr<FileSystemImpl> owner;
+    std::shared_ptr<FileDescriptorImpl> descriptor;
+  };
+
+  // Operation is counted before the call returns, so descriptor may be closed right after it.
+  // Pending operation keeps file and owner of descriptor from release
+  std::shared_ptr<PendingOperation> BeginOperation(std::shared_ptr<FileDescriptorImpl> const & descriptor)
+  {
+    auto lock = LockOpenedFile(descriptor.get());
+    descriptor->beginOperation();
+    return std::make_shared<PendingOperation>(PendingOperation{ descriptor->owner(), descriptor });
+  }
+
+  // Operation is ended if the task can't be posted
+  void PostOperation(PendingOperation & operation, std::function<void()> && task)
+  {
+    try
+    {
+      operation.owner->post(std::move(task));
+    }
+    catch (...)
+    {
+      operation.descriptor->endOperation();
+      throw;
+    }
+  }
+
+  // Storage may report completion on its own thread, so references that may keep file system
+  // alive are moved to task posted to the thread pool. Descriptor is released before completion,
+  // so that caller sees file closed if it closed own descriptor
+  void PostCompletion(PendingOperation & operation, std::function<void()> && complete)
+  {
+    FileSystemImpl & pool = *operation.owner;
+    pool.post([owner = std::move(operation.owner), descriptor = std::move(operation.descriptor),
+      complete = std::move(complete)]() mutable
+    {
+      descriptor->endOperation();
+      descriptor.reset();
+      complete();
+    });
+  }
+
+  // Called if operation wasn't started, its completion callback isn't called then
+  void AbortOperation(PendingOperation & operation)
+  {
+    operation.descriptor->endOperation();
+    operation.descriptor.reset();
+    operation.owner.reset();
+  }
+}
+
+void FileDescriptor::readAsync(uint64_t position, size_t size, void * buffer, OnReadComplete const & onComplete)
+{
+  auto operation = BeginOperation(m_impl ? m_impl->ptr : nullptr);
+  // Ranges are found on the thread pool, then storage reads data without occupying it.
+  // Pending operation keeps descriptor opened until it's completed
+  PostOperation(*operation, [operation, position, size, buffer, onComplete]
+  {
+    try
+    {
+      operation->descriptor->file()->readAtAsync(position, size, buffer,
+        [operation, onComplete](size_t readSize, std::exception_ptr error)
+        {
+          PostCompletion(*operation, [onComplete, readSize, error]{
+            onComplete(readSize, error);
+          });
+        });
+    }
+    catch (...)
+    {
+      AbortOperation(*operation);
+      onComplete(0, std::current_exception());
+    }
+  });
+}
+
+void FileDescriptor::writeAsync(uint64_t position, size_t size, void const * buffer, OnComplete const & onComplete)
+{
+  auto operation = BeginOperation(m_impl ? m_impl->ptr : nullptr);
+  PostOperation(*operation, [operation, position, size, buffer, onComplete]
+  {
+    try
+    {
+      operation->descriptor->file()->writeAtAsync(position, size, buffer,
+        [operation, onComplete](std::exception_ptr error)
+        {
+          PostCompletion(*operation, [onComplete, error]{
+            onComplete(error);
+          });
+        });
+    }
+    catch (...)
+    {
+      AbortOperation(*operation);
+      onComplete(std::current_exception());
+    }
+  });
+}
+
+std::future<size_t> FileDescriptor::readAsync(uint64_t position, size_t size, void * buffer)
+{
+  auto promise = std::make_shared<std::promise<size_t>>();
+  readAsync(position, size, buffer, [promise](size_t readSize, std::exception_ptr error)
+  {
+    if (error)
+      promise->set_exception(error);
+    else
+      promise->set_value(readSize);
+  });
+  return promise->get_future();
+}
+
+std::future<void> FileDescriptor::writeAsync(uint64_t position, size_t size, void const * buffer)
+{
+  auto promise = std::make_shared<std::promise<void>>();
+  writeAsync(position, size, buffer, [promise](std::exception_ptr error)
+  {
+    if (error)
+      promise->set_exception(error);
+    else
+      promise->set_value();
+  });
+  return promise->get_future();
 }
 
 uint64_t FileDescriptor::size() const
 {
-  if (!isOpen())
-    ThrowNotOpened();
+  auto lock = LockOpenedFile(m_impl ? m_impl->ptr.get() : nullptr);
 
   return m_impl->ptr->file()->size();
 }
 
+FileView FileDescriptor::map(uint64_t offset, size_t length) const
+{
+  if (!m_impl)
+    ThrowNotOpened();
+  // View pins descriptor, so it isn't released until the view is destroyed
+  std::unique_ptr<FileView::Impl> view(new FileView::Impl(m_impl->ptr));
+  auto lock = LockOpenedFile(m_impl->ptr.get());
+  IStorage const & storage = m_impl->ptr->file()->storage();
+  m_impl->ptr->file()->enumerateRanges(offset, length,
+    [&view, &storage](uint64_t position, unsigned size) {
+      void const * data = storage.map(position, size);
+      if (!data)
+        throw FileSystemError(ErrorCode::OperationNotSupportedByStorage, "Storage doesn't support mapping");
+      view->append(data, size);
+    });
+  return FileViewFactory::create(std::move(view));
+}
+
 }
\ No newline at end of file
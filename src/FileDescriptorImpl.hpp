@@ -2,6 +2,7 @@
 
 #include <memory>
 #include <functional>
+#include <mutex>
 #include "f2f/FileDescriptor.hpp"
 #include "File.hpp"
 
@@ -10,15 +11,22 @@ namespace f2f
 
 class FileSystemImpl;
 
+// Copies of descriptor may be used from different threads, operations on the file are
+// serialized by mutex(). file(), cursor(), owner(), isOpen(), isPinned() and beginOperation()
+// require it to be locked.
+// File object is shared with other descriptors of the same file, cursor is own
 class FileDescriptorImpl
 {
 public:
   typedef std::function<void()> OnCloseFunc_t;
 
-  FileDescriptorImpl(std::unique_ptr<File> && file, std::shared_ptr<FileSystemImpl> const & owner, OnCloseFunc_t const & onClose)
-    : m_file(std::move(file))
+  FileDescriptorImpl(std::shared_ptr<File> const & file, std::shared_ptr<FileSystemImpl> const & owner, OnCloseFunc_t const & onClose)
+    : m_file(file)
     , m_owner(owner)
     , m_onClose(onClose)
+    , m_isClosed(false)
+    , m_pinCount(0)
+    , m_pendingOperations(0)
   {}
 
   ~FileDescriptorImpl()
@@ -31,29 +39,78 @@ public:
     {}
   }
 
+  std::mutex & mutex() { return m_mutex; }
+
   bool isOpen() const
   {
-    return bool(m_file);
+    return !m_isClosed && bool(m_file);
   }
 
   void close()
   {
-    m_file.reset();
-    if (m_onClose)
-    {
-      m_onClose();
-      m_onClose = OnCloseFunc_t();
-    }
-    m_owner.reset();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_isClosed = true;
+    if (m_pinCount == 0 && m_pendingOperations == 0)
+      release();
   }
 
   File * file() { return m_file.get(); }
+  File::Cursor & cursor() { return m_cursor; }
+  std::shared_ptr<FileSystemImpl> const & owner() const { return m_owner; }
+
+  // File contents stay in place while descriptor is pinned: actual closing is postponed 
+  // until last pin is removed
+  void pin() 
+  { 
+    std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_pinCount; 
+    if (m_file)
+      m_file->pin();
+  }
+  void unpin()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // File isn't released while pinned, so it's the same file that was pinned
+    if (m_file)
+      m_file->unpin();
+    if (--m_pinCount == 0 && m_pendingOperations == 0 && m_isClosed)
+      release();
+  }
+  bool isPinned() const { return m_pinCount > 0; }
+
+  // Asynchronous operation postpones actual closing too, as its storage transfer may be still
+  // in flight. File keeps the transferred range from truncation itself
+  void beginOperation() { ++m_pendingOperations; }
+  void endOperation()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (--m_pendingOperations == 0 && m_pinCount == 0 && m_isClosed)
+      release();
+  }
 
 private:
-  std::unique_ptr<File> m_file;
+  std::shared_ptr<File> m_file;
+  File::Cursor m_cursor;
   std::shared_ptr<FileSystemImpl> m_owner;
 
+  std::mutex m_mutex;
   OnCloseFunc_t m_onClose;
+  bool m_isClosed;
+  unsigned m_pinCount;
+  unsigned m_pendingOperations;
+
+  void release()
+  {
+    if (!m_file)
+      return; // Already released
+    m_file.reset();
+    if (m_onClose)
+    {
+      m_onClose();
+      m_onClose = OnCloseFunc_t();
+    }
+    m_owner.reset();
+  }
 };
 
 class FileDescriptor::Impl
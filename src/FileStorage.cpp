@@ -1,7 +1,18 @@
 #include "f2f/FileStorage.hpp"
 #include <fstream>
+#include <mutex>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include "f2f/FileSystemError.hpp"
+
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
 
 namespace f2f
 {
@@ -27,22 +38,30 @@ public:
     m_size = m_stream.tellg();
   }
 
-  uint64_t size() const override { return m_size; }
+  uint64_t size() const override
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_size;
+  }
 
+  // Stream position is shared, so all accesses are serialized
   void read(uint64_t position, size_t size, void * data) const override
   {
+    std::lock_guard<std::mutex> lock(m_mutex);
     m_stream.seekg(position);
     m_stream.read(reinterpret_cast<char *>(data),size);
   }
 
   void write(uint64_t position, size_t size, void const * data) override
   {
+    std::lock_guard<std::mutex> lock(m_mutex);
     m_stream.seekp(position);
     m_stream.write(reinterpret_cast<const char *>(data), size);
   }
 
   void resize(uint64_t size) override
   {
+    std::lock_guard<std::mutex> lock(m_mutex);
     if (size > m_size)
     {
       m_stream.seekp(size - 1);
@@ -61,13 +80,14 @@ public:
 private:
   fs::path const m_fileName;
   OpenMode const m_openMode;
+  mutable std::mutex m_mutex;
   mutable fs::fstream m_stream;
   uint64_t m_size;
 
   void open()
   {
     std::ios_base::openmode openmode = std::ios_base::binary | std::ios_base::in;
-    if (m_openMode == OpenMode::ReadWrite)
+    if (m_openMode != OpenMode::ReadOnly)
     {
       openmode |= std::ios_base::out;
       if (!fs::exists(m_fileName))
@@ -77,14 +97,171 @@ private:
   }
 };
 
+#ifndef _WIN32
+// Read-only storage with positional reads: there is no shared file position, so reads
+// from different threads don't need synchronization
+class ReadOnlyFileStorage: public IStorage
+{
+public:
+  explicit ReadOnlyFileStorage(fs::path const & fileName)
+    : m_fd(::open(fileName.c_str(), O_RDONLY))
+  {
+    if (m_fd < 0)
+      throw fs::filesystem_error("Can't open storage file", fileName, 
+        boost::system::error_code(errno, boost::system::system_category()));
+    struct stat st;
+    if (::fstat(m_fd, &st) != 0)
+    {
+      int const error = errno;
+      ::close(m_fd);
+      throw fs::filesystem_error("Can't get size of storage file", fileName, 
+        boost::system::error_code(error, boost::system::system_category()));
+    }
+    m_size = uint64_t(st.st_size);
+  }
+
+  ~ReadOnlyFileStorage()
+  {
+    ::close(m_fd);
+  }
+
+  uint64_t size() const override { return m_size; }
+
+  void read(uint64_t position, size_t size, void * data) const override
+  {
+    char * buffer = static_cast<char *>(data);
+    while (size > 0)
+    {
+      ssize_t const bytesRead = ::pread(m_fd, buffer, size, off_t(position));
+      if (bytesRead < 0 && errno == EINTR)
+        continue;
+      if (bytesRead <= 0)
+        throw FileSystemError(ErrorCode::InvalidStorageFormat, "Can't read from storage file");
+      buffer += bytesRead;
+      position += bytesRead;
+      size -= size_t(bytesRead);
+    }
+  }
+
+  // Kernel starts loading all ranges but the first one while it is read
+  void readBatch(ReadRequest const * requests, size_t count) const override
+  {
+    for(size_t i = 1; i < count; ++i)
+      prefetch(requests[i].position, requests[i].size);
+    IStorage::readBatch(requests, count);
+  }
+
+  void write(uint64_t, size_t, void const *) override
+  {
+    throw FileSystemError(ErrorCode::OperationRequiresWriteAccess, "Storage is opened in read-only mode");
+  }
+
+  void resize(uint64_t) override
+  {
+    throw FileSystemError(ErrorCode::OperationRequiresWriteAccess, "Storage is opened in read-only mode");
+  }
+
+  void prefetch(uint64_t position, size_t size) const override
+  {
+#ifdef POSIX_FADV_WILLNEED
+    ::posix_fadvise(m_fd, off_t(position), off_t(size), POSIX_FADV_WILLNEED);
+#endif
+  }
+
+private:
+  int const m_fd;
+  uint64_t m_size;
+};
+#endif
+
+// Read-only storage with contents mapped to memory. Allows zero-copy reads (see IStorage::map).
+// Mapping doesn't change, so no synchronization is needed
+class MappedFileStorage: public IStorage
+{
+public:
+  explicit MappedFileStorage(fs::path const & fileName)
+    : m_size(fs::file_size(fileName))
+  {
+    if (m_size > 0)
+    {
+      m_mapping = boost::interprocess::file_mapping(fileName.string().c_str(), boost::interprocess::read_only);
+      m_region = boost::interprocess::mapped_region(m_mapping, boost::interprocess::read_only);
+    }
+  }
+
+  uint64_t size() const override { return m_size; }
+
+  void read(uint64_t position, size_t size, void * data) const override
+  {
+    memcpy(data, map(position, size), size);
+  }
+
+  void write(uint64_t, size_t, void const *) override
+  {
+    throw FileSystemError(ErrorCode::OperationRequiresWriteAccess, "Mapped file storage is read-only");
+  }
+
+  void resize(uint64_t) override
+  {
+    throw FileSystemError(ErrorCode::OperationRequiresWriteAccess, "Mapped file storage is read-only");
+  }
+
+  void const * map(uint64_t position, size_t size) const override
+  {
+    if (position > m_size || size > m_size - position)
+      throw FileSystemError(ErrorCode::InvalidStorageFormat, "Access beyond the end of mapped storage");
+    return static_cast<char const *>(m_region.get_address()) + position;
+  }
+
+  void prefetch(uint64_t position, size_t size) const override
+  {
+#ifndef _WIN32
+    if (position >= m_size || size == 0)
+      return;
+    size = size_t(std::min(uint64_t(size), m_size - position));
+    uint64_t const pageSize = boost::interprocess::mapped_region::get_page_size();
+    uint64_t const alignedPosition = position - position % pageSize;
+    char * address = static_cast<char *>(m_region.get_address()) + alignedPosition;
+    madvise(address, size_t(position + size - alignedPosition), MADV_WILLNEED);
+#endif
+  }
+
+private:
+  uint64_t const m_size;
+  boost::interprocess::file_mapping m_mapping;
+  boost::interprocess::mapped_region m_region;
+};
+
+std::unique_ptr<IStorage> OpenMappedFileStorage(const char * fileName)
+{
+  return std::unique_ptr<IStorage>(new MappedFileStorage(fileName));
+}
+
+std::unique_ptr<IStorage> OpenMappedFileStorage(const wchar_t * fileName)
+{
+  return std::unique_ptr<IStorage>(new MappedFileStorage(fileName));
+}
+
+namespace
+{
+  std::unique_ptr<IStorage> OpenStorageFile(fs::path const & fileName, OpenMode openMode)
+  {
+#ifndef _WIN32
+    if (openMode == OpenMode::ReadOnly)
+      return std::unique_ptr<IStorage>(new ReadOnlyFileStorage(fileName));
+#endif
+    return std::unique_ptr<IStorage>(new FileStorage(fileName, openMode));
+  }
+}
+
 std::unique_ptr<IStorage> OpenFileStorage(const char * fileName, OpenMode openMode)
 {
-  return std::unique_ptr<IStorage>(new FileStorage(fileName, openMode));
+  return OpenStorageFile(fs::path(fileName), openMode);
 }
 
 std::unique_ptr<IStorage> OpenFileStorage(const wchar_t * fileName,OpenMode openMode)
 {
-  return std::unique_ptr<IStorage>(new FileStorage(fileName,openMode));
+  return OpenStorageFile(fs::path(fileName), openMode);
 }
 
 }
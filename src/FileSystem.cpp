@@ -1,8 +1,11 @@
 #include "FileSystemImpl.hpp"
 #include "Directory.hpp"
+#include "DirectoryHandleImpl.hpp"
 #include "DirectoryIteratorImpl.hpp"
 #include "File.hpp"
 #include "util/Assert.hpp"
+#include "util/FloorDiv.hpp"
+#include "util/PathTokenizer.hpp"
 
 namespace f2f
 {
@@ -12,12 +15,63 @@ static_assert(MaxFileName <= format::MaxFileNameSize, "");
 namespace
 {
   const BlockAddress RootDirectoryAddress = BlockAddress::fromBlockIndex(0);
+  const size_t DirectoryEntryCacheSize = 16384;
+  // Larger files are released by FileSystem::reclaim()
+  const uint64_t LazyRemovalFileSize = 1024 * format::AddressableBlockSize;
 
-  inline void CheckFileNameSize(std::string const & name)
+  inline void CheckFileNameSize(boost::string_ref name)
   {
     if (name.size() > MaxFileName)
       throw FileSystemError(ErrorCode::FileNameExceedsLimit, "Name of file exceeds size limit");
   }
+
+  // Block size is stored as power of two relative to minimal one
+  inline unsigned BlockSizeLog2(uint32_t blockSize)
+  {
+    for(unsigned log2 = 0; log2 <= format::MaxBlockSizeLog2; ++log2)
+      if (blockSize == format::AddressableBlockSize << log2)
+        return log2;
+    throw FileSystemError(ErrorCode::InvalidArgument, "Block size must be power of two from 1 KB to 64 KB");
+  }
+
+  inline boost::string_ref ToStringRef(PathRef path)
+  {
+    return boost::string_ref(path.data(), path.size());
+  }
+
+  // Collects blocks of removed files and directories and releases them
+  // in batches, each occupancy block is updated once per batch
+  class ReleasedBlocks
+  {
+  public:
+    explicit ReleasedBlocks(BlockStorage & blockStorage)
+      : m_blockStorage(blockStorage)
+    {}
+
+    void add(BlockAddress blockAddress, unsigned blocksCount)
+    {
+      m_extents.emplace_back(blockAddress, blocksCount);
+      if (m_extents.size() >= MaxExtentsCount)
+        flush();
+    }
+
+    void flush()
+    {
+      m_blockStorage.releaseExtents(m_extents);
+      m_extents.clear();
+    }
+
+  private:
+    static const size_t MaxExtentsCount = 65536;
+
+    BlockStorage & m_blockStorage;
+    std::vector<BlockStorage::Extent> m_extents;
+  };
+
+  inline bool IsSpecialName(boost::string_ref name)
+  {
+    return name == "." || name == "..";
+  }
 }
 
 FileSystem::FileSystem(std::unique_ptr<IStorage> && storage, bool format, OpenMode openMode)
@@ -26,6 +80,17 @@ FileSystem::FileSystem(std::unique_ptr<IStorage> && storage, bool format, OpenMo
   m_impl->ptr = std::make_shared<FileSystemImpl>(std::move(storage), format, openMode);
 }
 
+FileSystem::FileSystem(std::unique_ptr<IStorage> && storage, FormatOptions const & formatOptions)
+  : m_impl(nullptr)
+{
+  unsigned const blockSizeLog2 = BlockSizeLog2(formatOptions.blockSize);
+  if (formatOptions.alignedLayout && formatOptions.blockSize % format::StorageHeader::AlignedHeaderSize != 0)
+    throw FileSystemError(ErrorCode::InvalidArgument, "Aligned layout requires block size of 4 KB or more");
+  m_impl = new Impl;
+  m_impl->ptr = std::make_shared<FileSystemImpl>(std::move(storage), true, OpenMode::ReadWrite, blockSizeLog2,
+    formatOptions.alignedLayout);
+}
+
 FileSystem::~FileSystem()
 {
   delete m_impl;
@@ -36,99 +101,337 @@ OpenMode FileSystem::openMode() const
   return m_impl->ptr->m_openMode;
 }
 
-FileDescriptor FileSystem::open(const char * pathStr, OpenMode openMode, bool createIfRW)
+FileDescriptor FileSystem::open(PathRef path, OpenMode openMode, bool createIfRW)
 {
-  if (openMode == OpenMode::ReadWrite)
-    m_impl->ptr->requiresReadWriteMode();
-
   // Always treat relative path as relative to root
-  fs::path path = fs::path(pathStr).relative_path();
-
-  if (path.empty())
-    return {};
+  return m_impl->ptr->open(nullptr, ToStringRef(path), openMode, createIfRW);
+}
 
-  boost::optional<std::pair<BlockAddress, FileType>> parentDirectory = m_impl->ptr->searchFile(path.parent_path());
-  if (!parentDirectory || parentDirectory->second != FileType::Directory)
-    return {};
+FileDescriptor FileSystem::open(PathRef path) const
+{
+  return const_cast<FileSystem *>(this)->open(path, f2f::OpenMode::ReadOnly);
+}
 
-  Directory directory(m_impl->ptr->m_blockStorage, parentDirectory->first); // create option requires r/w
-  // TODO: file name encoding
-  std::string fileName = path.filename().generic_string();
-  CheckFileNameSize(fileName);
-  boost::optional<std::pair<BlockAddress, FileType>> directoryItem =
-    directory.searchFile(fileName);
-  if (directoryItem)
+void FileSystem::openAsync(PathRef path, OpenMode openMode, bool createIfRW, OnOpenComplete const & onComplete)
+{
+  std::shared_ptr<FileSystemImpl> const impl = m_impl->ptr;
+  impl->post([impl, path = ToStringRef(path).to_string(), openMode, createIfRW, onComplete]
   {
-    if (directoryItem->second == FileType::Directory)
-      // Path is to directory
-      return {};
-    else
-      return m_impl->ptr->openFile(directoryItem->first, openMode);
-  }
-  else // not found
+    FileDescriptor file;
+    std::exception_ptr error;
+    try
+    {
+      file = impl->open(nullptr, path, openMode, createIfRW);
+    }
+    catch (...)
+    {
+      error = std::current_exception();
+    }
+    onComplete(std::move(file), error);
+  });
+}
+
+void FileSystem::removeAsync(PathRef path, OnComplete const & onComplete)
+{
+  std::shared_ptr<FileSystemImpl> const impl = m_impl->ptr;
+  impl->post([impl, path = ToStringRef(path).to_string(), onComplete]
   {
-    if (openMode == OpenMode::ReadWrite && createIfRW)
+    std::exception_ptr error;
+    try
     {
-      std::unique_ptr<File> file(new File(m_impl->ptr->m_blockStorage));
-      directory.addFile(file->inodeAddress(), FileType::Regular, fileName);
-      m_impl->ptr->directoryModified(directory.inodeAddress());
-      return m_impl->ptr->openFile(file->inodeAddress(), openMode, std::move(file));
+      impl->remove(nullptr, path);
     }
+    catch (...)
+    {
+      error = std::current_exception();
+    }
+    onComplete(error);
+  });
+}
+
+std::future<FileDescriptor> FileSystem::openAsync(PathRef path, OpenMode openMode, bool createIfRW)
+{
+  auto promise = std::make_shared<std::promise<FileDescriptor>>();
+  openAsync(path, openMode, createIfRW, [promise](FileDescriptor file, std::exception_ptr error)
+  {
+    if (error)
+      promise->set_exception(error);
     else
-      // File not found
-      return {};
+      promise->set_value(std::move(file));
+  });
+  return promise->get_future();
+}
+
+std::future<void> FileSystem::removeAsync(PathRef path)
+{
+  auto promise = std::make_shared<std::promise<void>>();
+  removeAsync(path, [promise](std::exception_ptr error)
+  {
+    if (error)
+      promise->set_exception(error);
+    else
+      promise->set_value();
+  });
+  return promise->get_future();
+}
+
+FileType FileSystem::fileType(PathRef path) const
+{
+  return m_impl->ptr->fileType(nullptr, ToStringRef(path));
+}
+
+bool FileSystem::exists(PathRef path) const
+{
+  return fileType(path) != FileType::NotFound;
+}
+
+void FileSystem::createDirectory(PathRef path)
+{
+  m_impl->ptr->createDirectory(nullptr, ToStringRef(path));
+}
+
+void FileSystem::createFiles(PathRef directoryPath, std::vector<std::string> const & names)
+{
+  m_impl->ptr->createFiles(nullptr, ToStringRef(directoryPath), names);
+}
+
+void FileSystem::remove(PathRef path)
+{
+  m_impl->ptr->remove(nullptr, ToStringRef(path));
+}
+
+void FileSystem::rename(PathRef from, PathRef to)
+{
+  m_impl->ptr->rename(nullptr, ToStringRef(from), ToStringRef(to));
+}
+
+DirectoryHandle FileSystem::openDirectory(PathRef path) const
+{
+  return DirectoryHandleFactory::create(
+    m_impl->ptr->openDirectory(nullptr, ToStringRef(path)), m_impl->ptr);
+}
+
+DirectoryIterator FileSystem::directoryIterator(PathRef path) const
+{
+  return m_impl->ptr->directoryIterator(path, nullptr);
+}
+
+DirectoryIterator FileSystem::directoryIterator(PathRef path, std::string const & resumeToken) const
+{
+  return m_impl->ptr->directoryIterator(path, &resumeToken);
+}
+
+void FileSystem::upgradeDirectories()
+{
+  m_impl->ptr->upgradeDirectories();
+}
+
+bool FileSystem::reclaim(uint64_t blocksBudget)
+{
+  return m_impl->ptr->reclaim(blocksBudget);
+}
+
+void FileSystem::reclaimInBackground(uint64_t stepBlocksBudget)
+{
+  m_impl->ptr->reclaimInBackground(stepBlocksBudget);
+}
+
+void FileSystem::check()
+{
+  m_impl->ptr->check();
+}
+
+FileSystemImpl::FileSystemImpl(std::unique_ptr<IStorage> && storage, bool format, OpenMode openMode,
+    unsigned blockSizeLog2, bool alignedLayout)
+  : m_storage(std::move(storage))
+  , m_blockStorage(*m_storage, format, blockSizeLog2, alignedLayout)
+  , m_orphanList(m_blockStorage)
+  , m_openMode(openMode)
+  , m_directoryEntryCache(DirectoryEntryCacheSize)
+  , m_readOnlyFilesSweepSize(ReadOnlyFilesMinSweepSize)
+  , m_reclaimStepBlocks(0)
+  , m_reclaimIsPosted(false)
+{
+  if (format)
+  {
+    Directory root(m_blockStorage, Directory::NoParentDirectory, Directory::create_tag());
+    F2F_ASSERT(root.inodeAddress() == RootDirectoryAddress);
   }
 }
 
-FileDescriptor FileSystem::open(const char * path) const
+FileSystemImpl::SharedMutex & FileSystemImpl::directoryMutex(BlockAddress const & inodeAddress)
 {
-  return const_cast<FileSystem *>(this)->open(path, f2f::OpenMode::ReadOnly);
+  return m_directoryMutexes[inodeAddress.index() % DirectoryMutexesCount];
 }
 
-FileType FileSystem::fileType(const char * pathStr) const
+FileSystemImpl::SharedLock FileSystemImpl::sharedLock(SharedMutex & mutex)
 {
-  fs::path path = fs::path(pathStr).relative_path();
+  if (m_openMode == OpenMode::ReadOnly)
+    return SharedLock(mutex, std::defer_lock);
+  return SharedLock(mutex);
+}
 
-  if (path.empty())
-    return FileType::Directory; // Root directory
+std::unique_lock<std::mutex> FileSystemImpl::lockCache()
+{
+  if (m_openMode == OpenMode::ReadOnly)
+    return std::unique_lock<std::mutex>(m_mutex, std::try_to_lock);
+  return std::unique_lock<std::mutex>(m_mutex);
+}
 
-  boost::optional<std::pair<BlockAddress, FileType>> file = m_impl->ptr->searchFile(path);
-  if (!file)
-    return FileType::NotFound;
+void FileSystemImpl::post(std::function<void()> && task)
+{
+  std::call_once(m_threadPoolStarted, [this]{
+    m_threadPool.reset(new util::ThreadPool(std::max(2u, std::thread::hardware_concurrency())));
+  });
+  m_threadPool->post(std::move(task));
+}
 
-  return file->second;
+void FileSystemImpl::requiresReadWriteMode()
+{
+  if (m_openMode == OpenMode::ReadOnly)
+    throw FileSystemError(ErrorCode::OperationRequiresWriteAccess, 
+      "Operation can't be performed: storage is opened in read-only mode");
 }
 
-bool FileSystem::exists(const char * path) const
+BlockAddress FileSystemImpl::baseDirectoryAddress(OpenedDirectory const * baseDirectory)
 {
-  return fileType(path) != FileType::NotFound;
+  if (!baseDirectory)
+    return RootDirectoryAddress;
+  if (baseDirectory->isRemoved)
+    throw FileSystemError(ErrorCode::PathNotFound, "Directory was removed");
+  return baseDirectory->directory.inodeAddress();
 }
 
-void FileSystem::createDirectory(const char * pathStr)
+boost::optional<BlockAddress> FileSystemImpl::searchParentDirectory(
+  BlockAddress const & baseDirectoryAddress, boost::string_ref path, boost::string_ref & fileName)
 {
-  m_impl->ptr->requiresReadWriteMode();
+  util::PathTokenizer tokenizer(path);
+  // Absolute path is resolved from root
+  BlockAddress currentDirectoryAddress = tokenizer.isAbsolute() ? RootDirectoryAddress : baseDirectoryAddress;
+  fileName.clear();
 
-  fs::path path = fs::path(pathStr).relative_path();
+  boost::string_ref name;
+  if (!tokenizer.next(name))
+    return currentDirectoryAddress;
 
-  if (path.empty())
-    return; // Root directory already exists - ok
+  for (boost::string_ref nextName; tokenizer.next(nextName); name = nextName)
+  {
+    // TODO: file name encoding
+    CheckFileNameSize(name);
+    boost::optional<std::pair<BlockAddress, FileType>> directoryItem =
+      searchInDirectory(currentDirectoryAddress, name);
+
+    if (!directoryItem || directoryItem->second != FileType::Directory)
+      // Not found or regular file in the middle of the path
+      return {};
+
+    currentDirectoryAddress = directoryItem->first;
+  }
+  fileName = name;
+  return currentDirectoryAddress;
+}
 
-  boost::optional<std::pair<BlockAddress,FileType>> parentDirectory = m_impl->ptr->searchFile(path.parent_path());
-  if (!parentDirectory || parentDirectory->second != FileType::Directory)
+boost::optional<std::pair<BlockAddress, FileType>> FileSystemImpl::searchFile(
+  BlockAddress const & baseDirectoryAddress, boost::string_ref path)
+{
+  boost::string_ref fileName;
+  boost::optional<BlockAddress> parentDirectory = searchParentDirectory(baseDirectoryAddress, path, fileName);
+  if (!parentDirectory)
+    return {};
+  if (fileName.empty())
+    return std::make_pair(*parentDirectory, FileType::Directory);
+
+  CheckFileNameSize(fileName);
+  return searchInDirectory(*parentDirectory, fileName);
+}
+
+FileDescriptor FileSystemImpl::open(
+  OpenedDirectory const * baseDirectory, boost::string_ref path, OpenMode openMode, bool createIfRW)
+{
+  if (openMode != OpenMode::ReadOnly)
+    requiresReadWriteMode();
+
+  SharedLock namespaceLock = sharedLock(m_namespaceMutex);
+  boost::string_ref fileName;
+  boost::optional<BlockAddress> parentDirectory = 
+    searchParentDirectory(baseDirectoryAddress(baseDirectory), path, fileName);
+  if (!parentDirectory || fileName.empty() || IsSpecialName(fileName))
+    // Not found or path is to directory
+    return {};
+
+  // TODO: file name encoding
+  CheckFileNameSize(fileName);
+  {
+    // Descriptor is registered while directory is locked, so that concurrent remove() sees it
+    SharedLock directoryLock = sharedLock(directoryMutex(*parentDirectory));
+    boost::optional<std::pair<BlockAddress, FileType>> directoryItem =
+      searchInLockedDirectory(*parentDirectory, fileName);
+    if (directoryItem)
+    {
+      if (directoryItem->second == FileType::Directory)
+        // Path is to directory
+        return {};
+      else
+        return openFile(directoryItem->first, openMode);
+    }
+  }
+
+  if (openMode == OpenMode::ReadOnly || !createIfRW)
+    // File not found
+    return {};
+
+  ExclusiveLock directoryLock(directoryMutex(*parentDirectory));
+  DirectoryHolder holder;
+  Directory & directory = this->directory(*parentDirectory, holder);
+  // File could be created after the directory was unlocked
+  if (boost::optional<std::pair<BlockAddress, FileType>> directoryItem = directory.searchFile(fileName))
+  {
+    if (directoryItem->second == FileType::Directory)
+      return {};
+    else
+      return openFile(directoryItem->first, openMode);
+  }
+  auto file = std::make_shared<File>(m_blockStorage, openMode);
+  directory.addFile(file->inodeAddress(), FileType::Regular, fileName);
+  directoryModified(directory.inodeAddress(), fileName);
+  return openFile(file->inodeAddress(), openMode, std::move(file));
+}
+
+FileType FileSystemImpl::fileType(OpenedDirectory const * baseDirectory, boost::string_ref path)
+{
+  SharedLock namespaceLock = sharedLock(m_namespaceMutex);
+  boost::optional<std::pair<BlockAddress, FileType>> file = searchFile(baseDirectoryAddress(baseDirectory), path);
+  if (!file)
+    return FileType::NotFound;
+
+  return file->second;
+}
+
+void FileSystemImpl::createDirectory(OpenedDirectory const * baseDirectory, boost::string_ref path)
+{
+  requiresReadWriteMode();
+
+  SharedLock namespaceLock(m_namespaceMutex);
+  boost::string_ref fileName;
+  boost::optional<BlockAddress> parentDirectory = 
+    searchParentDirectory(baseDirectoryAddress(baseDirectory), path, fileName);
+  if (!parentDirectory)
     throw FileSystemError(ErrorCode::PathNotFound, "Can't find path to the directory");
 
-  std::string fileName = path.filename().generic_string();
-  if (fileName == ".." || fileName == ".")
-    return; 
+  if (fileName.empty() || IsSpecialName(fileName))
+    return; // Directory already exists - ok
 
   CheckFileNameSize(fileName);
 
-  Directory newDirectory(m_impl->ptr->m_blockStorage, parentDirectory->first, Directory::create_tag());
-  Directory directory(m_impl->ptr->m_blockStorage, parentDirectory->first); 
+  // New directory isn't reachable until it's added to parent, so it doesn't need lock
+  Directory newDirectory(m_blockStorage, *parentDirectory, Directory::create_tag());
+  ExclusiveLock directoryLock(directoryMutex(*parentDirectory));
+  DirectoryHolder holder;
+  Directory & directory = this->directory(*parentDirectory, holder);
   try
   {
     directory.addFile(newDirectory.inodeAddress(), FileType::Directory, fileName);
-    m_impl->ptr->directoryModified(directory.inodeAddress());
+    directoryModified(directory.inodeAddress(), fileName);
   }
   catch (Directory::FileExistsError const & e)
   {
@@ -138,97 +441,481 @@ void FileSystem::createDirectory(const char * pathStr)
   }
 }
 
-void FileSystem::remove(const char * pathStr)
+void FileSystemImpl::createFiles(OpenedDirectory const * baseDirectory, boost::string_ref path,
+  std::vector<std::string> const & names)
+{
+  requiresReadWriteMode();
+
+  SharedLock namespaceLock(m_namespaceMutex);
+  boost::optional<std::pair<BlockAddress, FileType>> target = searchFile(baseDirectoryAddress(baseDirectory), path);
+  if (!target || target->second != FileType::Directory)
+    throw FileSystemError(ErrorCode::PathNotFound, "Can't find directory to create files in");
+
+  for(auto const & name: names)
+  {
+    if (name.empty() || IsSpecialName(name)
+      || std::any_of(name.begin(), name.end(), &util::PathTokenizer::isSeparator))
+      throw FileSystemError(ErrorCode::PathNotFound, "File name must be a single path component");
+    CheckFileNameSize(name);
+  }
+
+  std::vector<BlockAddress> const inodes = File::createEmptyFiles(m_blockStorage, names.size());
+  ExclusiveLock directoryLock(directoryMutex(target->first));
+  try
+  {
+    std::vector<Directory::NewFile> files;
+    files.reserve(names.size());
+    for(size_t i = 0; i < names.size(); ++i)
+      files.push_back(Directory::NewFile{inodes[i], FileType::Regular, names[i]});
+    DirectoryHolder holder;
+    directory(target->first, holder).addFiles(files);
+  }
+  catch (Directory::FileExistsError const &)
+  {
+    File::removeEmptyFiles(m_blockStorage, inodes);
+    throw FileSystemError(ErrorCode::FileExists, "Can't create files. File with same name already exists");
+  }
+  catch (...)
+  {
+    File::removeEmptyFiles(m_blockStorage, inodes);
+    throw;
+  }
+  for(auto const & name: names)
+    directoryModified(target->first, name);
+}
+
+void FileSystemImpl::remove(OpenedDirectory const * baseDirectory, boost::string_ref path)
 {
-  m_impl->ptr->requiresReadWriteMode();
+  requiresReadWriteMode();
 
-  fs::path const path = fs::path(pathStr).relative_path();
+  {
+    SharedLock namespaceLock(m_namespaceMutex);
+    if (removeEntry(baseDirectoryAddress(baseDirectory), path, false))
+      return;
+  }
+  // Path is to directory
+  ExclusiveLock namespaceLock(m_namespaceMutex);
+  removeEntry(baseDirectoryAddress(baseDirectory), path, true);
+}
 
+// Returns false if path is to directory and namespace isn't locked exclusively
+bool FileSystemImpl::removeEntry(BlockAddress const & baseDirectoryAddress, boost::string_ref path, 
+  bool namespaceIsExclusive)
+{
   // Check that all elements of path are valid
-  boost::optional<std::pair<BlockAddress, FileType>> target = m_impl->ptr->searchFile(path);
+  boost::optional<std::pair<BlockAddress, FileType>> target = searchFile(baseDirectoryAddress, path);
   if (!target)
     throw FileSystemError(ErrorCode::PathNotFound, "Can't find path to remove");
 
   // Simplify path
-  std::vector<std::string> names;
-  for(auto pathElement: path)
+  util::PathTokenizer tokenizer(path);
+  BlockAddress currentDirectoryAddress = tokenizer.isAbsolute() ? RootDirectoryAddress : baseDirectoryAddress;
+  std::vector<boost::string_ref> names;
+  for (boost::string_ref name; tokenizer.next(name); )
   {
-    if (pathElement.generic_string() == ".")
-      continue;
-    if (pathElement.generic_string() == "..")
+    if (name == "..")
     {
       if (!names.empty())
         names.pop_back();
+      else
+        // Leading '..' goes above base directory
+        currentDirectoryAddress = searchInDirectory(currentDirectoryAddress, name)->first;
     }
     else
-    {
-      names.push_back(pathElement.generic_string());
-      CheckFileNameSize(names.back());
-    }
+      names.push_back(name);
   }
 
   if (names.empty())
-    throw FileSystemError(ErrorCode::CantRemoveRootDirectory, "Can't remove root directory");
+  {
+    if (currentDirectoryAddress == RootDirectoryAddress)
+      throw FileSystemError(ErrorCode::CantRemoveRootDirectory, "Can't remove root directory");
+    else
+      throw FileSystemError(ErrorCode::PathNotFound, "Can't remove directory by path not containing its name");
+  }
   
-  BlockAddress currentDirectoryAddress = RootDirectoryAddress;
   for (auto pathElementIt = names.begin(); pathElementIt != --names.end(); ++pathElementIt)
   {
-    Directory directory(m_impl->ptr->m_blockStorage, currentDirectoryAddress);
     // TODO: file name encoding
     boost::optional<std::pair<BlockAddress, FileType>> directoryItem =
-      directory.searchFile(*pathElementIt);
+      searchInDirectory(currentDirectoryAddress, *pathElementIt);
 
     F2F_FORMAT_ASSERT(directoryItem && directoryItem->second == FileType::Directory);
 
     currentDirectoryAddress = directoryItem->first;
   }
 
-  Directory parentDirectory(m_impl->ptr->m_blockStorage, currentDirectoryAddress);
-  boost::optional<std::pair<BlockAddress, FileType>> removedItem = parentDirectory.removeFile(names.back());
-  F2F_FORMAT_ASSERT(removedItem);
-  m_impl->ptr->directoryModified(parentDirectory.inodeAddress());
-  switch (removedItem->second)
+  std::pair<BlockAddress, FileType> removedItem;
+  {
+    ExclusiveLock directoryLock(directoryMutex(currentDirectoryAddress));
+    DirectoryHolder holder;
+    Directory & parentDirectory = directory(currentDirectoryAddress, holder);
+    // File could be removed concurrently after the path was checked
+    boost::optional<std::pair<BlockAddress, FileType>> item = parentDirectory.searchFile(names.back());
+    if (!item)
+      throw FileSystemError(ErrorCode::PathNotFound, "Can't find path to remove");
+    if (item->second == FileType::Directory && !namespaceIsExclusive)
+      return false;
+    parentDirectory.removeFile(names.back());
+    directoryModified(parentDirectory.inodeAddress(), names.back());
+    removedItem = *item;
+  }
+  switch (removedItem.second)
   {
   case FileType::Regular:
-    m_impl->ptr->removeRegularFile(removedItem->first);
+    removeRegularFile(removedItem.first);
     break;
   case FileType::Directory:
-    m_impl->ptr->removeDirectory(removedItem->first);
+    removeDirectory(removedItem.first);
     break;
   }
+  return true;
 }
 
-DirectoryIterator FileSystem::directoryIterator(const char * pathStr) const
+void FileSystemImpl::rename(OpenedDirectory const * baseDirectory, boost::string_ref from, boost::string_ref to)
 {
-  fs::path const path = fs::path(pathStr).relative_path();
+  requiresReadWriteMode();
+
+  // Directories are modified without their locks
+  ExclusiveLock namespaceLock(m_namespaceMutex);
+  BlockAddress const baseDirectoryAddress = this->baseDirectoryAddress(baseDirectory);
+
+  boost::string_ref fromName;
+  boost::optional<BlockAddress> fromDirectoryAddress = searchParentDirectory(baseDirectoryAddress, from, fromName);
+  if (!fromDirectoryAddress)
+    throw FileSystemError(ErrorCode::PathNotFound, "Can't find path to rename");
+  if (fromName.empty() || IsSpecialName(fromName))
+    throw FileSystemError(ErrorCode::PathNotFound, "Can't rename file by path not containing its name");
+  CheckFileNameSize(fromName);
+  boost::optional<std::pair<BlockAddress, FileType>> source = searchInDirectory(*fromDirectoryAddress, fromName);
+  if (!source)
+    throw FileSystemError(ErrorCode::PathNotFound, "Can't find file to rename");
+
+  boost::string_ref toName;
+  boost::optional<BlockAddress> toDirectoryAddress = searchParentDirectory(baseDirectoryAddress, to, toName);
+  if (!toDirectoryAddress)
+    throw FileSystemError(ErrorCode::PathNotFound, "Can't find path to the new name");
+  if (toName.empty() || IsSpecialName(toName))
+    throw FileSystemError(ErrorCode::FileExists, "Can't rename file. Directory with same name already exists");
+  CheckFileNameSize(toName);
+
+  if (*fromDirectoryAddress == *toDirectoryAddress && fromName == toName)
+    return;
+
+  if (source->second == FileType::Directory
+    && (*toDirectoryAddress == source->first || isSubdirectory(*toDirectoryAddress, source->first)))
+    throw FileSystemError(ErrorCode::CantMoveDirectoryIntoItself, "Can't move directory into its own subdirectory");
+
+  // Regular file with the new name is replaced, directory isn't
+  boost::optional<std::pair<BlockAddress, FileType>> target = searchInDirectory(*toDirectoryAddress, toName);
+  if (target && (target->second == FileType::Directory || source->second == FileType::Directory))
+    throw FileSystemError(ErrorCode::FileExists, "Can't rename file. File with same name already exists");
+
+  // The same object must be used if both names are in one directory
+  DirectoryHolder fromHolder, toHolder;
+  Directory & fromDirectory = directory(*fromDirectoryAddress, fromHolder);
+  Directory & toDirectory = *fromDirectoryAddress == *toDirectoryAddress
+    ? fromDirectory : directory(*toDirectoryAddress, toHolder);
+
+  // Entry of replaced file is pointed to the moved one in place, so that failed rename can restore
+  // it without allocating blocks and leaves both names as they were
+  try
+  {
+    if (target)
+    {
+      boost::optional<std::pair<BlockAddress, FileType>> replacedItem =
+        toDirectory.replaceFile(toName, source->first, source->second);
+      F2F_FORMAT_ASSERT(replacedItem);
+    }
+    else
+      toDirectory.addFile(source->first, source->second, toName);
+  }
+  catch (...)
+  {
+    directoryModified(*toDirectoryAddress, toName);
+    throw;
+  }
+  try
+  {
+    boost::optional<std::pair<BlockAddress, FileType>> movedItem = fromDirectory.removeFile(fromName);
+    F2F_FORMAT_ASSERT(movedItem);
+  }
+  catch (...)
+  {
+    if (target)
+      toDirectory.replaceFile(toName, target->first, target->second);
+    else
+      toDirectory.removeFile(toName);
+    directoryModified(*toDirectoryAddress, toName);
+    throw;
+  }
+  directoryModified(*fromDirectoryAddress, fromName);
+  directoryModified(*toDirectoryAddress, toName);
 
-  boost::optional<std::pair<BlockAddress, FileType>> target = m_impl->ptr->searchFile(path);
+  if (source->second == FileType::Directory && !(*fromDirectoryAddress == *toDirectoryAddress))
+  {
+    DirectoryHolder holder;
+    directory(source->first, holder).setParentInodeAddress(*toDirectoryAddress);
+  }
+
+  if (target)
+    removeRegularFile(target->first);
+}
+
+std::shared_ptr<FileSystemImpl::OpenedDirectory> FileSystemImpl::openDirectory(
+  OpenedDirectory const * baseDirectory, boost::string_ref path)
+{
+  SharedLock namespaceLock = sharedLock(m_namespaceMutex);
+  boost::optional<std::pair<BlockAddress, FileType>> target = searchFile(baseDirectoryAddress(baseDirectory), path);
   if (!target || target->second != FileType::Directory)
     throw FileSystemError(ErrorCode::PathNotFound, "Can't find directory");
 
-  auto iteratedDirectoryIt = m_impl->ptr->m_iteratedDirectories.insert(
-    std::make_pair(target->first, FileSystemImpl::IteratedDirectory())).first;
-  ++iteratedDirectoryIt->second.refCount;
-  auto currentDirVersion = iteratedDirectoryIt->second.version;
-  std::unique_ptr<DirectoryIteratorImpl> it(
-    new DirectoryIteratorImpl(m_impl->ptr, pathStr, target->first, 
-      [iteratedDirectoryIt, currentDirVersion]() -> bool {
-        return iteratedDirectoryIt->second.version == currentDirVersion;
-      },
-      [iteratedDirectoryIt, this] {
-        if (--iteratedDirectoryIt->second.refCount == 0)
-          m_impl->ptr->m_iteratedDirectories.erase(iteratedDirectoryIt);
-      }));
+  BlockAddress const inodeAddress = target->first;
+  if (m_openMode == OpenMode::ReadOnly)
+    // Directory isn't modified, so handles don't need to share its object
+    return std::make_shared<OpenedDirectory>(m_blockStorage, inodeAddress);
 
-  return DirectoryIteratorFactory::create(std::move(it));
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_openedDirectories.find(inodeAddress);
+    if (it != m_openedDirectories.end())
+      if (std::shared_ptr<OpenedDirectory> opened = it->second.lock())
+        return opened;
+  }
+
+  // Directory object is read and registered under directory lock, so that it isn't outdated
+  // by modification made through temporary object
+  SharedLock directoryLock(directoryMutex(inodeAddress));
+  std::unique_ptr<OpenedDirectory> newDirectory(new OpenedDirectory(m_blockStorage, inodeAddress));
+  std::shared_ptr<OpenedDirectory> opened;
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto ins = m_openedDirectories.insert(std::make_pair(inodeAddress, std::weak_ptr<OpenedDirectory>()));
+  if ((opened = ins.first->second.lock()))
+    return opened;
+
+  opened.reset(
+    newDirectory.release(),
+    [this, inodeAddress](OpenedDirectory * openedDirectory)
+    {
+      delete openedDirectory;
+      // Record could be replaced if directory was removed and its inode reused
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto it = m_openedDirectories.find(inodeAddress);
+      if (it != m_openedDirectories.end() && it->second.expired())
+        m_openedDirectories.erase(it);
+    });
+  ins.first->second = opened;
+  return opened;
 }
 
-void FileSystem::check()
+Directory & FileSystemImpl::directory(BlockAddress const & inodeAddress, DirectoryHolder & holder)
 {
-  m_impl->ptr->m_blockStorage.check();
+  if (m_openMode != OpenMode::ReadOnly)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_openedDirectories.find(inodeAddress);
+    if (it != m_openedDirectories.end())
+      holder.opened = it->second.lock();
+  }
+  if (holder.opened)
+    return holder.opened->directory;
+
+  holder.temp.emplace(m_blockStorage, inodeAddress);
+  return *holder.temp;
+}
+
+boost::optional<std::pair<BlockAddress, FileType>> FileSystemImpl::searchInDirectory(
+  BlockAddress const & directoryAddress, boost::string_ref name)
+{
+  SharedLock directoryLock = sharedLock(directoryMutex(directoryAddress));
+  return searchInLockedDirectory(directoryAddress, name);
+}
+
+boost::optional<std::pair<BlockAddress, FileType>> FileSystemImpl::searchInLockedDirectory(
+  BlockAddress const & directoryAddress, boost::string_ref name)
+{
+  {
+    std::unique_lock<std::mutex> lock = lockCache();
+    if (lock.owns_lock())
+      if (boost::optional<DirectoryEntryCache::Entry> cached = m_directoryEntryCache.find(directoryAddress, name))
+        return *cached;
+  }
+
+  DirectoryHolder holder;
+  boost::optional<std::pair<BlockAddress, FileType>> result = directory(directoryAddress, holder).searchFile(name);
+  if (name != "..") // Parent reference isn't a directory entry and isn't invalidated
+  {
+    // Directory is still locked, so concurrent modification will invalidate this entry
+    std::unique_lock<std::mutex> lock = lockCache();
+    if (lock.owns_lock())
+      m_directoryEntryCache.insert(directoryAddress, name, result);
+  }
+  return result;
+}
+
+FileDescriptor FileSystemImpl::openFile(BlockAddress const & inodeAddress, OpenMode openMode, std::shared_ptr<File> && file)
+{
+  if (m_openMode == OpenMode::ReadOnly)
+    // Files can't be locked or removed, so descriptors aren't registered
+    return FileDescriptorFactory::create(
+      std::make_shared<FileDescriptorImpl>(
+        sharedReadOnlyFile(inodeAddress),
+        shared_from_this(),
+        FileDescriptorImpl::OnCloseFunc_t()));
+
+  std::map<BlockAddress, DescriptorRecord>::iterator record;
+  std::shared_ptr<File> openedFile;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    record = m_openedFiles.insert(std::make_pair(inodeAddress, DescriptorRecord())).first;
+    // File may be opened by several readers or by several shared writers
+    if (record->second.refCount > 0 && openMode != record->second.openMode)
+      throw FileSystemError(ErrorCode::FileLocked, "File is locked");
+    if (record->second.refCount > 0 && openMode == OpenMode::ReadWrite)
+      throw FileSystemError(ErrorCode::FileLocked, "File is locked");
+    if (record->second.refCount++ == 0)
+      record->second.openMode = openMode;
+    openedFile = record->second.file;
+  }
+
+  if (!openedFile)
+  {
+    // Inode isn't modified by others while the file is registered as opened
+    try
+    {
+      if (!file)
+        file = std::make_shared<File>(m_blockStorage, inodeAddress, openMode);
+    }
+    catch (...)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (--record->second.refCount == 0)
+        m_openedFiles.erase(record);
+      throw;
+    }
+    // Concurrent reader could open the same file meanwhile
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!record->second.file)
+      record->second.file = std::move(file);
+    openedFile = record->second.file;
+  }
+
+  return FileDescriptorFactory::create(
+    std::make_shared<FileDescriptorImpl>(
+      openedFile,
+      shared_from_this(),
+      [this, record, inodeAddress]() { closeFile(record, inodeAddress); }
+  ));
+}
+
+std::shared_ptr<File> FileSystemImpl::sharedReadOnlyFile(BlockAddress const & inodeAddress)
+{
+  {
+    std::unique_lock<std::mutex> lock = lockCache();
+    if (lock.owns_lock())
+    {
+      auto it = m_readOnlyFiles.find(inodeAddress);
+      if (it != m_readOnlyFiles.end())
+        if (std::shared_ptr<File> file = it->second.lock())
+          return file;
+    }
+  }
+
+  auto file = std::make_shared<File>(m_blockStorage, inodeAddress, OpenMode::ReadOnly);
+  std::unique_lock<std::mutex> lock = lockCache();
+  if (lock.owns_lock())
+  {
+    if (m_readOnlyFiles.size() >= m_readOnlyFilesSweepSize)
+    {
+      // Records of closed files are dropped when map doubles
+      for(auto it = m_readOnlyFiles.begin(); it != m_readOnlyFiles.end(); )
+        if (it->second.expired())
+          it = m_readOnlyFiles.erase(it);
+        else
+          ++it;
+      m_readOnlyFilesSweepSize = std::max(size_t(ReadOnlyFilesMinSweepSize), m_readOnlyFiles.size() * 2);
+    }
+    m_readOnlyFiles[inodeAddress] = file;
+  }
+  return file;
+}
+
+void FileSystemImpl::closeFile(std::map<BlockAddress, DescriptorRecord>::iterator record, BlockAddress const & inodeAddress)
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (--record->second.refCount > 0)
+      return;
+    bool const isDeleted = record->second.fileIsDeleted;
+    m_openedFiles.erase(record);
+    if (!isDeleted)
+      return;
+  }
+  SharedLock namespaceLock(m_namespaceMutex);
+  removeRegularFile(inodeAddress);
+}
+
+void FileSystemImpl::removeRegularFile(BlockAddress const & inodeAddress)
+{
+  if (markOpenedFileDeleted(inodeAddress))
+    return;
+
+  File file(m_blockStorage, inodeAddress, OpenMode::ReadWrite);
+  if (file.size() > LazyRemovalFileSize)
+  {
+    m_orphanList.push(inodeAddress, FileType::Regular);
+    scheduleReclaim();
+  }
+  else
+    file.remove();
+}
+
+bool FileSystemImpl::markOpenedFileDeleted(BlockAddress const & inodeAddress)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto openedFile = m_openedFiles.find(inodeAddress);
+  if (openedFile == m_openedFiles.end() || openedFile->second.refCount == 0)
+    return false;
+  openedFile->second.fileIsDeleted = true;
+  return true;
+}
+
+void FileSystemImpl::upgradeDirectories()
+{
+  requiresReadWriteMode();
+
+  ExclusiveLock namespaceLock(m_namespaceMutex);
   for (std::vector<BlockAddress> directories(1, RootDirectoryAddress); !directories.empty(); )
   {
-    Directory directory(m_impl->ptr->m_blockStorage, directories.back());
+    DirectoryHolder holder;
+    Directory & dir = directory(directories.back(), holder);
+    directories.pop_back();
+    for(Directory::Iterator it(dir); !it.eof(); it.moveNext())
+      if (it.currentFileType() == FileType::Directory)
+        directories.push_back(it.currentInode());
+
+    if (dir.formatVersion() != format::DirectoryFormatCurrent)
+    {
+      dir.convert(format::DirectoryFormatCurrent);
+      directoryModified(dir.inodeAddress());
+    }
+  }
+}
+
+void FileSystemImpl::check()
+{
+  ExclusiveLock namespaceLock(m_namespaceMutex);
+  m_blockStorage.check();
+  std::vector<BlockAddress> directories(1, RootDirectoryAddress);
+  m_orphanList.enumerate([this, &directories](BlockAddress address, FileType fileType)
+  {
+    if (fileType == FileType::Directory)
+      directories.push_back(address);
+    else
+      File(m_blockStorage, address, OpenMode::ReadOnly).check();
+  });
+  while (!directories.empty())
+  {
+    Directory directory(m_blockStorage, directories.back());
     directories.pop_back();
     directory.check();
     for(Directory::Iterator it(directory); !it.eof(); it.moveNext())
@@ -237,7 +924,7 @@ void FileSystem::check()
       {
       case FileType::Regular:
       {
-        File file(m_impl->ptr->m_blockStorage, it.currentInode(), OpenMode::ReadOnly);
+        File file(m_blockStorage, it.currentInode(), OpenMode::ReadOnly);
         file.check();
         break;
       }
@@ -249,129 +936,278 @@ void FileSystem::check()
   }
 }
 
-FileSystemImpl::FileSystemImpl(std::unique_ptr<IStorage> && storage, bool format, OpenMode openMode)
-  : m_storage(std::move(storage))
-  , m_blockStorage(*m_storage, format)
-  , m_openMode(openMode)
+DirectoryIterator FileSystemImpl::directoryIterator(PathRef path, std::string const * resumeToken)
 {
-  if (format)
+  SharedLock namespaceLock = sharedLock(m_namespaceMutex);
+  boost::optional<std::pair<BlockAddress, FileType>> target = 
+    searchFile(RootDirectoryAddress, ToStringRef(path));
+  if (!target || target->second != FileType::Directory)
+    throw FileSystemError(ErrorCode::PathNotFound, "Can't find directory");
+
+  boost::optional<Directory::Iterator::Position> position;
+  if (resumeToken)
+    position = DirectoryIteratorImpl::parseResumeToken(*resumeToken, target->first);
+
+  if (m_openMode == OpenMode::ReadOnly)
   {
-    Directory root(m_blockStorage, Directory::NoParentDirectory, Directory::create_tag());
-    F2F_ASSERT(root.inodeAddress() == RootDirectoryAddress);
+    // Directory isn't modified, so iterator isn't registered
+    static const IteratedDirectory Unmodified;
+    return DirectoryIteratorFactory::create(std::unique_ptr<DirectoryIteratorImpl>(
+      new DirectoryIteratorImpl(shared_from_this(), std::string(path.data(), path.size()), target->first,
+        Unmodified, []{}, position)));
   }
-}
 
-void FileSystemImpl::requiresReadWriteMode()
-{
-  if (m_openMode == OpenMode::ReadOnly)
-    throw FileSystemError(ErrorCode::OperationRequiresWriteAccess, 
-      "Operation can't be performed: storage is opened in read-only mode");
+  // Iterator reads directory and its version under the lock
+  SharedLock directoryLock(directoryMutex(target->first));
+  std::map<BlockAddress, IteratedDirectory>::iterator iteratedDirectoryIt;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    iteratedDirectoryIt = m_iteratedDirectories.insert(
+      std::make_pair(target->first, IteratedDirectory())).first;
+    ++iteratedDirectoryIt->second.refCount;
+    iteratedDirectoryIt->second.isRemoved = false;
+  }
+  std::unique_ptr<DirectoryIteratorImpl> it(
+    new DirectoryIteratorImpl(shared_from_this(), std::string(path.data(), path.size()), target->first,
+      iteratedDirectoryIt->second,
+      [iteratedDirectoryIt, this] {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--iteratedDirectoryIt->second.refCount == 0)
+          m_iteratedDirectories.erase(iteratedDirectoryIt);
+      },
+      position));
+
+  return DirectoryIteratorFactory::create(std::move(it));
 }
 
-boost::optional<std::pair<BlockAddress, FileType>> FileSystemImpl::searchFile(fs::path const & path)
+void FileSystemImpl::removeDirectory(BlockAddress const & inodeAddress)
 {
-  // Always treat relative path as relative to root
-  BlockAddress currentDirectoryAddress = RootDirectoryAddress;
-  for (auto pathElementIt = path.begin(); pathElementIt != path.end(); ++pathElementIt)
+  // Subtree isn't walked, only opened and iterated subdirectories are checked by their parent chains
+  std::vector<BlockAddress> candidates;
   {
-    if (pathElementIt->generic_string() == ".")
-      continue;
-    bool isLast = pathElementIt == --path.end();
-    Directory directory(m_blockStorage, currentDirectoryAddress);
-    // TODO: file name encoding
-    CheckFileNameSize(pathElementIt->generic_string());
-    boost::optional<std::pair<BlockAddress, FileType>> directoryItem =
-      directory.searchFile(pathElementIt->generic_string());
-    if (isLast)
-      return directoryItem;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for(auto const & opened: m_openedDirectories)
+      candidates.push_back(opened.first);
+    for(auto const & iterated: m_iteratedDirectories)
+      if (!iterated.second.isRemoved)
+        candidates.push_back(iterated.first);
+  }
+  std::vector<BlockAddress> removed(1, inodeAddress);
+  for(auto const & address: candidates)
+    if (isSubdirectory(address, inodeAddress))
+      removed.push_back(address);
+  for(auto const & address: removed)
+    forgetDirectory(address);
 
-    if (!directoryItem)
-      return {};
-    
-    if (directoryItem->second != FileType::Directory)
-      // Regular file in the middle of the path
-      return {};
+  m_orphanList.push(inodeAddress, FileType::Directory);
+  scheduleReclaim();
+}
 
-    currentDirectoryAddress = directoryItem->first;
+bool FileSystemImpl::isSubdirectory(BlockAddress inodeAddress, BlockAddress const & ancestorAddress)
+{
+  while (!(inodeAddress == RootDirectoryAddress))
+  {
+    DirectoryHolder holder;
+    inodeAddress = directory(inodeAddress, holder).parentInodeAddress();
+    if (inodeAddress == ancestorAddress)
+      return true;
   }
-  return std::make_pair(currentDirectoryAddress, FileType::Directory);
+  return false;
 }
 
-FileDescriptor FileSystemImpl::openFile(BlockAddress const & inodeAddress, OpenMode openMode, std::unique_ptr<File> && file)
+void FileSystemImpl::forgetDirectory(BlockAddress const & inodeAddress)
 {
-  auto ins = m_openedFiles.insert(std::make_pair(inodeAddress, DescriptorRecord()));
-  DescriptorRecord & record = ins.first->second;
+  directoryModified(inodeAddress);
 
-  if (record.refCount > 0)
+  std::shared_ptr<OpenedDirectory> opened; // Released after unlocking, its deleter locks m_mutex
+  std::lock_guard<std::mutex> lock(m_mutex);
+  auto iteratedDirectory = m_iteratedDirectories.find(inodeAddress);
+  if (iteratedDirectory != m_iteratedDirectories.end())
   {
-    if (openMode == OpenMode::ReadWrite || record.openMode == OpenMode::ReadWrite)
-      throw FileSystemError(ErrorCode::FileLocked, "File is locked");
+    ++iteratedDirectory->second.generation;
+    iteratedDirectory->second.isRemoved = true;
   }
 
-  if (!file)
-    file.reset(new File(m_blockStorage, inodeAddress, openMode));
+  auto openedDirectory = m_openedDirectories.find(inodeAddress);
+  if (openedDirectory != m_openedDirectories.end())
+  {
+    if ((opened = openedDirectory->second.lock()))
+      opened->isRemoved = true;
+    m_openedDirectories.erase(openedDirectory);
+  }
+}
 
-  if (record.refCount++ == 0)
-    record.openMode = openMode;
+bool FileSystemImpl::reclaim(uint64_t blocksBudget)
+{
+  requiresReadWriteMode();
 
-  return FileDescriptorFactory::create(
-    std::make_shared<FileDescriptorImpl>(
-      std::move(file),
-      shared_from_this(),
-      [this, ins, inodeAddress]() 
+  // Orphans are read on this thread. Reading subtrees on thread pool would make the step wait for
+  // pool tasks while holding exclusive namespace lock, and other pool tasks (async operations and
+  // the step itself in background reclamation) may occupy all pool threads waiting for this lock.
+  // Work under the lock is bounded by the budget instead, and inode headers of directory entries
+  // are read a leaf at a time by the iterator
+  ExclusiveLock namespaceLock(m_namespaceMutex);
+  ReleasedBlocks releasedBlocks(m_blockStorage);
+  uint64_t releasedCount = 0;
+  auto releaseBlocks = [&releasedBlocks, &releasedCount](BlockAddress blockAddress, unsigned blocksCount)
+  {
+    releasedBlocks.add(blockAddress, blocksCount);
+    releasedCount += blocksCount;
+  };
+
+  // Subdirectories and large files of released directory become orphans, pushing one costs a block
+  auto releaseEntry = [this, &releaseBlocks, &releasedCount](BlockAddress address, FileType fileType)
+  {
+    if (fileType == FileType::Directory)
+    {
+      forgetDirectory(address);
+      m_orphanList.push(address, FileType::Directory);
+      ++releasedCount;
+    }
+    else if (!markOpenedFileDeleted(address))
+    {
+      File file(m_blockStorage, address, OpenMode::ReadOnly);
+      if (file.size() > LazyRemovalFileSize)
+      {
+        m_orphanList.push(address, FileType::Regular);
+        ++releasedCount;
+      }
+      else
+        // Reading file tree is enough, it doesn't need to be truncated before release
+        file.enumerateAllBlocks(releaseBlocks);
+    }
+  };
+
+  while (!m_orphanList.empty() && releasedCount < blocksBudget)
+  {
+    std::pair<BlockAddress, FileType> const orphan = m_orphanList.top();
+    if (orphan.second == FileType::Regular)
+    {
+      File file(m_blockStorage, orphan.first, OpenMode::ReadWrite);
+      uint64_t const blocksCount = m_blockStorage.fileBlocksCount(file.size());
+      uint64_t const budgetRemain = blocksBudget - releasedCount;
+      if (blocksCount > budgetRemain)
+      {
+        // Large file is truncated from the end in several calls
+        file.seek((blocksCount - budgetRemain) * m_blockStorage.blockSize());
+        file.truncate();
+        releasedCount += budgetRemain;
+      }
+      else
+      {
+        m_orphanList.pop();
+        file.enumerateAllBlocks(releaseBlocks);
+      }
+    }
+    else
+    {
+      // Entries of directory are released in chunks that fit the budget, estimated by their
+      // inode headers. Directory itself is released with the last chunk
+      Directory directory(m_blockStorage, orphan.first);
+      std::vector<std::pair<utf8string_t, std::pair<BlockAddress, FileType>>> chunk;
+      bool isLastChunk;
       {
-        if (--ins.first->second.refCount == 0)
+        uint64_t chunkBlocks = 0;
+        Directory::Iterator it(directory);
+        for(; !it.eof() && (chunk.empty() || releasedCount + chunkBlocks < blocksBudget); it.moveNext())
         {
-          bool isDeleted = ins.first->second.fileIsDeleted;
-          m_openedFiles.erase(ins.first);
-          if (isDeleted)
-          {
-            File file(m_blockStorage, inodeAddress, OpenMode::ReadWrite);
-            file.remove();
-          }
+          chunk.emplace_back(it.currentName().to_string(), std::make_pair(it.currentInode(), it.currentFileType()));
+          if (it.currentFileType() == FileType::Directory || it.currentInodeHeader().fileSize > LazyRemovalFileSize)
+            ++chunkBlocks;
+          else
+            chunkBlocks += it.currentAllocatedSize() / m_blockStorage.blockSize() + 1;
         }
+        isLastChunk = it.eof();
       }
-  ));
+
+      if (isLastChunk)
+      {
+        m_orphanList.pop();
+        directory.remove(releaseEntry,
+          [&releaseBlocks](BlockAddress address)
+          {
+            releaseBlocks(address, 1);
+          });
+      }
+      else
+        for(auto const & entry: chunk)
+        {
+          // Entry is unlinked before its blocks are released
+          directory.removeFile(entry.first);
+          releaseEntry(entry.second.first, entry.second.second);
+        }
+    }
+  }
+  releasedBlocks.flush();
+  return m_orphanList.empty();
 }
 
-void FileSystemImpl::removeRegularFile(BlockAddress const & inodeAddress)
+void FileSystemImpl::reclaimInBackground(uint64_t stepBlocksBudget)
 {
-  auto openedFile = m_openedFiles.find(inodeAddress);
-  if (openedFile != m_openedFiles.end() && openedFile->second.refCount > 0)
-    openedFile->second.fileIsDeleted = true;
-  else
+  requiresReadWriteMode();
   {
-    File file(m_blockStorage, inodeAddress, OpenMode::ReadWrite);
-    file.remove();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_reclaimStepBlocks = stepBlocksBudget;
   }
+  scheduleReclaim();
 }
 
-void FileSystemImpl::removeDirectory(BlockAddress const & inodeAddress)
+void FileSystemImpl::scheduleReclaim()
 {
-  for(std::vector<BlockAddress> directories(1, inodeAddress); !directories.empty(); )
   {
-    directoryModified(directories.back());
-
-    Directory directory(m_blockStorage, directories.back());
-    directories.pop_back();
-    directory.remove(
-      [this, &directories](BlockAddress address, FileType fileType)
-      {
-        switch(fileType)
-        {
-        case FileType::Regular:
-          removeRegularFile(address);
-          break;
-        case FileType::Directory:
-          directories.push_back(address);
-          break;
-        }
-      });
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_reclaimStepBlocks == 0 || m_reclaimIsPosted)
+      return;
+    m_reclaimIsPosted = true;
   }
+  // Posted step doesn't keep file system alive
+  std::weak_ptr<FileSystemImpl> const weakThis = shared_from_this();
+  post([weakThis]
+  {
+    std::shared_ptr<FileSystemImpl> const impl = weakThis.lock();
+    if (!impl)
+      return;
+    uint64_t stepBlocks;
+    {
+      std::lock_guard<std::mutex> lock(impl->m_mutex);
+      stepBlocks = impl->m_reclaimStepBlocks;
+    }
+    bool failed = false;
+    try
+    {
+      if (stepBlocks > 0)
+        impl->reclaim(stepBlocks);
+    }
+    catch (...)
+    {
+      // Step isn't repeated after error, reclamation resumes when more orphans are added
+      failed = true;
+    }
+    {
+      std::lock_guard<std::mutex> lock(impl->m_mutex);
+      impl->m_reclaimIsPosted = false;
+    }
+    // Orphans added while the step was running didn't post another one
+    if (!failed && !impl->m_orphanList.empty())
+      impl->scheduleReclaim();
+  });
+}
+
+void FileSystemImpl::directoryModified(BlockAddress const & inodeAddress, boost::string_ref name)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_directoryEntryCache.invalidate(inodeAddress, name);
+
+  auto iteratedDirectory = m_iteratedDirectories.find(inodeAddress);
+  if (iteratedDirectory != m_iteratedDirectories.end())
+    ++iteratedDirectory->second.version;
 }
 
 void FileSystemImpl::directoryModified(BlockAddress const & inodeAddress)
 {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  m_directoryEntryCache.invalidateDirectory(inodeAddress);
+
   auto iteratedDirectory = m_iteratedDirectories.find(inodeAddress);
   if (iteratedDirectory != m_iteratedDirectories.end())
     ++iteratedDirectory->second.version;
@@ -1,39 +1,140 @@
 #pragma once
 
+#include <array>
 #include <map>
 #include <memory>
-#include <boost/filesystem/path.hpp>
+#include <mutex>
+#include <shared_mutex>
+#include <boost/utility/string_ref.hpp>
 #include "f2f/FileSystem.hpp"
 #include "f2f/IStorage.hpp"
 #include "BlockStorage.hpp"
+#include "Directory.hpp"
+#include "DirectoryEntryCache.hpp"
 #include "FileDescriptorImpl.hpp"
+#include "OrphanList.hpp"
+#include "util/ThreadPool.hpp"
 
 namespace f2f
 {
 
-namespace fs = boost::filesystem;
-
-class FileSystemImpl: 
+// Locking. Operations that change structure of directory tree (removing directory, rename,
+// reclaim, upgrade) hold namespace lock exclusively. Other path operations hold it shared and
+// lock each directory they read (shared) or modify (exclusive), one directory at a time.
+// Directory locks are striped by inode address. File contents are guarded by descriptors
+// (see FileDescriptorImpl) and block allocation by BlockStorage.
+// m_mutex guards maps of opened and iterated objects and lookup cache, nothing is locked under it.
+// Metadata of file system opened read-only never changes, so its lookups and reads take no
+// locks: opened files, directories and iterators aren't registered and the lookup cache is
+// skipped while another thread uses it.
+class FileSystemImpl:
   public std::enable_shared_from_this<FileSystemImpl>
 {
 public:
-  FileSystemImpl(std::unique_ptr<IStorage> && storage, bool format, OpenMode openMode);
+  FileSystemImpl(std::unique_ptr<IStorage> && storage, bool format, OpenMode openMode,
+    unsigned blockSizeLog2 = 0, bool alignedLayout = false);
 
   std::unique_ptr<IStorage> m_storage;
   BlockStorage m_blockStorage;
+  OrphanList m_orphanList;
   OpenMode const m_openMode;
 
+  typedef std::shared_timed_mutex SharedMutex;
+  typedef std::shared_lock<SharedMutex> SharedLock;
+  typedef std::unique_lock<SharedMutex> ExclusiveLock;
+
+  SharedMutex m_namespaceMutex;
+  SharedMutex & directoryMutex(BlockAddress const & inodeAddress);
+  // Lock for lookups, not acquired in read-only mode
+  SharedLock sharedLock(SharedMutex & mutex);
+
   void requiresReadWriteMode();
 
-  boost::optional<std::pair<BlockAddress, FileType>> searchFile(fs::path const & path);
+  // Runs task on thread pool, which is started on first use
+  void post(std::function<void()> && task);
+
+  // Directory object shared by all operations on directory while it has opened handles
+  struct OpenedDirectory
+  {
+    OpenedDirectory(BlockStorage & blockStorage, BlockAddress const & inodeAddress)
+      : directory(blockStorage, inodeAddress)
+      , isRemoved(false)
+    {}
 
-  FileDescriptor openFile(BlockAddress const & inodeAddress, OpenMode openMode, 
-    std::unique_ptr<File> && = std::unique_ptr<File>());
+    Directory directory;
+    bool isRemoved; // Changed under exclusive namespace lock
+  };
 
+  // Path operations. Absolute path is resolved from root, relative - from base directory,
+  // which is opened directory of handle or root if it's null
+  FileDescriptor open(OpenedDirectory const * baseDirectory, boost::string_ref path, OpenMode, bool createIfRW);
+  FileType fileType(OpenedDirectory const * baseDirectory, boost::string_ref path);
+  void createDirectory(OpenedDirectory const * baseDirectory, boost::string_ref path);
+  void createFiles(OpenedDirectory const * baseDirectory, boost::string_ref path,
+    std::vector<std::string> const & names);
+  void remove(OpenedDirectory const * baseDirectory, boost::string_ref path);
+  void rename(OpenedDirectory const * baseDirectory, boost::string_ref from, boost::string_ref to);
+  std::shared_ptr<OpenedDirectory> openDirectory(OpenedDirectory const * baseDirectory, boost::string_ref path);
+
+  // Functions below require namespace lock and no locked directories unless stated otherwise
+
+  // Throws if base directory was removed
+  BlockAddress baseDirectoryAddress(OpenedDirectory const * baseDirectory);
+  boost::optional<std::pair<BlockAddress, FileType>> searchFile(
+    BlockAddress const & baseDirectoryAddress, boost::string_ref path);
+  // Resolves all path components except the last one, which is returned in 'fileName'
+  // (empty if path has no components)
+  boost::optional<BlockAddress> searchParentDirectory(
+    BlockAddress const & baseDirectoryAddress, boost::string_ref path, boost::string_ref & fileName);
+  // Cached lookup of single name in directory
+  boost::optional<std::pair<BlockAddress, FileType>> searchInDirectory(
+    BlockAddress const & directoryAddress, boost::string_ref name);
+
+  // Registers descriptor of file found in locked directory or created in it.
+  // Descriptors of the same file share its File object
+  FileDescriptor openFile(BlockAddress const & inodeAddress, OpenMode openMode,
+    std::shared_ptr<File> && = std::shared_ptr<File>());
+
+  // Keeps object returned by directory() alive
+  struct DirectoryHolder
+  {
+    boost::optional<Directory> temp;
+    std::shared_ptr<OpenedDirectory> opened;
+  };
+
+  // Returns directory object of opened handle if any, otherwise constructs it in holder.
+  // Directory must be locked or namespace locked exclusively
+  Directory & directory(BlockAddress const & inodeAddress, DirectoryHolder & holder);
+
+  void upgradeDirectories();
+  void check();
+
+  // Iteration starts from resume token if it isn't null
+  DirectoryIterator directoryIterator(PathRef path, std::string const * resumeToken);
+
+  // Directories and large files are added to orphan list to be released by reclaim().
+  // Removing directory requires exclusive namespace lock
   void removeRegularFile(BlockAddress const & inodeAddress);
   void removeDirectory(BlockAddress const & inodeAddress);
-
-  // Invalidates iterators of this directory
+  // Returns true if file is opened, so it is removed when last descriptor is closed
+  bool markOpenedFileDeleted(BlockAddress const & inodeAddress);
+  // Finishes iterators and handles of removed directory and drops its cached lookups.
+  // Requires exclusive namespace lock
+  void forgetDirectory(BlockAddress const & inodeAddress);
+  bool isSubdirectory(BlockAddress inodeAddress, BlockAddress const & ancestorAddress);
+  // Releases about blocksBudget blocks of orphans on calling thread under exclusive namespace lock.
+  // Returns true if orphan list is empty
+  bool reclaim(uint64_t blocksBudget);
+  // Background reclamation runs reclaim() steps on thread pool while orphan list isn't empty.
+  // Zero step budget stops it
+  void reclaimInBackground(uint64_t stepBlocksBudget);
+  // Posts next step unless it is already posted. Called after orphans are added
+  void scheduleReclaim();
+
+  // Invalidates iterators of this directory and cached lookups of the name.
+  // Called while modified directory is still locked
+  void directoryModified(BlockAddress const & inodeAddress, boost::string_ref name);
+  // Invalidates iterators and all cached lookups of this directory
   void directoryModified(BlockAddress const & inodeAddress);
 
   struct IteratedDirectory
@@ -41,10 +142,15 @@ public:
     IteratedDirectory()
       : refCount(0)
       , version(0)
+      , generation(0)
+      , isRemoved(false)
     {}
 
     unsigned refCount;
-    unsigned version;
+    // Counters are changed while directory is locked, iterators read them under lock too
+    unsigned version; // Changed on each modification
+    unsigned generation; // Changed when directory is removed, so that its iterators are finished
+    bool isRemoved; // Until new directory with the same inode address is iterated
   };
 
   std::map<BlockAddress,IteratedDirectory> m_iteratedDirectories;
@@ -60,9 +166,34 @@ private:
     OpenMode openMode;
     unsigned refCount;
     bool fileIsDeleted;
+    std::shared_ptr<File> file; // Shared by descriptors
   };
 
+  static const size_t DirectoryMutexesCount = 64;
+  static const size_t ReadOnlyFilesMinSweepSize = 256;
+
+  std::mutex m_mutex;
+  std::array<SharedMutex, DirectoryMutexesCount> m_directoryMutexes;
   std::map<BlockAddress, DescriptorRecord> m_openedFiles; // key - inode block address
+  DirectoryEntryCache m_directoryEntryCache;
+  std::map<BlockAddress, std::weak_ptr<OpenedDirectory>> m_openedDirectories; // key - inode block address
+  // Files opened in read-only mode, guarded as lookup cache
+  std::map<BlockAddress, std::weak_ptr<File>> m_readOnlyFiles; // key - inode block address
+  size_t m_readOnlyFilesSweepSize;
+  uint64_t m_reclaimStepBlocks; // Guarded by m_mutex, zero if background reclamation is stopped
+  bool m_reclaimIsPosted; // Guarded by m_mutex
+  std::once_flag m_threadPoolStarted;
+  std::unique_ptr<util::ThreadPool> m_threadPool; // Declared last to be destroyed first
+
+  // Lookup cache lock. In read-only mode it isn't waited for and may be not owned
+  std::unique_lock<std::mutex> lockCache();
+  // File object shared by descriptors of file system opened read-only
+  std::shared_ptr<File> sharedReadOnlyFile(BlockAddress const & inodeAddress);
+  void closeFile(std::map<BlockAddress, DescriptorRecord>::iterator record, BlockAddress const & inodeAddress);
+  // Same as searchInDirectory(), but directory is already locked by caller
+  boost::optional<std::pair<BlockAddress, FileType>> searchInLockedDirectory(
+    BlockAddress const & directoryAddress, boost::string_ref name);
+  bool removeEntry(BlockAddress const & baseDirectoryAddress, boost::string_ref path, bool namespaceIsExclusive);
 };
 
 struct FileSystem::Impl
@@ -70,4 +201,4 @@ struct FileSystem::Impl
   std::shared_ptr<FileSystemImpl> ptr;
 };
 
-}
\ No newline at end of file
+}
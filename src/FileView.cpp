@@ -0,0 +1,77 @@
+#include "FileViewImpl.hpp"
+#include "f2f/FileSystemError.hpp"
+
+namespace f2f
+{
+
+FileView::FileView()
+  : m_impl(nullptr)
+{}
+
+FileView::FileView(FileView && src)
+  : m_impl(src.m_impl)
+{
+  src.m_impl = nullptr;
+}
+
+FileView::FileView(FileView const & src)
+  : m_impl(nullptr)
+{
+  if (src.m_impl)
+    m_impl = new Impl(*src.m_impl);
+}
+
+FileView::~FileView()
+{
+  delete m_impl;
+}
+
+FileView & FileView::operator=(FileView const & src)
+{
+  if (this != &src)
+  {
+    delete m_impl;
+    m_impl = src.m_impl ? new Impl(*src.m_impl) : nullptr;
+  }
+  return *this;
+}
+
+FileView & FileView::operator=(FileView && src)
+{
+  if (this != &src)
+  {
+    delete m_impl;
+    m_impl = src.m_impl;
+    src.m_impl = nullptr;
+  }
+  return *this;
+}
+
+uint64_t FileView::size() const
+{
+  return m_impl ? m_impl->size() : 0;
+}
+
+size_t FileView::buffersCount() const
+{
+  return m_impl ? m_impl->buffers().size() : 0;
+}
+
+ConstBuffer const & FileView::buffer(size_t index) const
+{
+  if (index >= buffersCount())
+    throw FileSystemError(ErrorCode::IncorrectIteratorAccess, "File view buffer index is out of range");
+  return m_impl->buffers()[index];
+}
+
+ConstBuffer const * FileView::begin() const
+{
+  return m_impl ? m_impl->buffers().data() : nullptr;
+}
+
+ConstBuffer const * FileView::end() const
+{
+  return m_impl ? m_impl->buffers().data() + m_impl->buffers().size() : nullptr;
+}
+
+}
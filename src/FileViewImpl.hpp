@@ -0,0 +1,72 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "f2f/FileView.hpp"
+#include "FileDescriptorImpl.hpp"
+
+namespace f2f
+{
+
+class FileView::Impl
+{
+public:
+  explicit Impl(std::shared_ptr<FileDescriptorImpl> const & descriptor)
+    : m_descriptor(descriptor)
+    , m_size(0)
+  {
+    m_descriptor->pin();
+  }
+
+  Impl(Impl const & src)
+    : m_descriptor(src.m_descriptor)
+    , m_buffers(src.m_buffers)
+    , m_size(src.m_size)
+  {
+    m_descriptor->pin();
+  }
+
+  ~Impl()
+  {
+    try
+    {
+      m_descriptor->unpin();
+    }
+    catch(...)
+    {}
+  }
+
+  void operator=(Impl const &) = delete;
+
+  void append(void const * data, size_t size)
+  {
+    if (!m_buffers.empty() 
+      && reinterpret_cast<char const *>(m_buffers.back().data) + m_buffers.back().size == data)
+      // Adjacent ranges are mapped to continuous memory
+      m_buffers.back().size += size;
+    else
+      m_buffers.push_back(ConstBuffer{data, size});
+    m_size += size;
+  }
+
+  std::vector<ConstBuffer> const & buffers() const { return m_buffers; }
+  uint64_t size() const { return m_size; }
+
+private:
+  std::shared_ptr<FileDescriptorImpl> m_descriptor;
+  std::vector<ConstBuffer> m_buffers;
+  uint64_t m_size;
+};
+
+class FileViewFactory
+{
+public:
+  static FileView create(std::unique_ptr<FileView::Impl> && impl)
+  {
+    FileView view;
+    view.m_impl = impl.release();
+    return view;
+  }
+};
+
+}
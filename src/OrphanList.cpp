@@ -0,0 +1,98 @@
+#include "OrphanList.hpp"
+#include "Directory.hpp"
+#include "format/OrphanList.hpp"
+#include "util/Assert.hpp"
+#include "util/StorageT.hpp"
+
+namespace f2f
+{
+
+namespace
+{
+  typedef util::BlockBuffer<format::OrphanListBlock> ListBlock;
+
+  void ReadListBlock(BlockStorage const & blockStorage, uint64_t blockIndex, ListBlock & block)
+  {
+    util::readT(blockStorage, BlockAddress::fromBlockIndex(blockIndex), block);
+    F2F_FORMAT_ASSERT(block->itemsCount > 0
+      && block->itemsCount <= format::OrphanListBlock::maxCount(blockStorage.blockSize()));
+  }
+}
+
+OrphanList::OrphanList(BlockStorage & blockStorage)
+  : m_blockStorage(blockStorage)
+{}
+
+bool OrphanList::empty() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_blockStorage.orphanListBlock() == 0;
+}
+
+void OrphanList::push(BlockAddress inodeAddress, FileType fileType)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  ListBlock block(m_blockStorage.blockSize());
+  uint64_t const head = m_blockStorage.orphanListBlock();
+  if (head != 0)
+  {
+    ReadListBlock(m_blockStorage, head, block);
+    if (block->itemsCount < format::OrphanListBlock::maxCount(m_blockStorage.blockSize()))
+    {
+      block->inodes[block->itemsCount++] = EncodeInode(inodeAddress, fileType);
+      util::writeT(m_blockStorage, BlockAddress::fromBlockIndex(head), block);
+      return;
+    }
+  }
+
+  BlockAddress const newHead = m_blockStorage.allocateBlock();
+  block->nextBlock = head;
+  block->itemsCount = 1;
+  block->inodes[0] = EncodeInode(inodeAddress, fileType);
+  util::writeT(m_blockStorage, newHead, block);
+  m_blockStorage.setOrphanListBlock(newHead.index());
+}
+
+std::pair<BlockAddress, FileType> OrphanList::top() const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  F2F_ASSERT(m_blockStorage.orphanListBlock() != 0);
+  ListBlock block(m_blockStorage.blockSize());
+  ReadListBlock(m_blockStorage, m_blockStorage.orphanListBlock(), block);
+  return DecodeInode(block->inodes[block->itemsCount - 1]);
+}
+
+void OrphanList::pop()
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  F2F_ASSERT(m_blockStorage.orphanListBlock() != 0);
+  BlockAddress const head = BlockAddress::fromBlockIndex(m_blockStorage.orphanListBlock());
+  ListBlock block(m_blockStorage.blockSize());
+  ReadListBlock(m_blockStorage, head.index(), block);
+  if (--block->itemsCount > 0)
+    util::writeT(m_blockStorage, head, block);
+  else
+  {
+    m_blockStorage.setOrphanListBlock(block->nextBlock);
+    m_blockStorage.releaseBlocks(head, 1);
+  }
+}
+
+void OrphanList::enumerate(std::function<void(BlockAddress, FileType)> const & visitor) const
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  for(uint64_t blockIndex = m_blockStorage.orphanListBlock(); blockIndex != 0; )
+  {
+    m_blockStorage.checkAllocatedBlock(BlockAddress::fromBlockIndex(blockIndex));
+    ListBlock block(m_blockStorage.blockSize());
+    ReadListBlock(m_blockStorage, blockIndex, block);
+    for(unsigned i = 0; i < block->itemsCount; ++i)
+    {
+      auto decoded = DecodeInode(block->inodes[i]);
+      visitor(decoded.first, decoded.second);
+    }
+    blockIndex = block->nextBlock;
+  }
+}
+
+}
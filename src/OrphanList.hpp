@@ -0,0 +1,32 @@
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include "f2f/Common.hpp"
+#include "BlockStorage.hpp"
+
+namespace f2f
+{
+
+// Persistent stack of removed files and directories whose blocks are released later
+// (see FileSystem::reclaim). Survives reopening of storage, so interrupted reclamation continues.
+// Each operation is atomic, sequence of top() and pop() must be protected by the caller.
+class OrphanList
+{
+public:
+  explicit OrphanList(BlockStorage &);
+
+  bool empty() const;
+  void push(BlockAddress inodeAddress, FileType);
+  std::pair<BlockAddress, FileType> top() const;
+  void pop();
+
+  // Diagnostics
+  void enumerate(std::function<void(BlockAddress, FileType)> const &) const;
+
+private:
+  BlockStorage & m_blockStorage;
+  mutable std::mutex m_mutex;
+};
+
+}
@@ -1,20 +1,18 @@
 #pragma once
 
-#include <cstdint>
+#include <cstddef>
 
 namespace f2f { namespace format 
 {
 
-static const int OccupancyBlockSize = 1024; // in bytes
-
+// Occupancy block fills whole block of storage and keeps one bit per block of its group
 struct OccupancyBlock
 {
   typedef size_t BitmapWord; // TODO: deal with endianness
-  static const int BitmapWordsCount = OccupancyBlockSize / sizeof(BitmapWord);
-  static const int BitmapItemsCount = BitmapWordsCount * sizeof(BitmapWord) * 8;
-  BitmapWord bitmap[BitmapWordsCount];
-};
+  static unsigned bitmapWordsCount(unsigned blockSize) { return blockSize / sizeof(BitmapWord); }
+  static unsigned bitmapItemsCount(unsigned blockSize) { return blockSize * 8; }
 
-static_assert(OccupancyBlockSize == sizeof(OccupancyBlock), "");
+  BitmapWord bitmap[1]; // bitmapWordsCount(blockSize) items
+};
 
-}}
\ No newline at end of file
+}}
@@ -3,6 +3,9 @@
 namespace f2f { namespace format 
 {
 
-const unsigned AddressableBlockSize = 1024; // in bytes
+// Block size is chosen when storage is formatted (StorageHeader::blockSizeLog2). Structures that
+// don't depend on it use first AddressableBlockSize bytes of their block
+const unsigned AddressableBlockSize = 1024; // default and minimal block size, in bytes
+const unsigned MaxBlockSizeLog2 = 6; // block size is AddressableBlockSize << log2, up to 64 KB
 
-}}
\ No newline at end of file
+}}
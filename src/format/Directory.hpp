@@ -5,23 +5,31 @@
 #include "Common.hpp"
 #include "Inode.hpp"
 
-namespace f2f { namespace format 
+namespace f2f { namespace format
 {
 
+// Directory format version is stored in InodeHeader::flags of DirectoryInode
+static const uint16_t DirectoryFormatMask = 0x000f;
+static const uint16_t DirectoryFormatFNV1a32 = 0; // 32-bit FNV-1a name hash
+static const uint16_t DirectoryFormatSlotted = 1; // 64-bit xxHash name hash, leaf items are indexed by slot array
+static const uint16_t DirectoryFormatCurrent = DirectoryFormatSlotted;
+
 #pragma pack(push, 1)
 
-struct DirectoryTreeLeafItem
+template<class NameHash>
+struct DirectoryTreeLeafItemT
 {
   // DirectoryFlag is set in inode value for directories
   static const uint64_t DirectoryFlag = UINT64_C(1) << 63;
 
   uint64_t inode;
-  uint32_t nameHash;
+  NameHash nameHash;
   uint16_t nameSize;
   char name[1];
 };
 
-struct DirectoryTreeLeafHeader
+template<class NameHash>
+struct DirectoryTreeLeafHeaderT
 {
   // dataSize and MaxDataSize are sizes of sequence of DirectoryTreeLeafItem items (header with following string)
   static const unsigned MaxDataSize = AddressableBlockSize - 2 /*dataSize*/ - 8 /*nextLeafNode*/;
@@ -30,32 +38,35 @@ struct DirectoryTreeLeafHeader
   uint16_t dataSize;
   uint64_t nextLeafNode;
   // Items are in sorted order
-  DirectoryTreeLeafItem head;
+  DirectoryTreeLeafItemT<NameHash> head;
 };
 
-struct DirectoryTreeLeaf: DirectoryTreeLeafHeader
+template<class NameHash>
+struct DirectoryTreeLeafT: DirectoryTreeLeafHeaderT<NameHash>
 {
-  char itemsData[AddressableBlockSize - sizeof(DirectoryTreeLeafHeader)];
+  char itemsData[AddressableBlockSize - sizeof(DirectoryTreeLeafHeaderT<NameHash>)];
 };
 
-struct DirectoryTreeChildNodeReference
+template<class NameHash>
+struct DirectoryTreeChildNodeReferenceT
 {
   uint64_t childBlockIndex;
-  uint32_t nameHash;
+  NameHash nameHash;
 };
 
-struct DirectoryTreeInternalNode
+// Internal nodes and slotted leaves fill whole block, BlockSize is block size of storage.
+// Inodes and leaves of packed format use first AddressableBlockSize bytes of block
+template<class NameHash, unsigned BlockSize = AddressableBlockSize>
+struct DirectoryTreeInternalNodeT
 {
-  static const unsigned MaxCount = (AddressableBlockSize - 2) / sizeof(DirectoryTreeChildNodeReference);
+  static const unsigned MaxCount = (BlockSize - 2) / sizeof(DirectoryTreeChildNodeReferenceT<NameHash>);
 
   uint16_t itemsCount;
-  DirectoryTreeChildNodeReference children[MaxCount];
+  DirectoryTreeChildNodeReferenceT<NameHash> children[MaxCount];
 };
 
-static const unsigned MaxFileNameSize = DirectoryTreeLeafHeader::MaxDataSize
-        - offsetof(DirectoryTreeLeafHeader, head) - offsetof(DirectoryTreeLeafItem, name);
-
-struct DirectoryInode : InodeHeader
+template<class NameHash>
+struct DirectoryInodeT : InodeHeader
 {
   uint64_t parentDirectoryInode;
   uint16_t levelsCount;
@@ -63,10 +74,10 @@ struct DirectoryInode : InodeHeader
 
   struct IndirectReferences
   {
-    static const unsigned MaxCount = (PayloadSize - 2) / sizeof(DirectoryTreeChildNodeReference);
+    static const unsigned MaxCount = (PayloadSize - 2) / sizeof(DirectoryTreeChildNodeReferenceT<NameHash>);
 
     uint16_t itemsCount;
-    DirectoryTreeChildNodeReference children[MaxCount];
+    DirectoryTreeChildNodeReferenceT<NameHash> children[MaxCount];
   };
 
   struct DirectReferences
@@ -75,8 +86,8 @@ struct DirectoryInode : InodeHeader
 
     // dataSize and MaxDataSize are sizes of sequence of DirectoryTreeLeafItem items with following strings
     uint16_t dataSize;
-    DirectoryTreeLeafItem head;
-    char itemsData[MaxDataSize - sizeof(DirectoryTreeLeafItem)];
+    DirectoryTreeLeafItemT<NameHash> head;
+    char itemsData[MaxDataSize - sizeof(DirectoryTreeLeafItemT<NameHash>)];
   };
 
   union
@@ -86,8 +97,87 @@ struct DirectoryInode : InodeHeader
   };
 };
 
-static_assert(sizeof(DirectoryInode) <= AddressableBlockSize, "");
+// Slotted leaf format (DirectoryFormatSlotted). Items area starts with array of slots sorted by name hash,
+// records referenced by slots are packed at the end of area
+struct DirectorySlot
+{
+  uint64_t nameHash;
+  uint16_t recordOffset; // from beginning of items data
+};
+
+struct DirectorySlottedRecord
+{
+  uint64_t inode;
+  uint16_t nameSize;
+  char name[1];
+};
+
+template<unsigned Size>
+struct DirectorySlottedItems
+{
+  static const unsigned MaxDataSize = Size - 2 /*slotsCount*/ - 2 /*recordsOffset*/;
+  static_assert(MaxDataSize <= 0xffff, "Record offsets are 16-bit");
+
+  uint16_t slotsCount;
+  // Records occupy data[recordsOffset, MaxDataSize) without gaps
+  uint16_t recordsOffset;
+  char data[MaxDataSize];
+};
+
+template<unsigned BlockSize>
+struct DirectorySlottedLeafT
+{
+  static const uint64_t NoNextLeaf = std::numeric_limits<uint64_t>::max();
+  typedef DirectorySlottedItems<BlockSize - 8 /*nextLeafNode*/> Items;
+
+  uint64_t nextLeafNode;
+  Items items;
+};
+
+struct DirectorySlottedInode : InodeHeader
+{
+  uint64_t parentDirectoryInode;
+  uint16_t levelsCount;
+  static const unsigned PayloadSize = AddressableBlockSize - sizeof(InodeHeader) - 2 - 8;
+
+  typedef DirectoryInodeT<uint64_t>::IndirectReferences IndirectReferences;
+  typedef DirectorySlottedItems<PayloadSize> DirectReferences;
+
+  union
+  {
+    IndirectReferences indirectReferences;
+    DirectReferences directReferences;
+  };
+};
 
 #pragma pack(pop)
 
+// Format with 32-bit name hash (DirectoryFormatFNV1a32)
+typedef DirectoryTreeLeafItemT<uint32_t> DirectoryTreeLeafItem;
+typedef DirectoryTreeLeafHeaderT<uint32_t> DirectoryTreeLeafHeader;
+typedef DirectoryTreeLeafT<uint32_t> DirectoryTreeLeaf;
+typedef DirectoryTreeChildNodeReferenceT<uint32_t> DirectoryTreeChildNodeReference;
+typedef DirectoryTreeInternalNodeT<uint32_t> DirectoryTreeInternalNode;
+typedef DirectoryInodeT<uint32_t> DirectoryInode;
+
+typedef DirectorySlottedLeafT<AddressableBlockSize> DirectorySlottedLeaf;
+
+static_assert(sizeof(DirectoryTreeLeaf) == AddressableBlockSize, "");
+static_assert(sizeof(DirectoryInode) <= AddressableBlockSize, "");
+static_assert(sizeof(DirectorySlottedLeaf) == AddressableBlockSize, "");
+static_assert(sizeof(DirectorySlottedInode) <= AddressableBlockSize, "");
+
+template<class NameHash>
+struct DirectoryMaxFileNameSize
+{
+  static const unsigned value = DirectoryTreeLeafHeaderT<NameHash>::MaxDataSize
+    - offsetof(DirectoryTreeLeafHeaderT<NameHash>, head) - offsetof(DirectoryTreeLeafItemT<NameHash>, name);
+};
+
+// Limit for all supported directory formats
+static const unsigned MaxFileNameSize = DirectoryMaxFileNameSize<uint64_t>::value;
+static_assert(MaxFileNameSize <= DirectoryMaxFileNameSize<uint32_t>::value, "");
+static_assert(MaxFileNameSize <= DirectorySlottedLeaf::Items::MaxDataSize
+  - sizeof(DirectorySlot) - offsetof(DirectorySlottedRecord, name), "");
+
 }}
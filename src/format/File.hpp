@@ -28,28 +28,28 @@ struct ChildNodeReference
   uint64_t fileOffset;
 };
 
+// Tree nodes fill whole block of storage, so their capacity depends on its block size
 struct BlockRangesInternalNode
 {
-  static const unsigned MaxCount =
-    (AddressableBlockSize - 4 /* isLeafNode + itemsCount */) / sizeof(ChildNodeReference);
+  static unsigned maxCount(unsigned blockSize)
+  {
+    return (blockSize - 4 /* isLeafNode + itemsCount */) / sizeof(ChildNodeReference);
+  }
 
   uint16_t itemsCount;
-  ChildNodeReference children[MaxCount];
+  ChildNodeReference children[1]; // maxCount(blockSize) items
 };
 
 struct BlockRangesLeafNode
 {
-  static const unsigned MaxCount = BlockRangesInternalNode::MaxCount - 1;
+  static unsigned maxCount(unsigned blockSize) { return BlockRangesInternalNode::maxCount(blockSize) - 1; }
   static const uint64_t NoNextLeaf = std::numeric_limits<uint64_t>::max();
 
   uint16_t itemsCount;
   uint64_t nextLeafNode;
-  BlockRange ranges[MaxCount];
+  BlockRange ranges[1]; // maxCount(blockSize) items
 };
 
-static_assert(sizeof(BlockRangesInternalNode) <= AddressableBlockSize, "");
-static_assert(sizeof(BlockRangesLeafNode) <= AddressableBlockSize, "");
-
 #pragma pack(pop)
 
 }}
\ No newline at end of file
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstdint>
+#include "Common.hpp"
+
+namespace f2f { namespace format 
+{
+
+#pragma pack(push,1)
+
+// Inodes of removed files and directories whose blocks aren't released yet.
+// Blocks form a stack, head block is referenced from StorageHeader
+struct OrphanListBlock
+{
+  // List block fills whole block of storage
+  static unsigned maxCount(unsigned blockSize) { return (blockSize - 10) / sizeof(uint64_t); }
+
+  uint64_t nextBlock; // 0 in the last block
+  uint16_t itemsCount;
+  uint64_t inodes[1]; // maxCount(blockSize) items, encoded as DirectoryTreeLeafItem::inode
+};
+
+#pragma pack(pop)
+
+}}
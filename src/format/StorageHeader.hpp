@@ -10,12 +10,35 @@ namespace f2f { namespace format
 struct StorageHeader
 {
   static const uint16_t MagicValue = 0xF2F0;
+  // Version 0 was written before block size was recorded, such storages have 1 KB blocks
+  static const uint8_t CurrentVersion = 1;
+  static const uint8_t BlockSizeLog2Mask = 0x0F;
+  // Header area is padded to AlignedHeaderSize, so that blocks of that size and larger are aligned
+  // to it for direct I/O
+  static const uint8_t AlignedLayoutFlag = 0x80;
+  static const unsigned AlignedHeaderSize = 4096;
 
   uint16_t magic; 
-  char reserved[6];
-  uint64_t occupiedBlocksCount;
+  // Head of orphan list (see OrphanList.hpp), 0 if list is empty. Stored in 48 bits as in BlockRange
+  uint32_t orphanListBlockLo;
+  uint16_t orphanListBlockHi;
+  // Stored in 48 bits, the rest of former 64-bit field was always zero and keeps fields below
+  uint32_t occupiedBlocksCountLo;
+  uint16_t occupiedBlocksCountHi;
+  uint8_t version;
+  // Low bits keep log2 of block size relative to AddressableBlockSize, high bit is AlignedLayoutFlag
+  uint8_t blockSizeAndFlags;
+
+  uint64_t orphanListBlock() const { return orphanListBlockLo + (uint64_t(orphanListBlockHi) << 32); }
+  void setOrphanListBlock(uint64_t index) { orphanListBlockLo = uint32_t(index); orphanListBlockHi = uint16_t(index >> 32); }
+  uint64_t occupiedBlocksCount() const { return occupiedBlocksCountLo + (uint64_t(occupiedBlocksCountHi) << 32); }
+  void setOccupiedBlocksCount(uint64_t count) { occupiedBlocksCountLo = uint32_t(count); occupiedBlocksCountHi = uint16_t(count >> 32); }
+  unsigned blockSizeLog2() const { return blockSizeAndFlags & BlockSizeLog2Mask; }
+  bool alignedLayout() const { return (blockSizeAndFlags & AlignedLayoutFlag) != 0; }
 };
 
+static_assert(sizeof(StorageHeader) == 16, "");
+
 #pragma pack(pop)
 
-}}
\ No newline at end of file
+}}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <boost/container/small_vector.hpp>
+#include "format/Common.hpp"
+
+namespace f2f { namespace util {
+
+// Zero-filled buffer of one block holding structure T, whose trailing array has as many items
+// as fit in the block. Blocks of default size are kept inline, larger ones are allocated on heap.
+// Empty until resized, so that objects kept for later use don't need block size at construction
+template<class T>
+class BlockBuffer
+{
+public:
+  BlockBuffer() = default;
+
+  explicit BlockBuffer(unsigned blockSize)
+  {
+    resize(blockSize);
+  }
+
+  void resize(unsigned blockSize)
+  {
+    m_words.assign(blockSize / sizeof(Word), 0);
+  }
+
+  bool empty() const { return m_words.empty(); }
+  unsigned size() const { return unsigned(m_words.size() * sizeof(Word)); }
+  void * data() { return m_words.data(); }
+  void const * data() const { return m_words.data(); }
+
+  T & operator*() { return *reinterpret_cast<T *>(m_words.data()); }
+  T const & operator*() const { return *reinterpret_cast<T const *>(m_words.data()); }
+  T * operator->() { return &**this; }
+  T const * operator->() const { return &**this; }
+
+private:
+  typedef uint64_t Word; // Keeps structure aligned
+  boost::container::small_vector<Word, format::AddressableBlockSize / sizeof(Word)> m_words;
+};
+
+}}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <boost/utility/string_ref.hpp>
+
+namespace f2f { namespace util {
+
+// Splits path into components in place, without copying.
+// Empty components (repeated or trailing separators) and '.' are skipped, '..' is returned as is.
+class PathTokenizer
+{
+public:
+  explicit PathTokenizer(boost::string_ref path)
+    : m_path(path)
+    , m_isAbsolute(!path.empty() && isSeparator(path.front()))
+  {}
+
+  bool isAbsolute() const { return m_isAbsolute; }
+
+  // Returns false if there are no more components
+  bool next(boost::string_ref & component)
+  {
+    for(;;)
+    {
+      while (!m_path.empty() && isSeparator(m_path.front()))
+        m_path.remove_prefix(1);
+      if (m_path.empty())
+        return false;
+
+      size_t size = 1;
+      while (size < m_path.size() && !isSeparator(m_path[size]))
+        ++size;
+      component = m_path.substr(0, size);
+      m_path.remove_prefix(size);
+
+      if (component.size() != 1 || component.front() != '.')
+        return true;
+    }
+  }
+
+  static bool isSeparator(char c)
+  {
+#if defined(_WIN32)
+    return c == '/' || c == '\\';
+#else
+    return c == '/';
+#endif
+  }
+
+private:
+  boost::string_ref m_path;
+  bool m_isAbsolute;
+};
+
+}}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace f2f { namespace util {
+
+// Shared and exclusive locks of half-open ranges [begin, end). Lock waits while any overlapping
+// range is locked, unless both locks are shared. Locks are expected to be few and short,
+// so held ranges are kept in a plain list
+class RangeLock
+{
+public:
+  void lock(uint64_t begin, uint64_t end, bool exclusive)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_released.wait(lock, [&]{ return !conflicts(begin, end, exclusive); });
+    m_ranges.push_back(Range{begin, end, exclusive});
+  }
+
+  void unlock(uint64_t begin, uint64_t end, bool exclusive)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto range = std::find_if(m_ranges.begin(), m_ranges.end(), [&](Range const & range) {
+        return range.begin == begin && range.end == end && range.exclusive == exclusive;
+      });
+      *range = m_ranges.back();
+      m_ranges.pop_back();
+    }
+    m_released.notify_all();
+  }
+
+  // Locks range for the guard lifetime. Guard created with isEnabled == false does nothing
+  class Guard
+  {
+  public:
+    Guard(RangeLock & rangeLock, uint64_t begin, uint64_t end, bool exclusive, bool isEnabled = true)
+      : m_rangeLock(isEnabled ? &rangeLock : nullptr)
+      , m_begin(begin)
+      , m_end(end)
+      , m_exclusive(exclusive)
+    {
+      if (m_rangeLock)
+        m_rangeLock->lock(m_begin, m_end, m_exclusive);
+    }
+
+    ~Guard()
+    {
+      if (m_rangeLock)
+        m_rangeLock->unlock(m_begin, m_end, m_exclusive);
+    }
+
+    Guard(Guard const &) = delete;
+    void operator=(Guard const &) = delete;
+
+  private:
+    RangeLock * const m_rangeLock;
+    uint64_t const m_begin;
+    uint64_t const m_end;
+    bool const m_exclusive;
+  };
+
+private:
+  struct Range
+  {
+    uint64_t begin;
+    uint64_t end;
+    bool exclusive;
+  };
+
+  std::mutex m_mutex;
+  std::condition_variable m_released;
+  std::vector<Range> m_ranges;
+
+  bool conflicts(uint64_t begin, uint64_t end, bool exclusive) const
+  {
+    return std::any_of(m_ranges.begin(), m_ranges.end(), [&](Range const & range) {
+      return range.begin < end && begin < range.end && (exclusive || range.exclusive);
+    });
+  }
+};
+
+}}
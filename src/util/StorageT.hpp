@@ -2,21 +2,35 @@
 
 #include "f2f/IStorage.hpp"
 #include "BlockStorage.hpp"
+#include "BlockBuffer.hpp"
 
 namespace f2f { namespace util {
 
 template<class T>
-inline void readT(IStorage const & storage, BlockAddress blockIndex, T & obj)
+inline void readT(BlockStorage const & blockStorage, BlockAddress blockIndex, T & obj)
 {
   static_assert(!std::is_pointer<T>::value, ""); // Protection against pointer reading
-  storage.read(blockIndex.absoluteAddress(), sizeof(T), &obj);
+  blockStorage.storage().read(blockStorage.absoluteAddress(blockIndex), sizeof(T), &obj);
 }
 
 template<class T>
-inline void writeT(IStorage & storage, BlockAddress blockIndex, T const & obj)
+inline void writeT(BlockStorage const & blockStorage, BlockAddress blockIndex, T const & obj)
 {
   static_assert(!std::is_pointer<T>::value, ""); // Protection against pointer writing
-  storage.write(blockIndex.absoluteAddress(), sizeof(T), &obj);
+  blockStorage.storage().write(blockStorage.absoluteAddress(blockIndex), sizeof(T), &obj);
 }
 
-}}
\ No newline at end of file
+// Whole block is transferred
+template<class T>
+inline void readT(BlockStorage const & blockStorage, BlockAddress blockIndex, BlockBuffer<T> & buffer)
+{
+  blockStorage.storage().read(blockStorage.absoluteAddress(blockIndex), buffer.size(), buffer.data());
+}
+
+template<class T>
+inline void writeT(BlockStorage const & blockStorage, BlockAddress blockIndex, BlockBuffer<T> const & buffer)
+{
+  blockStorage.storage().write(blockStorage.absoluteAddress(blockIndex), buffer.size(), buffer.data());
+}
+
+}}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace f2f { namespace util {
+
+// Fixed set of threads running posted tasks in FIFO order. Exceptions thrown by tasks are ignored.
+// Destructor waits until posted tasks are done. Pool may be destroyed from its own task:
+// that thread is detached and finishes remaining tasks
+class ThreadPool
+{
+public:
+  explicit ThreadPool(unsigned threadsCount)
+    : m_state(std::make_shared<State>())
+  {
+    m_threads.reserve(threadsCount);
+    for(unsigned i = 0; i < threadsCount; ++i)
+      m_threads.emplace_back(&ThreadPool::run, m_state);
+  }
+
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_state->mutex);
+      m_state->isStopping = true;
+    }
+    m_state->changed.notify_all();
+    for(auto & thread: m_threads)
+      if (thread.get_id() == std::this_thread::get_id())
+        thread.detach();
+      else
+        thread.join();
+  }
+
+  ThreadPool(ThreadPool const &) = delete;
+  void operator=(ThreadPool const &) = delete;
+
+  // Pool isn't touched after the task is queued, so the task may destroy it
+  void post(std::function<void()> && task)
+  {
+    std::shared_ptr<State> const state = m_state;
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->tasks.push_back(std::move(task));
+    }
+    state->changed.notify_one();
+  }
+
+private:
+  // Shared with threads, so that detached thread doesn't outlive it
+  struct State
+  {
+    State()
+      : isStopping(false)
+    {}
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::function<void()>> tasks;
+    bool isStopping;
+  };
+
+  std::shared_ptr<State> const m_state;
+  std::vector<std::thread> m_threads;
+
+  static void run(std::shared_ptr<State> state)
+  {
+    for(;;)
+    {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->changed.wait(lock, [&state]{ return state->isStopping || !state->tasks.empty(); });
+        if (state->tasks.empty())
+          return;
+        task = std::move(state->tasks.front());
+        state->tasks.pop_front();
+      }
+      try
+      {
+        task();
+      }
+      catch (...)
+      {}
+    }
+  }
+};
+
+}}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <boost/endian/conversion.hpp>
+
+namespace f2f { namespace util {
+
+// XXH64 (https://github.com/Cyan4973/xxHash) with zero seed. Processes input by 8-byte words
+namespace detail
+{
+  const uint64_t XXH64Prime1 = UINT64_C(0x9E3779B185EBCA87);
+  const uint64_t XXH64Prime2 = UINT64_C(0xC2B2AE3D27D4EB4F);
+  const uint64_t XXH64Prime3 = UINT64_C(0x165667B19E3779F9);
+  const uint64_t XXH64Prime4 = UINT64_C(0x85EBCA77C2B2AE63);
+  const uint64_t XXH64Prime5 = UINT64_C(0x27D4EB2F165667C5);
+
+  inline uint64_t RotL64(uint64_t x, unsigned r)
+  {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  inline uint64_t ReadLE64(const char * p)
+  {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return boost::endian::little_to_native(value);
+  }
+
+  inline uint32_t ReadLE32(const char * p)
+  {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return boost::endian::little_to_native(value);
+  }
+
+  inline uint64_t XXH64Round(uint64_t acc, uint64_t input)
+  {
+    acc += input * XXH64Prime2;
+    acc = RotL64(acc, 31);
+    return acc * XXH64Prime1;
+  }
+
+  inline uint64_t XXH64MergeRound(uint64_t acc, uint64_t value)
+  {
+    acc ^= XXH64Round(0, value);
+    return acc * XXH64Prime1 + XXH64Prime4;
+  }
+}
+
+inline uint64_t HashXXH64(const char * it, const char * end)
+{
+  using namespace detail;
+
+  size_t const size = end - it;
+  uint64_t hash;
+  if (size >= 32)
+  {
+    uint64_t v1 = XXH64Prime1 + XXH64Prime2;
+    uint64_t v2 = XXH64Prime2;
+    uint64_t v3 = 0;
+    uint64_t v4 = 0 - XXH64Prime1;
+    for (; end - it >= 32; it += 32)
+    {
+      v1 = XXH64Round(v1, ReadLE64(it));
+      v2 = XXH64Round(v2, ReadLE64(it + 8));
+      v3 = XXH64Round(v3, ReadLE64(it + 16));
+      v4 = XXH64Round(v4, ReadLE64(it + 24));
+    }
+    hash = RotL64(v1, 1) + RotL64(v2, 7) + RotL64(v3, 12) + RotL64(v4, 18);
+    hash = XXH64MergeRound(hash, v1);
+    hash = XXH64MergeRound(hash, v2);
+    hash = XXH64MergeRound(hash, v3);
+    hash = XXH64MergeRound(hash, v4);
+  }
+  else
+    hash = XXH64Prime5;
+
+  hash += size;
+
+  for (; end - it >= 8; it += 8)
+  {
+    hash ^= XXH64Round(0, ReadLE64(it));
+    hash = RotL64(hash, 27) * XXH64Prime1 + XXH64Prime4;
+  }
+  if (end - it >= 4)
+  {
+    hash ^= uint64_t(ReadLE32(it)) * XXH64Prime1;
+    hash = RotL64(hash, 23) * XXH64Prime2 + XXH64Prime3;
+    it += 4;
+  }
+  for (; it != end; ++it)
+  {
+    hash ^= uint64_t(static_cast<unsigned char>(*it)) * XXH64Prime5;
+    hash = RotL64(hash, 11) * XXH64Prime1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= XXH64Prime2;
+  hash ^= hash >> 29;
+  hash *= XXH64Prime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+}}
@@ -0,0 +1,91 @@
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <future>
+#include "f2f/Awaitable.hpp"
+#include "f2f/FileStorage.hpp"
+#include "f2f/FileSystemError.hpp"
+#include "StorageInMemory.hpp"
+
+namespace
+{
+  // Coroutine that starts at once and reports its end to the future
+  struct Task
+  {
+    struct promise_type
+    {
+      std::promise<void> done;
+
+      Task get_return_object() { return Task{done.get_future()}; }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() { done.set_value(); }
+      void unhandled_exception() { done.set_exception(std::current_exception()); }
+    };
+
+    std::future<void> finished;
+  };
+
+  Task WriteAndRead(f2f::FileSystem & fs, std::string const & data, std::string & result)
+  {
+    f2f::FileDescriptor file = co_await f2f::coro::open(fs, "file", f2f::OpenMode::ReadWrite);
+    co_await f2f::coro::write(file, 0, data.size(), data.data());
+    co_await f2f::coro::write(file, data.size(), data.size(), data.data());
+    std::string buffer(data.size() * 2 + 1, ' ');
+    size_t const readSize = co_await f2f::coro::read(file, 0, buffer.size(), &buffer[0]);
+    result = buffer.substr(0, readSize);
+    file.close();
+    co_await f2f::coro::remove(fs, "file");
+  }
+
+  Task ReadClosed(f2f::FileSystem & fs, f2f::ErrorCode & errorCode)
+  {
+    f2f::FileDescriptor file = co_await f2f::coro::open(fs, "missing", f2f::OpenMode::ReadOnly, false);
+    char buffer[10];
+    try
+    {
+      co_await f2f::coro::read(file, 0, sizeof(buffer), buffer);
+    }
+    catch (f2f::FileSystemError const & e)
+    {
+      errorCode = e.code();
+    }
+  }
+
+  Task RemoveMissing(f2f::FileSystem & fs)
+  {
+    co_await f2f::coro::remove(fs, "missing");
+  }
+
+  void TestAwaitables(f2f::FileSystem & fs)
+  {
+    std::string data(300'000, ' ');
+    for(size_t i = 0; i < data.size(); ++i)
+      data[i] = char(i * 7 + i / 1000);
+    std::string result;
+    WriteAndRead(fs, data, result).finished.get();
+    EXPECT_EQ(data + data, result);
+    EXPECT_FALSE(fs.exists("file"));
+
+    f2f::ErrorCode errorCode = f2f::ErrorCode::InvalidArgument;
+    ReadClosed(fs, errorCode).finished.get();
+    EXPECT_EQ(f2f::ErrorCode::OperationRequiresOpenedFile, errorCode);
+    EXPECT_THROW(RemoveMissing(fs).finished.get(), f2f::FileSystemError);
+  }
+}
+
+TEST(Awaitable, StorageInMemory)
+{
+  f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(new StorageInMemory(f2f::OpenMode::ReadWrite)), true);
+  TestAwaitables(fs);
+}
+
+TEST(Awaitable, UringFileStorage)
+{
+  static const char FileStorageName[] = "f2f_AwaitableUring.stg";
+  {
+    f2f::FileSystem fs(f2f::OpenUringFileStorage(FileStorageName), true);
+    TestAwaitables(fs);
+    fs.check();
+  }
+  std::remove(FileStorageName);
+}
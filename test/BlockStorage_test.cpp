@@ -1,4 +1,5 @@
 #include <gtest/gtest.h>
+#include <algorithm>
 #include <random>
 #include <memory>
 
@@ -62,7 +63,7 @@ TEST(BlockStorage, T3)
     f2f::BlockStorage blockStorage(storage, true);
 
     std::set<f2f::BlockAddress, BlockAddressLess> allocated;
-    blockStorage.allocateBlocks(f2f::format::OccupancyBlock::BitmapItemsCount, [&allocated](f2f::BlockAddress const & block)
+    blockStorage.allocateBlocks(blockStorage.blocksInGroup(), [&allocated](f2f::BlockAddress const & block)
     {
       EXPECT_TRUE(allocated.insert(block).second);
     });
@@ -92,6 +93,94 @@ TEST(BlockStorage, T3)
   }
 }
 
+TEST(BlockStorage, ReleaseExtents)
+{
+  StorageInMemory storage;
+  {
+    f2f::BlockStorage blockStorage(storage, true);
+
+    std::set<f2f::BlockAddress, BlockAddressLess> allocated;
+    blockStorage.allocateBlocks(30000, [&allocated](f2f::BlockAddress const & block)
+    {
+      EXPECT_TRUE(allocated.insert(block).second);
+    });
+
+    // Extents of different sizes, spanning occupancy groups and passed unsorted
+    std::vector<f2f::BlockStorage::Extent> extents;
+    for(uint64_t blockIndex = 1; blockIndex + 20 < 30000; blockIndex += 37)
+      extents.emplace_back(f2f::BlockAddress::fromBlockIndex(blockIndex), static_cast<unsigned>(blockIndex % 20 + 1));
+    extents.emplace_back(f2f::BlockAddress::fromBlockIndex(8000), 400);
+    std::shuffle(extents.begin(), extents.end(), std::minstd_rand());
+    // Remove extents overlapping the large one
+    extents.erase(std::remove_if(extents.begin(), extents.end(), [](f2f::BlockStorage::Extent const & extent)
+      {
+        return extent.second != 400
+          && extent.first.index() + extent.second > 8000 && extent.first.index() < 8400;
+      }), extents.end());
+    for(auto const & extent: extents)
+      for(unsigned i = 0; i < extent.second; ++i)
+        allocated.erase(f2f::BlockAddress::fromBlockIndex(extent.first.index() + i));
+    blockStorage.releaseExtents(extents);
+    blockStorage.check();
+
+    std::vector<f2f::BlockAddress> checkAllocated;
+    blockStorage.enumerateAllocatedBlocks([&checkAllocated](f2f::BlockAddress const & block)
+    {
+      checkAllocated.push_back(block);
+    });
+    EXPECT_TRUE(std::equal(allocated.begin(), allocated.end(), checkAllocated.begin(), checkAllocated.end()));
+
+    // Released blocks of the first, previously full, group are reused
+    EXPECT_EQ(1, blockStorage.allocateBlock().index());
+    allocated.insert(f2f::BlockAddress::fromBlockIndex(1));
+
+    extents.clear();
+    for(auto block: allocated)
+      extents.emplace_back(block, 1);
+    blockStorage.releaseExtents(extents);
+    blockStorage.check();
+  }
+  EXPECT_EQ(sizeof(f2f::format::StorageHeader), storage.size());
+  {
+    // Reopening storage
+    f2f::BlockStorage blockStorage(storage);
+  }
+}
+
+TEST(BlockStorage, AlignedLayout)
+{
+  uint64_t const headerSize = f2f::format::StorageHeader::AlignedHeaderSize;
+  StorageInMemory storage;
+  std::vector<f2f::BlockAddress> allocated;
+  {
+    f2f::BlockStorage blockStorage(storage, true, 2, true);
+    EXPECT_EQ(headerSize, storage.size());
+    blockStorage.allocateBlocks(100, [&allocated](f2f::BlockAddress const & block)
+    {
+      allocated.push_back(block);
+    });
+    for(auto const & block: allocated)
+      EXPECT_EQ(0, blockStorage.absoluteAddress(block) % 4096);
+    EXPECT_EQ(0, storage.size() % 4096);
+  }
+  {
+    // Layout is read from header when storage is reopened
+    f2f::BlockStorage blockStorage(storage);
+    EXPECT_EQ(4096, blockStorage.blockSize());
+    EXPECT_EQ(headerSize + 4096, blockStorage.absoluteAddress(allocated.front()));
+    blockStorage.allocateBlocks(100, [&allocated](f2f::BlockAddress const & block)
+    {
+      allocated.push_back(block);
+    });
+    blockStorage.check();
+    std::sort(allocated.begin(), allocated.end(), BlockAddressLess());
+    EXPECT_TRUE(std::adjacent_find(allocated.begin(), allocated.end(),
+      [](f2f::BlockAddress lhs, f2f::BlockAddress rhs) { return lhs.index() == rhs.index(); }) == allocated.end());
+    blockStorage.releaseBlocks(allocated.front(), unsigned(allocated.size()));
+    blockStorage.check();
+  }
+  EXPECT_EQ(headerSize, storage.size());
+}
 
 TEST(BlockStorage, Random_Slow)
 {
@@ -0,0 +1,53 @@
+#include <gtest/gtest.h>
+#include "DirectoryEntryCache.hpp"
+
+using namespace f2f;
+
+TEST(DirectoryEntryCache, FindAndInvalidate)
+{
+  DirectoryEntryCache cache(16);
+  BlockAddress const dir1 = BlockAddress::fromBlockIndex(1);
+  BlockAddress const dir2 = BlockAddress::fromBlockIndex(2);
+  BlockAddress const file = BlockAddress::fromBlockIndex(10);
+
+  EXPECT_FALSE(cache.find(dir1, "a"));
+  cache.insert(dir1, "a", std::make_pair(file, FileType::Regular));
+  cache.insert(dir1, "b", DirectoryEntryCache::Entry());
+  cache.insert(dir2, "a", std::make_pair(file, FileType::Directory));
+
+  auto found = cache.find(dir1, "a");
+  ASSERT_TRUE(found);
+  ASSERT_TRUE(*found);
+  EXPECT_EQ(file, (*found)->first);
+  EXPECT_EQ(FileType::Regular, (*found)->second);
+
+  // Negative entry
+  found = cache.find(dir1, "b");
+  ASSERT_TRUE(found);
+  EXPECT_FALSE(*found);
+
+  cache.invalidate(dir1, "a");
+  EXPECT_FALSE(cache.find(dir1, "a"));
+  EXPECT_TRUE(cache.find(dir2, "a"));
+
+  cache.invalidateDirectory(dir1);
+  EXPECT_FALSE(cache.find(dir1, "b"));
+  EXPECT_TRUE(cache.find(dir2, "a"));
+  EXPECT_EQ(1, cache.size());
+}
+
+TEST(DirectoryEntryCache, Eviction)
+{
+  DirectoryEntryCache cache(3);
+  BlockAddress const dir = BlockAddress::fromBlockIndex(1);
+  cache.insert(dir, "a", DirectoryEntryCache::Entry());
+  cache.insert(dir, "b", DirectoryEntryCache::Entry());
+  cache.insert(dir, "c", DirectoryEntryCache::Entry());
+  EXPECT_TRUE(cache.find(dir, "a")); // "b" is least recently used now
+  cache.insert(dir, "d", DirectoryEntryCache::Entry());
+  EXPECT_EQ(3, cache.size());
+  EXPECT_TRUE(cache.find(dir, "a"));
+  EXPECT_FALSE(cache.find(dir, "b"));
+  EXPECT_TRUE(cache.find(dir, "c"));
+  EXPECT_TRUE(cache.find(dir, "d"));
+}
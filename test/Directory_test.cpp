@@ -1,9 +1,13 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <memory>
 #include <random>
+#include <set>
 #include "Directory.hpp"
 #include "StorageInMemory.hpp"
 #include "util/FNVHash.hpp"
+#include "util/XXHash.hpp"
 #include "util/StorageT.hpp"
 
 namespace
@@ -27,6 +31,15 @@ namespace
     {"altarage", "zinke"},
     {"altarages", "zinkes"}
   };
+
+  void RandomFill(uint16_t formatVersion);
+
+  uint64_t CountAllocatedBlocks(f2f::BlockStorage const & blockStorage)
+  {
+    uint64_t count = 0;
+    blockStorage.enumerateAllocatedBlocks([&count](f2f::BlockAddress const &) { ++count; });
+    return count;
+  }
 }
 
 TEST(Directory, CheckCollisionPairs)
@@ -37,7 +50,312 @@ TEST(Directory, CheckCollisionPairs)
       f2f::util::HashFNV1a_32(p.second.data(), p.second.data() + p.second.size()));
 }
 
+TEST(Directory, XXHashVectors)
+{
+  auto hash = [](std::string const & s) { return f2f::util::HashXXH64(s.data(), s.data() + s.size()); };
+  EXPECT_EQ(UINT64_C(0xef46db3751d8e999), hash(""));
+  EXPECT_EQ(UINT64_C(0xd24ec4f1a98c6e5b), hash("a"));
+  EXPECT_EQ(UINT64_C(0x44bc2cf5ad770999), hash("abc"));
+  EXPECT_EQ(UINT64_C(0xfbcea83c8a378bf1), hash("Nobody inspects the spammish repetition"));
+}
+
+TEST(Directory, NoCollisionsInXXHash)
+{
+  for(auto const & p: HashCollisions)
+    EXPECT_NE(
+      f2f::util::HashXXH64(p.first.data(), p.first.data() + p.first.size()),
+      f2f::util::HashXXH64(p.second.data(), p.second.data() + p.second.size()));
+}
+
+TEST(Directory, ConvertFormat)
+{
+  std::minstd_rand random_engine;
+  StorageInMemory storage;
+  f2f::BlockStorage blockStorage(storage, true);
+  f2f::BlockAddress inodeAddress;
+  std::map<std::string, uint64_t> items;
+  {
+    f2f::Directory directory(blockStorage, f2f::Directory::NoParentDirectory, f2f::Directory::create_tag(),
+      f2f::format::DirectoryFormatFNV1a32);
+    inodeAddress = directory.inodeAddress();
+    for(int i = 0; i < 5000; ++i)
+    {
+      std::string name = CreateRandomString(random_engine);
+      if (items.insert(std::make_pair(name, i)).second)
+        directory.addFile(f2f::BlockAddress::fromBlockIndex(i), 
+          i % 2 ? f2f::FileType::Regular : f2f::FileType::Directory, name);
+    }
+    directory.check();
+  }
+
+  f2f::Directory directory(blockStorage, inodeAddress);
+  EXPECT_EQ(f2f::format::DirectoryFormatFNV1a32, directory.formatVersion());
+  directory.convert(f2f::format::DirectoryFormatCurrent);
+  EXPECT_EQ(f2f::format::DirectoryFormatCurrent, directory.formatVersion());
+  EXPECT_EQ(inodeAddress, directory.inodeAddress());
+  directory.check();
+
+  f2f::Directory reopened(blockStorage, inodeAddress);
+  EXPECT_EQ(f2f::format::DirectoryFormatCurrent, reopened.formatVersion());
+  EXPECT_EQ(inodeAddress, reopened.parentInodeAddress());
+  for(auto const & item: items)
+  {
+    auto res = reopened.searchFile(item.first);
+    ASSERT_TRUE(res);
+    EXPECT_EQ(item.second, res->first.index());
+    EXPECT_EQ(item.second % 2 ? f2f::FileType::Regular : f2f::FileType::Directory, res->second);
+  }
+}
+
+TEST(Directory, RemoveReleasesNodes)
+{
+  for(uint16_t formatVersion: { 
+    f2f::format::DirectoryFormatFNV1a32, f2f::format::DirectoryFormatSlotted })
+  {
+    std::minstd_rand random_engine;
+    StorageInMemory storage;
+    f2f::BlockStorage blockStorage(storage, true);
+    auto const initialBlocksCount = CountAllocatedBlocks(blockStorage);
+    f2f::Directory directory(blockStorage, f2f::Directory::NoParentDirectory, f2f::Directory::create_tag(), formatVersion);
+
+    std::vector<std::string> names;
+    std::set<std::string> uniqueNames;
+    for(int i = 0; i < 5000; ++i)
+    {
+      std::string name = CreateRandomString(random_engine);
+      if (i % 500 == 0)
+      {
+        auto const & collision = HashCollisions[(i / 500) % (std::end(HashCollisions) - std::begin(HashCollisions))];
+        name = i % 1000 == 0 ? collision.first : collision.second;
+      }
+      if (uniqueNames.insert(name).second)
+      {
+        directory.addFile(f2f::BlockAddress::fromBlockIndex(names.size()), f2f::FileType::Regular, name);
+        names.push_back(name);
+      }
+    }
+    auto const filledBlocksCount = CountAllocatedBlocks(blockStorage);
+
+    std::set<std::string> remainingNames;
+    for(size_t i = 0; i < names.size(); ++i)
+    {
+      if (i % 100 == 0)
+        remainingNames.insert(names[i]);
+      else
+        EXPECT_TRUE(directory.removeFile(names[i]));
+    }
+    directory.check();
+    EXPECT_LT(CountAllocatedBlocks(blockStorage) - initialBlocksCount, (filledBlocksCount - initialBlocksCount) / 10);
+
+    std::set<std::string> listedNames;
+    for(f2f::Directory::Iterator it(directory); !it.eof(); it.moveNext())
+      listedNames.insert(it.currentName().to_string());
+    EXPECT_TRUE(remainingNames == listedNames);
+
+    for(auto const & name: remainingNames)
+      EXPECT_TRUE(directory.removeFile(name));
+    directory.check();
+    EXPECT_TRUE(f2f::Directory::Iterator(directory).eof());
+    // Only inode remains
+    EXPECT_EQ(initialBlocksCount + 1, CountAllocatedBlocks(blockStorage));
+  }
+}
+
+TEST(Directory, ResumeIteration)
+{
+  for(uint16_t formatVersion: { 
+    f2f::format::DirectoryFormatFNV1a32, f2f::format::DirectoryFormatSlotted })
+  {
+    std::minstd_rand random_engine;
+    StorageInMemory storage;
+    f2f::BlockStorage blockStorage(storage, true);
+    f2f::Directory directory(blockStorage, f2f::Directory::NoParentDirectory, f2f::Directory::create_tag(), formatVersion);
+
+    std::set<std::string> collisionNames;
+    for(auto const & collision: HashCollisions)
+    {
+      collisionNames.insert(collision.first);
+      collisionNames.insert(collision.second);
+    }
+    std::set<std::string> names = collisionNames;
+    while (names.size() < 3000)
+      names.insert(CreateRandomString(random_engine));
+    for(auto const & name: names)
+      directory.addFile(f2f::BlockAddress::fromBlockIndex(1000), f2f::FileType::Regular, name);
+
+    // Current item is removed and a new one is added before resuming from position after it
+    std::multiset<std::string> listedNames;
+    std::set<std::string> modifiedNames;
+    std::unique_ptr<f2f::Directory::Iterator> it(new f2f::Directory::Iterator(directory));
+    for(int i = 0; !it->eof(); ++i)
+    {
+      std::string const name = it->currentName().to_string();
+      listedNames.insert(name);
+      if (i % 37 == 0 || collisionNames.count(name) != 0)
+      {
+        f2f::Directory::Iterator::Position position = it->position();
+        position.passedNames.push_back(name);
+        it.reset();
+        EXPECT_TRUE(directory.removeFile(name));
+        modifiedNames.insert(name);
+        std::string newName = CreateRandomString(random_engine);
+        if (names.insert(newName).second)
+        {
+          directory.addFile(f2f::BlockAddress::fromBlockIndex(1000), f2f::FileType::Regular, newName);
+          modifiedNames.insert(newName);
+        }
+        it.reset(new f2f::Directory::Iterator(directory, position));
+      }
+      else
+        it->moveNext();
+    }
+    directory.check();
+
+    for(auto const & name: listedNames)
+      EXPECT_EQ(1, listedNames.count(name));
+    for(auto const & name: names)
+    {
+      if (modifiedNames.count(name) == 0)
+      {
+        EXPECT_EQ(1, listedNames.count(name));
+      }
+    }
+  }
+}
+
+TEST(Directory, AddFiles)
+{
+  for(uint16_t formatVersion: {
+    f2f::format::DirectoryFormatFNV1a32, f2f::format::DirectoryFormatSlotted })
+  {
+    std::minstd_rand random_engine;
+    StorageInMemory storage;
+    f2f::BlockStorage blockStorage(storage, true);
+    f2f::Directory directory(blockStorage, f2f::Directory::NoParentDirectory, f2f::Directory::create_tag(), formatVersion);
+
+    std::map<std::string, uint64_t> items;
+    auto addBatch = [&](size_t count)
+    {
+      std::vector<std::string> names;
+      for(auto const & p: HashCollisions)
+        if (items.find(p.first) == items.end())
+        {
+          names.push_back(p.first);
+          names.push_back(p.second);
+        }
+      while (names.size() < count)
+      {
+        std::string name = CreateRandomString(random_engine);
+        if (items.find(name) == items.end() && std::find(names.begin(), names.end(), name) == names.end())
+          names.push_back(name);
+      }
+      std::vector<f2f::Directory::NewFile> files;
+      for(auto const & name: names)
+      {
+        items[name] = items.size();
+        files.push_back(f2f::Directory::NewFile{f2f::BlockAddress::fromBlockIndex(items[name]), f2f::FileType::Regular, name});
+      }
+      directory.addFiles(files);
+      directory.check();
+    };
+
+    addBatch(1);    // Fits in inode
+    addBatch(3000); // Built bottom-up
+    addBatch(20);   // Merged into leaves
+    addBatch(5000);
+
+    for(auto const & item: items)
+    {
+      auto res = directory.searchFile(item.first);
+      ASSERT_TRUE(res);
+      EXPECT_EQ(item.second, res->first.index());
+    }
+    size_t listedCount = 0;
+    for(f2f::Directory::Iterator it(directory); !it.eof(); it.moveNext())
+      ++listedCount;
+    EXPECT_EQ(items.size(), listedCount);
+
+    // Existing or repeated name - nothing is added
+    auto const blocksCount = CountAllocatedBlocks(blockStorage);
+    std::string const newName = "new name";
+    EXPECT_THROW(directory.addFiles({
+      { f2f::BlockAddress::fromBlockIndex(0), f2f::FileType::Regular, newName },
+      { f2f::BlockAddress::fromBlockIndex(1), f2f::FileType::Regular, items.begin()->first }}),
+      f2f::Directory::FileExistsError);
+    EXPECT_THROW(directory.addFiles({
+      { f2f::BlockAddress::fromBlockIndex(0), f2f::FileType::Regular, newName },
+      { f2f::BlockAddress::fromBlockIndex(1), f2f::FileType::Regular, newName }}),
+      f2f::Directory::FileExistsError);
+    EXPECT_FALSE(directory.searchFile(newName));
+    EXPECT_EQ(blocksCount, CountAllocatedBlocks(blockStorage));
+  }
+}
+
+TEST(Directory, ReplaceFile)
+{
+  for(uint16_t formatVersion: {
+    f2f::format::DirectoryFormatFNV1a32, f2f::format::DirectoryFormatSlotted })
+  {
+    for(size_t filesCount: { 8, 3000 }) // In inode and in tree
+    {
+      std::minstd_rand random_engine;
+      StorageInMemory storage;
+      f2f::BlockStorage blockStorage(storage, true);
+      f2f::Directory directory(blockStorage, f2f::Directory::NoParentDirectory, f2f::Directory::create_tag(), formatVersion);
+
+      std::map<std::string, uint64_t> items;
+      std::vector<f2f::Directory::NewFile> files;
+      for(auto const & p: HashCollisions)
+      {
+        items[p.first] = items.size();
+        items[p.second] = items.size();
+      }
+      while (items.size() < filesCount)
+        items.insert(std::make_pair(CreateRandomString(random_engine), items.size()));
+      for(auto const & item: items)
+        files.push_back(f2f::Directory::NewFile{f2f::BlockAddress::fromBlockIndex(item.second), f2f::FileType::Regular, item.first});
+      directory.addFiles(files);
+      auto const blocksCount = CountAllocatedBlocks(blockStorage);
+
+      for(auto & item: items)
+        if (item.second % 3 == 0)
+        {
+          auto replaced = directory.replaceFile(item.first, f2f::BlockAddress::fromBlockIndex(item.second + 100000),
+            f2f::FileType::Directory);
+          ASSERT_TRUE(replaced);
+          EXPECT_EQ(item.second, replaced->first.index());
+          EXPECT_EQ(f2f::FileType::Regular, replaced->second);
+          item.second += 100000;
+        }
+      EXPECT_FALSE(directory.replaceFile("new name", f2f::BlockAddress::fromBlockIndex(1), f2f::FileType::Regular));
+      EXPECT_EQ(blocksCount, CountAllocatedBlocks(blockStorage));
+      directory.check();
+
+      f2f::Directory reopened(blockStorage, directory.inodeAddress());
+      for(auto const & item: items)
+      {
+        auto res = reopened.searchFile(item.first);
+        ASSERT_TRUE(res);
+        EXPECT_EQ(item.second, res->first.index());
+        EXPECT_EQ(item.second >= 100000 ? f2f::FileType::Directory : f2f::FileType::Regular, res->second);
+      }
+    }
+  }
+}
+
 TEST(Directory, RandomFillSlow)
+{
+  RandomFill(f2f::format::DirectoryFormatCurrent);
+}
+
+TEST(Directory, RandomFillFNV1a32Slow)
+{
+  RandomFill(f2f::format::DirectoryFormatFNV1a32);
+}
+
+namespace
+{
+void RandomFill(uint16_t formatVersion)
 {
   std::minstd_rand random_engine;
   static const int RepeatCount = 3;
@@ -47,7 +365,7 @@ TEST(Directory, RandomFillSlow)
     StorageInMemory storage;
     std::unique_ptr<f2f::BlockStorage> blockStorage(new f2f::BlockStorage(storage, true));
     std::unique_ptr<f2f::Directory> directory(
-      new f2f::Directory(*blockStorage, f2f::Directory::NoParentDirectory, f2f::Directory::create_tag()));
+      new f2f::Directory(*blockStorage, f2f::Directory::NoParentDirectory, f2f::Directory::create_tag(), formatVersion));
   
     {
       f2f::Directory::Iterator it(*directory);
@@ -102,7 +420,7 @@ TEST(Directory, RandomFillSlow)
         for(f2f::Directory::Iterator it(*directory); !it.eof(); it.moveNext())
         {
           EXPECT_EQ(f2f::FileType::Regular, it.currentFileType());
-          EXPECT_TRUE(listed_items.insert(std::make_pair(it.currentName(), it.currentInode().index())).second);
+          EXPECT_TRUE(listed_items.insert(std::make_pair(it.currentName().to_string(), it.currentInode().index())).second);
         }
         EXPECT_TRUE(items == listed_items);
       }
@@ -116,3 +434,4 @@ TEST(Directory, RandomFillSlow)
     }
   }
 }
+}
@@ -1,5 +1,11 @@
 #include <gtest/gtest.h>
+#include <cstdio>
+#include <future>
+#include <set>
+#include <thread>
 #include "f2f/FileSystem.hpp"
+#include "f2f/FileStorage.hpp"
+#include "f2f/FileSystemError.hpp"
 #include "StorageInMemory.hpp"
 
 TEST(FileSystem, Basic)
@@ -51,6 +57,124 @@ TEST(FileSystem, DeleteOpenedFile)
   }
 }
 
+TEST(FileSystem, SharedOpenedFile)
+{
+  std::string const testString("0123456789");
+  f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(new StorageInMemory(f2f::OpenMode::ReadWrite)), true);
+  fs.open("file", f2f::OpenMode::ReadWrite).write(testString.size(), testString.data());
+
+  // Descriptors of one file have own positions
+  auto file1 = fs.open("file");
+  auto file2 = fs.open("file");
+  file1.seek(4);
+  char buf[3] = {};
+  size_t size = sizeof(buf);
+  file1.read(size, buf);
+  EXPECT_EQ("456", std::string(buf, size));
+  EXPECT_EQ(0, file2.position());
+  size = sizeof(buf);
+  file2.read(size, buf);
+  EXPECT_EQ("012", std::string(buf, size));
+  EXPECT_EQ(7, file1.position());
+  EXPECT_THROW(fs.open("file", f2f::OpenMode::ReadWrite), f2f::FileSystemError);
+
+  // File is reopened after all descriptors are closed
+  file1.close();
+  file2.close();
+  {
+    auto file = fs.open("file", f2f::OpenMode::ReadWrite);
+    file.seek(5);
+    file.truncate();
+  }
+  auto file3 = fs.open("file");
+  auto file4 = fs.open("file");
+  EXPECT_EQ(5, file3.size());
+  EXPECT_EQ(5, file4.size());
+}
+
+TEST(FileSystem, SharedWriters)
+{
+  static const int ThreadsCount = 4;
+  static const int ChunksCount = 16;
+  static const size_t ChunkSize = 10'000;
+  f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(new StorageInMemory(f2f::OpenMode::ReadWrite)), true);
+  {
+    // Preallocate file
+    auto file = fs.open("file", f2f::OpenMode::SharedReadWrite);
+    file.writeAt(ChunksCount * ChunkSize - 1, 1, "");
+    EXPECT_EQ(0, file.position());
+    EXPECT_THROW(fs.open("file", f2f::OpenMode::ReadWrite), f2f::FileSystemError);
+    EXPECT_THROW(fs.open("file", f2f::OpenMode::ReadOnly), f2f::FileSystemError);
+  }
+
+  std::vector<std::thread> threads;
+  for(int t = 0; t < ThreadsCount; ++t)
+    threads.emplace_back([&fs, t]
+    {
+      auto file = fs.open("file", f2f::OpenMode::SharedReadWrite);
+      for(int chunk = t; chunk < ChunksCount; chunk += ThreadsCount)
+      {
+        std::string const data(ChunkSize, char('a' + chunk));
+        file.writeAt(chunk * ChunkSize, data.size(), data.data());
+      }
+    });
+  for(auto & thread: threads)
+    thread.join();
+
+  auto file = fs.open("file");
+  EXPECT_EQ(ChunksCount * ChunkSize, file.size());
+  for(int chunk = 0; chunk < ChunksCount; ++chunk)
+  {
+    std::string data(ChunkSize, ' ');
+    size_t size = data.size();
+    file.readAt(chunk * ChunkSize, size, &data[0]);
+    EXPECT_EQ(ChunkSize, size);
+    EXPECT_EQ(std::string(ChunkSize, char('a' + chunk)), data);
+  }
+  EXPECT_EQ(0, file.position());
+  fs.check();
+}
+
+TEST(FileSystem, AsyncOperations)
+{
+  f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(new StorageInMemory(f2f::OpenMode::ReadWrite)), true);
+  std::string const testString("123454321");
+  {
+    auto file = fs.openAsync("file", f2f::OpenMode::ReadWrite).get();
+    ASSERT_TRUE(file.isOpen());
+    file.writeAsync(0, testString.size(), testString.data()).get();
+    EXPECT_EQ(testString.size(), file.size());
+  }
+  EXPECT_FALSE(fs.openAsync("missing", f2f::OpenMode::ReadOnly).get().isOpen());
+
+  std::promise<std::string> readResult;
+  std::promise<void> opened;
+  std::string data(testString.size() + 1, ' ');
+  fs.openAsync("file", f2f::OpenMode::ReadOnly, false,
+    [&readResult, &opened, &data](f2f::FileDescriptor file, std::exception_ptr error)
+    {
+      if (error)
+        return readResult.set_exception(error);
+      file.readAsync(0, data.size(), &data[0], [&readResult, &data](size_t readSize, std::exception_ptr error)
+      {
+        if (error)
+          readResult.set_exception(error);
+        else
+          readResult.set_value(data.substr(0, readSize));
+      });
+      // Pending operation keeps file opened
+      file.close();
+      opened.set_value();
+    });
+  EXPECT_EQ(testString, readResult.get_future().get());
+  opened.get_future().get();
+
+  fs.removeAsync("file").get();
+  EXPECT_EQ(f2f::FileType::NotFound, fs.fileType("file"));
+  EXPECT_THROW(fs.removeAsync("file").get(), f2f::FileSystemError);
+  EXPECT_THROW(f2f::FileDescriptor().readAsync(0, data.size(), &data[0]), f2f::FileSystemError);
+}
+
 TEST(FileSystem, DeleteIteratedDirectory)
 {
   for(int c = 0; c < 3; ++c)
@@ -63,6 +187,7 @@ TEST(FileSystem, DeleteIteratedDirectory)
     fs.createDirectory("root/dir4");
     auto it = fs.directoryIterator("root");
     EXPECT_TRUE(it != f2f::DirectoryIterator());
+    auto firstName = it->name();
     ++it;
     EXPECT_TRUE(it != f2f::DirectoryIterator());
     auto dirName = it->name();
@@ -82,6 +207,896 @@ TEST(FileSystem, DeleteIteratedDirectory)
     EXPECT_TRUE(it != f2f::DirectoryIterator());
     EXPECT_EQ(dirName, it->name());
     ++it;
-    EXPECT_FALSE(it != f2f::DirectoryIterator());
+    if (c == 0)
+    {
+      EXPECT_FALSE(it != f2f::DirectoryIterator());
+      continue;
+    }
+
+    // Iteration continues after modification
+    std::set<std::string> names;
+    for(auto const & name: { "dir1", "dir2", "dir3", "dir4" })
+      names.insert(name);
+    names.erase(firstName);
+    names.erase(dirName);
+    for(; it != f2f::DirectoryIterator(); ++it)
+    {
+      if (it->name() == "dir5")
+        continue;
+      EXPECT_EQ(1, names.erase(it->name()));
+    }
+    if (c == 2)
+      names.erase("dir1");
+    EXPECT_TRUE(names.empty());
+  }
+}
+
+TEST(FileSystem, ResumeToken)
+{
+  std::vector<char> storageData;
+  std::vector<std::string> names;
+  for(int i = 0; i < 1000; ++i)
+    names.push_back("file" + std::to_string(i));
+  std::string token;
+  std::set<std::string> listedNames;
+  {
+    auto storage = new StorageInMemory(f2f::OpenMode::ReadWrite);
+    f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(storage), true);
+    fs.createDirectory("dir1");
+    fs.createDirectory("dir2");
+    fs.createFiles("dir1", names);
+    auto it = fs.directoryIterator("dir1");
+    for(int i = 0; i < 400; ++i, ++it)
+      listedNames.insert(it->name());
+    token = it.resumeToken();
+    EXPECT_THROW(fs.directoryIterator("dir2", token), f2f::FileSystemError);
+    EXPECT_THROW(fs.directoryIterator("dir1", token.substr(1)), f2f::FileSystemError);
+    storageData = storage->data();
+  }
+  {
+    // Listing continues in another file system instance
+    auto storage = new StorageInMemory(f2f::OpenMode::ReadWrite);
+    storage->data() = storageData;
+    f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(storage), false);
+    int count = 0;
+    for(auto it = fs.directoryIterator("dir1", token); it != f2f::DirectoryIterator(); ++it, ++count)
+      EXPECT_TRUE(listedNames.insert(it->name()).second);
+    EXPECT_EQ(600, count);
+    EXPECT_EQ(names.size(), listedNames.size());
+  }
+}
+
+TEST(FileSystem, LookupAfterModification)
+{
+  f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(new StorageInMemory(f2f::OpenMode::ReadWrite)), true);
+  fs.createDirectory("dir1");
+  EXPECT_FALSE(fs.exists("dir1/sub/file.bin"));
+  EXPECT_FALSE(fs.exists("dir1/sub"));
+  fs.createDirectory("dir1/sub");
+  EXPECT_TRUE(fs.exists("dir1/sub"));
+  EXPECT_FALSE(fs.exists("dir1/sub/file.bin"));
+  fs.open("dir1/sub/file.bin", f2f::OpenMode::ReadWrite).write(3, "abc");
+  EXPECT_TRUE(fs.exists("dir1/sub/file.bin"));
+
+  // Removing directory must invalidate lookups of its whole subtree
+  fs.remove("dir1");
+  EXPECT_FALSE(fs.exists("dir1"));
+  EXPECT_FALSE(fs.exists("dir1/sub/file.bin"));
+
+  // Recreated directory may reuse blocks of removed ones
+  fs.createDirectory("dir1");
+  fs.createDirectory("dir1/sub");
+  EXPECT_FALSE(fs.exists("dir1/sub/file.bin"));
+  EXPECT_EQ(0, fs.open("dir1/sub/file.bin", f2f::OpenMode::ReadWrite).size());
+  EXPECT_TRUE(fs.exists("dir1/../dir1/./sub/file.bin"));
+  fs.remove("dir1/sub/file.bin");
+  EXPECT_FALSE(fs.exists("dir1/sub/file.bin"));
+  EXPECT_FALSE(fs.open("dir1/sub/file.bin", f2f::OpenMode::ReadOnly).isOpen());
+}
+
+TEST(FileSystem, ConcurrentAccess)
+{
+  f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(new StorageInMemory(f2f::OpenMode::ReadWrite)), true);
+  fs.createDirectory("shared");
+  static const int ThreadsCount = 4;
+  static const int FilesCount = 50;
+  std::vector<std::thread> threads;
+  std::vector<int> failures(ThreadsCount, 0);
+  for(int t = 0; t < ThreadsCount; ++t)
+    threads.emplace_back([&fs, &failures, t]
+    {
+      std::string const own = "dir" + std::to_string(t);
+      fs.createDirectory(own);
+      for(int i = 0; i < FilesCount; ++i)
+      {
+        std::string const name = std::to_string(t) + "_" + std::to_string(i);
+        std::string const data(100 + i * 37, char('a' + t));
+        fs.open(own + "/" + name, f2f::OpenMode::ReadWrite).write(data.size(), data.data());
+        fs.open("shared/" + name, f2f::OpenMode::ReadWrite).write(data.size(), data.data());
+
+        f2f::FileDescriptor file = fs.open(own + "/" + name);
+        std::string read(data.size(), '\0');
+        size_t size = read.size();
+        file.read(size, &read[0]);
+        if (read != data)
+          ++failures[t];
+        // Files of other threads in shared directory may appear at any time
+        fs.exists("shared/" + std::to_string((t + 1) % ThreadsCount) + "_" + std::to_string(i));
+        if (i % 10 == 0)
+        {
+          // Removing directory takes exclusive namespace lock
+          fs.createDirectory("shared/sub" + std::to_string(t));
+          fs.remove("shared/sub" + std::to_string(t));
+          for(auto const & entry: fs.directoryIterator("shared"))
+            if (entry.name().empty())
+              ++failures[t];
+        }
+        if (i % 2 == 0)
+          fs.remove("shared/" + name);
+      }
+    });
+  for(auto & thread: threads)
+    thread.join();
+
+  for(int t = 0; t < ThreadsCount; ++t)
+  {
+    EXPECT_EQ(0, failures[t]);
+    int filesCount = 0;
+    for(auto const & entry: fs.directoryIterator("dir" + std::to_string(t)))
+    {
+      (void)entry;
+      ++filesCount;
+    }
+    EXPECT_EQ(FilesCount, filesCount);
+  }
+  int sharedCount = 0;
+  for(auto const & entry: fs.directoryIterator("shared"))
+  {
+    EXPECT_EQ(f2f::FileType::Regular, entry.type());
+    ++sharedCount;
+  }
+  EXPECT_EQ(ThreadsCount * FilesCount / 2, sharedCount);
+  fs.check();
+}
+
+TEST(FileSystem, ConcurrentReadOnly)
+{
+  static const char FileStorageName[] = "f2f_ConcurrentReadOnly.stg";
+  static const int ThreadsCount = 4;
+  static const int FilesCount = 20;
+  {
+    f2f::FileSystem fs(f2f::OpenFileStorage(FileStorageName), true);
+    fs.createDirectory("dir");
+    fs.createDirectory("dir/sub");
+    for(int i = 0; i < FilesCount; ++i)
+    {
+      std::string const data(1000 + i * 1500, char('a' + i));
+      fs.open("dir/sub/" + std::to_string(i), f2f::OpenMode::ReadWrite).write(data.size(), data.data());
+    }
+  }
+  {
+    f2f::FileSystem fs(f2f::OpenFileStorage(FileStorageName, f2f::OpenMode::ReadOnly), false, f2f::OpenMode::ReadOnly);
+    std::vector<std::thread> threads;
+    std::vector<int> failures(ThreadsCount, 0);
+    for(int t = 0; t < ThreadsCount; ++t)
+      threads.emplace_back([&fs, &failures, t]
+      {
+        f2f::DirectoryHandle dir = fs.openDirectory("dir");
+        for(int i = 0; i < FilesCount * 5; ++i)
+        {
+          int const index = (i + t) % FilesCount;
+          std::string const expected(1000 + index * 1500, char('a' + index));
+          f2f::FileDescriptor file = dir.open("sub/" + std::to_string(index));
+          std::string data(expected.size(), '\0');
+          size_t size = data.size();
+          file.read(size, &data[0]);
+          if (size != expected.size() || data != expected)
+            ++failures[t];
+          int filesCount = 0;
+          for(auto const & entry: fs.directoryIterator("dir/sub"))
+            filesCount += entry.type() == f2f::FileType::Regular ? 1 : 0;
+          if (filesCount != FilesCount)
+            ++failures[t];
+        }
+      });
+    for(auto & thread: threads)
+      thread.join();
+    for(int t = 0; t < ThreadsCount; ++t)
+      EXPECT_EQ(0, failures[t]);
+    EXPECT_FALSE(fs.exists("dir/sub/missing"));
+    EXPECT_THROW(fs.createDirectory("dir/other"), f2f::FileSystemError);
+  }
+  std::remove(FileStorageName);
+}
+
+TEST(FileSystem, ConcurrentReadOnlySharedFile)
+{
+  static const char FileStorageName[] = "f2f_ConcurrentReadOnlyShared.stg";
+  static const int ThreadsCount = 8;
+  static const size_t ChunkSize = 1000;
+  std::string expected;
+  {
+    f2f::FileSystem fs(f2f::OpenFileStorage(FileStorageName), true);
+    // Interleaved writes give file with many ranges, so readers cross leaves of its tree
+    auto file = fs.open("file", f2f::OpenMode::ReadWrite);
+    auto other = fs.open("other", f2f::OpenMode::ReadWrite);
+    for(int i = 0; i < 2000; ++i)
+    {
+      std::string const chunk(ChunkSize, char('a' + i % 26));
+      file.write(chunk.size(), chunk.data());
+      other.write(chunk.size(), chunk.data());
+      expected += chunk;
+    }
+  }
+  {
+    f2f::FileSystem fs(f2f::OpenFileStorage(FileStorageName, f2f::OpenMode::ReadOnly), false, f2f::OpenMode::ReadOnly);
+    std::vector<std::thread> threads;
+    std::vector<int> failures(ThreadsCount, 0);
+    for(int t = 0; t < ThreadsCount; ++t)
+      threads.emplace_back([&fs, &failures, &expected, t]
+      {
+        // Descriptors of all threads share one file object
+        f2f::FileDescriptor file = fs.open("file");
+        for(int i = 0; i < 20; ++i)
+        {
+          if (file.size() != expected.size())
+            ++failures[t];
+          std::string data(expected.size(), '\0');
+          file.seek(0);
+          for(size_t pos = 0; pos < data.size(); pos += 7 * ChunkSize)
+          {
+            size_t size = std::min(7 * ChunkSize, data.size() - pos);
+            file.read(size, &data[pos]);
+          }
+          if (data != expected)
+            ++failures[t];
+          size_t const position = (i * 7919 + t * 104729) % expected.size();
+          size_t size = 3 * ChunkSize;
+          file.readAt(position, size, &data[0]);
+          if (size != std::min(3 * ChunkSize, expected.size() - position)
+            || expected.compare(position, size, data, 0, size) != 0)
+            ++failures[t];
+        }
+      });
+    for(auto & thread: threads)
+      thread.join();
+    for(int t = 0; t < ThreadsCount; ++t)
+      EXPECT_EQ(0, failures[t]);
+    EXPECT_THROW(fs.open("file").truncate(), f2f::FileSystemError);
+  }
+  std::remove(FileStorageName);
+}
+
+TEST(FileSystem, Rename)
+{
+  StorageInMemory * storage = new StorageInMemory(f2f::OpenMode::ReadWrite);
+  f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(storage), true);
+  fs.createDirectory("dir1");
+  fs.createDirectory("dir1/sub");
+  fs.createDirectory("dir2");
+  std::string const data(100000, 'x');
+  fs.open("dir1/file.tmp", f2f::OpenMode::ReadWrite).write(data.size(), data.data());
+  fs.open("dir2/file.bin", f2f::OpenMode::ReadWrite).write(3, "abc");
+  auto const storageSize = storage->size();
+
+  // Replacing existing file, which stays readable while opened
+  auto replaced = fs.open("dir2/file.bin");
+  fs.rename("dir1/file.tmp", "dir2/file.bin");
+  EXPECT_FALSE(fs.exists("dir1/file.tmp"));
+  EXPECT_EQ(data.size(), fs.open("dir2/file.bin").size());
+  EXPECT_EQ(3, replaced.size());
+  replaced.close();
+  // Data isn't copied, storage of replaced file is released
+  EXPECT_GT(storageSize, storage->size());
+
+  // Moving directory to another parent
+  fs.rename("/dir1/sub", "dir2/sub2");
+  EXPECT_FALSE(fs.exists("dir1/sub"));
+  EXPECT_EQ(f2f::FileType::Directory, fs.fileType("dir2/sub2"));
+  EXPECT_EQ(f2f::FileType::Regular, fs.fileType("dir2/sub2/../file.bin"));
+  fs.open("dir2/sub2/new", f2f::OpenMode::ReadWrite);
+  fs.rename("dir2/sub2/new", "dir2/sub2/new");
+  EXPECT_TRUE(fs.exists("dir2/sub2/new"));
+
+  try
+  {
+    fs.rename("dir2", "dir2/sub2/dir2");
+    ADD_FAILURE();
+  }
+  catch(f2f::FileSystemError const & e)
+  {
+    EXPECT_EQ(f2f::ErrorCode::CantMoveDirectoryIntoItself, e.code());
+  }
+
+  try
+  {
+    fs.rename("dir2/sub2", "dir2/file.bin");
+    ADD_FAILURE();
+  }
+  catch(f2f::FileSystemError const & e)
+  {
+    EXPECT_EQ(f2f::ErrorCode::FileExists, e.code());
+  }
+
+  try
+  {
+    fs.rename("dir1/missing", "dir2/missing");
+    ADD_FAILURE();
+  }
+  catch(f2f::FileSystemError const & e)
+  {
+    EXPECT_EQ(f2f::ErrorCode::PathNotFound, e.code());
+  }
+  EXPECT_TRUE(fs.exists("dir2/sub2"));
+  EXPECT_TRUE(fs.exists("dir2/file.bin"));
+  fs.check();
+}
+
+TEST(FileSystem, CreateFiles)
+{
+  f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(new StorageInMemory(f2f::OpenMode::ReadWrite)), true);
+  fs.createDirectory("dir1");
+  EXPECT_FALSE(fs.exists("dir1/file3"));
+
+  std::vector<std::string> names;
+  for(int i = 0; i < 1000; ++i)
+    names.push_back("file" + std::to_string(i));
+  fs.createFiles("dir1", names);
+  EXPECT_TRUE(fs.exists("dir1/file3"));
+  EXPECT_EQ(f2f::FileType::Regular, fs.fileType("dir1/file999"));
+  fs.open("dir1/file3", f2f::OpenMode::ReadWrite).write(3, "abc");
+  EXPECT_EQ(3, fs.open("dir1/file3").size());
+
+  try
+  {
+    fs.createFiles("/dir1/", { "new", "file5" });
+    ADD_FAILURE();
+  }
+  catch(f2f::FileSystemError const & e)
+  {
+    EXPECT_EQ(f2f::ErrorCode::FileExists, e.code());
+  }
+  EXPECT_FALSE(fs.exists("dir1/new"));
+
+  try
+  {
+    fs.createFiles("dir1", { "sub/new" });
+    ADD_FAILURE();
+  }
+  catch(f2f::FileSystemError const & e)
+  {
+    EXPECT_EQ(f2f::ErrorCode::PathNotFound, e.code());
+  }
+  fs.check();
+}
+
+TEST(FileSystem, DirectoryEntrySize)
+{
+  f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(new StorageInMemory(f2f::OpenMode::ReadWrite)), true);
+  fs.createDirectory("dir1");
+  fs.createDirectory("dir1/sub");
+  std::vector<std::string> names;
+  for(int i = 0; i < 500; ++i)
+    names.push_back("file" + std::to_string(i));
+  fs.createFiles("dir1", names);
+  std::vector<char> const data(500 * 20, 'a');
+  for(int i = 0; i < 500; i += 7)
+    fs.open("dir1/" + names[i], f2f::OpenMode::ReadWrite).write(i * 20, data.data());
+
+  int count = 0;
+  for(auto it = fs.directoryIterator("dir1"); it != f2f::DirectoryIterator(); ++it, ++count)
+  {
+    if (it->type() == f2f::FileType::Directory)
+    {
+      EXPECT_EQ("sub", it->name());
+      EXPECT_EQ(0, it->size());
+      continue;
+    }
+    int const i = std::stoi(it->name().substr(4));
+    uint64_t const expectedSize = i % 7 == 0 ? i * 20 : 0;
+    EXPECT_EQ(expectedSize, it->size());
+    EXPECT_EQ(fs.open(it->path()).size(), it->size());
+    EXPECT_GE(it->allocatedSize(), it->size());
+  }
+  EXPECT_EQ(501, count);
+}
+
+TEST(FileSystem, DirectoryEntryNameRef)
+{
+  f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(new StorageInMemory(f2f::OpenMode::ReadWrite)), true);
+  fs.createDirectory("dir1");
+  std::vector<std::string> names;
+  for(int i = 0; i < 300; ++i)
+    names.push_back(std::string(i % 50 + 1, 'a') + std::to_string(i));
+  fs.createFiles("dir1", names);
+
+  std::string path;
+  int count = 0;
+  for(auto it = fs.directoryIterator("dir1"); it != f2f::DirectoryIterator(); ++it, ++count)
+  {
+    f2f::PathRef name = it->nameRef();
+    EXPECT_EQ(it->name(), std::string(name.data(), name.size()));
+    it->path(path);
+    EXPECT_EQ(it->path(), path);
+    EXPECT_EQ("dir1/" + it->name(), path);
+  }
+  EXPECT_EQ(300, count);
+}
+
+TEST(FileSystem, RemoveDirectoryTree)
+{
+  auto storage = new StorageInMemory(f2f::OpenMode::ReadWrite);
+  f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(storage), true);
+  fs.createDirectory("keep");
+  fs.open("keep/file", f2f::OpenMode::ReadWrite).write(3, "abc");
+  auto const initialStorageSize = storage->size();
+
+  std::vector<char> const data(4096, 'a');
+  fs.createDirectory("root");
+  for(int i = 0; i < 5; ++i)
+  {
+    std::string const dir = "root/dir" + std::to_string(i);
+    fs.createDirectory(dir);
+    fs.createDirectory(dir + "/sub");
+    std::vector<f2f::FileDescriptor> files;
+    for(int j = 0; j < 25; ++j)
+      files.push_back(fs.open(dir + (j % 2 ? "/sub/file" : "/file") + std::to_string(j), f2f::OpenMode::ReadWrite));
+    // Interleaved writes make files fragmented, so that some of them get ranges tree
+    for(int k = 0; k < 25; ++k)
+      for(auto & file: files)
+        file.write(data.size(), data.data());
+  }
+  std::string const testString("123454321");
+  auto opened = fs.open("root/dir3/sub/opened", f2f::OpenMode::ReadWrite);
+  opened.write(testString.size(), testString.data());
+
+  fs.remove("root");
+  EXPECT_FALSE(fs.exists("root"));
+  EXPECT_TRUE(fs.exists("keep/file"));
+  fs.check();
+  EXPECT_TRUE(fs.reclaim());
+  fs.check();
+
+  // Opened file is removed when closed
+  std::string rd(testString.size(), ' ');
+  size_t size = testString.size();
+  opened.seek(0);
+  opened.read(size, &rd[0]);
+  EXPECT_EQ(testString, rd);
+  opened = f2f::FileDescriptor();
+  fs.check();
+  EXPECT_EQ(initialStorageSize, storage->size());
+}
+
+TEST(FileSystem, ReclaimRemoved)
+{
+  std::vector<char> storageData;
+  uint64_t initialStorageSize;
+  {
+    auto storage = new StorageInMemory(f2f::OpenMode::ReadWrite);
+    f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(storage), true);
+    fs.createDirectory("keep");
+    initialStorageSize = storage->size();
+
+    std::vector<char> const data(3 * 1024 * 1024, 'a');
+    fs.open("large", f2f::OpenMode::ReadWrite).write(data.size(), data.data());
+    fs.createDirectory("dir");
+    fs.createDirectory("dir/sub");
+    fs.open("dir/sub/large", f2f::OpenMode::ReadWrite).write(data.size(), data.data());
+    for(int i = 0; i < 100; ++i)
+      fs.open("dir/sub/file" + std::to_string(i), f2f::OpenMode::ReadWrite).write(i * 100, data.data());
+
+    // Storage is released later, but files are unlinked at once
+    auto const filledStorageSize = storage->size();
+    fs.remove("large");
+    fs.remove("dir");
+    EXPECT_FALSE(fs.exists("large"));
+    EXPECT_FALSE(fs.exists("dir"));
+    EXPECT_LE(filledStorageSize, storage->size());
+    fs.check();
+
+    EXPECT_FALSE(fs.reclaim(1000));
+    fs.check();
+    storageData = storage->data();
+  }
+  {
+    // Reclamation continues after reopening
+    auto storage = new StorageInMemory(f2f::OpenMode::ReadWrite);
+    storage->data() = storageData;
+    f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(storage), false);
+    fs.check();
+    int calls = 1;
+    for(; !fs.reclaim(1000); ++calls)
+      fs.check();
+    EXPECT_LT(5, calls);
+    fs.check();
+    EXPECT_EQ(initialStorageSize, storage->size());
+    EXPECT_TRUE(fs.exists("keep"));
+  }
+}
+
+TEST(FileSystem, ReclaimLargeDirectoryInChunks)
+{
+  auto storage = new StorageInMemory(f2f::OpenMode::ReadWrite);
+  f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(storage), true);
+  auto const initialStorageSize = storage->size();
+
+  std::vector<char> const data(10000, 'a');
+  fs.createDirectory("dir");
+  std::vector<std::string> names;
+  for(int i = 0; i < 2000; ++i)
+    names.push_back("file" + std::to_string(i));
+  fs.createFiles("dir", names);
+  for(int i = 0; i < 2000; i += 10)
+    fs.open("dir/file" + std::to_string(i), f2f::OpenMode::ReadWrite).write(data.size(), data.data());
+  fs.remove("dir");
+
+  // Directory listing is larger than the budget, so it is released by several calls
+  int calls = 1;
+  for(; !fs.reclaim(200); ++calls)
+    fs.check();
+  EXPECT_LT(5, calls);
+  EXPECT_EQ(initialStorageSize, storage->size());
+}
+
+TEST(FileSystem, ReclaimInBackground)
+{
+  auto storage = new StorageInMemory(f2f::OpenMode::ReadWrite);
+  f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(storage), true);
+  fs.createDirectory("keep");
+  auto const initialStorageSize = storage->size();
+
+  std::vector<char> const data(3 * 1024 * 1024, 'a');
+  fs.createDirectory("dir");
+  fs.createDirectory("dir/sub");
+  fs.open("dir/sub/large", f2f::OpenMode::ReadWrite).write(data.size(), data.data());
+  for(int i = 0; i < 100; ++i)
+    fs.open("dir/file" + std::to_string(i), f2f::OpenMode::ReadWrite).write(i * 100, data.data());
+
+  fs.reclaimInBackground(100);
+  fs.remove("dir");
+  fs.open("large", f2f::OpenMode::ReadWrite).write(data.size(), data.data());
+  fs.remove("large");
+  // Other operations proceed while storage is reclaimed
+  for(int i = 0; i < 100; ++i)
+    fs.createDirectory("keep/dir" + std::to_string(i));
+
+  // Zero budget only checks whether anything is left
+  auto waitReclaimed = [&fs]
+  {
+    for(int i = 0; i < 1000 && !fs.reclaim(0); ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_TRUE(fs.reclaim(0));
+  };
+  waitReclaimed();
+  fs.check();
+  // Background reclamation resumes after removal
+  fs.remove("keep");
+  fs.createDirectory("keep");
+  waitReclaimed();
+  fs.check();
+  EXPECT_EQ(initialStorageSize, storage->size());
+}
+
+TEST(FileSystem, DirectoryHandle)
+{
+  f2f::FileSystem fs(std::unique_ptr<f2f::IStorage>(new StorageInMemory(f2f::OpenMode::ReadWrite)), true);
+  fs.createDirectory("dir1");
+  fs.createDirectory("dir2");
+  EXPECT_THROW(fs.openDirectory("dir3"), f2f::FileSystemError);
+
+  auto dir1 = fs.openDirectory("dir1");
+  EXPECT_TRUE(dir1.isOpen());
+  dir1.createDirectory("sub");
+  for(int i = 0; i < 200; ++i)
+    dir1.open(("sub/file" + std::to_string(i)).c_str(), f2f::OpenMode::ReadWrite).write(1, "a");
+  dir1.open("file.bin", f2f::OpenMode::ReadWrite).write(3, "abc");
+  EXPECT_TRUE(fs.exists("dir1/sub/file199"));
+  EXPECT_TRUE(fs.exists("/dir1/file.bin"));
+  EXPECT_EQ(f2f::FileType::Directory, dir1.fileType("sub"));
+  EXPECT_EQ(f2f::FileType::Directory, dir1.fileType("."));
+  EXPECT_FALSE(dir1.open(".", f2f::OpenMode::ReadWrite).isOpen());
+
+  // Path is passed by size, not required to be null-terminated
+  std::string const path = "sub/file1/extra";
+  EXPECT_TRUE(dir1.exists(f2f::PathRef(path.data(), 9)));
+  EXPECT_TRUE(fs.exists(std::string("dir1/") + path.substr(0, 9)));
+
+  // Relative and absolute paths
+  dir1.open("../dir2/file.bin", f2f::OpenMode::ReadWrite).write(1, "x");
+  EXPECT_TRUE(fs.exists("dir2/file.bin"));
+  EXPECT_TRUE(dir1.exists("/dir2/file.bin"));
+  EXPECT_FALSE(dir1.exists("dir2/file.bin"));
+
+  // Modification by another path must be seen by handle
+  fs.remove("dir1/file.bin");
+  EXPECT_FALSE(dir1.exists("file.bin"));
+  fs.open("dir1/file2.bin", f2f::OpenMode::ReadWrite);
+  EXPECT_TRUE(dir1.exists("file2.bin"));
+  dir1.remove("file2.bin");
+  EXPECT_FALSE(fs.exists("dir1/file2.bin"));
+  fs.check();
+
+  // Removing directory with opened handles
+  auto sub = dir1.openDirectory("sub");
+  EXPECT_TRUE(sub.exists("file0"));
+  fs.remove("dir1");
+  EXPECT_THROW(dir1.exists("sub"), f2f::FileSystemError);
+  EXPECT_THROW(sub.open("file0", f2f::OpenMode::ReadWrite), f2f::FileSystemError);
+  fs.createDirectory("dir1");
+  EXPECT_FALSE(fs.openDirectory("dir1").exists("sub"));
+  fs.check();
+}
+
+namespace
+{
+  std::string ReadView(f2f::FileView const & view)
+  {
+    std::string result;
+    for(auto const & buffer: view)
+      result.append(static_cast<char const *>(buffer.data), buffer.size);
+    EXPECT_EQ(result.size(), view.size());
+    return result;
+  }
+
+  std::string MakeTestData(size_t size)
+  {
+    std::string data(size, ' ');
+    for(size_t i = 0; i < size; ++i)
+      data[i] = char('a' + i % 26);
+    return data;
+  }
+}
+
+TEST(FileSystem, MapFile)
+{
+  std::string const testData = MakeTestData(100'000);
+  std::unique_ptr<StorageInMemory> storage(new StorageInMemory(f2f::OpenMode::ReadWrite));
+  storage->data().reserve(10'000'000);
+  f2f::FileSystem fs(std::move(storage), true);
+  {
+    auto file = fs.open("file1", f2f::OpenMode::ReadWrite);
+    for(size_t pos = 0; pos < testData.size(); pos += 7000)
+    {
+      file.write(std::min<size_t>(7000, testData.size() - pos), testData.data() + pos);
+      // Interleave with another file to get fragmented ranges
+      auto file2 = fs.open("file2", f2f::OpenMode::ReadWrite);
+      file2.seek(file2.size());
+      file2.write(1000, testData.data());
+    }
+  }
+
+  auto file = fs.open("file1", f2f::OpenMode::ReadWrite);
+  EXPECT_EQ(testData, ReadView(file.map(0, testData.size())));
+  EXPECT_EQ(testData.substr(1234, 56789), ReadView(file.map(1234, 56789)));
+  EXPECT_EQ(testData.substr(99'000), ReadView(file.map(99'000, 5000)));
+  EXPECT_EQ(0, file.map(testData.size() + 1, 10).size());
+
+  {
+    auto view = file.map(0, 1000);
+    file.seek(10);
+    try
+    {
+      file.truncate();
+      ADD_FAILURE() << "Truncating mapped file must fail";
+    }
+    catch(f2f::FileSystemError const & e)
+    {
+      EXPECT_EQ(f2f::ErrorCode::FileLocked, e.code());
+    }
+
+    // File removal is postponed while view exists
+    file.close();
+    fs.remove("file1");
+    EXPECT_FALSE(fs.exists("file1"));
+    EXPECT_EQ(testData.substr(0, 1000), ReadView(view));
+  }
+  fs.check();
+}
+
+TEST(FileSystem, MappedFileStorage)
+{
+  static const char FileStorageName[] = "f2f_MappedStorage.stg";
+  std::string const testData = MakeTestData(300'000);
+  {
+    f2f::FileSystem fs(f2f::OpenFileStorage(FileStorageName), true);
+    fs.createDirectory("dir");
+    fs.open("dir/file", f2f::OpenMode::ReadWrite).write(testData.size(), testData.data());
+  }
+  {
+    f2f::FileView view;
+    {
+      f2f::FileSystem fs(f2f::OpenMappedFileStorage(FileStorageName), false, f2f::OpenMode::ReadOnly);
+      view = fs.open("dir/file").map(0, testData.size());
+    }
+    // View keeps file system alive
+    EXPECT_EQ(testData, ReadView(view));
+  }
+  std::remove(FileStorageName);
+}
+
+TEST(FileSystem, UringFileStorage)
+{
+  static const char FileStorageName[] = "f2f_UringStorage.stg";
+  static const int FilesCount = 20;
+  std::string const testData = MakeTestData(300'000);
+  {
+    f2f::FileSystem fs(f2f::OpenUringFileStorage(FileStorageName), true);
+    fs.createDirectory("dir");
+    // Interleaved writes make fragmented files, which are read in batches
+    std::vector<f2f::FileDescriptor> files;
+    for(int i = 0; i < FilesCount; ++i)
+      files.push_back(fs.open("dir/file" + std::to_string(i), f2f::OpenMode::ReadWrite));
+    for(size_t pos = 0; pos < testData.size(); pos += 5000)
+      for(auto & file: files)
+        file.write(std::min(size_t(5000), testData.size() - pos), testData.data() + pos);
+  }
+  {
+    f2f::FileSystem fs(f2f::OpenUringFileStorage(FileStorageName, f2f::OpenMode::ReadOnly), false,
+      f2f::OpenMode::ReadOnly);
+    std::vector<std::thread> threads;
+    for(int t = 0; t < 4; ++t)
+      threads.emplace_back([&fs, &testData, t]
+      {
+        for(int i = t; i < FilesCount; i += 4)
+        {
+          auto file = fs.open("dir/file" + std::to_string(i));
+          std::string data(testData.size() + 1, ' ');
+          size_t size = data.size();
+          file.read(size, &data[0]);
+          data.resize(size);
+          EXPECT_EQ(testData, data);
+        }
+      });
+    for(auto & thread: threads)
+      thread.join();
+    fs.check();
+  }
+  {
+    // Write past the end extends storage
+    std::remove(FileStorageName);
+    auto storage = f2f::OpenUringFileStorage(FileStorageName);
+    storage->write(0, 3, "abc");
+    storage->write(100, 3, "def");
+    EXPECT_EQ(103, storage->size());
+    storage->write(50, 3, "ghi");
+    EXPECT_EQ(103, storage->size());
+  }
+  std::remove(FileStorageName);
+}
+
+TEST(FileSystem, DirectFileStorage)
+{
+  static const char FileStorageName[] = "f2f_DirectStorage.stg";
+  std::string const testData = MakeTestData(300'000);
+  {
+    // Writes past the end extend storage
+    auto storage = f2f::OpenDirectFileStorage(FileStorageName);
+    storage->write(0, 5000, testData.data());
+    EXPECT_EQ(5000, storage->size());
+  }
+  EXPECT_EQ(5000, f2f::OpenDirectFileStorage(FileStorageName, f2f::OpenMode::ReadOnly)->size());
+  {
+    f2f::FileSystem fs(f2f::OpenDirectFileStorage(FileStorageName), true);
+    fs.createDirectory("dir");
+    auto file1 = fs.open("dir/file1", f2f::OpenMode::ReadWrite);
+    auto file2 = fs.open("dir/file2", f2f::OpenMode::ReadWrite);
+    // Odd sizes make writes unaligned
+    for(size_t pos = 0; pos < testData.size(); pos += 3001)
+    {
+      size_t const size = std::min(size_t(3001), testData.size() - pos);
+      file1.write(size, testData.data() + pos);
+      file2.write(size, testData.data() + pos);
+    }
+  }
+  {
+    f2f::FileSystem fs(f2f::OpenDirectFileStorage(FileStorageName, f2f::OpenMode::ReadOnly), false,
+      f2f::OpenMode::ReadOnly);
+    for(const char * name: {"dir/file1", "dir/file2"})
+    {
+      auto file = fs.open(name);
+      std::string data(testData.size(), ' ');
+      size_t size = data.size();
+      file.readAt(1, size, &data[0]);
+      EXPECT_EQ(testData.size() - 1, size);
+      EXPECT_EQ(0, testData.compare(1, size, data, 0, size));
+    }
+    fs.check();
+  }
+  std::remove(FileStorageName);
+}
+
+TEST(FileSystem, AlignedLayout)
+{
+  EXPECT_THROW(f2f::FileSystem(std::unique_ptr<f2f::IStorage>(new StorageInMemory()), f2f::FormatOptions{1024, true}),
+    f2f::FileSystemError);
+
+  static const char FileStorageName[] = "f2f_AlignedLayout.stg";
+  std::string const testData = MakeTestData(300'000);
+  {
+    f2f::FileSystem fs(f2f::OpenDirectFileStorage(FileStorageName), f2f::FormatOptions{4096, true});
+    fs.createDirectory("dir");
+    auto file = fs.open("dir/file", f2f::OpenMode::ReadWrite);
+    for(size_t pos = 0; pos < testData.size(); pos += 4096)
+      file.write(std::min(size_t(4096), testData.size() - pos), testData.data() + pos);
+  }
+  {
+    f2f::FileSystem fs(f2f::OpenDirectFileStorage(FileStorageName, f2f::OpenMode::ReadOnly), false,
+      f2f::OpenMode::ReadOnly);
+    auto file = fs.open("dir/file");
+    std::string data(testData.size(), ' ');
+    size_t size = data.size();
+    file.read(size, &data[0]);
+    EXPECT_EQ(testData, data);
+    fs.check();
+  }
+  std::remove(FileStorageName);
+}
+
+TEST(FileSystem, BlockSize)
+{
+  EXPECT_THROW(f2f::FileSystem(std::unique_ptr<f2f::IStorage>(new StorageInMemory()), f2f::FormatOptions{3000}),
+    f2f::FileSystemError);
+  EXPECT_THROW(f2f::FileSystem(std::unique_ptr<f2f::IStorage>(new StorageInMemory()), f2f::FormatOptions{512}),
+    f2f::FileSystemError);
+  EXPECT_THROW(f2f::FileSystem(std::unique_ptr<f2f::IStorage>(new StorageInMemory()), f2f::FormatOptions{128 * 1024}),
+    f2f::FileSystemError);
+
+  static const char FileStorageName[] = "f2f_BlockSize.stg";
+  // Larger than files that are removed immediately
+  std::string const testData = MakeTestData(1'500'000);
+  auto readFile = [](f2f::FileSystem & fs, const char * path) {
+    auto file = fs.open(path);
+    std::string data(size_t(file.size()), ' ');
+    size_t size = data.size();
+    file.read(size, &data[0]);
+    return data;
+  };
+  std::vector<std::string> names;
+  for(int i = 0; i < 2000; ++i)
+    names.push_back("f" + std::to_string(i));
+  for(uint32_t blockSize: { 4096, 64 * 1024 })
+  {
+    {
+      f2f::FileSystem fs(f2f::OpenFileStorage(FileStorageName), f2f::FormatOptions{blockSize});
+      fs.createDirectory("dir");
+      fs.open("dir/file1", f2f::OpenMode::ReadWrite).write(testData.size(), testData.data());
+      fs.open("dir/file2", f2f::OpenMode::ReadWrite).write(testData.size(), testData.data());
+      fs.createFiles("dir", names);
+      fs.open("dir/f7", f2f::OpenMode::ReadWrite).write(10, testData.data());
+    }
+    {
+      f2f::FileSystem fs(f2f::OpenFileStorage(FileStorageName), false);
+      EXPECT_EQ(testData, readFile(fs, "dir/file1"));
+      int count = 0;
+      for(auto const & entry: fs.directoryIterator("dir"))
+      {
+        ++count;
+        if (entry.name() == "f7")
+        {
+          EXPECT_EQ(10, entry.size());
+          EXPECT_EQ(blockSize, entry.allocatedSize());
+        }
+      }
+      EXPECT_EQ(2002, count);
+      // Large removed file is reclaimed by parts
+      fs.remove("dir/file1");
+      int reclaimCalls = 0;
+      while (!fs.reclaim(5))
+        ++reclaimCalls;
+      EXPECT_LT(1, reclaimCalls);
+      for(int i = 0; i < 2000; i += 3)
+        fs.remove("dir/" + names[i]);
+      fs.check();
+    }
+    {
+      f2f::FileSystem fs(f2f::OpenFileStorage(FileStorageName, f2f::OpenMode::ReadOnly), false, 
+        f2f::OpenMode::ReadOnly);
+      EXPECT_EQ(testData, readFile(fs, "dir/file2"));
+      EXPECT_TRUE(fs.exists("dir/f1999"));
+      EXPECT_FALSE(fs.exists("dir/f1998"));
+      fs.check();
+    }
+    std::remove(FileStorageName);
   }
 }
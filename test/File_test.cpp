@@ -3,6 +3,8 @@
 #include <vector>
 #include <memory>
 #include <random>
+#include <set>
+#include <thread>
 #include "File.hpp"
 #include "StorageInMemory.hpp"
 #include "util/StorageT.hpp"
@@ -100,4 +102,296 @@ INSTANTIATE_TEST_CASE_P(FileTest,
     std::make_pair(3, UINT64_C(100'000'000)),
     std::make_pair(10, UINT64_C(100'000'000))
   )
-);
\ No newline at end of file
+);
+namespace
+{
+  class StorageWithPrefetchLog: public StorageInMemory
+  {
+  public:
+    void prefetch(uint64_t position, size_t size) const override
+    {
+      prefetched.push_back(std::make_pair(position, size));
+    }
+
+    mutable std::vector<std::pair<uint64_t, size_t>> prefetched;
+  };
+}
+
+TEST(File, SequentialReadAhead)
+{
+  StorageWithPrefetchLog storage;
+  f2f::BlockStorage blockStorage(storage, true);
+  f2f::File file1(blockStorage);
+  f2f::File file2(blockStorage);
+
+  // Interleaved writes produce file with many single-block ranges and several leaf nodes
+  std::vector<char> data(f2f::format::AddressableBlockSize * 500);
+  for(size_t i = 0; i < data.size(); ++i)
+    data[i] = char(i * 7 + i / 1000);
+  for(size_t pos = 0; pos < data.size(); pos += f2f::format::AddressableBlockSize)
+  {
+    file1.write(f2f::format::AddressableBlockSize, data.data() + pos);
+    file2.write(f2f::format::AddressableBlockSize, data.data() + pos);
+  }
+
+  // Random access doesn't trigger read-ahead
+  std::vector<char> buf(data.size());
+  for(uint64_t pos: {5000, 100, 300'000})
+  {
+    file1.seek(pos);
+    size_t size = 10;
+    file1.read(size, buf.data());
+  }
+  EXPECT_TRUE(storage.prefetched.empty());
+
+  file1.seek(0);
+  for(size_t pos = 0; pos < data.size(); )
+  {
+    size_t size = 3000;
+    file1.read(size, buf.data() + pos);
+    ASSERT_GT(size, 0);
+    pos += size;
+  }
+  EXPECT_TRUE(std::equal(data.begin(), data.end(), buf.begin()));
+  EXPECT_FALSE(storage.prefetched.empty());
+  for(auto const & range: storage.prefetched)
+    EXPECT_LE(range.first + range.second, storage.size());
+}
+
+TEST(File, ConcurrentCursors)
+{
+  StorageInMemory storage;
+  f2f::BlockStorage blockStorage(storage, true);
+  f2f::File file1(blockStorage, f2f::OpenMode::SharedReadWrite);
+  f2f::File file2(blockStorage);
+
+  // Fragmented file with several leaf nodes, which cursors walk independently
+  std::vector<char> data(f2f::format::AddressableBlockSize * 500);
+  for(size_t i = 0; i < data.size(); ++i)
+    data[i] = char(i * 7 + i / 1000);
+  for(size_t pos = 0; pos < data.size(); pos += f2f::format::AddressableBlockSize)
+  {
+    file1.write(f2f::format::AddressableBlockSize, data.data() + pos);
+    file2.write(f2f::format::AddressableBlockSize, data.data() + pos);
+  }
+
+  std::vector<std::thread> threads;
+  for(int t = 0; t < 4; ++t)
+    threads.emplace_back([&file1, &data, t]
+    {
+      f2f::File::Cursor cursor;
+      std::vector<char> buf(data.size());
+      for(int pass = 0; pass < 3; ++pass)
+      {
+        cursor.position = 0;
+        for(size_t pos = 0; pos < data.size(); )
+        {
+          size_t size = std::min(size_t(1000 + 500 * t), data.size() - pos);
+          file1.read(cursor, size, buf.data() + pos);
+          ASSERT_GT(size, 0);
+          pos += size;
+        }
+        EXPECT_TRUE(std::equal(data.begin(), data.end(), buf.begin()));
+      }
+    });
+  // Extension of file modifies block ranges tree while it's read
+  threads.emplace_back([&file1, &data]
+  {
+    for(size_t pos = 0; pos < data.size(); pos += f2f::format::AddressableBlockSize)
+      file1.writeAt(data.size() + pos, f2f::format::AddressableBlockSize, data.data() + pos);
+  });
+  for(auto & thread: threads)
+    thread.join();
+  EXPECT_EQ(data.size() * 2, file1.size());
+  file1.check();
+}
+
+namespace
+{
+  class StorageWithBatchLog: public StorageInMemory
+  {
+  public:
+    void readBatch(ReadRequest const * requests, size_t count) const override
+    {
+      batchSizes.push_back(count);
+      StorageInMemory::readBatch(requests, count);
+    }
+
+    mutable std::vector<size_t> batchSizes;
+  };
+}
+
+TEST(File, BatchedRead)
+{
+  StorageWithBatchLog storage;
+  f2f::BlockStorage blockStorage(storage, true);
+  f2f::File file1(blockStorage);
+  f2f::File file2(blockStorage);
+
+  std::vector<char> data(f2f::format::AddressableBlockSize * 20);
+  for(size_t i = 0; i < data.size(); ++i)
+    data[i] = char(i * 7 + i / 1000);
+  for(size_t pos = 0; pos < data.size(); pos += f2f::format::AddressableBlockSize)
+  {
+    file1.write(f2f::format::AddressableBlockSize, data.data() + pos);
+    file2.write(f2f::format::AddressableBlockSize, data.data() + pos);
+  }
+
+  // All ranges of fragmented file are requested from storage at once
+  storage.batchSizes.clear();
+  std::vector<char> buf(data.size());
+  file1.seek(0);
+  size_t size = buf.size();
+  file1.read(size, buf.data());
+  EXPECT_EQ(data.size(), size);
+  EXPECT_EQ(data, buf);
+  ASSERT_EQ(1, storage.batchSizes.size());
+  EXPECT_GT(storage.batchSizes.front(), 1);
+}
+
+namespace
+{
+  // Records blocks read one by one and leaves loaded asynchronously
+  class StorageWithReadLog: public StorageInMemory
+  {
+  public:
+    void read(uint64_t position, size_t size, void * data) const override
+    {
+      if (size == f2f::format::AddressableBlockSize)
+        blockReads.insert(position);
+      StorageInMemory::read(position, size, data);
+    }
+
+    void readBatchAsync(ReadRequest const * requests, size_t count, OnBatchComplete const & onComplete) const override
+    {
+      for(size_t i = 0; i < count; ++i)
+      {
+        asyncReads.insert(requests[i].position);
+        StorageInMemory::read(requests[i].position, requests[i].size, requests[i].data);
+      }
+      onComplete(std::exception_ptr());
+    }
+
+    mutable std::set<uint64_t> blockReads;
+    mutable std::set<uint64_t> asyncReads;
+  };
+}
+
+TEST(File, NextLeafLoadedInAdvance)
+{
+  StorageWithReadLog storage;
+  f2f::BlockStorage blockStorage(storage, true);
+  f2f::File file1(blockStorage);
+  f2f::File file2(blockStorage);
+
+  // Interleaved writes give range per block, so that ranges of file take several leaves
+  std::vector<char> data(f2f::format::AddressableBlockSize * 300);
+  for(size_t i = 0; i < data.size(); ++i)
+    data[i] = char(i * 7 + i / 1000);
+  for(size_t pos = 0; pos < data.size(); pos += f2f::format::AddressableBlockSize)
+  {
+    file1.write(f2f::format::AddressableBlockSize, data.data() + pos);
+    file2.write(f2f::format::AddressableBlockSize, data.data() + pos);
+  }
+
+  f2f::File reopened(blockStorage, file1.inodeAddress(), f2f::OpenMode::ReadOnly);
+  storage.blockReads.clear();
+  storage.asyncReads.clear();
+  std::vector<char> buf(data.size());
+  for(size_t pos = 0; pos < buf.size(); pos += 1000)
+  {
+    size_t size = std::min(size_t(1000), buf.size() - pos);
+    reopened.read(size, buf.data() + pos);
+  }
+  EXPECT_EQ(data, buf);
+
+  // Leaves loaded by read-ahead aren't read again
+  EXPECT_LE(2, storage.asyncReads.size());
+  for(uint64_t position: storage.asyncReads)
+    EXPECT_EQ(0, storage.blockReads.count(position));
+}
+
+TEST(File, BlockSize)
+{
+  // 4 KB blocks
+  StorageInMemory storage;
+  f2f::BlockStorage blockStorage(storage, true, 2);
+  ASSERT_EQ(4096, blockStorage.blockSize());
+  f2f::File file1(blockStorage);
+  f2f::File file2(blockStorage);
+
+  // Interleaved writes give range per block, so that tree has several 4 KB leaves
+  std::vector<char> data(4096 * 600 + 10);
+  for(size_t i = 0; i < data.size(); ++i)
+    data[i] = char(i * 7 + i / 1000);
+  for(size_t pos = 0; pos < data.size(); pos += 4096)
+  {
+    size_t const size = std::min(size_t(4096), data.size() - pos);
+    file1.write(size, data.data() + pos);
+    file2.write(size, data.data() + pos);
+  }
+  file1.check();
+  file2.check();
+
+  // Size is rounded up to block only
+  uint64_t blocksCount = 0;
+  file1.enumerateAllBlocks([&](f2f::BlockAddress, unsigned count) { blocksCount += count; });
+  EXPECT_LT(601 + 1, blocksCount); // Data, inode and tree nodes
+
+  std::vector<char> buf(data.size());
+  file2.seek(0);
+  size_t size = buf.size();
+  file2.read(size, buf.data());
+  EXPECT_EQ(data.size(), size);
+  EXPECT_EQ(data, buf);
+
+  file1.seek(16 * 4096 + 1);
+  file1.truncate();
+  blocksCount = 0;
+  file1.enumerateAllBlocks([&](f2f::BlockAddress, unsigned count) { blocksCount += count; });
+  EXPECT_EQ(17 + 1, blocksCount);
+  file1.check();
+
+  // Block size is kept in storage
+  f2f::BlockStorage reopened(storage);
+  EXPECT_EQ(4096, reopened.blockSize());
+  EXPECT_EQ(17, reopened.fileBlocksCount(16 * 4096 + 1));
+  EXPECT_EQ(1, reopened.fileBlocksCount(10));
+  EXPECT_EQ(0, reopened.fileBlocksCount(0));
+  f2f::File reopenedFile(reopened, file2.inodeAddress(), f2f::OpenMode::ReadOnly);
+  buf.assign(buf.size(), 0);
+  size = buf.size();
+  reopenedFile.read(size, buf.data());
+  EXPECT_EQ(data, buf);
+}
+
+TEST(File, CreateEmptyFiles)
+{
+  StorageInMemory storage;
+  f2f::BlockStorage blockStorage(storage, true);
+  uint64_t allocatedCount = 0;
+  blockStorage.enumerateAllocatedBlocks([&](f2f::BlockAddress const &) { ++allocatedCount; });
+
+  // Released blocks keep data, so new inodes are written over it
+  {
+    f2f::File file(blockStorage);
+    std::vector<char> const data(2000 * f2f::format::AddressableBlockSize, 'a');
+    file.write(data.size(), data.data());
+    file.remove();
+  }
+
+  std::vector<f2f::BlockAddress> const inodes = f2f::File::createEmptyFiles(blockStorage, 3000);
+  ASSERT_EQ(3000, inodes.size());
+  for(auto const & inode: inodes)
+  {
+    f2f::File file(blockStorage, inode, f2f::OpenMode::ReadWrite);
+    EXPECT_EQ(0, file.size());
+    file.check();
+  }
+  blockStorage.check();
+
+  f2f::File::removeEmptyFiles(blockStorage, inodes);
+  uint64_t remainingCount = 0;
+  blockStorage.enumerateAllocatedBlocks([&](f2f::BlockAddress const &) { ++remainingCount; });
+  EXPECT_EQ(allocatedCount, remainingCount);
+}
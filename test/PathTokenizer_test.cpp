@@ -0,0 +1,45 @@
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+#include "util/PathTokenizer.hpp"
+
+namespace
+{
+  std::vector<std::string> Tokenize(const char * path, bool & isAbsolute)
+  {
+    f2f::util::PathTokenizer tokenizer(path);
+    isAbsolute = tokenizer.isAbsolute();
+    std::vector<std::string> result;
+    for(boost::string_ref component; tokenizer.next(component); )
+      result.push_back(component.to_string());
+    return result;
+  }
+}
+
+TEST(PathTokenizer, Components)
+{
+  bool isAbsolute;
+  EXPECT_EQ(std::vector<std::string>(), Tokenize("", isAbsolute));
+  EXPECT_FALSE(isAbsolute);
+  EXPECT_EQ(std::vector<std::string>(), Tokenize("/", isAbsolute));
+  EXPECT_TRUE(isAbsolute);
+  EXPECT_EQ(std::vector<std::string>(), Tokenize("././/.", isAbsolute));
+  EXPECT_FALSE(isAbsolute);
+  EXPECT_EQ((std::vector<std::string>{"a"}), Tokenize("a", isAbsolute));
+  EXPECT_EQ((std::vector<std::string>{"dir", "file.bin"}), Tokenize("//dir///file.bin/", isAbsolute));
+  EXPECT_TRUE(isAbsolute);
+  EXPECT_EQ((std::vector<std::string>{"..", "a", "..", ".b", "..."}), Tokenize("../a/./../.b/...", isAbsolute));
+  EXPECT_FALSE(isAbsolute);
+}
+
+TEST(PathTokenizer, NotNullTerminated)
+{
+  std::string const path = "dir1/dir2/file";
+  f2f::util::PathTokenizer tokenizer(boost::string_ref(path.data(), 8));
+  boost::string_ref component;
+  ASSERT_TRUE(tokenizer.next(component));
+  EXPECT_EQ("dir1", component);
+  ASSERT_TRUE(tokenizer.next(component));
+  EXPECT_EQ("dir", component);
+  EXPECT_FALSE(tokenizer.next(component));
+}
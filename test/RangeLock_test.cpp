@@ -0,0 +1,45 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "util/RangeLock.hpp"
+
+TEST(RangeLock, NonOverlappingDontWait)
+{
+  f2f::util::RangeLock rangeLock;
+  rangeLock.lock(0, 10, true);
+  rangeLock.lock(10, 20, true);
+  rangeLock.lock(20, 30, false);
+  rangeLock.lock(25, 40, false);
+  rangeLock.unlock(10, 20, true);
+  rangeLock.unlock(0, 10, true);
+  rangeLock.unlock(25, 40, false);
+  rangeLock.unlock(20, 30, false);
+}
+
+TEST(RangeLock, OverlappingWait)
+{
+  f2f::util::RangeLock rangeLock;
+  std::atomic<bool> locked(false);
+  rangeLock.lock(0, 100, false);
+  std::thread writer([&]{
+    f2f::util::RangeLock::Guard guard(rangeLock, 50, 60, true);
+    locked = true;
+  });
+  {
+    // Shared locks don't wait for each other
+    f2f::util::RangeLock::Guard guard(rangeLock, 40, 70, false);
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_FALSE(locked);
+  rangeLock.unlock(0, 100, false);
+  writer.join();
+  EXPECT_TRUE(locked);
+
+  // Disabled guard doesn't lock
+  rangeLock.lock(0, 100, true);
+  {
+    f2f::util::RangeLock::Guard guard(rangeLock, 0, 100, true, false);
+  }
+  rangeLock.unlock(0, 100, true);
+}
@@ -2,14 +2,22 @@
 #include <algorithm>
 #include <stdexcept>
 #include <limits>
+#include <mutex>
 
 StorageInMemory::StorageInMemory(f2f::OpenMode mode)
   : m_mode(mode)
 {
 }
 
+uint64_t StorageInMemory::size() const
+{
+  std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+  return m_data.size();
+}
+
 void StorageInMemory::read(uint64_t position, size_t size, void * data) const
 {
+  std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
   if (position + size > m_data.size())
     throw std::runtime_error("StorageInMemory::read: Unexpected");
   std::copy_n(m_data.data() + position, size, reinterpret_cast<char *>(data));
@@ -19,6 +27,7 @@ void StorageInMemory::write(uint64_t position, size_t size, void const * data)
 {
   if (m_mode != f2f::OpenMode::ReadWrite)
     throw std::runtime_error("Incorrect file mode");
+  std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
   if (position + size > m_data.size())
     throw std::runtime_error("StorageInMemory::write: Unexpected");
   std::copy_n(reinterpret_cast<const char *>(data), size, m_data.data() + position);
@@ -30,5 +39,14 @@ void StorageInMemory::resize(uint64_t size)
     throw std::runtime_error("Incorrect file mode");
   if (size > std::numeric_limits<size_t>::max())
     throw std::runtime_error("StorageInMemory::resize: Unexpected");
+  std::unique_lock<std::shared_timed_mutex> lock(m_mutex);
   m_data.resize(static_cast<size_t>(size));
 }
+
+void const * StorageInMemory::map(uint64_t position, size_t size) const
+{
+  std::shared_lock<std::shared_timed_mutex> lock(m_mutex);
+  if (position + size > m_data.size())
+    throw std::runtime_error("StorageInMemory::map: Unexpected");
+  return m_data.data() + position;
+}
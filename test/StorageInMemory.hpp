@@ -1,5 +1,6 @@
 #pragma once
 
+#include <shared_mutex>
 #include <vector>
 #include "f2f/IStorage.hpp"
 
@@ -8,14 +9,18 @@ class StorageInMemory: public f2f::IStorage
 public:
   StorageInMemory(f2f::OpenMode = f2f::OpenMode::ReadWrite);
 
-  uint64_t size() const override { return m_data.size(); }
+  uint64_t size() const override;
   void read(uint64_t position, size_t size, void *) const override;
   void write(uint64_t position, size_t size, void const *) override;
   void resize(uint64_t size) override;
+  // Pointers are valid until vector reallocation - reserve data() capacity in tests that use it
+  void const * map(uint64_t position, size_t size) const override;
 
+  // Not synchronized with file system operations
   std::vector<char> & data() { return m_data; }
 
 private:
   f2f::OpenMode m_mode;
+  mutable std::shared_timed_mutex m_mutex; // Exclusive for resize, shared for access to contents
   std::vector<char> m_data;
 };
@@ -0,0 +1,36 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <future>
+#include "util/ThreadPool.hpp"
+
+TEST(ThreadPool, RunsAllTasks)
+{
+  std::atomic<int> counter(0);
+  {
+    f2f::util::ThreadPool pool(3);
+    for(int i = 0; i < 100; ++i)
+      pool.post([&counter]{ ++counter; });
+    pool.post([]{ throw std::runtime_error("ignored"); });
+  }
+  // Destructor waits for posted tasks
+  EXPECT_EQ(100, counter);
+}
+
+TEST(ThreadPool, DestroyedFromOwnTask)
+{
+  auto pool = std::make_shared<f2f::util::ThreadPool>(2);
+  auto destroyed = std::make_shared<std::promise<void>>();
+  std::future<void> isDestroyed = destroyed->get_future();
+  std::weak_ptr<f2f::util::ThreadPool> weakPool = pool;
+  std::promise<void> posted;
+  std::shared_future<void> isPosted = posted.get_future().share();
+  pool->post([&pool, destroyed, isPosted]{
+    // Pool must not be destroyed while post() is still running
+    isPosted.wait();
+    pool.reset();
+    destroyed->set_value();
+  });
+  posted.set_value();
+  isDestroyed.wait();
+  EXPECT_TRUE(weakPool.expired());
+}